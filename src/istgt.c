@@ -1153,6 +1153,7 @@ istgt_init(ISTGT_Ptr istgt)
 	int ErrorRecoveryLevel;
 	int timeout;
 	int nopininterval;
+	int network_threads;
 	int maxr2t;
 	int rc;
 	int i;
@@ -1463,6 +1464,50 @@ istgt_init(ISTGT_Ptr istgt)
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "NopInInterval %d\n",
 	    istgt->nopininterval);
 
+	network_threads = istgt_get_intval(sp, "NetworkThreads");
+	if (network_threads < 0) {
+		network_threads = DEFAULT_NETWORKTHREADS;
+	}
+	if (network_threads > MAX_NETWORKTHREADS) {
+		ISTGT_ERRLOG("NetworkThreads(%d) > %d\n",
+		    network_threads, MAX_NETWORKTHREADS);
+		return -1;
+	}
+#ifndef ISTGT_USE_EPOLL
+	if (network_threads != 0) {
+		ISTGT_WARNLOG("NetworkThreads is not supported, ignored\n");
+		network_threads = 0;
+	}
+#endif /* !ISTGT_USE_EPOLL */
+	istgt->network_threads = network_threads;
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "NetworkThreads %d\n",
+	    istgt->network_threads);
+
+	istgt->affinity = ISTGT_AFFINITY_NONE;
+	istgt_cpuset_zero(&istgt->cpuset);
+	val = istgt_get_val(sp, "CPUAffinity");
+	if (val == NULL || strcasecmp(val, "None") == 0) {
+		istgt->affinity = ISTGT_AFFINITY_NONE;
+	} else if (strcasecmp(val, "Auto") == 0) {
+		/* NUMA node of the receiving NIC queue, per connection */
+		istgt->affinity = ISTGT_AFFINITY_AUTO;
+	} else {
+		rc = istgt_cpuset_parse(&istgt->cpuset, val);
+		if (rc < 0) {
+			ISTGT_ERRLOG("CPUAffinity %s: format error\n", val);
+			return -1;
+		}
+		istgt->affinity = ISTGT_AFFINITY_LIST;
+	}
+#ifndef HAVE_PTHREAD_SETAFFINITY_NP
+	if (istgt->affinity != ISTGT_AFFINITY_NONE) {
+		ISTGT_WARNLOG("CPUAffinity is not supported, ignored\n");
+		istgt->affinity = ISTGT_AFFINITY_NONE;
+	}
+#endif /* !HAVE_PTHREAD_SETAFFINITY_NP */
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "CPUAffinity %s\n",
+	    val != NULL ? val : "None");
+
 	maxr2t = istgt_get_intval(sp, "MaxR2T");
 	if (maxr2t < 0) {
 		maxr2t = DEFAULT_MAXR2T;
@@ -2789,6 +2834,7 @@ main(int argc, char **argv)
 	/* build crc32c table */
 	istgt_init_crc32c_table();
 #endif /* ISTGT_USE_CRC32C_TABLE */
+	ISTGT_NOTICELOG("using %s crc32c\n", istgt_crc32c_engine());
 
 	/* initialize sub modules */
 	rc = istgt_init(istgt);
@@ -2935,6 +2981,13 @@ main(int argc, char **argv)
 	pthread_set_name_np(pthread_self(), "mainthread");
 #endif
 
+	/* hand logging over to the writer thread, signals are blocked here */
+	rc = istgt_log_start();
+	if (rc < 0) {
+		ISTGT_ERRLOG("istgt_log_start() failed\n");
+		goto initialize_error;
+	}
+
 	/* create LUN threads for command queuing */
 	rc = istgt_lu_create_threads(istgt);
 	if (rc < 0) {
@@ -2947,6 +3000,13 @@ main(int argc, char **argv)
 		goto initialize_error;
 	}
 
+	/* create network threads for multiplexed connections */
+	rc = istgt_iscsi_create_network_threads(istgt);
+	if (rc < 0) {
+		ISTGT_ERRLOG("iscsi_create_network_threads() failed\n");
+		goto initialize_error;
+	}
+
 	/* open portals */
 	rc = istgt_open_uctl_portal(istgt);
 	if (rc < 0) {
@@ -50,6 +50,7 @@
 #include <signal.h>
 #include "istgt_log.h"
 #include "istgt_conf.h"
+#include "istgt_cpuset.h"
 
 #if !defined(__GNUC__)
 #undef __attribute__
@@ -104,6 +105,8 @@
 #define DEFAULT_ERRORRECOVERYLEVEL 0
 #define DEFAULT_TIMEOUT 60
 #define DEFAULT_NOPININTERVAL 20
+#define DEFAULT_NETWORKTHREADS 0
+#define MAX_NETWORKTHREADS 256
 #define DEFAULT_MAXR2T 16
 
 #define ISTGT_PG_TAG_MAX 0x0000ffff
@@ -135,6 +138,10 @@
 #define ISTGT_EV_SET(kevp,a,b,c,d,e,f) EV_SET((kevp),(a),(b),(c),(d),(e),(f))
 #endif
 #endif
+#if !defined (ISTGT_USE_KQUEUE) && defined (HAVE_SYS_EPOLL_H) \
+    && defined (HAVE_SYS_EVENTFD_H)
+#define ISTGT_USE_EPOLL
+#endif
 
 #define MTX_LOCK(MTX) \
 	do {								\
@@ -150,6 +157,27 @@
 			pthread_exit(NULL);				\
 		}							\
 	} while (0)
+#define RW_RDLOCK(RWLOCK) \
+	do {								\
+		if (pthread_rwlock_rdlock((RWLOCK)) != 0) {		\
+			ISTGT_ERRLOG("lock error\n");			\
+			pthread_exit(NULL);				\
+		}							\
+	} while (0)
+#define RW_WRLOCK(RWLOCK) \
+	do {								\
+		if (pthread_rwlock_wrlock((RWLOCK)) != 0) {		\
+			ISTGT_ERRLOG("lock error\n");			\
+			pthread_exit(NULL);				\
+		}							\
+	} while (0)
+#define RW_UNLOCK(RWLOCK) \
+	do {								\
+		if (pthread_rwlock_unlock((RWLOCK)) != 0) {		\
+			ISTGT_ERRLOG("unlock error\n");			\
+			pthread_exit(NULL);				\
+		}							\
+	} while (0)
 #define SPIN_LOCK(SPIN) \
 	do {								\
 		if (pthread_spin_lock((SPIN)) != 0) {			\
@@ -211,6 +239,12 @@ typedef enum {
 	ISTGT_SWMODE_EXPERIMENTAL = 2,
 } ISTGT_SWMODE;
 
+typedef enum {
+	ISTGT_AFFINITY_NONE = 0,
+	ISTGT_AFFINITY_LIST = 1,
+	ISTGT_AFFINITY_AUTO = 2,
+} ISTGT_AFFINITY;
+
 typedef struct istgt_t {
 	CONFIG *config;
 	CONFIG *config_old;
@@ -251,6 +285,10 @@ typedef struct istgt_t {
 
 	int timeout;
 	int nopininterval;
+	int network_threads;
+	/* connection, sender and network threads */
+	ISTGT_AFFINITY affinity;
+	ISTGT_CPUSET cpuset;
 	int maxr2t;
 	int no_discovery_auth;
 	int req_discovery_auth;
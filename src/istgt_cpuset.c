@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#endif
+#ifdef HAVE_SYS_CPUSET_H
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#include "istgt.h"
+#include "istgt_misc.h"
+#include "istgt_cpuset.h"
+
+#ifdef HAVE_SYS_CPUSET_H
+typedef cpuset_t ISTGT_OS_CPUSET;
+#else
+typedef cpu_set_t ISTGT_OS_CPUSET;
+#endif
+
+void
+istgt_cpuset_zero(ISTGT_CPUSET_Ptr set)
+{
+	memset(set, 0, sizeof *set);
+}
+
+void
+istgt_cpuset_set(ISTGT_CPUSET_Ptr set, int cpu)
+{
+	if (cpu < 0 || cpu >= ISTGT_CPUSET_MAXCPU)
+		return;
+	set->bits[cpu / 64] |= (1ULL << (cpu % 64));
+}
+
+int
+istgt_cpuset_isset(const ISTGT_CPUSET *set, int cpu)
+{
+	if (cpu < 0 || cpu >= ISTGT_CPUSET_MAXCPU)
+		return 0;
+	return (set->bits[cpu / 64] & (1ULL << (cpu % 64))) ? 1 : 0;
+}
+
+int
+istgt_cpuset_count(const ISTGT_CPUSET *set)
+{
+	int n;
+	int i;
+
+	n = 0;
+	for (i = 0; i < ISTGT_CPUSET_MAXCPU / 64; i++) {
+		n += __builtin_popcountll(set->bits[i]);
+	}
+	return n;
+}
+
+/* "0-3,8,10-11" as used by taskset(1), cpuset(1) and sysfs */
+int
+istgt_cpuset_parse(ISTGT_CPUSET_Ptr set, const char *list)
+{
+	const char *p;
+	char *ep;
+	long first, last;
+	long i;
+
+	istgt_cpuset_zero(set);
+	p = list;
+	while (*p != '\0' && *p != '\n') {
+		first = strtol(p, &ep, 10);
+		if (ep == p || first < 0 || first >= ISTGT_CPUSET_MAXCPU)
+			return -1;
+		last = first;
+		p = ep;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &ep, 10);
+			if (ep == p || last < first || last >= ISTGT_CPUSET_MAXCPU)
+				return -1;
+			p = ep;
+		}
+		for (i = first; i <= last; i++) {
+			istgt_cpuset_set(set, (int) i);
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0' && *p != '\n') {
+			return -1;
+		}
+	}
+	if (istgt_cpuset_count(set) == 0)
+		return -1;
+	return 0;
+}
+
+int
+istgt_cpuset_format(char *buf, size_t len, const ISTGT_CPUSET *set)
+{
+	size_t pos;
+	int first, last;
+	int n;
+	int i;
+
+	if (len == 0)
+		return -1;
+	buf[0] = '\0';
+	pos = 0;
+	for (i = 0; i < ISTGT_CPUSET_MAXCPU; i++) {
+		if (!istgt_cpuset_isset(set, i))
+			continue;
+		first = last = i;
+		while (istgt_cpuset_isset(set, last + 1))
+			last++;
+		i = last;
+		if (first == last) {
+			n = snprintf(buf + pos, len - pos, "%s%d",
+			    pos == 0 ? "" : ",", first);
+		} else {
+			n = snprintf(buf + pos, len - pos, "%s%d-%d",
+			    pos == 0 ? "" : ",", first, last);
+		}
+		if (n < 0 || (size_t) n >= len - pos)
+			return -1;
+		pos += (size_t) n;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+static int
+istgt_cpuset_read_sysfs(const char *path, char *buf, size_t len)
+{
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(buf, (int) len, fp) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+#endif /* __linux__ */
+
+/* CPUs of the NUMA node */
+int
+istgt_cpuset_node(ISTGT_CPUSET_Ptr set, int node)
+{
+#ifdef __linux__
+	char path[MAX_TMPBUF];
+	char buf[MAX_TMPBUF];
+
+	if (node < 0)
+		return -1;
+	snprintf(path, sizeof path,
+	    "/sys/devices/system/node/node%d/cpulist", node);
+	if (istgt_cpuset_read_sysfs(path, buf, sizeof buf) < 0)
+		return -1;
+	return istgt_cpuset_parse(set, buf);
+#else
+	(void) set;
+	(void) node;
+	return -1;
+#endif /* __linux__ */
+}
+
+/* NUMA node of the CPU, -1 if unknown */
+int
+istgt_cpuset_cpu_node(int cpu)
+{
+#ifdef __linux__
+	char path[MAX_TMPBUF];
+	struct dirent *dp;
+	DIR *dirp;
+	int node;
+
+	if (cpu < 0)
+		return -1;
+	snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+	dirp = opendir(path);
+	if (dirp == NULL)
+		return -1;
+	node = -1;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (sscanf(dp->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dirp);
+	return node;
+#else
+	(void) cpu;
+	return -1;
+#endif /* __linux__ */
+}
+
+#ifdef __linux__
+static int
+istgt_cpuset_sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a == NULL || b == NULL || a->sa_family != b->sa_family)
+		return 0;
+	if (a->sa_family == AF_INET) {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *) (const void *) a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in *) (const void *) b;
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+	if (a->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) (const void *) a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) (const void *) b;
+		return memcmp(&a6->sin6_addr, &b6->sin6_addr,
+		    sizeof a6->sin6_addr) == 0;
+	}
+	return 0;
+}
+#endif /* __linux__ */
+
+/*
+ * NUMA node which receives the packets of the socket: the node of the
+ * CPU serving its RX queue, or the node of the NIC holding the local
+ * address.  -1 if unknown (loopback, no NUMA).
+ */
+int
+istgt_cpuset_sock_node(int sock)
+{
+#ifdef __linux__
+	struct sockaddr_storage ss;
+	struct ifaddrs *ifap, *ifa;
+	socklen_t len;
+	char path[MAX_TMPBUF];
+	char buf[MAX_TMPBUF];
+	int node;
+
+	node = -1;
+#ifdef SO_INCOMING_CPU
+	{
+		int cpu = -1;
+
+		len = sizeof cpu;
+		if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+		    && cpu >= 0) {
+			node = istgt_cpuset_cpu_node(cpu);
+			if (node >= 0)
+				return node;
+		}
+	}
+#endif /* SO_INCOMING_CPU */
+	len = sizeof ss;
+	if (getsockname(sock, (struct sockaddr *) &ss, &len) < 0)
+		return -1;
+	if (getifaddrs(&ifap) < 0)
+		return -1;
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		if (!istgt_cpuset_sockaddr_equal(ifa->ifa_addr,
+			(struct sockaddr *) &ss))
+			continue;
+		snprintf(path, sizeof path, "/sys/class/net/%s/device/numa_node",
+		    ifa->ifa_name);
+		if (istgt_cpuset_read_sysfs(path, buf, sizeof buf) == 0) {
+			node = (int) strtol(buf, NULL, 10);
+		}
+		break;
+	}
+	freeifaddrs(ifap);
+	return node;
+#else
+	(void) sock;
+	return -1;
+#endif /* __linux__ */
+}
+
+int
+istgt_cpuset_apply(pthread_t thread, const ISTGT_CPUSET *set)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	ISTGT_OS_CPUSET mask;
+	int rc;
+	int i;
+
+	CPU_ZERO(&mask);
+	for (i = 0; i < ISTGT_CPUSET_MAXCPU && i < CPU_SETSIZE; i++) {
+		if (istgt_cpuset_isset(set, i)) {
+			CPU_SET(i, &mask);
+		}
+	}
+	rc = pthread_setaffinity_np(thread, sizeof mask, &mask);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+#else
+	(void) thread;
+	(void) set;
+	errno = ENOTSUP;
+	return -1;
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef ISTGT_CPUSET_H
+#define ISTGT_CPUSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define ISTGT_CPUSET_MAXCPU 1024
+
+/* CPUs by number, independent of the OS cpuset type */
+typedef struct istgt_cpuset_t {
+	uint64_t bits[ISTGT_CPUSET_MAXCPU / 64];
+} ISTGT_CPUSET;
+typedef ISTGT_CPUSET *ISTGT_CPUSET_Ptr;
+
+void istgt_cpuset_zero(ISTGT_CPUSET_Ptr set);
+void istgt_cpuset_set(ISTGT_CPUSET_Ptr set, int cpu);
+int istgt_cpuset_isset(const ISTGT_CPUSET *set, int cpu);
+int istgt_cpuset_count(const ISTGT_CPUSET *set);
+int istgt_cpuset_parse(ISTGT_CPUSET_Ptr set, const char *list);
+int istgt_cpuset_format(char *buf, size_t len, const ISTGT_CPUSET *set);
+int istgt_cpuset_node(ISTGT_CPUSET_Ptr set, int node);
+int istgt_cpuset_cpu_node(int cpu);
+int istgt_cpuset_sock_node(int sock);
+int istgt_cpuset_apply(pthread_t thread, const ISTGT_CPUSET *set);
+
+#endif /* ISTGT_CPUSET_H */
@@ -40,15 +40,39 @@
 #include "istgt_iscsi.h"
 #include "istgt_crc32c.h"
 
+#if defined (ISTGT_USE_CRC32C_TABLE) && defined (__x86_64__) \
+	&& (defined (__GNUC__) || defined (__clang__))
+#define ISTGT_USE_CRC32C_SSE42
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
 /* defined in RFC3720(12.1) */
 static uint32_t istgt_crc32c_initial    = ISTGT_CRC32C_INITIAL;
 static uint32_t istgt_crc32c_xor        = ISTGT_CRC32C_XOR;
 static uint32_t istgt_crc32c_polynomial = ISTGT_CRC32C_POLYNOMIAL;
 #ifdef ISTGT_USE_CRC32C_TABLE
-static uint32_t istgt_crc32c_table[256];
+/* slicing-by-8, table[0] is the classic byte table */
+static uint32_t istgt_crc32c_table[8][256];
 static int istgt_crc32c_initialized = 0;
+
+static uint32_t istgt_update_crc32c_slice8(const uint8_t *buf, size_t len, uint32_t crc);
+static uint32_t (*istgt_update_crc32c_func)(const uint8_t *buf, size_t len, uint32_t crc) = istgt_update_crc32c_slice8;
+static const char *istgt_crc32c_engine_name = "slicing-by-8";
 #endif /* ISTGT_USE_CRC32C_TABLE */
 
+#ifdef ISTGT_USE_CRC32C_SSE42
+/*
+ * 3 independent streams hide the 3 cycles latency of crc32 instruction.
+ * The streams are merged by multiplying with x^(8*len) mod P, which is
+ * precomputed for the two block lengths as 4x256 tables.
+ */
+#define CRC32C_LONG_BLOCK  8192
+#define CRC32C_SHORT_BLOCK 256
+static uint32_t istgt_crc32c_long_shift[4][256];
+static uint32_t istgt_crc32c_short_shift[4][256];
+#endif /* ISTGT_USE_CRC32C_SSE42 */
+
 static uint32_t
 istgt_reflect(uint32_t val, int bits)
 {
@@ -64,6 +88,158 @@ istgt_reflect(uint32_t val, int bits)
 	return r;
 }
 
+#ifdef ISTGT_USE_CRC32C_TABLE
+static uint32_t
+istgt_update_crc32c_slice8(const uint8_t *buf, size_t len, uint32_t crc)
+{
+	uint32_t lo, hi;
+
+	/* align to 8 bytes boundary */
+	while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+		crc = (crc >> 8) ^ istgt_crc32c_table[0][(crc ^ *buf++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ ((uint32_t) buf[0]
+		    | ((uint32_t) buf[1] << 8)
+		    | ((uint32_t) buf[2] << 16)
+		    | ((uint32_t) buf[3] << 24));
+		hi = ((uint32_t) buf[4]
+		    | ((uint32_t) buf[5] << 8)
+		    | ((uint32_t) buf[6] << 16)
+		    | ((uint32_t) buf[7] << 24));
+		crc = istgt_crc32c_table[7][lo & 0xff]
+		    ^ istgt_crc32c_table[6][(lo >> 8) & 0xff]
+		    ^ istgt_crc32c_table[5][(lo >> 16) & 0xff]
+		    ^ istgt_crc32c_table[4][lo >> 24]
+		    ^ istgt_crc32c_table[3][hi & 0xff]
+		    ^ istgt_crc32c_table[2][(hi >> 8) & 0xff]
+		    ^ istgt_crc32c_table[1][(hi >> 16) & 0xff]
+		    ^ istgt_crc32c_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = (crc >> 8) ^ istgt_crc32c_table[0][(crc ^ *buf++) & 0xff];
+		len--;
+	}
+	return crc;
+}
+#endif /* ISTGT_USE_CRC32C_TABLE */
+
+#ifdef ISTGT_USE_CRC32C_SSE42
+static void
+istgt_init_crc32c_shift(uint32_t shift[4][256], size_t len)
+{
+	uint32_t basis[32];
+	uint32_t val;
+	uint8_t zero[CRC32C_SHORT_BLOCK];
+	size_t n;
+	int i, j, k;
+
+	/* shifting is linear, so build it from the image of each bit */
+	memset(zero, 0, sizeof zero);
+	for (i = 0; i < 32; i++) {
+		val = 1U << i;
+		for (n = 0; n < len; n += sizeof zero) {
+			val = istgt_update_crc32c_slice8(zero, sizeof zero, val);
+		}
+		basis[i] = val;
+	}
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < 256; i++) {
+			val = 0;
+			for (j = 0; j < 8; j++) {
+				if (i & (1 << j)) {
+					val ^= basis[k * 8 + j];
+				}
+			}
+			shift[k][i] = val;
+		}
+	}
+}
+
+static inline uint32_t
+istgt_crc32c_shift(uint32_t shift[4][256], uint32_t crc)
+{
+	return shift[0][crc & 0xff]
+	    ^ shift[1][(crc >> 8) & 0xff]
+	    ^ shift[2][(crc >> 16) & 0xff]
+	    ^ shift[3][crc >> 24];
+}
+
+static int
+istgt_crc32c_has_sse42(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return 0;
+	return (ecx & bit_SSE4_2) != 0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+istgt_update_crc32c_sse42(const uint8_t *buf, size_t len, uint32_t crc)
+{
+	uint64_t crc0, crc1, crc2;
+	uint64_t v0, v1, v2;
+	const uint8_t *end;
+	size_t block;
+
+	/* align to 8 bytes boundary */
+	while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+
+	crc0 = crc;
+	block = CRC32C_LONG_BLOCK;
+	while (len >= 3 * CRC32C_SHORT_BLOCK) {
+		if (len < 3 * block) {
+			block = CRC32C_SHORT_BLOCK;
+		}
+		crc1 = 0;
+		crc2 = 0;
+		end = buf + block;
+		do {
+			memcpy(&v0, buf, 8);
+			memcpy(&v1, buf + block, 8);
+			memcpy(&v2, buf + 2 * block, 8);
+			crc0 = _mm_crc32_u64(crc0, v0);
+			crc1 = _mm_crc32_u64(crc1, v1);
+			crc2 = _mm_crc32_u64(crc2, v2);
+			buf += 8;
+		} while (buf < end);
+		if (block == CRC32C_LONG_BLOCK) {
+			crc0 = istgt_crc32c_shift(istgt_crc32c_long_shift,
+			    (uint32_t) crc0) ^ crc1;
+			crc0 = istgt_crc32c_shift(istgt_crc32c_long_shift,
+			    (uint32_t) crc0) ^ crc2;
+		} else {
+			crc0 = istgt_crc32c_shift(istgt_crc32c_short_shift,
+			    (uint32_t) crc0) ^ crc1;
+			crc0 = istgt_crc32c_shift(istgt_crc32c_short_shift,
+			    (uint32_t) crc0) ^ crc2;
+		}
+		buf += 2 * block;
+		len -= 3 * block;
+	}
+	while (len >= 8) {
+		memcpy(&v0, buf, 8);
+		crc0 = _mm_crc32_u64(crc0, v0);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t) crc0;
+	while (len > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	return crc;
+}
+#endif /* ISTGT_USE_CRC32C_SSE42 */
+
 #ifdef ISTGT_USE_CRC32C_TABLE
 void
 istgt_init_crc32c_table(void)
@@ -82,17 +258,46 @@ istgt_init_crc32c_table(void)
 				val = (val >> 1);
 			}
 		}
-		istgt_crc32c_table[i] = val;
+		istgt_crc32c_table[0][i] = val;
+	}
+	for (i = 0; i < 256; i++) {
+		val = istgt_crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			val = (val >> 8) ^ istgt_crc32c_table[0][val & 0xff];
+			istgt_crc32c_table[j][i] = val;
+		}
 	}
+	istgt_update_crc32c_func = istgt_update_crc32c_slice8;
+	istgt_crc32c_engine_name = "slicing-by-8";
+#ifdef ISTGT_USE_CRC32C_SSE42
+	if (istgt_crc32c_has_sse42()) {
+		istgt_init_crc32c_shift(istgt_crc32c_long_shift,
+		    CRC32C_LONG_BLOCK);
+		istgt_init_crc32c_shift(istgt_crc32c_short_shift,
+		    CRC32C_SHORT_BLOCK);
+		istgt_update_crc32c_func = istgt_update_crc32c_sse42;
+		istgt_crc32c_engine_name = "SSE4.2";
+	}
+#endif /* ISTGT_USE_CRC32C_SSE42 */
 	istgt_crc32c_initialized = 1;
 }
 #endif /* ISTGT_USE_CRC32C_TABLE */
 
+const char *
+istgt_crc32c_engine(void)
+{
+#ifdef ISTGT_USE_CRC32C_TABLE
+	return istgt_crc32c_engine_name;
+#else
+	return "bitwise";
+#endif /* ISTGT_USE_CRC32C_TABLE */
+}
+
 uint32_t
 istgt_update_crc32c(const uint8_t *buf, size_t len, uint32_t crc)
 {
-	size_t s;
 #ifndef ISTGT_USE_CRC32C_TABLE
+	size_t s;
 	int i;
 	uint32_t val;
 	uint32_t reflect_polynomial;
@@ -105,14 +310,10 @@ istgt_update_crc32c(const uint8_t *buf, size_t len, uint32_t crc)
 		istgt_init_crc32c_table();
 	}
 #endif
+	return istgt_update_crc32c_func(buf, len, crc);
 #else
 	reflect_polynomial = istgt_reflect(istgt_crc32c_polynomial, 32);
-#endif /* ISTGT_USE_CRC32C_TABLE */
-
 	for (s = 0; s < len; s++) {
-#ifdef ISTGT_USE_CRC32C_TABLE
-		crc = (crc >> 8) ^ istgt_crc32c_table[(crc ^ buf[s]) & 0xff];
-#else
 		val = buf[s];
 		for (i = 0; i < 8; i++) {
 			if ((crc ^ val) & 1) {
@@ -122,9 +323,9 @@ istgt_update_crc32c(const uint8_t *buf, size_t len, uint32_t crc)
 			}
 			val = val >> 1;
 		}
-#endif /* ISTGT_USE_CRC32C_TABLE */
 	}
 	return crc;
+#endif /* ISTGT_USE_CRC32C_TABLE */
 }
 
 uint32_t
@@ -184,13 +385,11 @@ istgt_iovec_crc32c(const struct iovec *iovp, int iovc, uint32_t offset, uint32_t
 			break;
 		if (pos + iovp[i].iov_len > offset) {
 			p = (const uint8_t *) iovp[i].iov_base + (offset - pos);
-			if (iovp[i].iov_len > len) {
+			n = iovp[i].iov_len - (offset - pos);
+			if (n > len) {
 				n = len;
-				len = 0;
-			} else {
-				n = iovp[i].iov_len;
-				len -= n;
 			}
+			len -= n;
 			crc32c = istgt_update_crc32c(p, n, crc32c);
 			offset += n;
 			total += n;
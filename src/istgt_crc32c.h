@@ -38,6 +38,7 @@
 #define ISTGT_CRC32C_POLYNOMIAL 0x1edc6f41UL
 
 void istgt_init_crc32c_table(void);
+const char *istgt_crc32c_engine(void);
 uint32_t istgt_update_crc32c(const uint8_t *buf, size_t len, uint32_t crc);
 uint32_t istgt_fixup_crc32c(size_t total, uint32_t crc);
 uint32_t istgt_crc32c(const uint8_t *buf, size_t len);
@@ -67,6 +67,10 @@
 #include <sys/event.h>
 #include <sys/time.h>
 #endif
+#ifdef ISTGT_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #if !defined(__GNUC__)
 #undef __attribute__
@@ -116,6 +120,21 @@ static int istgt_append_sess(CONN_Ptr conn, uint64_t isid, uint16_t tsih, uint16
 static void istgt_remove_conn(CONN_Ptr conn);
 static int istgt_iscsi_drop_all_conns(CONN_Ptr conn);
 static int istgt_iscsi_drop_old_conns(CONN_Ptr conn);
+static int istgt_iscsi_cmdsn_deliver(CONN_Ptr conn);
+static int istgt_iscsi_cmdsn_advance(CONN_Ptr conn, uint32_t CmdSN);
+static int istgt_iscsi_cmdsn_skip(CONN_Ptr conn, uint32_t CmdSN);
+static void istgt_iscsi_cmdsn_abort(CONN_Ptr conn, CONN_Ptr owner, uint64_t lun, int all_luns, int all_cmds, uint32_t CmdSN);
+static int istgt_iscsi_wbatch_flush(CONN_Ptr conn);
+static int istgt_iscsi_wbatch_append(CONN_Ptr conn, struct iovec *iovp, int iovc, int total);
+#ifdef ISTGT_USE_EPOLL
+static void istgt_reactor_detach(CONN_Ptr conn);
+static int istgt_reactor_write_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu);
+#endif /* ISTGT_USE_EPOLL */
+
+/* PDU is gathered only in the thread which is sending responses */
+#define ISTGT_WBATCH_ACTIVE(CONN) \
+	((CONN)->wbatch.enable						\
+	    && pthread_equal(pthread_self(), (CONN)->wbatch.owner))
 
 /* Switch to use readv/writev (assume blocking) */
 #define ISTGT_USE_IOVEC
@@ -124,6 +143,13 @@ static int istgt_iscsi_drop_old_conns(CONN_Ptr conn);
 #include <sys/uio.h>
 #endif
 
+#ifdef ISTGT_USE_SENDFILE
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <sys/uio.h>
+#endif /* ISTGT_USE_SENDFILE */
+
 #if !defined (ISTGT_USE_IOVEC)
 #if 0
 #define ISTGT_USE_RECVBLOCK
@@ -641,59 +667,16 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	return total;
 }
 #else /* defined (ISTGT_USE_IOVEC) */
+/* allocate AHS and data segment of the PDU by BHS, return total length */
 static int
-istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+istgt_iscsi_setup_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
-	struct iovec iovec[4]; /* AHS+HD+DATA+DD */
-	uint32_t crc32c;
-	time_t start, now;
-	int nbytes;
 	int total_ahs_len;
 	int data_len;
 	int segment_len;
 	int total;
-	int rc;
-	int i;
-
-	pdu->ahs = NULL;
-	pdu->total_ahs_len = 0;
-	pdu->data = NULL;
-	pdu->data_segment_len = 0;
-	total = 0;
 
-	/* BHS (require for all PDU) */
-	ISTGT_TRACELOG(ISTGT_TRACE_NET, "BHS read %d\n",
-	    ISCSI_BHS_LEN);
-	errno = 0;
-	start = time(NULL);
-	rc = recv(conn->sock, &pdu->bhs, ISCSI_BHS_LEN, MSG_WAITALL);
-	if (rc < 0) {
-		now = time(NULL);
-		if (errno == ECONNRESET) {
-			ISTGT_WARNLOG("Connection reset by peer (%s,time=%d)\n",
-			    conn->initiator_name, istgt_difftime(now, start));
-			conn->state = CONN_STATE_EXITING;
-		} else if (errno == ETIMEDOUT) {
-			ISTGT_WARNLOG("Operation timed out (%s,time=%d)\n",
-			    conn->initiator_name, istgt_difftime(now, start));
-			conn->state = CONN_STATE_EXITING;
-		} else {
-			ISTGT_ERRLOG("iscsi_read() failed (errno=%d,%s,time=%d)\n",
-			    errno, conn->initiator_name, istgt_difftime(now, start));
-		}
-		return -1;
-	}
-	if (rc == 0) {
-		ISTGT_TRACELOG(ISTGT_TRACE_NET, "recv() EOF (%s)\n",
-		    conn->initiator_name);
-		conn->state = CONN_STATE_EXITING;
-		return -1;
-	}
-	if (rc != ISCSI_BHS_LEN) {
-		ISTGT_ERRLOG("invalid BHS length (%d,%s)\n", rc, conn->initiator_name);
-		return -1;
-	}
-	total += ISCSI_BHS_LEN;
+	total = ISCSI_BHS_LEN;
 
 	/* AHS */
 	total_ahs_len = DGET8(&pdu->bhs.total_ahs_len);
@@ -705,16 +688,10 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		pdu->ahs = NULL;
 		pdu->total_ahs_len = 0;
 	}
-	iovec[0].iov_base = pdu->ahs;
-	iovec[0].iov_len = 4 * pdu->total_ahs_len;
 
 	/* Header Digest */
-	iovec[1].iov_base = pdu->header_digest;
 	if (conn->header_digest) {
-		iovec[1].iov_len = ISCSI_DIGEST_LEN;
 		total += ISCSI_DIGEST_LEN;
-	} else {
-		iovec[1].iov_len = 0;
 	}
 
 	/* Data Segment */
@@ -741,55 +718,65 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		pdu->data = NULL;
 		pdu->data_segment_len = 0;
 	}
-	iovec[2].iov_base = pdu->data;
-	iovec[2].iov_len = ISCSI_ALIGN(pdu->data_segment_len);
 
 	/* Data Digest */
-	iovec[3].iov_base = pdu->data_digest;
 	if (conn->data_digest && data_len != 0) {
-		iovec[3].iov_len = ISCSI_DIGEST_LEN;
 		total += ISCSI_DIGEST_LEN;
+	}
+	return total;
+}
+
+/* iovec of the PDU after BHS */
+static void
+istgt_iscsi_pdu_iovec(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, struct iovec *iovec)
+{
+	iovec[0].iov_base = pdu->ahs;
+	iovec[0].iov_len = 4 * pdu->total_ahs_len;
+	iovec[1].iov_base = pdu->header_digest;
+	if (conn->header_digest) {
+		iovec[1].iov_len = ISCSI_DIGEST_LEN;
+	} else {
+		iovec[1].iov_len = 0;
+	}
+	iovec[2].iov_base = pdu->data;
+	iovec[2].iov_len = ISCSI_ALIGN(pdu->data_segment_len);
+	iovec[3].iov_base = pdu->data_digest;
+	if (conn->data_digest && pdu->data_segment_len != 0) {
+		iovec[3].iov_len = ISCSI_DIGEST_LEN;
 	} else {
 		iovec[3].iov_len = 0;
 	}
+}
 
-	/* read all bytes to iovec */
-	nbytes = total - ISCSI_BHS_LEN;
-	ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU read %d\n", nbytes);
-	errno = 0;
-	start = time(NULL);
-	while (nbytes > 0) {
-		rc = readv(conn->sock, &iovec[0], 4);
-		if (rc < 0) {
-			now = time(NULL);
-			ISTGT_ERRLOG("readv() failed (%d,errno=%d,%s,time=%d)\n",
-			    rc, errno, conn->initiator_name, istgt_difftime(now, start));
-			return -1;
-		}
-		if (rc == 0) {
-			ISTGT_TRACELOG(ISTGT_TRACE_NET, "readv() EOF (%s)\n",
-			    conn->initiator_name);
-			conn->state = CONN_STATE_EXITING;
-			return -1;
-		}
-		nbytes -= rc;
-		if (nbytes == 0)
+/* skip nbytes already read from iovec */
+static void
+istgt_iscsi_advance_iovec(struct iovec *iovec, int iovcnt, size_t nbytes)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iovec[i].iov_len != 0 && iovec[i].iov_len > nbytes) {
+			iovec[i].iov_base
+				= (void *) (((uintptr_t)iovec[i].iov_base) + nbytes);
+			iovec[i].iov_len -= nbytes;
 			break;
-		/* adjust iovec length */
-		for (i = 0; i < 4; i++) {
-			if (iovec[i].iov_len != 0 && iovec[i].iov_len > (size_t)rc) {
-				iovec[i].iov_base
-					= (void *) (((uintptr_t)iovec[i].iov_base) + rc);
-				iovec[i].iov_len -= rc;
-				break;
-			} else {
-				rc -= iovec[i].iov_len;
-				iovec[i].iov_len = 0;
-			}
+		} else {
+			nbytes -= iovec[i].iov_len;
+			iovec[i].iov_len = 0;
 		}
 	}
+}
 
-	/* check digest */
+static int
+istgt_iscsi_check_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	uint32_t crc32c;
+	int total_ahs_len;
+	int data_len;
+	int rc;
+
+	total_ahs_len = pdu->total_ahs_len;
+	data_len = pdu->data_segment_len;
 	if (conn->header_digest) {
 		if (total_ahs_len == 0) {
 			crc32c = istgt_crc32c((uint8_t *) &pdu->bhs,
@@ -820,22 +807,108 @@ istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			return -1;
 		}
 	}
+	return 0;
+}
+
+static int
+istgt_iscsi_read_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	struct iovec iovec[4]; /* AHS+HD+DATA+DD */
+	time_t start, now;
+	int nbytes;
+	int total;
+	int rc;
+
+	pdu->ahs = NULL;
+	pdu->total_ahs_len = 0;
+	pdu->data = NULL;
+	pdu->data_segment_len = 0;
+
+	/* BHS (require for all PDU) */
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "BHS read %d\n",
+	    ISCSI_BHS_LEN);
+	errno = 0;
+	start = time(NULL);
+	rc = recv(conn->sock, &pdu->bhs, ISCSI_BHS_LEN, MSG_WAITALL);
+	if (rc < 0) {
+		now = time(NULL);
+		if (errno == ECONNRESET) {
+			ISTGT_WARNLOG("Connection reset by peer (%s,time=%d)\n",
+			    conn->initiator_name, istgt_difftime(now, start));
+			conn->state = CONN_STATE_EXITING;
+		} else if (errno == ETIMEDOUT) {
+			ISTGT_WARNLOG("Operation timed out (%s,time=%d)\n",
+			    conn->initiator_name, istgt_difftime(now, start));
+			conn->state = CONN_STATE_EXITING;
+		} else {
+			ISTGT_ERRLOG("iscsi_read() failed (errno=%d,%s,time=%d)\n",
+			    errno, conn->initiator_name, istgt_difftime(now, start));
+		}
+		return -1;
+	}
+	if (rc == 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_NET, "recv() EOF (%s)\n",
+		    conn->initiator_name);
+		conn->state = CONN_STATE_EXITING;
+		return -1;
+	}
+	if (rc != ISCSI_BHS_LEN) {
+		ISTGT_ERRLOG("invalid BHS length (%d,%s)\n", rc, conn->initiator_name);
+		return -1;
+	}
+
+	/* AHS, Header Digest, Data Segment and Data Digest */
+	total = istgt_iscsi_setup_pdu(conn, pdu);
+	if (total < 0) {
+		return -1;
+	}
+	istgt_iscsi_pdu_iovec(conn, pdu, iovec);
+
+	/* read all bytes to iovec */
+	nbytes = total - ISCSI_BHS_LEN;
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU read %d\n", nbytes);
+	errno = 0;
+	start = time(NULL);
+	while (nbytes > 0) {
+		rc = readv(conn->sock, &iovec[0], 4);
+		if (rc < 0) {
+			now = time(NULL);
+			ISTGT_ERRLOG("readv() failed (%d,errno=%d,%s,time=%d)\n",
+			    rc, errno, conn->initiator_name, istgt_difftime(now, start));
+			return -1;
+		}
+		if (rc == 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET, "readv() EOF (%s)\n",
+			    conn->initiator_name);
+			conn->state = CONN_STATE_EXITING;
+			return -1;
+		}
+		nbytes -= rc;
+		if (nbytes == 0)
+			break;
+		/* adjust iovec length */
+		istgt_iscsi_advance_iovec(iovec, 4, (size_t) rc);
+	}
+
+	/* check digest */
+	rc = istgt_iscsi_check_pdu(conn, pdu);
+	if (rc < 0) {
+		return -1;
+	}
 
 	return total;
 }
 #endif /* defined (ISTGT_USE_IOVEC) */
 
 static int istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu);
-static int istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int I_bit);
+static int istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type);
 
 static int istgt_update_pdu(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 {
 	uint8_t *rsp;
 	uint32_t task_tag;
 	int opcode;
-	int I_bit;
 
-	I_bit = lu_cmd->I_bit;
 	rsp = (uint8_t *) &lu_cmd->pdu->bhs;
 	opcode = BGET8W(&rsp[0], 5, 6);
 	task_tag = DGET32(&rsp[16]);
@@ -848,13 +921,10 @@ static int istgt_update_pdu(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 		SESS_MTX_UNLOCK(conn);
 	} else if ((opcode == ISCSI_OP_TASK_RSP)
 	    || (opcode == ISCSI_OP_NOPIN && task_tag != 0xffffffffU)) {
+		/* CmdSN of the request is taken at arrival */
 		SESS_MTX_LOCK(conn);
 		DSET32(&rsp[24], conn->StatSN);
 		conn->StatSN++;
-		if (I_bit == 0) {
-			conn->sess->ExpCmdSN++;
-			conn->sess->MaxCmdSN++;
-		}
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
 		DSET32(&rsp[32], conn->sess->MaxCmdSN);
 		SESS_MTX_UNLOCK(conn);
@@ -870,26 +940,26 @@ istgt_iscsi_write_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	if (conn->use_sender == 0) {
 		rc = istgt_iscsi_write_pdu_internal(conn, pdu);
 	} else {
-		rc = istgt_iscsi_write_pdu_queue(conn, pdu, ISTGT_LU_TASK_REQPDU, 0);
+		rc = istgt_iscsi_write_pdu_queue(conn, pdu, ISTGT_LU_TASK_REQPDU);
 	}
 	return rc;
 }
 
 static int
-istgt_iscsi_write_pdu_upd(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int I_bit)
+istgt_iscsi_write_pdu_upd(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 {
 	int rc;
 
 	if (conn->use_sender == 0) {
 		rc = istgt_iscsi_write_pdu_internal(conn, pdu);
 	} else {
-		rc = istgt_iscsi_write_pdu_queue(conn, pdu, ISTGT_LU_TASK_REQUPDPDU, I_bit);
+		rc = istgt_iscsi_write_pdu_queue(conn, pdu, ISTGT_LU_TASK_REQUPDPDU);
 	}
 	return rc;
 }
 
 static int
-istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int I_bit)
+istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type)
 {
 	int rc;
 
@@ -932,9 +1002,6 @@ istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int
 		lu_task->type = req_type;
 		lu_task->conn = conn;
 
-		/* extra flags */
-		lu_task->lu_cmd.I_bit = I_bit;
-
 		/* copy PDU structure */
 		src_pdu = pdu;
 		dst_pdu = lu_task->lu_cmd.pdu;
@@ -963,19 +1030,10 @@ istgt_iscsi_write_pdu_queue(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int req_type, int
 			total += ISCSI_DIGEST_LEN;
 		}
 
-		/* insert to queue */
-		MTX_LOCK(&conn->result_queue_mutex);
-		rc = istgt_queue_enqueue(&conn->result_queue, lu_task);
-		if (rc != 0) {
-			MTX_UNLOCK(&conn->result_queue_mutex);
-			ISTGT_ERRLOG("queue_enqueue() failed\n");
-			return -1;
-		}
-		/* notify to thread */
-		rc = pthread_cond_broadcast(&conn->result_queue_cond);
-		MTX_UNLOCK(&conn->result_queue_mutex);
+		/* insert to queue and notify to thread */
+		rc = istgt_iscsi_queue_result(conn, lu_task);
 		if (rc != 0) {
-			ISTGT_ERRLOG("cond_broadcast() failed\n");
+			ISTGT_ERRLOG("queue_result() failed\n");
 			return -1;
 		}
 
@@ -1248,6 +1306,15 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		iovec[4].iov_len = 0;
 	}
 
+	if (ISTGT_WBATCH_ACTIVE(conn)) {
+		/* sent by sender later */
+		rc = istgt_iscsi_wbatch_append(conn, &iovec[0], 5, total);
+		if (rc < 0) {
+			return -1;
+		}
+		return total;
+	}
+
 	/* write all bytes from iovec */
 	nbytes = total;
 	ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU write %d\n", nbytes);
@@ -1282,33 +1349,354 @@ istgt_iscsi_write_pdu_internal(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 }
 #endif /* defined (ISTGT_USE_IOVEC) */
 
-int
-istgt_iscsi_copy_pdu(ISCSI_PDU_Ptr dst_pdu, ISCSI_PDU_Ptr src_pdu)
+#ifdef ISTGT_USE_SENDFILE
+static int
+istgt_iscsi_write_zero(CONN_Ptr conn, int len)
 {
-	memcpy(&dst_pdu->bhs, &src_pdu->bhs, ISCSI_BHS_LEN);
-	dst_pdu->ahs = src_pdu->ahs;
-	memcpy(dst_pdu->header_digest, src_pdu->header_digest,
-	    ISCSI_DIGEST_LEN);
-	if (src_pdu->data == src_pdu->shortdata) {
-		memcpy(dst_pdu->shortdata, src_pdu->shortdata,
-		    sizeof src_pdu->shortdata);
-		dst_pdu->data = dst_pdu->shortdata;
-	} else {
-		dst_pdu->data = src_pdu->data;
+	uint8_t zero[ISCSI_ALIGNMENT * 128];
+	int n;
+	int rc;
+
+	memset(zero, 0, sizeof zero);
+	while (len > 0) {
+		n = DMIN32(len, (int) sizeof zero);
+		rc = (int) write(conn->sock, zero, (size_t) n);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			ISTGT_ERRLOG("write() failed (errno=%d,%s)\n",
+			    errno, conn->initiator_name);
+			return -1;
+		}
+		len -= rc;
 	}
-	memcpy(dst_pdu->data_digest, src_pdu->data_digest, ISCSI_DIGEST_LEN);
-	dst_pdu->total_ahs_len = src_pdu->total_ahs_len;
-	dst_pdu->data_segment_len = src_pdu->data_segment_len;
-	dst_pdu->copy_pdu = 0;
-	src_pdu->copy_pdu = 1;
 	return 0;
 }
 
-typedef struct iscsi_param_table_t
+static int
+istgt_iscsi_sendfile(CONN_Ptr conn, int fd, uint64_t offset, int len)
 {
-	const char *key;
-	const char *val;
-	const char *list;
+	off_t off;
+	int nbytes;
+	int rc;
+
+	nbytes = len;
+	off = (off_t) offset;
+	while (nbytes > 0) {
+#ifdef HAVE_SYS_SENDFILE_H
+		rc = (int) sendfile(conn->sock, fd, &off, (size_t) nbytes);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			ISTGT_ERRLOG("sendfile() failed (errno=%d,%s)\n",
+			    errno, conn->initiator_name);
+			return -1;
+		}
+#else
+		{
+			off_t sbytes = 0;
+
+			rc = sendfile(fd, conn->sock, off, (size_t) nbytes,
+			    NULL, &sbytes, 0);
+			if (rc < 0 && errno != EINTR && errno != EAGAIN) {
+				ISTGT_ERRLOG("sendfile() failed (errno=%d,%s)\n",
+				    errno, conn->initiator_name);
+				return -1;
+			}
+			off += sbytes;
+			rc = (int) sbytes;
+		}
+#endif /* HAVE_SYS_SENDFILE_H */
+		if (rc == 0) {
+			/* beyond end of file */
+			ISTGT_TRACELOG(ISTGT_TRACE_NET,
+			    "sendfile() EOF, fill %d bytes\n", nbytes);
+			rc = istgt_iscsi_write_zero(conn, nbytes);
+			if (rc < 0) {
+				return -1;
+			}
+			break;
+		}
+		nbytes -= rc;
+	}
+	return len;
+}
+
+static int
+istgt_iscsi_write_pdu_zcopy(CONN_Ptr conn, ISCSI_PDU_Ptr pdu, int fd, uint64_t offset)
+{
+	struct iovec iovec[2]; /* BHS+HD */
+	uint8_t *cp;
+	uint32_t crc32c;
+	int data_len;
+	int nbytes;
+	int total;
+	int rc;
+	int i;
+
+	cp = (uint8_t *) &pdu->bhs;
+	data_len = DGET24(&cp[5]);
+	if (DGET8(&cp[4]) != 0 || conn->data_digest) {
+		ISTGT_ERRLOG("zero-copy with AHS or DataDigest\n");
+		return -1;
+	}
+	total = 0;
+
+	/* keep order of gathered PDUs */
+	if (ISTGT_WBATCH_ACTIVE(conn)) {
+		rc = istgt_iscsi_wbatch_flush(conn);
+		if (rc < 0) {
+			return -1;
+		}
+	}
+
+	/* BHS */
+	iovec[0].iov_base = &pdu->bhs;
+	iovec[0].iov_len = ISCSI_BHS_LEN;
+	total += ISCSI_BHS_LEN;
+
+	/* Header Digest */
+	iovec[1].iov_base = pdu->header_digest;
+	if (conn->header_digest) {
+		crc32c = istgt_crc32c((uint8_t *) &pdu->bhs, ISCSI_BHS_LEN);
+		MAKE_DIGEST_WORD(pdu->header_digest, crc32c);
+		iovec[1].iov_len = ISCSI_DIGEST_LEN;
+		total += ISCSI_DIGEST_LEN;
+	} else {
+		iovec[1].iov_len = 0;
+	}
+
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU write %d (zero-copy %d)\n",
+	    total + ISCSI_ALIGN(data_len), data_len);
+	nbytes = total;
+	while (nbytes > 0) {
+		rc = writev(conn->sock, &iovec[0], 2);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			ISTGT_ERRLOG("writev() failed (errno=%d,%s)\n",
+			    errno, conn->initiator_name);
+			return -1;
+		}
+		nbytes -= rc;
+		if (nbytes == 0)
+			break;
+		/* adjust iovec length */
+		for (i = 0; i < 2; i++) {
+			if (iovec[i].iov_len != 0 && iovec[i].iov_len > (size_t)rc) {
+				iovec[i].iov_base
+					= (void *) (((uintptr_t)iovec[i].iov_base) + rc);
+				iovec[i].iov_len -= rc;
+				break;
+			} else {
+				rc -= iovec[i].iov_len;
+				iovec[i].iov_len = 0;
+			}
+		}
+	}
+
+	/* Data Segment from file */
+	if (data_len != 0) {
+		rc = istgt_iscsi_sendfile(conn, fd, offset, data_len);
+		if (rc < 0) {
+			return -1;
+		}
+		rc = istgt_iscsi_write_zero(conn, ISCSI_ALIGN(data_len) - data_len);
+		if (rc < 0) {
+			return -1;
+		}
+		total += ISCSI_ALIGN(data_len);
+	}
+	return total;
+}
+#endif /* ISTGT_USE_SENDFILE */
+
+static void
+istgt_iscsi_wbatch_release(CONN_Ptr conn)
+{
+	ISTGT_WBATCH *wb = &conn->wbatch;
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+	int i;
+
+	for (i = 0; i < wb->ntasks; i++) {
+		lu_task = wb->tasks[i];
+		wb->tasks[i] = NULL;
+		if (lu_task->type == ISTGT_LU_TASK_RESPONSE) {
+			rc = istgt_lu_destroy_task(lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_destroy_task() failed\n");
+				/* ignore error */
+			}
+		} else {
+			/* free allocated memory by caller */
+			xfree(lu_task);
+		}
+	}
+	wb->ntasks = 0;
+}
+
+static int
+istgt_iscsi_wbatch_flush(CONN_Ptr conn)
+{
+	ISTGT_WBATCH *wb = &conn->wbatch;
+	struct iovec *iovp;
+	time_t start, now;
+	int nbytes;
+	int iovc;
+	int rc;
+
+	nbytes = wb->bytes;
+	iovp = &wb->iov[0];
+	iovc = wb->iovcnt;
+	if (nbytes != 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_NET, "PDU write %d (%d iovec)\n",
+		    nbytes, iovc);
+	}
+	errno = 0;
+	start = time(NULL);
+	rc = 0;
+	while (nbytes > 0) {
+		rc = writev(conn->sock, iovp, iovc);
+		if (rc < 0) {
+			now = time(NULL);
+			ISTGT_ERRLOG("writev() failed (errno=%d,%s,time=%d)\n",
+			    errno, conn->initiator_name, istgt_difftime(now, start));
+			break;
+		}
+		nbytes -= rc;
+		if (nbytes == 0)
+			break;
+		/* skip written iovec */
+		while (iovc > 0 && iovp->iov_len <= (size_t) rc) {
+			rc -= iovp->iov_len;
+			iovp++;
+			iovc--;
+		}
+		if (iovc > 0) {
+			iovp->iov_base = (void *) (((uintptr_t)iovp->iov_base) + rc);
+			iovp->iov_len -= rc;
+		}
+		rc = 0;
+	}
+	wb->iovcnt = 0;
+	wb->bytes = 0;
+	wb->hdrlen = 0;
+	istgt_iscsi_wbatch_release(conn);
+	if (rc < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+istgt_iscsi_wbatch_append(CONN_Ptr conn, struct iovec *iovp, int iovc, int total)
+{
+	ISTGT_WBATCH *wb = &conn->wbatch;
+	struct iovec *last;
+	size_t hdrlen;
+	int rc;
+	int i;
+
+	/* small parts are copied, large data is referred until flush */
+	hdrlen = 0;
+	for (i = 0; i < iovc; i++) {
+		if (iovp[i].iov_len <= ISTGT_WBATCH_COPY) {
+			hdrlen += iovp[i].iov_len;
+		}
+	}
+	if (wb->iovcnt + iovc > ISTGT_WBATCH_IOV
+	    || wb->hdrlen + hdrlen > ISTGT_WBATCH_HDR) {
+		rc = istgt_iscsi_wbatch_flush(conn);
+		if (rc < 0) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < iovc; i++) {
+		if (iovp[i].iov_len == 0)
+			continue;
+		last = (wb->iovcnt != 0) ? &wb->iov[wb->iovcnt - 1] : NULL;
+		if (iovp[i].iov_len <= ISTGT_WBATCH_COPY) {
+			memcpy(&wb->hdr[wb->hdrlen], iovp[i].iov_base,
+			    iovp[i].iov_len);
+			if (last != NULL
+			    && (uint8_t *) last->iov_base + last->iov_len
+			    == &wb->hdr[wb->hdrlen]) {
+				/* continuous in hdr */
+				last->iov_len += iovp[i].iov_len;
+			} else {
+				wb->iov[wb->iovcnt].iov_base = &wb->hdr[wb->hdrlen];
+				wb->iov[wb->iovcnt].iov_len = iovp[i].iov_len;
+				wb->iovcnt++;
+			}
+			wb->hdrlen += iovp[i].iov_len;
+		} else {
+			wb->iov[wb->iovcnt].iov_base = iovp[i].iov_base;
+			wb->iov[wb->iovcnt].iov_len = iovp[i].iov_len;
+			wb->iovcnt++;
+		}
+	}
+	wb->bytes += total;
+
+	if (wb->bytes >= ISTGT_WBATCH_BYTES) {
+		rc = istgt_iscsi_wbatch_flush(conn);
+		if (rc < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+istgt_iscsi_wbatch_hold(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISTGT_WBATCH *wb = &conn->wbatch;
+	int rc;
+
+	if (wb->ntasks >= ISTGT_WBATCH_TASKS) {
+		rc = istgt_iscsi_wbatch_flush(conn);
+		if (rc < 0) {
+			/* task is released by next flush */
+			wb->tasks[wb->ntasks++] = lu_task;
+			return -1;
+		}
+	}
+	wb->tasks[wb->ntasks++] = lu_task;
+	if (wb->iovcnt == 0) {
+		/* nothing refers the task */
+		istgt_iscsi_wbatch_release(conn);
+	}
+	return 0;
+}
+
+int
+istgt_iscsi_copy_pdu(ISCSI_PDU_Ptr dst_pdu, ISCSI_PDU_Ptr src_pdu)
+{
+	memcpy(&dst_pdu->bhs, &src_pdu->bhs, ISCSI_BHS_LEN);
+	dst_pdu->ahs = src_pdu->ahs;
+	memcpy(dst_pdu->header_digest, src_pdu->header_digest,
+	    ISCSI_DIGEST_LEN);
+	if (src_pdu->data == src_pdu->shortdata) {
+		memcpy(dst_pdu->shortdata, src_pdu->shortdata,
+		    sizeof src_pdu->shortdata);
+		dst_pdu->data = dst_pdu->shortdata;
+	} else {
+		dst_pdu->data = src_pdu->data;
+	}
+	memcpy(dst_pdu->data_digest, src_pdu->data_digest, ISCSI_DIGEST_LEN);
+	dst_pdu->total_ahs_len = src_pdu->total_ahs_len;
+	dst_pdu->data_segment_len = src_pdu->data_segment_len;
+	dst_pdu->copy_pdu = 0;
+	src_pdu->copy_pdu = 1;
+	return 0;
+}
+
+typedef struct iscsi_param_table_t
+{
+	const char *key;
+	const char *val;
+	const char *list;
 	int type;
 } ISCSI_PARAM_TABLE;
 
@@ -2341,6 +2729,7 @@ istgt_iscsi_op_login(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	int StatusClass, StatusDetail;
 	int data_len;
 	int alloc_len;
+	int map;
 	int rc;
 
 	/* Login is proceeding OK */
@@ -2483,7 +2872,7 @@ istgt_iscsi_op_login(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 				goto response;
 			}
 			rc = istgt_lu_access(conn, lu, conn->initiator_name,
-			    conn->initiator_addr);
+			    conn->initiator_addr, &map);
 			if (rc < 0) {
 				MTX_UNLOCK(&conn->istgt->mutex);
 				ISTGT_ERRLOG("lu_access() failed\n");
@@ -2500,6 +2889,9 @@ istgt_iscsi_op_login(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 				StatusDetail = 0x03;
 				goto response;
 			}
+			/* limits and weight of the matched initiator group */
+			conn->qos = lu->map[map].qos;
+			conn->weight = lu->map[map].weight;
 			MTX_UNLOCK(&conn->istgt->mutex);
 
 			/* check existing session */
@@ -3166,8 +3558,12 @@ istgt_iscsi_op_text(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	DSET32(&rsp[24], conn->StatSN);
 	conn->StatSN++;
 	if (I_bit == 0) {
-		conn->sess->ExpCmdSN++;
-		conn->sess->MaxCmdSN++;
+		rc = istgt_iscsi_cmdsn_advance(conn, CmdSN);
+		if (rc < 0) {
+			SESS_MTX_UNLOCK(conn);
+			istgt_iscsi_param_free(params);
+			return -1;
+		}
 	}
 	DSET32(&rsp[28], conn->sess->ExpCmdSN);
 	DSET32(&rsp[32], conn->sess->MaxCmdSN);
@@ -3479,6 +3875,12 @@ istgt_iscsi_transfer_in_internal(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			DSET32(&rsp[44], 0);
 		}
 
+#ifdef ISTGT_USE_SENDFILE
+		if (lu_cmd->zcopy) {
+			rc = istgt_iscsi_write_pdu_zcopy(conn, &rsp_pdu,
+			    lu_cmd->zcopy_fd, lu_cmd->zcopy_offset + offset);
+		} else
+#endif /* ISTGT_USE_SENDFILE */
 		rc = istgt_iscsi_write_pdu_internal(conn, &rsp_pdu);
 		if (rc < 0) {
 			ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
@@ -3492,48 +3894,310 @@ istgt_iscsi_transfer_in_internal(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	return 0;
 }
 
+/*
+ * CmdSN reorder window of the session. With MC/S, a command ahead of
+ * ExpCmdSN is held in its slot as a task, and the connection goes on
+ * reading; whoever fills the gap delivers the held tasks to the LU in
+ * CmdSN order. A slot without task only advances ExpCmdSN.
+ * All called with sess->mutex held.
+ */
 static int
-istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+istgt_iscsi_cmdsn_deliver(CONN_Ptr conn)
 {
-	ISTGT_LU_CMD lu_cmd;
-	ISCSI_PDU rsp_pdu;
-	uint8_t *rsp;
-	uint8_t *cp;
-	uint8_t *data;
-	uint8_t *cdb;
-	uint64_t lun;
-	uint32_t task_tag;
-	uint32_t transfer_len;
-	uint32_t CmdSN;
-	uint32_t ExpStatSN;
-	size_t bidi_residual_len;
-	size_t residual_len;
-	size_t data_len;
-	size_t alloc_len;
-	int I_bit, F_bit, R_bit, W_bit, Attr_bit;
-	int o_bit, u_bit, O_bit, U_bit;
+	SESS_Ptr sess;
+	CMDSN_SLOT *sp;
+	ISTGT_LU_TASK_Ptr lu_task;
+	int delivered;
 	int rc;
 
-	if (!conn->full_feature) {
-		ISTGT_ERRLOG("before Full Feature\n");
-		return -1;
+	sess = conn->sess;
+	delivered = 0;
+	rc = 0;
+	while (sess->cmdsn_held != 0) {
+		sp = &sess->cmdsn_slot[sess->ExpCmdSN % ISTGT_CMDSN_WINDOW];
+		if (sp->held == 0)
+			break;
+		lu_task = sp->lu_task;
+		sp->held = 0;
+		sp->lu_task = NULL;
+		sess->cmdsn_held--;
+		sess->ExpCmdSN++;
+		delivered++;
+		if (lu_task == NULL)
+			continue;
+		ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "MCS: deliver CmdSN=%u\n",
+		    lu_task->lu_cmd.CmdSN);
+		/* the task answers a full queue on its own connection */
+		if (istgt_lu_execute_task(lu_task, NULL) < 0) {
+			ISTGT_ERRLOG("lu_execute_task() failed\n");
+			rc = -1;
+		}
 	}
+	if (delivered != 0 && sess->cmdsn_held != 0) {
+		sess->cmdsn_stall = time(NULL);
+	}
+	return rc;
+}
 
-	data_len = 0;
-	alloc_len = conn->sendbufsize;
-	data = (uint8_t *) conn->sendbuf;
-	memset(data, 0, alloc_len);
-	memset(&lu_cmd, 0, sizeof lu_cmd);
-
-	cp = (uint8_t *) &pdu->bhs;
-	I_bit = BGET8(&cp[0], 6);
-	F_bit = BGET8(&cp[1], 7);
-	R_bit = BGET8(&cp[1], 6);
-	W_bit = BGET8(&cp[1], 5);
-	Attr_bit = BGET8W(&cp[1], 2, 3);
+/* drop held tasks, they leave an empty slot to keep the CmdSN order */
+static void
+istgt_iscsi_cmdsn_abort(CONN_Ptr conn, CONN_Ptr owner, uint64_t lun, int all_luns, int all_cmds, uint32_t CmdSN)
+{
+	SESS_Ptr sess;
+	CMDSN_SLOT *sp;
+	ISTGT_LU_TASK_Ptr lu_task;
+	int i;
 
-	lun = DGET64(&cp[8]);
-	task_tag = DGET32(&cp[16]);
+	sess = conn->sess;
+	if (sess == NULL || sess->cmdsn_held == 0)
+		return;
+	for (i = 0; i < ISTGT_CMDSN_WINDOW; i++) {
+		sp = &sess->cmdsn_slot[i];
+		lu_task = sp->lu_task;
+		if (sp->held == 0 || lu_task == NULL)
+			continue;
+		if (owner != NULL && lu_task->conn != owner)
+			continue;
+		if (!all_luns && lu_task->lu_cmd.lun != lun)
+			continue;
+		if (!all_cmds && lu_task->lu_cmd.CmdSN != CmdSN)
+			continue;
+		ISTGT_LOG("CmdSN(%u), OP=0x%x held for MCS cleared\n",
+		    lu_task->lu_cmd.CmdSN, lu_task->lu_cmd.cdb[0]);
+		sp->lu_task = NULL;
+		(void) istgt_lu_destroy_task(lu_task);
+	}
+}
+
+/* skip CmdSNs lost on a single connection, nothing else can fill them */
+static int
+istgt_iscsi_cmdsn_skip(CONN_Ptr conn, uint32_t CmdSN)
+{
+	SESS_Ptr sess;
+	int rc;
+
+	sess = conn->sess;
+	rc = 0;
+	while (SN32_LT(sess->ExpCmdSN, CmdSN)) {
+		if (sess->cmdsn_slot[sess->ExpCmdSN % ISTGT_CMDSN_WINDOW].held) {
+			/* held tasks on the way are delivered in order */
+			if (istgt_iscsi_cmdsn_deliver(conn) < 0) {
+				rc = -1;
+			}
+			continue;
+		}
+		sess->ExpCmdSN++;
+	}
+	return rc;
+}
+
+/* take the CmdSN of a non-SCSI request, ahead of ExpCmdSN it holds a slot */
+static int
+istgt_iscsi_cmdsn_advance(CONN_Ptr conn, uint32_t CmdSN)
+{
+	SESS_Ptr sess;
+	CMDSN_SLOT *sp;
+	int rc;
+
+	sess = conn->sess;
+	if (CmdSN != sess->ExpCmdSN && sess->connections == 1) {
+		ISTGT_WARNLOG("CmdSN(%u) > ExpCmdSN(%u)\n",
+		    CmdSN, sess->ExpCmdSN);
+		if (istgt_iscsi_cmdsn_skip(conn, CmdSN) < 0) {
+			return -1;
+		}
+	}
+	if (SN32_LT(CmdSN, sess->ExpCmdSN)
+	    || SN32_GT(CmdSN, sess->MaxCmdSN)) {
+		ISTGT_ERRLOG("CmdSN(%u) ignore (ExpCmdSN=%u, MaxCmdSN=%u)\n",
+		    CmdSN, sess->ExpCmdSN, sess->MaxCmdSN);
+		return -1;
+	}
+	sess->MaxCmdSN++;
+	if (CmdSN == sess->ExpCmdSN) {
+		sess->ExpCmdSN++;
+		rc = istgt_iscsi_cmdsn_deliver(conn);
+		if (sess->req_mcs_cond > 0) {
+			sess->req_mcs_cond--;
+			if (pthread_cond_broadcast(&sess->mcs_cond) != 0) {
+				ISTGT_ERRLOG("cond_broadcast() failed\n");
+				rc = -1;
+			}
+		}
+		return rc;
+	}
+
+	/* a lower CmdSN is still on the way on another connection */
+	sp = &sess->cmdsn_slot[CmdSN % ISTGT_CMDSN_WINDOW];
+	if (sp->held != 0) {
+		ISTGT_ERRLOG("MCS: CmdSN(%u) already held (ExpCmdSN=%u)\n",
+		    CmdSN, sess->ExpCmdSN);
+		return -1;
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "MCS: hold CmdSN=%u ExpCmdSN=%u\n",
+	    CmdSN, sess->ExpCmdSN);
+	sp->held = 1;
+	sp->lu_task = NULL;
+	if (sess->cmdsn_held++ == 0) {
+		sess->cmdsn_stall = time(NULL);
+	}
+	return 0;
+}
+
+/* return 1 if a CmdSN gap is not filled within MAX_MCSREVWAIT */
+static int
+istgt_iscsi_cmdsn_expired(CONN_Ptr conn, time_t now)
+{
+	SESS_Ptr sess;
+
+	sess = conn->sess;
+	if (sess->cmdsn_held == 0
+	    || istgt_difftime(now, sess->cmdsn_stall)
+	    <= (MAX_MCSREVWAIT / 1000)) {
+		return 0;
+	}
+	ISTGT_ERRLOG("MCS: CmdSN gap at ExpCmdSN=%u (time=%d)\n",
+	    sess->ExpCmdSN, istgt_difftime(now, sess->cmdsn_stall));
+	return 1;
+}
+
+/* called by the connection timers without sess->mutex */
+static int
+istgt_iscsi_cmdsn_check(CONN_Ptr conn)
+{
+	int rc;
+
+	if (conn->sess == NULL) {
+		return 0;
+	}
+	SESS_MTX_LOCK(conn);
+	rc = istgt_iscsi_cmdsn_expired(conn, time(NULL));
+	SESS_MTX_UNLOCK(conn);
+	return (rc ? -1 : 0);
+}
+
+/* execute a command of a queued LU in CmdSN order across connections */
+static int
+istgt_iscsi_cmdsn_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	SESS_Ptr sess;
+	CMDSN_SLOT *sp;
+	ISTGT_LU_TASK_Ptr lu_task;
+	time_t now;
+	int rc;
+
+	/* copy the command before taking the session lock */
+	rc = istgt_lu_execute_defer(conn, lu_cmd, &lu_task);
+	if (rc < 0) {
+		ISTGT_ERRLOG("lu_execute_defer() failed\n");
+		return -1;
+	}
+
+	sess = conn->sess;
+	SESS_MTX_LOCK(conn);
+	if (SN32_GT(lu_cmd->CmdSN, sess->ExpCmdSN) && sess->connections == 1) {
+		ISTGT_WARNLOG("CmdSN(%u) > ExpCmdSN(%u)\n",
+		    lu_cmd->CmdSN, sess->ExpCmdSN);
+		if (istgt_iscsi_cmdsn_skip(conn, lu_cmd->CmdSN) < 0) {
+			SESS_MTX_UNLOCK(conn);
+			goto error_return;
+		}
+	}
+	if (lu_cmd->CmdSN == sess->ExpCmdSN) {
+		sess->ExpCmdSN++;
+		if (lu_task != NULL) {
+			rc = istgt_lu_execute_task(lu_task, lu_cmd);
+		}
+		if (sess->cmdsn_held != 0) {
+			if (istgt_iscsi_cmdsn_deliver(conn) < 0) {
+				rc = -1;
+			}
+		}
+		SESS_MTX_UNLOCK(conn);
+		return rc;
+	}
+
+	/* a lower CmdSN is still on the way on another connection */
+	now = time(NULL);
+	if (istgt_iscsi_cmdsn_expired(conn, now)) {
+		ISTGT_ERRLOG("MCS: CmdSN(%u) error ExpCmdSN=%u\n",
+		    lu_cmd->CmdSN, sess->ExpCmdSN);
+		SESS_MTX_UNLOCK(conn);
+		goto error_return;
+	}
+	sp = &sess->cmdsn_slot[lu_cmd->CmdSN % ISTGT_CMDSN_WINDOW];
+	if (sp->held != 0) {
+		ISTGT_ERRLOG("MCS: CmdSN(%u) already held (ExpCmdSN=%u)\n",
+		    lu_cmd->CmdSN, sess->ExpCmdSN);
+		SESS_MTX_UNLOCK(conn);
+		goto error_return;
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "MCS: hold CmdSN=%u ExpCmdSN=%u\n",
+	    lu_cmd->CmdSN, sess->ExpCmdSN);
+	sp->held = 1;
+	sp->lu_task = lu_task;
+	if (sess->cmdsn_held++ == 0) {
+		sess->cmdsn_stall = now;
+	}
+	SESS_MTX_UNLOCK(conn);
+
+	if (lu_task == NULL) {
+		/* answered now, the slot only keeps the CmdSN */
+		return rc;
+	}
+	return ISTGT_LU_TASK_RESULT_QUEUE_OK;
+
+ error_return:
+	if (lu_task != NULL) {
+		(void) istgt_lu_destroy_task(lu_task);
+	}
+	return -1;
+}
+
+static int
+istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ISTGT_LU_CMD lu_cmd;
+	ISCSI_PDU rsp_pdu;
+	uint8_t *rsp;
+	uint8_t *cp;
+	uint8_t *data;
+	uint8_t *cdb;
+	uint64_t lun;
+	uint32_t task_tag;
+	uint32_t transfer_len;
+	uint32_t CmdSN;
+	uint32_t ExpStatSN;
+	size_t bidi_residual_len;
+	size_t residual_len;
+	size_t data_len;
+	size_t alloc_len;
+	int I_bit, F_bit, R_bit, W_bit, Attr_bit;
+	int o_bit, u_bit, O_bit, U_bit;
+	int queued;
+	int rc;
+
+	if (!conn->full_feature) {
+		ISTGT_ERRLOG("before Full Feature\n");
+		return -1;
+	}
+
+	data_len = 0;
+	alloc_len = conn->sendbufsize;
+	data = (uint8_t *) conn->sendbuf;
+	memset(data, 0, alloc_len);
+	memset(&lu_cmd, 0, sizeof lu_cmd);
+	lu_cmd.ts_recv = istgt_clock_usec();
+
+	cp = (uint8_t *) &pdu->bhs;
+	I_bit = BGET8(&cp[0], 6);
+	F_bit = BGET8(&cp[1], 7);
+	R_bit = BGET8(&cp[1], 6);
+	W_bit = BGET8(&cp[1], 5);
+	Attr_bit = BGET8W(&cp[1], 2, 3);
+
+	lun = DGET64(&cp[8]);
+	task_tag = DGET32(&cp[16]);
 	transfer_len = DGET32(&cp[20]);
 	CmdSN = DGET32(&cp[24]);
 	ExpStatSN = DGET32(&cp[28]);
@@ -3553,7 +4217,9 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	    "CmdSN=%u, ExpStatSN=%u, StatSN=%u, ExpCmdSN=%u, MaxCmdSN=%u\n",
 	    CmdSN, ExpStatSN, conn->StatSN, conn->sess->ExpCmdSN,
 	    conn->sess->MaxCmdSN);
-	if (I_bit == 0) {
+	/* queued LUs reorder CmdSN in the session window, others wait here */
+	queued = (I_bit == 0 && istgt_lu_queued(conn->sess->lu));
+	if (I_bit == 0 && !queued) {
 		/* XXX MCS reverse order? */
 		if (SN32_GT(CmdSN, conn->sess->ExpCmdSN)) {
 			if (conn->sess->connections > 1) {
@@ -3613,7 +4279,7 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 			SESS_MTX_UNLOCK(conn);
 			return -1;
 		}
-		if (SN32_GT(CmdSN, conn->sess->ExpCmdSN)) {
+		if (!queued && SN32_GT(CmdSN, conn->sess->ExpCmdSN)) {
 			ISTGT_WARNLOG("CmdSN(%u) > ExpCmdSN(%u)\n",
 			    CmdSN, conn->sess->ExpCmdSN);
 			conn->sess->ExpCmdSN = CmdSN;
@@ -3647,8 +4313,10 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	lu_cmd.pdu = pdu;
 	SESS_MTX_LOCK(conn);
 	lu_cmd.lu = conn->sess->lu;
-	if (I_bit == 0) {
+	if (I_bit == 0 && !queued) {
 		conn->sess->ExpCmdSN++;
+		/* slots held by non-SCSI requests that follow */
+		(void) istgt_iscsi_cmdsn_deliver(conn);
 		if (conn->sess->req_mcs_cond > 0) {
 			conn->sess->req_mcs_cond--;
 			rc = pthread_cond_broadcast(&conn->sess->mcs_cond);
@@ -3698,9 +4366,15 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	}
 
 	/* execute SCSI command */
-	rc = istgt_lu_execute(conn, &lu_cmd);
+	istgt_lu_stats_begin(conn, &lu_cmd);
+	if (queued) {
+		rc = istgt_iscsi_cmdsn_execute(conn, &lu_cmd);
+	} else {
+		rc = istgt_lu_execute(conn, &lu_cmd);
+	}
 	if (rc < 0) {
 		ISTGT_ERRLOG("lu_execute() failed\n");
+		istgt_lu_stats_update(conn, &lu_cmd, 0);
 		return -1;
 	}
 	switch (rc) {
@@ -3716,6 +4390,7 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		break;
 	default:
 		ISTGT_ERRLOG("lu_execute() unknown rc=%d\n", rc);
+		istgt_lu_stats_update(conn, &lu_cmd, 0);
 		return -1;
 	}
 
@@ -3727,10 +4402,12 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		rc = istgt_iscsi_transfer_in(conn, &lu_cmd);
 		if (rc < 0) {
 			ISTGT_ERRLOG("iscsi_transfer_in() failed\n");
+			istgt_lu_stats_update(conn, &lu_cmd, 0);
 			return -1;
 		}
 		if (rc > 0) {
 			/* sent status by last DATAIN PDU */
+			istgt_lu_stats_update(conn, &lu_cmd, 1);
 			return 0;
 		}
 	}
@@ -3794,8 +4471,10 @@ istgt_iscsi_op_scsi(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	rc = istgt_iscsi_write_pdu(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
+		istgt_lu_stats_update(conn, &lu_cmd, 0);
 		return -1;
 	}
+	istgt_lu_stats_update(conn, &lu_cmd, 1);
 
 	return 0;
 }
@@ -3855,6 +4534,7 @@ istgt_iscsi_task_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
 		}
 		if (rc > 0) {
 			/* sent status by last DATAIN PDU */
+			istgt_lu_stats_update(conn, lu_cmd, 1);
 			return 0;
 		}
 	}
@@ -3924,6 +4604,7 @@ istgt_iscsi_task_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return -1;
 	}
+	istgt_lu_stats_update(conn, lu_cmd, 1);
 
 	return 0;
 }
@@ -3971,10 +4652,10 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	    "CmdSN=%u, ExpStatSN=%u, StatSN=%u, ExpCmdSN=%u, MaxCmdSN=%u\n",
 	    CmdSN, ExpStatSN, conn->StatSN, conn->sess->ExpCmdSN,
 	    conn->sess->MaxCmdSN);
-	if (CmdSN != conn->sess->ExpCmdSN) {
+	if (CmdSN != conn->sess->ExpCmdSN && conn->sess->connections == 1) {
 		ISTGT_WARNLOG("CmdSN(%u) might have dropped\n",
 		    conn->sess->ExpCmdSN);
-		conn->sess->ExpCmdSN = CmdSN;
+		(void) istgt_iscsi_cmdsn_skip(conn, CmdSN);
 	}
 	if (SN32_GT(ExpStatSN, conn->StatSN)) {
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "StatSN(%u) advanced\n",
@@ -3998,6 +4679,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_clear_task_ITLQ(conn, conn->sess->lu, lun,
 		    ref_CmdSN);
+		istgt_iscsi_cmdsn_abort(conn, NULL, lun, 0, 0, ref_CmdSN);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4008,6 +4690,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		ISTGT_LOG("ABORT_TASK_SET\n");
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_clear_task_ITL(conn, conn->sess->lu, lun);
+		istgt_iscsi_cmdsn_abort(conn, NULL, lun, 0, 1, 0);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4021,6 +4704,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		ISTGT_LOG("CLEAR_TASK_SET\n");
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_clear_task_ITL(conn, conn->sess->lu, lun);
+		istgt_iscsi_cmdsn_abort(conn, NULL, lun, 0, 1, 0);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4032,6 +4716,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		istgt_iscsi_drop_all_conns(conn);
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_reset(conn->sess->lu, lun);
+		istgt_iscsi_cmdsn_abort(conn, NULL, lun, 0, 1, 0);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4043,6 +4728,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		istgt_iscsi_drop_all_conns(conn);
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_reset(conn->sess->lu, lun);
+		istgt_iscsi_cmdsn_abort(conn, NULL, 0, 1, 1, 0);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4054,6 +4740,7 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 		istgt_iscsi_drop_all_conns(conn);
 		SESS_MTX_LOCK(conn);
 		rc = istgt_lu_reset(conn->sess->lu, lun);
+		istgt_iscsi_cmdsn_abort(conn, NULL, 0, 1, 1, 0);
 		SESS_MTX_UNLOCK(conn);
 		if (rc < 0) {
 			ISTGT_ERRLOG("LU reset failed\n");
@@ -4081,22 +4768,25 @@ istgt_iscsi_op_task(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 
 	DSET32(&rsp[16], task_tag);
 
+	SESS_MTX_LOCK(conn);
+	rc = 0;
+	if (I_bit == 0) {
+		rc = istgt_iscsi_cmdsn_advance(conn, CmdSN);
+	}
 	if (conn->use_sender == 0) {
-		SESS_MTX_LOCK(conn);
 		DSET32(&rsp[24], conn->StatSN);
 		conn->StatSN++;
-		if (I_bit == 0) {
-			conn->sess->ExpCmdSN++;
-			conn->sess->MaxCmdSN++;
-		}
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
 		DSET32(&rsp[32], conn->sess->MaxCmdSN);
-		SESS_MTX_UNLOCK(conn);
 	} else {
 		// update by sender
 	}
+	SESS_MTX_UNLOCK(conn);
+	if (rc < 0) {
+		return -1;
+	}
 
-	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu, I_bit);
+	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return -1;
@@ -4224,22 +4914,25 @@ istgt_iscsi_op_nopout(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
 	DSET32(&rsp[16], task_tag);
 	DSET32(&rsp[20], transfer_tag);
 
+	SESS_MTX_LOCK(conn);
+	rc = 0;
+	if (I_bit == 0) {
+		rc = istgt_iscsi_cmdsn_advance(conn, CmdSN);
+	}
 	if (conn->use_sender == 0) {
-		SESS_MTX_LOCK(conn);
 		DSET32(&rsp[24], conn->StatSN);
 		conn->StatSN++;
-		if (I_bit == 0) {
-			conn->sess->ExpCmdSN++;
-			conn->sess->MaxCmdSN++;
-		}
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
 		DSET32(&rsp[32], conn->sess->MaxCmdSN);
-		SESS_MTX_UNLOCK(conn);
 	} else {
 		// update by sender
 	}
+	SESS_MTX_UNLOCK(conn);
+	if (rc < 0) {
+		return -1;
+	}
 
-	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu, I_bit);
+	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return -1;
@@ -4574,7 +5267,7 @@ istgt_iscsi_send_r2t(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int offset, int len
 	DSET32(&rsp[16], lu_cmd->task_tag);
 	DSET32(&rsp[20], transfer_tag);
 
-	if (conn->use_sender == 0) {
+	if (conn->use_sender == 0 || conn->use_reactor) {
 		SESS_MTX_LOCK(conn);
 		DSET32(&rsp[24], conn->StatSN);
 		DSET32(&rsp[28], conn->sess->ExpCmdSN);
@@ -4589,7 +5282,13 @@ istgt_iscsi_send_r2t(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int offset, int len
 	DSET32(&rsp[40], (uint32_t) offset);
 	DSET32(&rsp[44], (uint32_t) len);
 
-	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu, 0);
+#ifdef ISTGT_USE_EPOLL
+	if (conn->use_reactor) {
+		/* caller waits for Data-OUT on this thread, don't queue */
+		rc = istgt_reactor_write_pdu(conn, &rsp_pdu);
+	} else
+#endif /* ISTGT_USE_EPOLL */
+	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return -1;
@@ -5016,7 +5715,7 @@ istgt_iscsi_send_nopin(CONN_Ptr conn)
 		// update by sender
 	}
 
-	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu, 0);
+	rc = istgt_iscsi_write_pdu_upd(conn, &rsp_pdu);
 	if (rc < 0) {
 		ISTGT_ERRLOG("iscsi_write_pdu() failed\n");
 		return -1;
@@ -5203,9 +5902,7 @@ wait_all_task(CONN_Ptr conn)
 				break;
 			}
 
-			MTX_LOCK(&conn->task_queue_mutex);
-			lu_task = istgt_queue_dequeue(&conn->task_queue);
-			MTX_UNLOCK(&conn->task_queue_mutex);
+			lu_task = istgt_ring_dequeue(&conn->task_queue);
 			if (lu_task != NULL) {
 				if (lu_task->lu_cmd.W_bit) {
 					/* write */
@@ -5259,731 +5956,1904 @@ wait_all_task(CONN_Ptr conn)
 	    conn->id, conn->running_tasks);
 }
 
-static void
-worker_cleanup(void *arg)
+static int
+worker_check_exit(CONN_Ptr conn)
 {
-	CONN_Ptr conn = (CONN_Ptr) arg;
 	ISTGT_LU_Ptr lu;
-	int rc;
-
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "worker_cleanup\n");
-	ISTGT_WARNLOG("force cleanup execute\n");
-
-	/* cleanup */
-	pthread_mutex_unlock(&conn->task_queue_mutex);
-	pthread_mutex_unlock(&conn->result_queue_mutex);
-	if (conn->sess != NULL) {
-		if (conn->sess->lu != NULL) {
-			pthread_mutex_unlock(&conn->sess->lu->mutex);
-		}
-		pthread_mutex_unlock(&conn->sess->mutex);
-	}
-	if (conn->exec_lu_task != NULL) {
-		conn->exec_lu_task->error = 1;
-		pthread_cond_broadcast(&conn->exec_lu_task->trans_cond);
-		pthread_mutex_unlock(&conn->exec_lu_task->trans_mutex);
-	}
-	pthread_mutex_unlock(&conn->wpdu_mutex);
-	pthread_mutex_unlock(&conn->r2t_mutex);
-	pthread_mutex_unlock(&conn->istgt->mutex);
-	pthread_mutex_unlock(&g_conns_mutex);
-	pthread_mutex_unlock(&g_last_tsih_mutex);
 
-	conn->state = CONN_STATE_EXITING;
+	/* check exit request */
 	if (conn->sess != NULL) {
 		SESS_MTX_LOCK(conn);
 		lu = conn->sess->lu;
-		if (lu != NULL && lu->queue_depth != 0) {
-			rc = istgt_lu_clear_task_IT(conn, lu);
-			if (rc < 0) {
-				ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
-			}
-			istgt_clear_all_transfer_task(conn);
-		}
 		SESS_MTX_UNLOCK(conn);
+	} else {
+		lu = NULL;
 	}
-	if (conn->pdu.copy_pdu == 0) {
-		xfree(conn->pdu.ahs);
-		conn->pdu.ahs = NULL;
-		if (conn->pdu.data != conn->pdu.shortdata) {
-			xfree(conn->pdu.data);
+	if (lu != NULL) {
+		if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING) {
+			conn->state = CONN_STATE_EXITING;
+			return 1;
+		}
+	} else {
+		if (istgt_get_state(conn->istgt) != ISTGT_STATE_RUNNING) {
+			conn->state = CONN_STATE_EXITING;
+			return 1;
 		}
-		conn->pdu.data = NULL;
-	}
-	wait_all_task(conn);
-	if (conn->use_sender) {
-		pthread_cond_broadcast(&conn->result_queue_cond);
-		pthread_join(conn->sender_thread, NULL);
 	}
-	close(conn->sock);
-#ifdef ISTGT_USE_KQUEUE
-	close(conn->kq);
-	conn->kq = -1;
-#endif /* ISTGT_USE_KQUEUE */
-	sleep(1);
-
-	/* cleanup conn & sess */
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cancel cleanup LOCK\n");
-	MTX_LOCK(&g_conns_mutex);
-	g_conns[conn->id] = NULL;
-	istgt_remove_conn(conn);
-	MTX_UNLOCK(&g_conns_mutex);
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cancel cleanup UNLOCK\n");
-
-	return;
+	return 0;
 }
 
-static void *
-sender(void *arg)
+/* execute conn->pdu and pending PDUs, return -1 if conn should be closed */
+static int
+worker_execute_pdu(CONN_Ptr conn)
 {
-	CONN_Ptr conn = (CONN_Ptr) arg;
-	ISTGT_LU_TASK_Ptr lu_task;
-	struct timespec abstime;
-	time_t now;
+	ISCSI_PDU_Ptr pdu;
+	int opcode;
 	int rc;
 
-#ifdef HAVE_PTHREAD_SET_NAME_NP
-	{
-		char buf[MAX_TMPBUF];
-		snprintf(buf, sizeof buf, "sendthread #%d", conn->id);
-		pthread_set_name_np(conn->sender_thread, buf);
-	}
-#endif
-	memset(&abstime, 0, sizeof abstime);
-	/* handle DATA-IN/SCSI status */
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "sender loop start (%d)\n", conn->id);
-	//MTX_LOCK(&conn->sender_mutex);
 	while (1) {
+		opcode = BGET8W(&conn->pdu.bhs.opcode, 5, 6);
+
 		if (conn->state != CONN_STATE_RUNNING) {
+			return -1;
+		}
+
+		if (g_trace_flag) {
+			if (conn->sess != NULL) {
+				SESS_MTX_LOCK(conn);
+				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+				    "isid=%"PRIx64", tsih=%u, cid=%u, op=%x\n",
+				    conn->sess->isid, conn->sess->tsih,
+				    conn->cid, opcode);
+				SESS_MTX_UNLOCK(conn);
+			} else {
+				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+				    "isid=xxx, tsih=xxx, cid=%u, op=%x\n",
+				    conn->cid, opcode);
+			}
+		}
+		rc = istgt_iscsi_execute(conn, &conn->pdu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_execute() failed on %s(%s)\n",
+			    conn->target_port, conn->initiator_port);
+			return -1;
+		}
+		if (g_trace_flag) {
+			if (conn->sess != NULL) {
+				SESS_MTX_LOCK(conn);
+				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+				    "isid=%"PRIx64", tsih=%u, cid=%u, op=%x complete\n",
+				    conn->sess->isid, conn->sess->tsih,
+				    conn->cid, opcode);
+				SESS_MTX_UNLOCK(conn);
+			} else {
+				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
+				    "isid=xxx, tsih=xxx, cid=%u, op=%x complete\n",
+				    conn->cid, opcode);
+			}
+		}
+
+		if (opcode == ISCSI_OP_LOGOUT) {
+			ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "logout received\n");
+			return -1;
+		}
+
+		if (conn->pdu.copy_pdu == 0) {
+			xfree(conn->pdu.ahs);
+			conn->pdu.ahs = NULL;
+			if (conn->pdu.data != conn->pdu.shortdata) {
+				xfree(conn->pdu.data);
+			}
+			conn->pdu.data = NULL;
+		}
+
+		/* execute pending PDUs */
+		pdu = istgt_queue_dequeue(&conn->pending_pdus);
+		if (pdu == NULL) {
 			break;
 		}
-		MTX_LOCK(&conn->result_queue_mutex);
-		lu_task = istgt_queue_dequeue(&conn->result_queue);
-		if (lu_task == NULL) {
-			now = time(NULL);
-			abstime.tv_sec = now + conn->timeout;
-			abstime.tv_nsec = 0;
-			rc = pthread_cond_timedwait(&conn->result_queue_cond,
-			    &conn->result_queue_mutex, &abstime);
-			if (rc == ETIMEDOUT) {
-				/* nothing */
-			}
-			lu_task = istgt_queue_dequeue(&conn->result_queue);
-			if (lu_task == NULL) {
-				MTX_UNLOCK(&conn->result_queue_mutex);
-				continue;
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "execute pending PDU\n");
+		rc = istgt_iscsi_copy_pdu(&conn->pdu, pdu);
+		conn->pdu.copy_pdu = 0;
+		xfree(pdu);
+	}
+	return 0;
+}
+
+/* socket is readable, return 1 if it should be retried later */
+static int
+worker_sock_event(CONN_Ptr conn)
+{
+	int rc;
+
+	conn->pdu.copy_pdu = 0;
+	rc = istgt_iscsi_read_pdu(conn, &conn->pdu);
+	if (rc < 0) {
+		if (conn->state != CONN_STATE_EXITING) {
+			ISTGT_ERRLOG("conn->state = %d\n", conn->state);
+		}
+		if (conn->state != CONN_STATE_RUNNING) {
+			if (errno == EINPROGRESS) {
+				sleep(1);
+				return 1;
+			}
+			if (errno == ECONNRESET
+			    || errno == ETIMEDOUT) {
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "iscsi_read_pdu() RESET/TIMEOUT\n");
+			} else {
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "iscsi_read_pdu() EOF\n");
 			}
+			return -1;
 		}
-		MTX_UNLOCK(&conn->result_queue_mutex);
-		/* send all responses */
-//		MTX_LOCK(&conn->wpdu_mutex);
-		do {
-			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-			    "task response CmdSN=%u\n", lu_task->lu_cmd.CmdSN);
-			lu_task->lock = 1;
-			if (lu_task->type == ISTGT_LU_TASK_RESPONSE) {
-				/* send DATA-IN, SCSI status */
+		ISTGT_ERRLOG("iscsi_read_pdu() failed\n");
+		return -1;
+	}
+	return worker_execute_pdu(conn);
+}
+
+/* execute DATA-IN/OUT of the queued task, lu_task may be NULL */
+static int
+worker_task_event(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISCSI_PDU_Ptr pdu;
+	int rc;
+
+	if (lu_task != NULL) {
+		if (conn->exec_lu_task != NULL) {
+			ISTGT_ERRLOG("task is overlapped (CmdSN=%u, %u)\n",
+			    conn->exec_lu_task->lu_cmd.CmdSN,
+			    lu_task->lu_cmd.CmdSN);
+			return -1;
+		}
+		conn->exec_lu_task = lu_task;
+		if (lu_task->lu_cmd.W_bit) {
+			/* write */
+			if (lu_task->req_transfer_out == 0) {
+				if (lu_task->req_execute) {
+					if (conn->running_tasks > 0) {
+						conn->running_tasks--;
+					} else {
+						ISTGT_ERRLOG("running no task\n");
+					}
+				}
 				rc = istgt_iscsi_task_response(conn, lu_task);
 				if (rc < 0) {
 					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"iscsi_task_response() CmdSN=%u failed"
-						" on %s(%s)\n", lu_task->lu_cmd.CmdSN,
-						conn->target_port, conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if(rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
+					ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
+					    conn->target_port,
+					    conn->initiator_port);
+					return -1;
 				}
 				rc = istgt_lu_destroy_task(lu_task);
 				if (rc < 0) {
 					ISTGT_ERRLOG("lu_destroy_task() failed\n");
-					break;
+					return -1;
 				}
-			} else if (lu_task->type == ISTGT_LU_TASK_REQPDU) {
-			reqpdu:
-				/* send PDU */
-				rc = istgt_iscsi_write_pdu_internal(lu_task->conn,
-				    lu_task->lu_cmd.pdu);
+				lu_task = NULL;
+				conn->exec_lu_task = NULL;
+			} else {
+				//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				//    "Task Write Trans START\n");
+				rc = istgt_iscsi_task_transfer_out(conn, lu_task);
 				if (rc < 0) {
 					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"iscsi_write_pdu() failed on %s(%s)\n",
-						lu_task->conn->target_port,
-						lu_task->conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if(rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
+					ISTGT_ERRLOG("iscsi_task_transfer_out() failed on %s(%s)\n",
+					    conn->target_port,
+					    conn->initiator_port);
+					return -1;
 				}
-				/* free allocated memory by caller */
-				xfree(lu_task);
-			} else if (lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
-				rc = istgt_update_pdu(lu_task->conn, &lu_task->lu_cmd);
-				if (rc < 0) {
-					lu_task->error = 1;
-					ISTGT_ERRLOG(
-						"update_pdu() failed on %s(%s)\n",
-						lu_task->conn->target_port,
-						lu_task->conn->initiator_port);
-					rc = write(conn->task_pipe[1], "E", 1);
-					if(rc < 0 || rc != 1) {
-						ISTGT_ERRLOG("write() failed\n");
-					}
-					break;
+				//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				//    "Task Write Trans END\n");
+
+				MTX_LOCK(&lu_task->trans_mutex);
+				lu_task->req_transfer_out = 0;
+
+				/* need response after execution */
+				lu_task->req_execute = 1;
+				if (conn->use_sender == 0) {
+					conn->running_tasks++;
 				}
-				goto reqpdu;
-			} else {
-				ISTGT_ERRLOG("Unknown task type %x\n", lu_task->type);
-				rc = -1;
+
+				rc = pthread_cond_broadcast(&lu_task->trans_cond);
+				MTX_UNLOCK(&lu_task->trans_mutex);
+				if (rc != 0) {
+					ISTGT_ERRLOG("cond_broadcast() failed\n");
+					return -1;
+				}
+				lu_task = NULL;
+				conn->exec_lu_task = NULL;
 			}
-			// conn is running?
-			if (conn->state != CONN_STATE_RUNNING) {
-				//ISTGT_WARNLOG("exit thread\n");
-				break;
+		} else {
+			/* read or no data */
+			rc = istgt_iscsi_task_response(conn, lu_task);
+			if (rc < 0) {
+				lu_task->error = 1;
+				ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
+				    conn->target_port,
+				    conn->initiator_port);
+				return -1;
 			}
-			MTX_LOCK(&conn->result_queue_mutex);
-			lu_task = istgt_queue_dequeue(&conn->result_queue);
-			MTX_UNLOCK(&conn->result_queue_mutex);
-		} while (lu_task != NULL);
-//		MTX_UNLOCK(&conn->wpdu_mutex);
+			rc = istgt_lu_destroy_task(lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_destroy_task() failed\n");
+				return -1;
+			}
+			lu_task = NULL;
+			conn->exec_lu_task = NULL;
+		}
 	}
-	//MTX_UNLOCK(&conn->sender_mutex);
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "sender loop ended (%d)\n", conn->id);
-	return NULL;
+	/* XXX PDUs in DATA-OUT? */
+	pdu = istgt_queue_dequeue(&conn->pending_pdus);
+	if (pdu != NULL) {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+		    "pending in task\n");
+		rc = istgt_iscsi_copy_pdu(&conn->pdu, pdu);
+		conn->pdu.copy_pdu = 0;
+		xfree(pdu);
+		return worker_execute_pdu(conn);
+	}
+	return 0;
 }
 
-static void *
-worker(void *arg)
+/* task pipe is readable, dequeue the task to execute */
+static int
+worker_pipe_read(CONN_Ptr conn, ISTGT_LU_TASK_Ptr *lu_taskp)
 {
-	CONN_Ptr conn = (CONN_Ptr) arg;
-	ISTGT_LU_TASK_Ptr lu_task;
-	ISTGT_LU_Ptr lu;
-	ISCSI_PDU_Ptr pdu;
-	sigset_t signew, sigold;
-#ifdef ISTGT_USE_KQUEUE
-	int kq;
-	struct kevent kev;
-	struct timespec kev_timeout;
-#else
-	struct pollfd fds[2];
-	int nopin_timer;
-#endif /* ISTGT_USE_KQUEUE */
-	int opcode;
+	char tmp[1];
 	int rc;
 
-	ISTGT_TRACELOG(ISTGT_TRACE_NET, "connect to %s:%s,%d\n",
-	    conn->portal.host, conn->portal.port, conn->portal.tag);
-#if 0
-	ISTGT_NOTICELOG("connect to %s:%s,%d\n",
-	    conn->portal.host, conn->portal.port, conn->portal.tag);
-#endif
+	//ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Queue Task START\n");
 
-#ifdef ISTGT_USE_KQUEUE
-	kq = kqueue();
-	if (kq == -1) {
-		ISTGT_ERRLOG("kqueue() failed\n");
-		return NULL;
-	}
-	conn->kq = kq;
-#if defined (ISTGT_USE_IOVEC) && defined (NOTE_LOWAT)
-	ISTGT_EV_SET(&kev, conn->sock, EVFILT_READ, EV_ADD, NOTE_LOWAT, ISCSI_BHS_LEN, NULL);
-#else
-	ISTGT_EV_SET(&kev, conn->sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
-#endif
-	rc = kevent(kq, &kev, 1, NULL, 0, NULL);
-	if (rc == -1) {
-		ISTGT_ERRLOG("kevent() failed\n");
-		close(kq);
-		return NULL;
+	*lu_taskp = NULL;
+	rc = read(conn->task_pipe[0], tmp, 1);
+	if (rc < 0 || rc == 0 || rc != 1) {
+		ISTGT_ERRLOG("read() failed\n");
+		return -1;
 	}
-	ISTGT_EV_SET(&kev, conn->task_pipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
-	rc = kevent(kq, &kev, 1, NULL, 0, NULL);
-	if (rc == -1) {
-		ISTGT_ERRLOG("kevent() failed\n");
-		close(kq);
-		return NULL;
+	if (tmp[0] == 'E') {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "exit request (%d)\n",
+		    conn->id);
+		return -1;
 	}
 
-	if (!conn->istgt->daemon) {
-		ISTGT_EV_SET(&kev, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-		rc = kevent(kq, &kev, 1, NULL, 0, NULL);
-		if (rc == -1) {
-			ISTGT_ERRLOG("kevent() failed\n");
-			close(kq);
-			return NULL;
-		}
-		ISTGT_EV_SET(&kev, SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-		rc = kevent(kq, &kev, 1, NULL, 0, NULL);
-		if (rc == -1) {
-			ISTGT_ERRLOG("kevent() failed\n");
-			close(kq);
-			return NULL;
-		}
+	/* DATA-IN/OUT */
+	*lu_taskp = istgt_ring_dequeue(&conn->task_queue);
+	return 0;
+}
+
+static int
+worker_pipe_event(CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+
+	rc = worker_pipe_read(conn, &lu_task);
+	if (rc < 0) {
+		return -1;
 	}
-#else
-	memset(&fds, 0, sizeof fds);
-	fds[0].fd = conn->sock;
-	fds[0].events = POLLIN;
-	fds[1].fd = conn->task_pipe[0];
-	fds[1].events = POLLIN;
-#endif /* ISTGT_USE_KQUEUE */
+	return worker_task_event(conn, lu_task);
+}
 
-	conn->pdu.ahs = NULL;
-	conn->pdu.data = NULL;
-	conn->pdu.copy_pdu = 0;
-	conn->state = CONN_STATE_RUNNING;
-	conn->exec_lu_task = NULL;
-	lu_task = NULL;
+static void
+worker_cleanup(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+	ISTGT_LU_Ptr lu;
+	int rc;
 
-	pthread_cleanup_push(worker_cleanup, conn);
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "worker_cleanup\n");
+	ISTGT_WARNLOG("force cleanup execute\n");
 
-	conn->use_sender = 0;
-	if (conn->istgt->swmode >= ISTGT_SWMODE_NORMAL) {
-		/* create sender thread */
-#ifdef ISTGT_STACKSIZE
-		rc = pthread_create(&conn->sender_thread, &conn->istgt->attr,
-		    &sender, (void *)conn);
-#else
-		rc = pthread_create(&conn->sender_thread, NULL, &sender,
-		    (void *)conn);
-#endif
-		if (rc != 0) {
-			ISTGT_ERRLOG("pthread_create() failed\n");
-			goto cleanup_exit;
+	/* cleanup */
+	pthread_mutex_unlock(&conn->result_queue_mutex);
+	if (conn->sess != NULL) {
+		if (conn->sess->lu != NULL) {
+			pthread_mutex_unlock(&conn->sess->lu->mutex);
 		}
-		conn->use_sender = 1;
+		pthread_mutex_unlock(&conn->sess->mutex);
 	}
-	conn->wsock = conn->sock;
-
-	sigemptyset(&signew);
-	sigemptyset(&sigold);
-	sigaddset(&signew, ISTGT_SIGWAKEUP);
-	pthread_sigmask(SIG_UNBLOCK, &signew, &sigold);
+	if (conn->exec_lu_task != NULL) {
+		conn->exec_lu_task->error = 1;
+		pthread_cond_broadcast(&conn->exec_lu_task->trans_cond);
+		pthread_mutex_unlock(&conn->exec_lu_task->trans_mutex);
+	}
+	pthread_mutex_unlock(&conn->wpdu_mutex);
+	pthread_mutex_unlock(&conn->r2t_mutex);
+	pthread_mutex_unlock(&conn->istgt->mutex);
+	pthread_mutex_unlock(&g_conns_mutex);
+	pthread_mutex_unlock(&g_last_tsih_mutex);
 
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop start (%d)\n", conn->id);
-#ifndef ISTGT_USE_KQUEUE
-	nopin_timer = conn->nopininterval;
-#endif /* !ISTGT_USE_KQUEUE */
-	while (1) {
-		/* check exit request */
-		if (conn->sess != NULL) {
-			SESS_MTX_LOCK(conn);
-			lu = conn->sess->lu;
-			SESS_MTX_UNLOCK(conn);
-		} else {
-			lu = NULL;
+	conn->state = CONN_STATE_EXITING;
+	if (conn->sess != NULL) {
+		SESS_MTX_LOCK(conn);
+		lu = conn->sess->lu;
+		if (lu != NULL && lu->queue_depth != 0) {
+			rc = istgt_lu_clear_task_IT(conn, lu);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
+			}
+			istgt_iscsi_cmdsn_abort(conn, conn, 0, 1, 1, 0);
+			istgt_clear_all_transfer_task(conn);
+		}
+		SESS_MTX_UNLOCK(conn);
+	}
+	if (conn->pdu.copy_pdu == 0) {
+		xfree(conn->pdu.ahs);
+		conn->pdu.ahs = NULL;
+		if (conn->pdu.data != conn->pdu.shortdata) {
+			xfree(conn->pdu.data);
+		}
+		conn->pdu.data = NULL;
+	}
+	wait_all_task(conn);
+	if (conn->use_sender) {
+		pthread_cond_broadcast(&conn->result_queue_cond);
+		pthread_join(conn->sender_thread, NULL);
+	}
+	close(conn->sock);
+#ifdef ISTGT_USE_KQUEUE
+	close(conn->kq);
+	conn->kq = -1;
+#endif /* ISTGT_USE_KQUEUE */
+	sleep(1);
+
+	/* cleanup conn & sess */
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cancel cleanup LOCK\n");
+	MTX_LOCK(&g_conns_mutex);
+	g_conns[conn->id] = NULL;
+	istgt_remove_conn(conn);
+	MTX_UNLOCK(&g_conns_mutex);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cancel cleanup UNLOCK\n");
+
+	return;
+}
+
+static int
+istgt_iscsi_send_task(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "task response CmdSN=%u\n", lu_task->lu_cmd.CmdSN);
+	lu_task->lock = 1;
+	if (lu_task->type == ISTGT_LU_TASK_RESPONSE) {
+		/* send DATA-IN, SCSI status */
+		rc = istgt_iscsi_task_response(conn, lu_task);
+		if (rc < 0) {
+			lu_task->error = 1;
+			ISTGT_ERRLOG(
+				"iscsi_task_response() CmdSN=%u failed"
+				" on %s(%s)\n", lu_task->lu_cmd.CmdSN,
+				conn->target_port, conn->initiator_port);
+			return -1;
+		}
+	} else if (lu_task->type == ISTGT_LU_TASK_REQPDU
+	    || lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
+		if (lu_task->type == ISTGT_LU_TASK_REQUPDPDU) {
+			rc = istgt_update_pdu(lu_task->conn, &lu_task->lu_cmd);
+			if (rc < 0) {
+				lu_task->error = 1;
+				ISTGT_ERRLOG(
+					"update_pdu() failed on %s(%s)\n",
+					lu_task->conn->target_port,
+					lu_task->conn->initiator_port);
+				return -1;
+			}
+		}
+		/* send PDU */
+		rc = istgt_iscsi_write_pdu_internal(lu_task->conn,
+		    lu_task->lu_cmd.pdu);
+		if (rc < 0) {
+			lu_task->error = 1;
+			ISTGT_ERRLOG(
+				"iscsi_write_pdu() failed on %s(%s)\n",
+				lu_task->conn->target_port,
+				lu_task->conn->initiator_port);
+			return -1;
+		}
+	} else {
+		ISTGT_ERRLOG("Unknown task type %x\n", lu_task->type);
+		return -1;
+	}
+	/* destroyed (or freed allocated memory by caller) after sending */
+	rc = istgt_iscsi_wbatch_hold(conn, lu_task);
+	if (rc < 0) {
+		ISTGT_ERRLOG("iscsi_wbatch_hold() failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+sender_send_tasks(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	int rc;
+
+	/* send all responses */
+//	MTX_LOCK(&conn->wpdu_mutex);
+	/* gather PDUs while queue is not empty */
+	conn->wbatch.owner = pthread_self();
+	conn->wbatch.enable = 1;
+	do {
+		rc = istgt_iscsi_send_task(conn, lu_task);
+		if (rc < 0) {
+			rc = write(conn->task_pipe[1], "E", 1);
+			if(rc < 0 || rc != 1) {
+				ISTGT_ERRLOG("write() failed\n");
+			}
+			break;
+		}
+		// conn is running?
+		if (conn->state != CONN_STATE_RUNNING) {
+			//ISTGT_WARNLOG("exit thread\n");
+			break;
+		}
+		lu_task = istgt_ring_dequeue(&conn->result_queue);
+	} while (lu_task != NULL);
+	conn->wbatch.enable = 0;
+	rc = istgt_iscsi_wbatch_flush(conn);
+	if (rc < 0) {
+		ISTGT_ERRLOG("iscsi_wbatch_flush() failed on %s(%s)\n",
+		    conn->target_port, conn->initiator_port);
+		rc = write(conn->task_pipe[1], "E", 1);
+		if(rc < 0 || rc != 1) {
+			ISTGT_ERRLOG("write() failed\n");
+		}
+	}
+//	MTX_UNLOCK(&conn->wpdu_mutex);
+}
+
+static void
+sender_flush_logout(CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+
+	/* logout response may be queued after worker exit */
+	while (1) {
+		lu_task = istgt_ring_dequeue(&conn->result_queue);
+		if (lu_task == NULL)
+			break;
+		rc = istgt_iscsi_send_task(conn, lu_task);
+		if (rc < 0)
+			break;
+	}
+	(void) istgt_iscsi_wbatch_flush(conn);
+}
+
+static void *
+sender(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+	ISTGT_LU_TASK_Ptr lu_task;
+	struct timespec abstime;
+	time_t now;
+	int rc;
+
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	{
+		char buf[MAX_TMPBUF];
+		snprintf(buf, sizeof buf, "sendthread #%d", conn->id);
+		pthread_set_name_np(conn->sender_thread, buf);
+	}
+#endif
+	memset(&abstime, 0, sizeof abstime);
+	/* handle DATA-IN/SCSI status */
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "sender loop start (%d)\n", conn->id);
+	//MTX_LOCK(&conn->sender_mutex);
+	while (1) {
+		if (conn->state != CONN_STATE_RUNNING) {
+			break;
+		}
+		lu_task = istgt_ring_dequeue(&conn->result_queue);
+		if (lu_task == NULL) {
+			/* producers signal only if result_waiting is set */
+			MTX_LOCK(&conn->result_queue_mutex);
+			__atomic_store_n(&conn->result_waiting, 1, __ATOMIC_SEQ_CST);
+			lu_task = istgt_ring_dequeue(&conn->result_queue);
+			if (lu_task == NULL) {
+				now = time(NULL);
+				abstime.tv_sec = now + conn->timeout;
+				abstime.tv_nsec = 0;
+				rc = pthread_cond_timedwait(&conn->result_queue_cond,
+				    &conn->result_queue_mutex, &abstime);
+				if (rc == ETIMEDOUT) {
+					/* nothing */
+				}
+			}
+			__atomic_store_n(&conn->result_waiting, 0, __ATOMIC_SEQ_CST);
+			MTX_UNLOCK(&conn->result_queue_mutex);
+			if (lu_task == NULL) {
+				continue;
+			}
+		}
+		sender_send_tasks(conn, lu_task);
+	}
+	if (conn->exec_logout) {
+		sender_flush_logout(conn);
+	}
+	//MTX_UNLOCK(&conn->sender_mutex);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "sender loop ended (%d)\n", conn->id);
+	return NULL;
+}
+
+static void
+worker_exit(CONN_Ptr conn)
+{
+	ISTGT_LU_Ptr lu;
+	int rc;
+
+	conn->state = CONN_STATE_EXITING;
+	if (conn->sess != NULL) {
+		SESS_MTX_LOCK(conn);
+		lu = conn->sess->lu;
+		if (lu != NULL && lu->queue_depth != 0) {
+			rc = istgt_lu_clear_task_IT(conn, lu);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
+			}
+			istgt_iscsi_cmdsn_abort(conn, conn, 0, 1, 1, 0);
+			istgt_clear_all_transfer_task(conn);
+		}
+		SESS_MTX_UNLOCK(conn);
+	}
+	if (conn->pdu.copy_pdu == 0) {
+		xfree(conn->pdu.ahs);
+		conn->pdu.ahs = NULL;
+		if (conn->pdu.data != conn->pdu.shortdata) {
+			xfree(conn->pdu.data);
+		}
+		conn->pdu.data = NULL;
+	}
+	wait_all_task(conn);
+
+	if (conn->use_reactor) {
+#ifdef ISTGT_USE_EPOLL
+		/* stop sending by network threads */
+		istgt_reactor_detach(conn);
+#endif /* ISTGT_USE_EPOLL */
+	} else if (conn->use_sender) {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "stop sender thread (%d)\n", conn->id);
+		/* stop sender thread */
+		MTX_LOCK(&conn->result_queue_mutex);
+		rc = pthread_cond_broadcast(&conn->result_queue_cond);
+		MTX_UNLOCK(&conn->result_queue_mutex);
+		if (rc != 0) {
+			ISTGT_ERRLOG("cond_broadcast() failed\n");
+			/* ignore errors */
+		}
+		rc = pthread_join(conn->sender_thread, NULL);
+		if (rc != 0) {
+			ISTGT_ERRLOG("pthread_join() failed\n");
+			/* ignore errors */
+		}
+	}
+
+	close(conn->sock);
+#ifdef ISTGT_USE_KQUEUE
+	close(conn->kq);
+	conn->kq = -1;
+#endif /* ISTGT_USE_KQUEUE */
+	sleep(1);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "worker %d end\n", conn->id);
+
+	/* cleanup conn & sess */
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cleanup LOCK\n");
+	MTX_LOCK(&g_conns_mutex);
+	g_conns[conn->id] = NULL;
+	istgt_remove_conn(conn);
+	MTX_UNLOCK(&g_conns_mutex);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cleanup UNLOCK\n");
+}
+
+/*
+ * Pin the connection thread, the sender thread inherits the mask.
+ * With Auto the thread goes to the NUMA node receiving the socket,
+ * and the buffers made by the acceptor are allocated again there.
+ */
+static void
+istgt_iscsi_set_affinity(CONN_Ptr conn)
+{
+	ISTGT_CPUSET cpuset;
+	char buf[MAX_TMPBUF];
+	int node;
+	int rc;
+
+	switch (conn->istgt->affinity) {
+	case ISTGT_AFFINITY_LIST:
+		cpuset = conn->istgt->cpuset;
+		node = -1;
+		break;
+	case ISTGT_AFFINITY_AUTO:
+		node = istgt_cpuset_sock_node(conn->sock);
+		if (node < 0 || istgt_cpuset_node(&cpuset, node) < 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET,
+			    "conn %d: NUMA node unknown\n", conn->id);
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+	rc = istgt_cpuset_apply(pthread_self(), &cpuset);
+	if (rc < 0) {
+		ISTGT_WARNLOG("conn %d: CPU affinity failed (errno=%d)\n",
+		    conn->id, errno);
+		return;
+	}
+	if (node >= 0) {
+		/* first touch by this thread */
+		xfree(conn->iobuf);
+		conn->iobuf = xmalloc(conn->iobufsize);
+		memset(conn->iobuf, 0, conn->iobufsize);
+		xfree(conn->recvbuf);
+		conn->recvbuf = xmalloc(conn->recvbufsize);
+		memset(conn->recvbuf, 0, conn->recvbufsize);
+		xfree(conn->sendbuf);
+		conn->sendbuf = xmalloc(conn->sendbufsize);
+		memset(conn->sendbuf, 0, conn->sendbufsize);
+	}
+	istgt_cpuset_format(buf, sizeof buf, &cpuset);
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "conn %d on CPU %s (node %d)\n",
+	    conn->id, buf, node);
+}
+
+static void *
+worker(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+	sigset_t signew, sigold;
+#ifdef ISTGT_USE_KQUEUE
+	int kq;
+	struct kevent kev;
+	struct timespec kev_timeout;
+#else
+	struct pollfd fds[2];
+	int nopin_timer;
+#endif /* ISTGT_USE_KQUEUE */
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "connect to %s:%s,%d\n",
+	    conn->portal.host, conn->portal.port, conn->portal.tag);
+#if 0
+	ISTGT_NOTICELOG("connect to %s:%s,%d\n",
+	    conn->portal.host, conn->portal.port, conn->portal.tag);
+#endif
+	istgt_iscsi_set_affinity(conn);
+
+#ifdef ISTGT_USE_KQUEUE
+	kq = kqueue();
+	if (kq == -1) {
+		ISTGT_ERRLOG("kqueue() failed\n");
+		return NULL;
+	}
+	conn->kq = kq;
+#if defined (ISTGT_USE_IOVEC) && defined (NOTE_LOWAT)
+	ISTGT_EV_SET(&kev, conn->sock, EVFILT_READ, EV_ADD, NOTE_LOWAT, ISCSI_BHS_LEN, NULL);
+#else
+	ISTGT_EV_SET(&kev, conn->sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
+#endif
+	rc = kevent(kq, &kev, 1, NULL, 0, NULL);
+	if (rc == -1) {
+		ISTGT_ERRLOG("kevent() failed\n");
+		close(kq);
+		return NULL;
+	}
+	ISTGT_EV_SET(&kev, conn->task_pipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+	rc = kevent(kq, &kev, 1, NULL, 0, NULL);
+	if (rc == -1) {
+		ISTGT_ERRLOG("kevent() failed\n");
+		close(kq);
+		return NULL;
+	}
+
+	if (!conn->istgt->daemon) {
+		ISTGT_EV_SET(&kev, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+		rc = kevent(kq, &kev, 1, NULL, 0, NULL);
+		if (rc == -1) {
+			ISTGT_ERRLOG("kevent() failed\n");
+			close(kq);
+			return NULL;
+		}
+		ISTGT_EV_SET(&kev, SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+		rc = kevent(kq, &kev, 1, NULL, 0, NULL);
+		if (rc == -1) {
+			ISTGT_ERRLOG("kevent() failed\n");
+			close(kq);
+			return NULL;
+		}
+	}
+#else
+	memset(&fds, 0, sizeof fds);
+	fds[0].fd = conn->sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = conn->task_pipe[0];
+	fds[1].events = POLLIN;
+#endif /* ISTGT_USE_KQUEUE */
+
+	conn->pdu.ahs = NULL;
+	conn->pdu.data = NULL;
+	conn->pdu.copy_pdu = 0;
+	conn->state = CONN_STATE_RUNNING;
+	conn->exec_lu_task = NULL;
+
+	pthread_cleanup_push(worker_cleanup, conn);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+	conn->use_sender = 0;
+	if (conn->istgt->swmode >= ISTGT_SWMODE_NORMAL) {
+		/* create sender thread */
+#ifdef ISTGT_STACKSIZE
+		rc = pthread_create(&conn->sender_thread, &conn->istgt->attr,
+		    &sender, (void *)conn);
+#else
+		rc = pthread_create(&conn->sender_thread, NULL, &sender,
+		    (void *)conn);
+#endif
+		if (rc != 0) {
+			ISTGT_ERRLOG("pthread_create() failed\n");
+			goto cleanup_exit;
+		}
+		conn->use_sender = 1;
+	}
+	conn->wsock = conn->sock;
+
+	sigemptyset(&signew);
+	sigemptyset(&sigold);
+	sigaddset(&signew, ISTGT_SIGWAKEUP);
+	pthread_sigmask(SIG_UNBLOCK, &signew, &sigold);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop start (%d)\n", conn->id);
+#ifndef ISTGT_USE_KQUEUE
+	nopin_timer = conn->nopininterval;
+#endif /* !ISTGT_USE_KQUEUE */
+	while (1) {
+		/* check exit request */
+		if (worker_check_exit(conn)) {
+			break;
+		}
+
+		pthread_testcancel();
+		if (conn->state != CONN_STATE_RUNNING) {
+			break;
+		}
+
+#ifdef ISTGT_USE_KQUEUE
+		ISTGT_TRACELOG(ISTGT_TRACE_NET,
+		    "kevent sock %d (timeout %dms)\n",
+		    conn->sock, conn->nopininterval);
+		if (conn->nopininterval != 0) {
+			kev_timeout.tv_sec = conn->nopininterval / 1000;
+			kev_timeout.tv_nsec = (conn->nopininterval % 1000) * 1000000;
+		} else {
+			kev_timeout.tv_sec = DEFAULT_NOPININTERVAL;
+			kev_timeout.tv_nsec = 0;
 		}
-		if (lu != NULL) {
-			if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING) {
-				conn->state = CONN_STATE_EXITING;
+		rc = kevent(kq, NULL, 0, &kev, 1, &kev_timeout);
+		if (rc == -1 && errno == EINTR) {
+			//ISTGT_ERRLOG("EINTR kevent\n");
+			continue;
+		}
+		if (rc == -1) {
+			ISTGT_ERRLOG("kevent() failed\n");
+			break;
+		}
+		if (rc == 0) {
+			if (istgt_iscsi_cmdsn_check(conn) < 0) {
+				break;
+			}
+			/* idle timeout, send diagnosis packet */
+			if (conn->nopininterval != 0) {
+				rc = istgt_iscsi_send_nopin(conn);
+				if (rc < 0) {
+					ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
+					break;
+				}
+			}
+			continue;
+		}
+		if (kev.filter == EVFILT_SIGNAL) {
+			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "kevent SIGNAL\n");
+			if (kev.ident == SIGINT || kev.ident == SIGTERM) {
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "kevent SIGNAL SIGINT/SIGTERM\n");
+				break;
+			}
+			continue;
+		}
+#else
+		//ISTGT_TRACELOG(ISTGT_TRACE_NET, "poll sock %d\n", conn->sock);
+		rc = poll(fds, 2, POLLWAIT);
+		if (rc == -1 && errno == EINTR) {
+			//ISTGT_ERRLOG("EINTR poll\n");
+			continue;
+		}
+		if (rc == -1) {
+			ISTGT_ERRLOG("poll() failed\n");
+			break;
+		}
+		if (rc == 0) {
+			/* no fds */
+			//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "poll TIMEOUT\n");
+			if (istgt_iscsi_cmdsn_check(conn) < 0) {
+				break;
+			}
+			if (nopin_timer > 0) {
+				nopin_timer -= POLLWAIT;
+				if (nopin_timer <= 0) {
+					nopin_timer = conn->nopininterval;
+					rc = istgt_iscsi_send_nopin(conn);
+					if (rc < 0) {
+						ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
+						break;
+					}
+				}
+			}
+			continue;
+		}
+		nopin_timer = conn->nopininterval;
+#endif /* ISTGT_USE_KQUEUE */
+
+		/* on socket */
+#ifdef ISTGT_USE_KQUEUE
+		if (kev.ident == (uintptr_t)conn->sock) {
+			if (kev.flags & (EV_EOF|EV_ERROR)) {
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "kevent EOF/ERROR\n");
+				break;
+			}
+#else
+		if (fds[0].revents & POLLHUP) {
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+#endif /* ISTGT_USE_KQUEUE */
+			rc = worker_sock_event(conn);
+			if (rc < 0) {
+				break;
+			}
+			if (rc > 0) {
+				continue;
+			}
+		}
+
+		/* execute on task queue */
+#ifdef ISTGT_USE_KQUEUE
+		if (kev.ident == (uintptr_t)conn->task_pipe[0]) {
+			if (kev.flags & (EV_EOF|EV_ERROR)) {
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "kevent EOF/ERROR\n");
+				break;
+			}
+#else
+		if (fds[1].revents & POLLHUP) {
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+#endif /* ISTGT_USE_KQUEUE */
+			rc = worker_pipe_event(conn);
+			if (rc < 0) {
 				break;
 			}
+		}
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop ended (%d)\n", conn->id);
+
+    cleanup_exit:
+	;
+	pthread_cleanup_pop(0);
+	worker_exit(conn);
+	return NULL;
+}
+
+#ifdef ISTGT_USE_EPOLL
+/*
+ * Network threads multiplex the connections by one epoll descriptor.
+ * Every descriptor is registered with EPOLLONESHOT and the events of a
+ * connection are serialized in two domains: receive (socket, task pipe
+ * and timer) and send (result queue, notified by eventfd).  An event for
+ * a busy domain is deferred to the thread which is running the domain.
+ * PDUs are assembled from the socket without blocking; handlers which
+ * wait on the socket or other connections (login, Data-OUT collection and
+ * MCS ordering of unqueued LUs) run on a thread of their own meanwhile.
+ */
+#define ISTGT_REACTOR_SOCK  0x01
+#define ISTGT_REACTOR_PIPE  0x02
+#define ISTGT_REACTOR_TIMER 0x04
+#define ISTGT_REACTOR_SEND  0x08
+#define ISTGT_REACTOR_TICK 1 /* sec. */
+
+typedef struct istgt_reactor_slot_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	CONN_Ptr conn;
+	uint32_t gen;
+	int efd;
+	int dead;
+	int rx_busy;
+	int rx_pending;
+	/* partial PDU in conn->pdu */
+	int rx_len;
+	int rx_total;
+	time_t rx_since;
+	/* handler running off the network threads */
+	int rx_kind;
+	ISTGT_LU_TASK_Ptr rx_task;
+	int tx_busy;
+	int tx_pending;
+	int tx_signaled;
+	int tx_dead;
+	time_t last_rx;
+} ISTGT_REACTOR_SLOT;
+
+typedef struct istgt_reactor_t {
+	int epfd;
+	volatile int running;
+	int nthreads;
+	pthread_t *threads;
+	uint32_t gen;
+	pthread_mutex_t tick_mutex;
+	time_t next_tick;
+	int nslots;
+	ISTGT_REACTOR_SLOT *slots;
+} ISTGT_REACTOR;
+
+static ISTGT_REACTOR g_reactor;
+
+static int
+istgt_reactor_ctl(int op, int fd, ISTGT_REACTOR_SLOT *slot, int id, int kind)
+{
+	struct epoll_event ev;
+	int rc;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	/* stale events of previous connection are discarded by generation */
+	ev.data.u64 = ((uint64_t) slot->gen << 32)
+	    | ((uint64_t) kind << 24) | (uint64_t) id;
+	rc = epoll_ctl(g_reactor.epfd, op, fd, &ev);
+	if (rc < 0) {
+		ISTGT_ERRLOG("epoll_ctl() failed: errno %d\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+istgt_reactor_ready(int fd)
+{
+	struct pollfd fds[1];
+	int rc;
+
+	/* the data may be consumed by a previous handler */
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	rc = poll(fds, 1, 0);
+	if (rc < 0) {
+		return (errno == EINTR) ? 0 : 1;
+	}
+	return rc;
+}
+
+static void
+istgt_reactor_kick(CONN_Ptr conn)
+{
+	ISTGT_REACTOR_SLOT *slot;
+	uint64_t val = 1;
+	int rc;
+
+	slot = &g_reactor.slots[conn->id];
+	MTX_LOCK(&slot->mutex);
+	if (slot->conn != conn || slot->tx_dead) {
+		MTX_UNLOCK(&slot->mutex);
+		return;
+	}
+	if (slot->tx_busy) {
+		/* picked up by current sender */
+		slot->tx_pending = 1;
+	} else if (!slot->tx_signaled) {
+		slot->tx_signaled = 1;
+		rc = write(slot->efd, &val, sizeof val);
+		if (rc < 0 || rc != sizeof val) {
+			ISTGT_ERRLOG("write() failed\n");
+			slot->tx_signaled = 0;
+		}
+	}
+	MTX_UNLOCK(&slot->mutex);
+}
+
+static void *
+istgt_reactor_exit_thread(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+
+	worker_exit(conn);
+	return NULL;
+}
+
+static void
+istgt_reactor_close(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn)
+{
+	pthread_t thread;
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop ended (%d)\n", conn->id);
+	MTX_LOCK(&slot->mutex);
+	slot->dead = 1;
+	MTX_UNLOCK(&slot->mutex);
+	conn->state = CONN_STATE_EXITING;
+	(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, conn->task_pipe[0],
+	    NULL);
+
+	/* waiting tasks may block long time, don't use network thread */
+#ifdef ISTGT_STACKSIZE
+	rc = pthread_create(&thread, &conn->istgt->attr,
+	    &istgt_reactor_exit_thread, (void *)conn);
+#else
+	rc = pthread_create(&thread, NULL, &istgt_reactor_exit_thread,
+	    (void *)conn);
+#endif /* ISTGT_STACKSIZE */
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		worker_exit(conn);
+		return;
+	}
+	rc = pthread_detach(thread);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_detach() failed\n");
+	}
+}
+
+/* read available part of a PDU, return 0 until conn->pdu is complete */
+static int
+istgt_reactor_read_pdu(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn)
+{
+	ISCSI_PDU_Ptr pdu;
+	struct iovec iovec[4]; /* AHS+HD+DATA+DD or BHS */
+	struct msghdr msg;
+	int iovcnt;
+	int total;
+	int rc;
+
+	pdu = &conn->pdu;
+	if (slot->rx_len == 0) {
+		pdu->ahs = NULL;
+		pdu->total_ahs_len = 0;
+		pdu->data = NULL;
+		pdu->data_segment_len = 0;
+		pdu->copy_pdu = 0;
+		slot->rx_total = ISCSI_BHS_LEN;
+		slot->rx_since = time(NULL);
+	}
+	while (slot->rx_len < slot->rx_total) {
+		if (slot->rx_len < ISCSI_BHS_LEN) {
+			iovec[0].iov_base = (uint8_t *) &pdu->bhs + slot->rx_len;
+			iovec[0].iov_len = ISCSI_BHS_LEN - slot->rx_len;
+			iovcnt = 1;
+		} else {
+			istgt_iscsi_pdu_iovec(conn, pdu, iovec);
+			istgt_iscsi_advance_iovec(iovec, 4,
+			    (size_t) (slot->rx_len - ISCSI_BHS_LEN));
+			iovcnt = 4;
+		}
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iovec;
+		msg.msg_iovlen = iovcnt;
+		/* the socket stays blocking for senders and Data-OUT threads */
+		rc = recvmsg(conn->sock, &msg, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK
+			    || errno == EINTR) {
+				return 0;
+			}
+			if (errno == ECONNRESET) {
+				ISTGT_WARNLOG("Connection reset by peer (%s)\n",
+				    conn->initiator_name);
+				conn->state = CONN_STATE_EXITING;
+			} else {
+				ISTGT_ERRLOG("recvmsg() failed (errno=%d,%s)\n",
+				    errno, conn->initiator_name);
+			}
+			goto error_return;
+		}
+		if (rc == 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_NET, "recvmsg() EOF (%s)\n",
+			    conn->initiator_name);
+			conn->state = CONN_STATE_EXITING;
+			goto error_return;
+		}
+		slot->rx_len += rc;
+		if (slot->rx_len == ISCSI_BHS_LEN
+		    && slot->rx_total == ISCSI_BHS_LEN) {
+			total = istgt_iscsi_setup_pdu(conn, pdu);
+			if (total < 0) {
+				goto error_return;
+			}
+			slot->rx_total = total;
+		}
+	}
+
+	total = slot->rx_total;
+	slot->rx_len = 0;
+	rc = istgt_iscsi_check_pdu(conn, pdu);
+	if (rc < 0) {
+		goto error_return;
+	}
+	return total;
+
+ error_return:
+	slot->rx_len = 0;
+	xfree(pdu->ahs);
+	pdu->ahs = NULL;
+	if (pdu->data != pdu->shortdata) {
+		xfree(pdu->data);
+	}
+	pdu->data = NULL;
+	return -1;
+}
+
+/* return 1 if the handler of conn->pdu may wait on the socket */
+static int
+istgt_reactor_pdu_blocks(CONN_Ptr conn)
+{
+	ISTGT_LU_Ptr lu;
+	uint8_t *cp;
+	uint32_t transfer_len;
+	int opcode;
+	int I_bit, W_bit;
+	int connections;
+
+	cp = (uint8_t *) &conn->pdu.bhs;
+	opcode = cp[0] & 0x3f;
+	if (opcode == ISCSI_OP_LOGIN) {
+		/* may wait for the connections of a reinstated session */
+		return 1;
+	}
+	if (opcode != ISCSI_OP_SCSI || conn->sess == NULL) {
+		return 0;
+	}
+	SESS_MTX_LOCK(conn);
+	lu = conn->sess->lu;
+	connections = conn->sess->connections;
+	SESS_MTX_UNLOCK(conn);
+	if (istgt_lu_queued(lu)) {
+		/* Data-OUT is collected by the task pipe */
+		return 0;
+	}
+	I_bit = (cp[0] & 0x40) != 0;
+	W_bit = (cp[1] & 0x20) != 0;
+	transfer_len = DGET32(&cp[20]);
+	if (W_bit && transfer_len > (uint32_t) conn->pdu.data_segment_len) {
+		return 1;
+	}
+	if (I_bit == 0 && connections > 1) {
+		/* may wait for a lower CmdSN on another connection */
+		return 1;
+	}
+	return 0;
+}
+
+static void *
+istgt_reactor_rx_thread(void *arg)
+{
+	CONN_Ptr conn = (CONN_Ptr) arg;
+	ISTGT_REACTOR_SLOT *slot;
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rx_pending;
+	int kind;
+	int fd;
+	int rc;
+
+	slot = &g_reactor.slots[conn->id];
+	kind = slot->rx_kind;
+	lu_task = slot->rx_task;
+	slot->rx_task = NULL;
+	if (kind == ISTGT_REACTOR_SOCK) {
+		fd = conn->sock;
+		rc = worker_execute_pdu(conn);
+	} else {
+		fd = conn->task_pipe[0];
+		rc = worker_task_event(conn, lu_task);
+	}
+	if (rc == 0) {
+		rc = istgt_reactor_ctl(EPOLL_CTL_MOD, fd, slot, conn->id, kind);
+	}
+	if (rc < 0) {
+		istgt_reactor_close(slot, conn);
+		return NULL;
+	}
+
+	/* give the receive domain back to the network threads */
+	MTX_LOCK(&slot->mutex);
+	rx_pending = slot->rx_pending;
+	slot->rx_pending = 0;
+	slot->rx_busy = 0;
+	MTX_UNLOCK(&slot->mutex);
+	/* deferred events are delivered again after re-arm, timer by tick */
+	if (rx_pending & ISTGT_REACTOR_SOCK) {
+		(void) istgt_reactor_ctl(EPOLL_CTL_MOD, conn->sock, slot,
+		    conn->id, ISTGT_REACTOR_SOCK);
+	}
+	if (rx_pending & ISTGT_REACTOR_PIPE) {
+		(void) istgt_reactor_ctl(EPOLL_CTL_MOD, conn->task_pipe[0], slot,
+		    conn->id, ISTGT_REACTOR_PIPE);
+	}
+	return NULL;
+}
+
+/* run the handler on its own thread, return 1 if the domain is passed */
+static int
+istgt_reactor_offload(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn, int kind, ISTGT_LU_TASK_Ptr lu_task)
+{
+	pthread_t thread;
+	int rc;
+
+	slot->rx_kind = kind;
+	slot->rx_task = lu_task;
+#ifdef ISTGT_STACKSIZE
+	rc = pthread_create(&thread, &conn->istgt->attr,
+	    &istgt_reactor_rx_thread, (void *)conn);
+#else
+	rc = pthread_create(&thread, NULL, &istgt_reactor_rx_thread,
+	    (void *)conn);
+#endif /* ISTGT_STACKSIZE */
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		slot->rx_task = NULL;
+		/* execute here */
+		if (kind == ISTGT_REACTOR_SOCK) {
+			rc = worker_execute_pdu(conn);
 		} else {
-			if (istgt_get_state(conn->istgt) != ISTGT_STATE_RUNNING) {
-				conn->state = CONN_STATE_EXITING;
-				break;
-			}
+			rc = worker_task_event(conn, lu_task);
 		}
+		return (rc < 0) ? -1 : 0;
+	}
+	rc = pthread_detach(thread);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_detach() failed\n");
+	}
+	return 1;
+}
 
-		pthread_testcancel();
-		if (conn->state != CONN_STATE_RUNNING) {
-			break;
-		}
+static int
+istgt_reactor_rx_event(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn, int kind)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	time_t now;
+	int fd;
+	int rc;
 
-#ifdef ISTGT_USE_KQUEUE
-		ISTGT_TRACELOG(ISTGT_TRACE_NET,
-		    "kevent sock %d (timeout %dms)\n",
-		    conn->sock, conn->nopininterval);
-		if (conn->nopininterval != 0) {
-			kev_timeout.tv_sec = conn->nopininterval / 1000;
-			kev_timeout.tv_nsec = (conn->nopininterval % 1000) * 1000000;
-		} else {
-			kev_timeout.tv_sec = DEFAULT_NOPININTERVAL;
-			kev_timeout.tv_nsec = 0;
+	if (worker_check_exit(conn)) {
+		return -1;
+	}
+	if (conn->state != CONN_STATE_RUNNING) {
+		return -1;
+	}
+
+	switch (kind) {
+	case ISTGT_REACTOR_SOCK:
+		slot->last_rx = time(NULL);
+		rc = istgt_reactor_read_pdu(slot, conn);
+		if (rc < 0) {
+			if (conn->state == CONN_STATE_RUNNING) {
+				ISTGT_ERRLOG("reactor_read_pdu() failed\n");
+			}
+			return -1;
 		}
-		rc = kevent(kq, NULL, 0, &kev, 1, &kev_timeout);
-		if (rc == -1 && errno == EINTR) {
-			//ISTGT_ERRLOG("EINTR kevent\n");
-			continue;
+		if (rc > 0) {
+			if (istgt_reactor_pdu_blocks(conn)) {
+				rc = istgt_reactor_offload(slot, conn, kind, NULL);
+				if (rc != 0) {
+					return rc;
+				}
+			} else {
+				rc = worker_execute_pdu(conn);
+				if (rc < 0) {
+					return -1;
+				}
+			}
 		}
-		if (rc == -1) {
-			ISTGT_ERRLOG("kevent() failed\n");
-			break;
+		rc = istgt_reactor_ctl(EPOLL_CTL_MOD, conn->sock, slot,
+		    conn->id, kind);
+		if (rc < 0) {
+			return -1;
 		}
-		if (rc == 0) {
-			/* idle timeout, send diagnosis packet */
-			if (conn->nopininterval != 0) {
-				rc = istgt_iscsi_send_nopin(conn);
+		break;
+	case ISTGT_REACTOR_PIPE:
+		fd = conn->task_pipe[0];
+		if (istgt_reactor_ready(fd)) {
+			slot->last_rx = time(NULL);
+			rc = worker_pipe_read(conn, &lu_task);
+			if (rc < 0) {
+				return -1;
+			}
+			if (lu_task != NULL && lu_task->lu_cmd.W_bit
+			    && lu_task->req_transfer_out != 0) {
+				/* Data-OUT is read by blocking socket I/O */
+				rc = istgt_reactor_offload(slot, conn, kind,
+				    lu_task);
+				if (rc != 0) {
+					return rc;
+				}
+			} else {
+				rc = worker_task_event(conn, lu_task);
 				if (rc < 0) {
-					ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
-					break;
+					return -1;
 				}
 			}
-			continue;
 		}
-		if (kev.filter == EVFILT_SIGNAL) {
-			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "kevent SIGNAL\n");
-			if (kev.ident == SIGINT || kev.ident == SIGTERM) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				    "kevent SIGNAL SIGINT/SIGTERM\n");
-				break;
-			}
-			continue;
+		rc = istgt_reactor_ctl(EPOLL_CTL_MOD, fd, slot, conn->id, kind);
+		if (rc < 0) {
+			return -1;
 		}
-#else
-		//ISTGT_TRACELOG(ISTGT_TRACE_NET, "poll sock %d\n", conn->sock);
-		rc = poll(fds, 2, POLLWAIT);
-		if (rc == -1 && errno == EINTR) {
-			//ISTGT_ERRLOG("EINTR poll\n");
-			continue;
+		break;
+	case ISTGT_REACTOR_TIMER:
+		if (istgt_iscsi_cmdsn_check(conn) < 0) {
+			return -1;
 		}
-		if (rc == -1) {
-			ISTGT_ERRLOG("poll() failed\n");
+		now = time(NULL);
+		if (slot->rx_len != 0
+		    && istgt_difftime(now, slot->rx_since) > conn->timeout) {
+			ISTGT_WARNLOG("PDU read timed out (%s)\n",
+			    conn->initiator_name);
+			conn->state = CONN_STATE_EXITING;
+			return -1;
+		}
+		if (conn->nopininterval == 0) {
 			break;
 		}
-		if (rc == 0) {
-			/* no fds */
-			//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "poll TIMEOUT\n");
-			if (nopin_timer > 0) {
-				nopin_timer -= POLLWAIT;
-				if (nopin_timer <= 0) {
-					nopin_timer = conn->nopininterval;
-					rc = istgt_iscsi_send_nopin(conn);
-					if (rc < 0) {
-						ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
-						break;
-					}
-				}
+		if ((now - slot->last_rx) * 1000 < conn->nopininterval) {
+			break;
+		}
+		/* idle timeout, send diagnosis packet */
+		slot->last_rx = now;
+		rc = istgt_iscsi_send_nopin(conn);
+		if (rc < 0) {
+			ISTGT_ERRLOG("iscsi_send_nopin() failed\n");
+			return -1;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void
+istgt_reactor_rx(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn, int kind)
+{
+	int rc;
+
+	while (1) {
+		rc = istgt_reactor_rx_event(slot, conn, kind);
+		if (rc < 0) {
+			/* keep receive domain busy until the slot is free */
+			istgt_reactor_close(slot, conn);
+			return;
+		}
+		if (rc > 0) {
+			/* the handler thread gives back the domain */
+			return;
+		}
+		MTX_LOCK(&slot->mutex);
+		if (slot->rx_pending == 0) {
+			slot->rx_busy = 0;
+			MTX_UNLOCK(&slot->mutex);
+			return;
+		}
+		kind = slot->rx_pending & -slot->rx_pending;
+		slot->rx_pending &= ~kind;
+		MTX_UNLOCK(&slot->mutex);
+	}
+}
+
+static void
+istgt_reactor_tx(ISTGT_REACTOR_SLOT *slot, CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	uint64_t val;
+	int rc;
+
+	/* clear notification, new one is deferred while tx_busy */
+	rc = read(slot->efd, &val, sizeof val);
+	if (rc < 0 && errno != EAGAIN) {
+		ISTGT_ERRLOG("read() failed\n");
+	}
+	(void) istgt_reactor_ctl(EPOLL_CTL_MOD, slot->efd, slot, conn->id,
+	    ISTGT_REACTOR_SEND);
+
+	while (1) {
+		if (conn->state == CONN_STATE_RUNNING) {
+			lu_task = istgt_ring_dequeue(&conn->result_queue);
+			if (lu_task != NULL) {
+				sender_send_tasks(conn, lu_task);
 			}
+		}
+		MTX_LOCK(&slot->mutex);
+		if (slot->tx_pending && !slot->tx_dead) {
+			slot->tx_pending = 0;
+			MTX_UNLOCK(&slot->mutex);
 			continue;
 		}
-		nopin_timer = conn->nopininterval;
-#endif /* ISTGT_USE_KQUEUE */
+		slot->tx_pending = 0;
+		slot->tx_busy = 0;
+		pthread_cond_broadcast(&slot->cond);
+		MTX_UNLOCK(&slot->mutex);
+		break;
+	}
+}
 
-		/* on socket */
-#ifdef ISTGT_USE_KQUEUE
-		if (kev.ident == (uintptr_t)conn->sock) {
-			if (kev.flags & (EV_EOF|EV_ERROR)) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				    "kevent EOF/ERROR\n");
-				break;
-			}
-#else
-		if (fds[0].revents & POLLHUP) {
+/* send PDU directly in the send domain, called from receive domain */
+static int
+istgt_reactor_write_pdu(CONN_Ptr conn, ISCSI_PDU_Ptr pdu)
+{
+	ISTGT_REACTOR_SLOT *slot;
+	int tx_pending;
+	int rc;
+
+	slot = &g_reactor.slots[conn->id];
+	MTX_LOCK(&slot->mutex);
+	while (slot->tx_busy && !slot->tx_dead) {
+		pthread_cond_wait(&slot->cond, &slot->mutex);
+	}
+	if (slot->conn != conn || slot->tx_dead) {
+		MTX_UNLOCK(&slot->mutex);
+		return -1;
+	}
+	slot->tx_busy = 1;
+	MTX_UNLOCK(&slot->mutex);
+
+	rc = istgt_iscsi_write_pdu_internal(conn, pdu);
+
+	MTX_LOCK(&slot->mutex);
+	tx_pending = slot->tx_pending;
+	slot->tx_pending = 0;
+	slot->tx_busy = 0;
+	pthread_cond_broadcast(&slot->cond);
+	MTX_UNLOCK(&slot->mutex);
+	if (tx_pending) {
+		/* results queued meanwhile */
+		istgt_reactor_kick(conn);
+	}
+	return rc;
+}
+
+static void
+istgt_reactor_dispatch(uint64_t data)
+{
+	ISTGT_REACTOR_SLOT *slot;
+	CONN_Ptr conn;
+	uint32_t gen;
+	int kind;
+	int id;
+
+	id = (int) (data & 0x00ffffffU);
+	kind = (int) ((data >> 24) & 0xffU);
+	gen = (uint32_t) (data >> 32);
+	if (id >= g_reactor.nslots) {
+		return;
+	}
+	slot = &g_reactor.slots[id];
+	MTX_LOCK(&slot->mutex);
+	conn = slot->conn;
+	if (conn == NULL || slot->gen != gen || slot->dead) {
+		MTX_UNLOCK(&slot->mutex);
+		return;
+	}
+	if (kind == ISTGT_REACTOR_SEND) {
+		slot->tx_signaled = 0;
+		if (slot->tx_dead) {
+			MTX_UNLOCK(&slot->mutex);
+			return;
+		}
+		if (slot->tx_busy) {
+			slot->tx_pending = 1;
+			MTX_UNLOCK(&slot->mutex);
+			return;
+		}
+		slot->tx_busy = 1;
+		MTX_UNLOCK(&slot->mutex);
+		istgt_reactor_tx(slot, conn);
+		return;
+	}
+	if (slot->rx_busy) {
+		slot->rx_pending |= kind;
+		MTX_UNLOCK(&slot->mutex);
+		return;
+	}
+	slot->rx_busy = 1;
+	MTX_UNLOCK(&slot->mutex);
+	istgt_reactor_rx(slot, conn, kind);
+}
+
+static void
+istgt_reactor_tick(void)
+{
+	ISTGT_REACTOR_SLOT *slot;
+	CONN_Ptr conn;
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	if (now < g_reactor.next_tick) {
+		return;
+	}
+	MTX_LOCK(&g_reactor.tick_mutex);
+	if (now < g_reactor.next_tick) {
+		MTX_UNLOCK(&g_reactor.tick_mutex);
+		return;
+	}
+	g_reactor.next_tick = now + ISTGT_REACTOR_TICK;
+	MTX_UNLOCK(&g_reactor.tick_mutex);
+
+	/* check exit request and NOP-In timer */
+	for (i = 0; i < g_reactor.nslots; i++) {
+		slot = &g_reactor.slots[i];
+		MTX_LOCK(&slot->mutex);
+		conn = slot->conn;
+		if (conn == NULL || slot->dead) {
+			MTX_UNLOCK(&slot->mutex);
+			continue;
+		}
+		if (slot->rx_busy) {
+			slot->rx_pending |= ISTGT_REACTOR_TIMER;
+			MTX_UNLOCK(&slot->mutex);
+			continue;
+		}
+		slot->rx_busy = 1;
+		MTX_UNLOCK(&slot->mutex);
+		istgt_reactor_rx(slot, conn, ISTGT_REACTOR_TIMER);
+	}
+}
+
+static void *
+istgt_reactor_worker(void *arg __attribute__((__unused__)))
+{
+	struct epoll_event ev;
+	sigset_t signew, sigold;
+	int rc;
+
+	sigemptyset(&signew);
+	sigemptyset(&sigold);
+	sigaddset(&signew, ISTGT_SIGWAKEUP);
+	pthread_sigmask(SIG_UNBLOCK, &signew, &sigold);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "network thread start\n");
+	while (g_reactor.running) {
+		/* one event at a time, handlers don't wait on the socket */
+		rc = epoll_wait(g_reactor.epfd, &ev, 1,
+		    ISTGT_REACTOR_TICK * 1000);
+		if (rc == -1 && errno != EINTR) {
+			ISTGT_ERRLOG("epoll_wait() failed\n");
 			break;
 		}
-		if (fds[0].revents & POLLIN) {
-#endif /* ISTGT_USE_KQUEUE */
-			conn->pdu.copy_pdu = 0;
-			rc = istgt_iscsi_read_pdu(conn, &conn->pdu);
-			if (rc < 0) {
-				if (conn->state != CONN_STATE_EXITING) {
-					ISTGT_ERRLOG("conn->state = %d\n", conn->state);
-				}
-				if (conn->state != CONN_STATE_RUNNING) {
-					if (errno == EINPROGRESS) {
-						sleep(1);
-						continue;
-					}
-					if (errno == ECONNRESET
-					    || errno == ETIMEDOUT) {
-						ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-						    "iscsi_read_pdu() RESET/TIMEOUT\n");
-					} else {
-						ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-						    "iscsi_read_pdu() EOF\n");
-					}
-					break;
-				}
-				ISTGT_ERRLOG("iscsi_read_pdu() failed\n");
-				break;
-			}
-		execute_pdu:
-			opcode = BGET8W(&conn->pdu.bhs.opcode, 5, 6);
+		if (rc == 1) {
+			istgt_reactor_dispatch(ev.data.u64);
+		}
+		istgt_reactor_tick();
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "network thread end\n");
+	return NULL;
+}
 
-#if 0
-			pthread_testcancel();
-#endif
-			if (conn->state != CONN_STATE_RUNNING) {
-				break;
-			}
+static int
+istgt_reactor_attach(CONN_Ptr conn)
+{
+	ISTGT_REACTOR_SLOT *slot;
+	int rx_pending;
+	int tx_pending;
+	int efd;
+	int rc;
 
-			if (g_trace_flag) {
-				if (conn->sess != NULL) {
-					SESS_MTX_LOCK(conn);
-					ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-					    "isid=%"PRIx64", tsih=%u, cid=%u, op=%x\n",
-					    conn->sess->isid, conn->sess->tsih,
-					    conn->cid, opcode);
-					SESS_MTX_UNLOCK(conn);
-				} else {
-					ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-					    "isid=xxx, tsih=xxx, cid=%u, op=%x\n",
-					    conn->cid, opcode);
-				}
-			}
-			rc = istgt_iscsi_execute(conn, &conn->pdu);
-			if (rc < 0) {
-				ISTGT_ERRLOG("iscsi_execute() failed on %s(%s)\n",
-				    conn->target_port, conn->initiator_port);
-				break;
-			}
-			if (g_trace_flag) {
-				if (conn->sess != NULL) {
-					SESS_MTX_LOCK(conn);
-					ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-					    "isid=%"PRIx64", tsih=%u, cid=%u, op=%x complete\n",
-					    conn->sess->isid, conn->sess->tsih,
-					    conn->cid, opcode);
-					SESS_MTX_UNLOCK(conn);
-				} else {
-					ISTGT_TRACELOG(ISTGT_TRACE_ISCSI,
-					    "isid=xxx, tsih=xxx, cid=%u, op=%x complete\n",
-					    conn->cid, opcode);
-				}
-			}
+	if (conn->id < 0 || conn->id >= g_reactor.nslots) {
+		ISTGT_ERRLOG("invalid conn id %d\n", conn->id);
+		return -1;
+	}
+	slot = &g_reactor.slots[conn->id];
+	/* a PDU tail shorter than BHS must wake up the partial read */
+	rc = istgt_set_recvlowat(conn->sock, 1);
+	if (rc != 0) {
+		ISTGT_ERRLOG("istgt_set_recvlowat() failed\n");
+		return -1;
+	}
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0) {
+		ISTGT_ERRLOG("eventfd() failed\n");
+		(void) istgt_set_recvlowat(conn->sock, ISCSI_BHS_LEN);
+		return -1;
+	}
 
-#if 0
-			if (opcode == ISCSI_OP_LOGIN) {
-				//ISTGT_NOTICELOG("OP LOGIN: %s\n", conn->initiator_port);
-				istgt_yield();
-				if (conn->full_feature) {
-					//ISTGT_NOTICELOG("full_feature %s\n", conn->initiator_port);
-				}
-			}
-#endif
-			if (opcode == ISCSI_OP_LOGOUT) {
-				ISTGT_TRACELOG(ISTGT_TRACE_ISCSI, "logout received\n");
-				break;
-			}
+	ISTGT_TRACELOG(ISTGT_TRACE_NET, "connect to %s:%s,%d\n",
+	    conn->portal.host, conn->portal.port, conn->portal.tag);
+	conn->pdu.ahs = NULL;
+	conn->pdu.data = NULL;
+	conn->pdu.copy_pdu = 0;
+	conn->state = CONN_STATE_RUNNING;
+	conn->exec_lu_task = NULL;
+	conn->use_reactor = 1;
+	/*
+	 * responses are always sent in the send domain, so that the timer
+	 * (NOP-In) and other receive handlers never block on the socket
+	 */
+	conn->use_sender = 1;
+	conn->wsock = conn->sock;
 
-			if (conn->pdu.copy_pdu == 0) {
-				xfree(conn->pdu.ahs);
-				conn->pdu.ahs = NULL;
-				if (conn->pdu.data != conn->pdu.shortdata) {
-					xfree(conn->pdu.data);
-				}
-				conn->pdu.data = NULL;
-			}
+	/* both domains are owned until all descriptors are registered */
+	MTX_LOCK(&slot->mutex);
+	slot->conn = conn;
+	slot->gen = __sync_add_and_fetch(&g_reactor.gen, 1);
+	slot->efd = efd;
+	slot->dead = 0;
+	slot->rx_busy = 1;
+	slot->rx_pending = 0;
+	slot->rx_len = 0;
+	slot->rx_total = 0;
+	slot->rx_task = NULL;
+	slot->tx_busy = 1;
+	slot->tx_pending = 0;
+	slot->tx_signaled = 0;
+	slot->tx_dead = 0;
+	slot->last_rx = time(NULL);
+	MTX_UNLOCK(&slot->mutex);
+
+	rc = istgt_reactor_ctl(EPOLL_CTL_ADD, conn->sock, slot, conn->id,
+	    ISTGT_REACTOR_SOCK);
+	if (rc == 0) {
+		rc = istgt_reactor_ctl(EPOLL_CTL_ADD, conn->task_pipe[0], slot,
+		    conn->id, ISTGT_REACTOR_PIPE);
+	}
+	if (rc == 0) {
+		rc = istgt_reactor_ctl(EPOLL_CTL_ADD, efd, slot, conn->id,
+		    ISTGT_REACTOR_SEND);
+	}
+	if (rc < 0) {
+		(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+		(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL,
+		    conn->task_pipe[0], NULL);
+		(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, efd, NULL);
+		MTX_LOCK(&slot->mutex);
+		slot->conn = NULL;
+		slot->efd = -1;
+		MTX_UNLOCK(&slot->mutex);
+		close(efd);
+		(void) istgt_set_recvlowat(conn->sock, ISCSI_BHS_LEN);
+		conn->use_reactor = 0;
+		return -1;
+	}
 
-			/* execute pending PDUs */
-			pdu = istgt_queue_dequeue(&conn->pending_pdus);
-			if (pdu != NULL) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				    "execute pending PDU\n");
-				rc = istgt_iscsi_copy_pdu(&conn->pdu, pdu);
-				conn->pdu.copy_pdu = 0;
-				xfree(pdu);
-				goto execute_pdu;
-			}
+	MTX_LOCK(&slot->mutex);
+	rx_pending = slot->rx_pending;
+	tx_pending = slot->tx_pending;
+	slot->rx_busy = 0;
+	slot->rx_pending = 0;
+	slot->tx_busy = 0;
+	slot->tx_pending = 0;
+	MTX_UNLOCK(&slot->mutex);
+	/* deferred events are delivered again after re-arm */
+	if (rx_pending & ISTGT_REACTOR_SOCK) {
+		(void) istgt_reactor_ctl(EPOLL_CTL_MOD, conn->sock, slot,
+		    conn->id, ISTGT_REACTOR_SOCK);
+	}
+	if (rx_pending & ISTGT_REACTOR_PIPE) {
+		(void) istgt_reactor_ctl(EPOLL_CTL_MOD, conn->task_pipe[0], slot,
+		    conn->id, ISTGT_REACTOR_PIPE);
+	}
+	if (tx_pending) {
+		istgt_reactor_kick(conn);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "attach conn %d to network threads\n",
+	    conn->id);
+	return 0;
+}
 
-#if 0
-			/* retry read/PDUs */
-			continue;
-#endif
-		}
+static void
+istgt_reactor_detach(CONN_Ptr conn)
+{
+	ISTGT_REACTOR_SLOT *slot;
 
-		/* execute on task queue */
-#ifdef ISTGT_USE_KQUEUE
-		if (kev.ident == (uintptr_t)conn->task_pipe[0]) {
-			if (kev.flags & (EV_EOF|EV_ERROR)) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				    "kevent EOF/ERROR\n");
-				break;
-			}
-#else
-		if (fds[1].revents & POLLHUP) {
-			break;
-		}
-		if (fds[1].revents & POLLIN) {
-#endif /* ISTGT_USE_KQUEUE */
-			char tmp[1];
+	slot = &g_reactor.slots[conn->id];
+	MTX_LOCK(&slot->mutex);
+	slot->tx_dead = 1;
+	while (slot->tx_busy) {
+		pthread_cond_wait(&slot->cond, &slot->mutex);
+	}
+	MTX_UNLOCK(&slot->mutex);
+	(void) epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, slot->efd, NULL);
 
-			//ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Queue Task START\n");
+	if (conn->exec_logout) {
+		sender_flush_logout(conn);
+	}
 
-			rc = read(conn->task_pipe[0], tmp, 1);
-			if (rc < 0 || rc == 0 || rc != 1) {
-				ISTGT_ERRLOG("read() failed\n");
-				break;
-			}
-			if (tmp[0] == 'E') {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "exit request (%d)\n",
-				    conn->id);
-				break;
-			}
+	MTX_LOCK(&slot->mutex);
+	slot->conn = NULL;
+	close(slot->efd);
+	slot->efd = -1;
+	MTX_UNLOCK(&slot->mutex);
+}
 
-			/* DATA-IN/OUT */
-			MTX_LOCK(&conn->task_queue_mutex);
-			rc = istgt_queue_count(&conn->task_queue);
-			lu_task = istgt_queue_dequeue(&conn->task_queue);
-			MTX_UNLOCK(&conn->task_queue_mutex);
-			if (lu_task != NULL) {
-				if (conn->exec_lu_task != NULL) {
-					ISTGT_ERRLOG("task is overlapped (CmdSN=%u, %u)\n",
-					    conn->exec_lu_task->lu_cmd.CmdSN,
-					    lu_task->lu_cmd.CmdSN);
-					break;
-				}
-				conn->exec_lu_task = lu_task;
-				if (lu_task->lu_cmd.W_bit) {
-					/* write */
-					if (lu_task->req_transfer_out == 0) {
-						if (lu_task->req_execute) {
-							if (conn->running_tasks > 0) {
-								conn->running_tasks--;
-							} else {
-								ISTGT_ERRLOG("running no task\n");
-							}
-						}
-						rc = istgt_iscsi_task_response(conn, lu_task);
-						if (rc < 0) {
-							lu_task->error = 1;
-							ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
-							    conn->target_port,
-							    conn->initiator_port);
-							break;
-						}
-						rc = istgt_lu_destroy_task(lu_task);
-						if (rc < 0) {
-							ISTGT_ERRLOG("lu_destroy_task() failed\n");
-							break;
-						}
-						lu_task = NULL;
-						conn->exec_lu_task = NULL;
-					} else {
-						//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-						//    "Task Write Trans START\n");
-						rc = istgt_iscsi_task_transfer_out(conn, lu_task);
-						if (rc < 0) {
-							lu_task->error = 1;
-							ISTGT_ERRLOG("iscsi_task_transfer_out() failed on %s(%s)\n",
-							    conn->target_port,
-							    conn->initiator_port);
-							break;
-						}
-						//ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-						//    "Task Write Trans END\n");
+static void
+istgt_reactor_shutdown(int active)
+{
+	int i;
+
+	if (g_reactor.threads == NULL) {
+		return;
+	}
+	g_reactor.running = 0;
+	for (i = 0; i < g_reactor.nthreads; i++) {
+		(void) pthread_join(g_reactor.threads[i], NULL);
+	}
+	xfree(g_reactor.threads);
+	g_reactor.threads = NULL;
+	close(g_reactor.epfd);
+	g_reactor.epfd = -1;
+	if (active != 0) {
+		/* slots are still referred by exiting conns */
+		return;
+	}
+	for (i = 0; i < g_reactor.nslots; i++) {
+		(void) pthread_mutex_destroy(&g_reactor.slots[i].mutex);
+		(void) pthread_cond_destroy(&g_reactor.slots[i].cond);
+	}
+	(void) pthread_mutex_destroy(&g_reactor.tick_mutex);
+	xfree(g_reactor.slots);
+	g_reactor.slots = NULL;
+	g_reactor.nslots = 0;
+}
+#endif /* ISTGT_USE_EPOLL */
 
-						MTX_LOCK(&lu_task->trans_mutex);
-						lu_task->req_transfer_out = 0;
+int
+istgt_iscsi_create_network_threads(ISTGT_Ptr istgt)
+{
+#ifdef ISTGT_USE_EPOLL
+	int rc;
+	int i;
 
-						/* need response after execution */
-						lu_task->req_execute = 1;
-						if (conn->use_sender == 0) {
-							conn->running_tasks++;
-						}
+	if (istgt->network_threads == 0)
+		return 0;
 
-						rc = pthread_cond_broadcast(&lu_task->trans_cond);
-						MTX_UNLOCK(&lu_task->trans_mutex);
-						if (rc != 0) {
-							ISTGT_ERRLOG("cond_broadcast() failed\n");
-							break;
-						}
-						lu_task = NULL;
-						conn->exec_lu_task = NULL;
-					}
-				} else {
-					/* read or no data */
-					rc = istgt_iscsi_task_response(conn, lu_task);
-					if (rc < 0) {
-						lu_task->error = 1;
-						ISTGT_ERRLOG("iscsi_task_response() failed on %s(%s)\n",
-						    conn->target_port,
-						    conn->initiator_port);
-						break;
-					}
-					rc = istgt_lu_destroy_task(lu_task);
-					if (rc < 0) {
-						ISTGT_ERRLOG("lu_destroy_task() failed\n");
-						break;
-					}
-					lu_task = NULL;
-					conn->exec_lu_task = NULL;
-				}
-			}
-			/* XXX PDUs in DATA-OUT? */
-			pdu = istgt_queue_dequeue(&conn->pending_pdus);
-			if (pdu != NULL) {
-				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-				    "pending in task\n");
-				rc = istgt_iscsi_copy_pdu(&conn->pdu, pdu);
-				conn->pdu.copy_pdu = 0;
-				xfree(pdu);
-#ifdef ISTGT_USE_KQUEUE
-				kev.ident = -1;
-#else
-				fds[1].revents &= ~POLLIN;
-#endif /* ISTGT_USE_KQUEUE */
-				goto execute_pdu;
-			}
+	g_reactor.epfd = epoll_create(g_nconns);
+	if (g_reactor.epfd < 0) {
+		ISTGT_ERRLOG("epoll_create() failed\n");
+		return -1;
+	}
+	rc = pthread_mutex_init(&g_reactor.tick_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		return -1;
+	}
+	g_reactor.next_tick = 0;
+	g_reactor.gen = 0;
+	g_reactor.nslots = g_nconns;
+	g_reactor.slots = xmalloc(sizeof *g_reactor.slots * g_reactor.nslots);
+	memset(g_reactor.slots, 0, sizeof *g_reactor.slots * g_reactor.nslots);
+	for (i = 0; i < g_reactor.nslots; i++) {
+		rc = pthread_mutex_init(&g_reactor.slots[i].mutex, NULL);
+		if (rc != 0) {
+			ISTGT_ERRLOG("mutex_init() failed\n");
+			return -1;
+		}
+		rc = pthread_cond_init(&g_reactor.slots[i].cond, NULL);
+		if (rc != 0) {
+			ISTGT_ERRLOG("cond_init() failed\n");
+			return -1;
 		}
+		g_reactor.slots[i].conn = NULL;
+		g_reactor.slots[i].efd = -1;
 	}
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "loop ended (%d)\n", conn->id);
 
-    cleanup_exit:
-	;
-	pthread_cleanup_pop(0);
-	conn->state = CONN_STATE_EXITING;
-	if (conn->sess != NULL) {
-		SESS_MTX_LOCK(conn);
-		lu = conn->sess->lu;
-		if (lu != NULL && lu->queue_depth != 0) {
-			rc = istgt_lu_clear_task_IT(conn, lu);
+	g_reactor.nthreads = istgt->network_threads;
+	g_reactor.threads = xmalloc(sizeof *g_reactor.threads
+	    * g_reactor.nthreads);
+	g_reactor.running = 1;
+	for (i = 0; i < g_reactor.nthreads; i++) {
+#ifdef ISTGT_STACKSIZE
+		rc = pthread_create(&g_reactor.threads[i], &istgt->attr,
+		    &istgt_reactor_worker, NULL);
+#else
+		rc = pthread_create(&g_reactor.threads[i], NULL,
+		    &istgt_reactor_worker, NULL);
+#endif /* ISTGT_STACKSIZE */
+		if (rc != 0) {
+			ISTGT_ERRLOG("pthread_create() failed\n");
+			g_reactor.nthreads = i;
+			istgt_reactor_shutdown(0);
+			return -1;
+		}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+		{
+			char buf[MAX_TMPBUF];
+			snprintf(buf, sizeof buf, "netthread #%d", i);
+			pthread_set_name_np(g_reactor.threads[i], buf);
+		}
+#endif
+		/* shared by connections, Auto is not applicable */
+		if (istgt->affinity == ISTGT_AFFINITY_LIST) {
+			rc = istgt_cpuset_apply(g_reactor.threads[i],
+			    &istgt->cpuset);
 			if (rc < 0) {
-				ISTGT_ERRLOG("lu_clear_task_IT() failed\n");
+				ISTGT_WARNLOG("CPU affinity failed (errno=%d)\n",
+				    errno);
 			}
-			istgt_clear_all_transfer_task(conn);
 		}
-		SESS_MTX_UNLOCK(conn);
 	}
-	if (conn->pdu.copy_pdu == 0) {
-		xfree(conn->pdu.ahs);
-		conn->pdu.ahs = NULL;
-		if (conn->pdu.data != conn->pdu.shortdata) {
-			xfree(conn->pdu.data);
-		}
-		conn->pdu.data = NULL;
+	ISTGT_NOTICELOG("%d network threads (epoll)\n", g_reactor.nthreads);
+#else
+	if (istgt->network_threads != 0) {
+		ISTGT_ERRLOG("network threads are not supported\n");
+		return -1;
 	}
-	wait_all_task(conn);
+#endif /* ISTGT_USE_EPOLL */
+	return 0;
+}
 
-	if (conn->use_sender) {
-		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "stop sender thread (%d)\n", conn->id);
-		/* stop sender thread */
-		MTX_LOCK(&conn->result_queue_mutex);
-		rc = pthread_cond_broadcast(&conn->result_queue_cond);
-		MTX_UNLOCK(&conn->result_queue_mutex);
-		if (rc != 0) {
-			ISTGT_ERRLOG("cond_broadcast() failed\n");
-			/* ignore errors */
-		}
-		rc = pthread_join(conn->sender_thread, NULL);
-		if (rc != 0) {
-			ISTGT_ERRLOG("pthread_join() failed\n");
-			/* ignore errors */
+/* notify queued responses */
+static int
+istgt_iscsi_wakeup_sender(CONN_Ptr conn)
+{
+	int rc;
+
+#ifdef ISTGT_USE_EPOLL
+	if (conn->use_reactor) {
+		istgt_reactor_kick(conn);
+		return 0;
+	}
+#endif /* ISTGT_USE_EPOLL */
+	/* pairs with the store of result_waiting in sender() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&conn->result_waiting, __ATOMIC_SEQ_CST))
+		return 0;
+	MTX_LOCK(&conn->result_queue_mutex);
+	rc = pthread_cond_broadcast(&conn->result_queue_cond);
+	MTX_UNLOCK(&conn->result_queue_mutex);
+	return rc;
+}
+
+/* wait for a free slot while the consumer is alive */
+static int
+istgt_iscsi_enqueue_ring(CONN_Ptr conn, ISTGT_RING_Ptr ring, void *elem)
+{
+	int rc;
+
+	while (1) {
+		rc = istgt_ring_enqueue(ring, elem);
+		if (rc == 0)
+			return 0;
+		if (conn->state != CONN_STATE_RUNNING) {
+			ISTGT_ERRLOG("queue is full (%d)\n", conn->id);
+			return -1;
 		}
+		istgt_yield();
 	}
+}
 
-	close(conn->sock);
-#ifdef ISTGT_USE_KQUEUE
-	close(kq);
-	conn->kq = -1;
-#endif /* ISTGT_USE_KQUEUE */
-	sleep(1);
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "worker %d end\n", conn->id);
+/* queue task for sender, called from any thread */
+int
+istgt_iscsi_queue_result(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	int rc;
 
-	/* cleanup conn & sess */
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cleanup LOCK\n");
-	MTX_LOCK(&g_conns_mutex);
-	g_conns[conn->id] = NULL;
-	istgt_remove_conn(conn);
-	MTX_UNLOCK(&g_conns_mutex);
-	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "cleanup UNLOCK\n");
+	rc = istgt_iscsi_enqueue_ring(conn, &conn->result_queue, lu_task);
+	if (rc < 0) {
+		return -1;
+	}
+	rc = istgt_iscsi_wakeup_sender(conn);
+	if (rc != 0) {
+		ISTGT_ERRLOG("cond_broadcast() failed\n");
+		return -1;
+	}
+	return 0;
+}
 
-	return NULL;
+/* queue task for connection worker, caller notifies by task_pipe */
+int
+istgt_iscsi_queue_task(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	return istgt_iscsi_enqueue_ring(conn, &conn->task_queue, lu_task);
 }
 
 int
@@ -6055,10 +7925,18 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 	conn->task_pipe[0] = -1;
 	conn->task_pipe[1] = -1;
 	conn->max_task_queue = MAX_LU_QUEUE_DEPTH;
-	istgt_queue_init(&conn->task_queue);
-	istgt_queue_init(&conn->result_queue);
+	istgt_ring_init(&conn->task_queue, ISTGT_CONN_RING_SIZE);
+	istgt_ring_init(&conn->result_queue, ISTGT_CONN_RING_SIZE);
+	conn->result_waiting = 0;
 	conn->exec_lu_task = NULL;
 	conn->running_tasks = 0;
+	conn->task_pool = istgt_lu_task_pool_create();
+	conn->use_reactor = 0;
+	conn->wbatch.enable = 0;
+	conn->wbatch.iovcnt = 0;
+	conn->wbatch.bytes = 0;
+	conn->wbatch.hdrlen = 0;
+	conn->wbatch.ntasks = 0;
 
 	memset(conn->initiator_addr, 0, sizeof conn->initiator_addr);
 	memset(conn->target_addr, 0, sizeof conn->target_addr);
@@ -6145,11 +8023,6 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 		conn->task_pipe[1] = -1;
 		goto error_return;
 	}
-	rc = pthread_mutex_init(&conn->task_queue_mutex, &istgt->mutex_attr);
-	if (rc != 0) {
-		ISTGT_ERRLOG("mutex_init() failed\n");
-		goto error_return;
-	}
 	rc = pthread_mutex_init(&conn->result_queue_mutex, &istgt->mutex_attr);
 	if (rc != 0) {
 		ISTGT_ERRLOG("mutex_init() failed\n");
@@ -6246,8 +8119,9 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 			close(conn->task_pipe[1]);
 		istgt_iscsi_param_free(conn->params);
 		istgt_queue_destroy(&conn->pending_pdus);
-		istgt_queue_destroy(&conn->task_queue);
-		istgt_queue_destroy(&conn->result_queue);
+		istgt_ring_destroy(&conn->task_queue);
+		istgt_ring_destroy(&conn->result_queue);
+		istgt_lu_task_pool_release(conn->task_pool);
 		xfree(conn->portal.label);
 		xfree(conn->portal.host);
 		xfree(conn->portal.port);
@@ -6259,6 +8133,17 @@ istgt_create_conn(ISTGT_Ptr istgt, PORTAL_Ptr portal, int sock, struct sockaddr
 		return -1;
 	}
 
+#ifdef ISTGT_USE_EPOLL
+	if (istgt->network_threads != 0) {
+		/* multiplexed by network threads */
+		rc = istgt_reactor_attach(conn);
+		if (rc == 0) {
+			return 0;
+		}
+		ISTGT_WARNLOG("reactor_attach() failed, use own thread\n");
+	}
+#endif /* ISTGT_USE_EPOLL */
+
 	/* create new thread */
 #ifdef ISTGT_STACKSIZE
 	rc = pthread_create(&conn->thread, &istgt->attr, &worker, (void *)conn);
@@ -6371,6 +8256,12 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	sess->connections++;
 
 	sess->req_mcs_cond = 0;
+	sess->cmdsn_slot = xmalloc(sizeof *sess->cmdsn_slot
+	    * ISTGT_CMDSN_WINDOW);
+	memset(sess->cmdsn_slot, 0, sizeof *sess->cmdsn_slot
+	    * ISTGT_CMDSN_WINDOW);
+	sess->cmdsn_held = 0;
+	sess->cmdsn_stall = 0;
 	sess->params = NULL;
 	sess->lu = NULL;
 	sess->isid = 0;
@@ -6379,14 +8270,22 @@ istgt_create_sess(ISTGT_Ptr istgt, CONN_Ptr conn, ISTGT_LU_Ptr lu)
 	sess->initial_r2t = 0;
 	sess->immediate_data = 0;
 
+	/* discovery sessions carry no I/O */
+	sess->stats = NULL;
+	if (lu != NULL) {
+		sess->stats = istgt_stats_create();
+	}
+
 	rc = pthread_mutex_init(&sess->mutex, NULL);
 	if (rc != 0) {
 		ISTGT_ERRLOG("mutex_init() failed\n");
 	error_return:
+		istgt_stats_destroy(sess->stats);
 		istgt_iscsi_param_free(sess->params);
 		xfree(sess->initiator_port);
 		xfree(sess->target_name);
 		xfree(sess->conns);
+		xfree(sess->cmdsn_slot);
 		xfree(sess);
 		conn->sess = NULL;
 		return -1;
@@ -6573,10 +8472,12 @@ istgt_free_sess(SESS_Ptr sess)
 		return;
 	(void) pthread_mutex_destroy(&sess->mutex);
 	(void) pthread_cond_destroy(&sess->mcs_cond);
+	istgt_stats_destroy(sess->stats);
 	istgt_iscsi_param_free(sess->params);
 	xfree(sess->initiator_port);
 	xfree(sess->target_name);
 	xfree(sess->conns);
+	xfree(sess->cmdsn_slot);
 	xfree(sess);
 }
 
@@ -6589,7 +8490,6 @@ istgt_free_conn(CONN_Ptr conn)
 		close(conn->task_pipe[0]);
 	if (conn->task_pipe[1] != -1)
 		close(conn->task_pipe[1]);
-	(void) pthread_mutex_destroy(&conn->task_queue_mutex);
 	(void) pthread_mutex_destroy(&conn->result_queue_mutex);
 	(void) pthread_cond_destroy(&conn->result_queue_cond);
 	(void) pthread_mutex_destroy(&conn->wpdu_mutex);
@@ -6599,8 +8499,10 @@ istgt_free_conn(CONN_Ptr conn)
 	(void) pthread_cond_destroy(&conn->sender_cond);
 	istgt_iscsi_param_free(conn->params);
 	istgt_queue_destroy(&conn->pending_pdus);
-	istgt_queue_destroy(&conn->task_queue);
-	istgt_queue_destroy(&conn->result_queue);
+	istgt_ring_destroy(&conn->task_queue);
+	istgt_ring_destroy(&conn->result_queue);
+	/* freed when the last task is destroyed */
+	istgt_lu_task_pool_release(conn->task_pool);
 	xfree(conn->r2t_tasks);
 	xfree(conn->portal.label);
 	xfree(conn->portal.host);
@@ -6741,6 +8643,14 @@ istgt_iscsi_drop_all_conns(CONN_Ptr conn)
 					    xconn->initiator_addr,
 					    xconn->cid);
 				}
+				if (xconn->use_reactor) {
+					/* network thread can't be cancelled */
+					rc = write(xconn->task_pipe[1], "E", 1);
+					if (rc < 0 || rc != 1) {
+						ISTGT_ERRLOG("write() failed\n");
+					}
+					continue;
+				}
 				rc = pthread_cancel(xconn->thread);
 				if (rc != 0) {
 					ISTGT_ERRLOG("pthread_cancel() failed rc=%d\n", rc);
@@ -6825,6 +8735,14 @@ istgt_iscsi_drop_old_conns(CONN_Ptr conn)
 					    xconn->initiator_addr,
 					    xconn->cid);
 				}
+				if (xconn->use_reactor) {
+					/* network thread can't be cancelled */
+					rc = write(xconn->task_pipe[1], "E", 1);
+					if (rc < 0 || rc != 1) {
+						ISTGT_ERRLOG("write() failed\n");
+					}
+					continue;
+				}
 				rc = pthread_cancel(xconn->thread);
 				if (rc != 0) {
 					ISTGT_ERRLOG("pthread_cancel() failed rc=%d\n", rc);
@@ -7027,6 +8945,10 @@ istgt_iscsi_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)))
 		}
 	}
 
+#ifdef ISTGT_USE_EPOLL
+	istgt_reactor_shutdown(num);
+#endif /* ISTGT_USE_EPOLL */
+
 	rc = pthread_mutex_destroy(&g_last_tsih_mutex);
 	if (rc != 0) {
 		ISTGT_ERRLOG("mutex_destroy() failed\n");
@@ -34,6 +34,7 @@
 #include "istgt_iscsi_param.h"
 #include "istgt_lu.h"
 #include "istgt_queue.h"
+#include "istgt_ring.h"
 
 #define ISCSI_BHS_LEN 48
 #define ISCSI_DIGEST_LEN 4
@@ -207,6 +208,28 @@ typedef struct istgt_r2t_task_t {
 } ISTGT_R2T_TASK;
 typedef ISTGT_R2T_TASK *ISTGT_R2T_TASK_Ptr;
 
+/* PDUs gathered by sender thread and sent by one writev() */
+#define ISTGT_WBATCH_IOV 64
+#define ISTGT_WBATCH_HDR 8192
+#define ISTGT_WBATCH_COPY 512
+#define ISTGT_WBATCH_TASKS 64
+#define ISTGT_WBATCH_BYTES (256 * 1024)
+
+/* task/result rings, R2T and NOP-In also go through the result ring */
+#define ISTGT_CONN_RING_SIZE (4 * MAX_LU_QUEUE_DEPTH)
+typedef struct istgt_wbatch_t {
+	int enable;
+	pthread_t owner;
+	int iovcnt;
+	int bytes;
+	struct iovec iov[ISTGT_WBATCH_IOV];
+	int hdrlen;
+	uint8_t hdr[ISTGT_WBATCH_HDR];
+	/* tasks referred by iov, released after writev() */
+	int ntasks;
+	ISTGT_LU_TASK_Ptr tasks[ISTGT_WBATCH_TASKS];
+} ISTGT_WBATCH;
+
 typedef struct istgt_conn_t {
 	int id;
 
@@ -217,6 +240,7 @@ typedef struct istgt_conn_t {
 #ifdef ISTGT_USE_KQUEUE
 	int kq;
 #endif /* ISTGT_USE_KQUEUE */
+	int use_reactor;
 	int use_sender;
 	pthread_t thread;
 	pthread_t sender_thread;
@@ -241,13 +265,15 @@ typedef struct istgt_conn_t {
 
 	int task_pipe[2];
 	int max_task_queue;
-	pthread_mutex_t task_queue_mutex;
-	ISTGT_QUEUE task_queue;
+	ISTGT_RING task_queue;
 	pthread_mutex_t result_queue_mutex;
 	pthread_cond_t result_queue_cond;
-	ISTGT_QUEUE result_queue;
+	int result_waiting;
+	ISTGT_RING result_queue;
 	ISTGT_LU_TASK_Ptr exec_lu_task;
 	int running_tasks;
+	ISTGT_LU_TASK_POOL *task_pool;
+	ISTGT_WBATCH wbatch;
 
 	uint16_t cid;
 
@@ -262,6 +288,13 @@ typedef struct istgt_conn_t {
 	char initiator_port[MAX_INITIATOR_NAME];
 	char target_port[MAX_TARGET_NAME];
 
+	/* initiator group limits and queue weight on the target LU */
+	ISTGT_QOS_Ptr qos;
+	int weight;
+
+	/* reservation state of the nexus per LUN, pr_epoch << 32 | state */
+	uint64_t pr_cache[MAX_LU_LUN];
+
 	/* for fast access */
 	int header_digest;
 	int data_digest;
@@ -303,6 +336,19 @@ typedef struct istgt_conn_t {
 } CONN;
 typedef CONN *CONN_Ptr;
 
+/*
+ * MaxCmdSN - ExpCmdSN is about QueueDepth (< MAX_LU_QUEUE_DEPTH), plus
+ * commands answered at arrival while a lower CmdSN is missing
+ */
+#define ISTGT_CMDSN_WINDOW (2 * MAX_LU_QUEUE_DEPTH)
+
+/* non-immediate command received ahead of ExpCmdSN */
+typedef struct istgt_cmdsn_slot_t {
+	int held;
+	/* NULL if answered at arrival, dropped while waiting, or not SCSI */
+	ISTGT_LU_TASK_Ptr lu_task;
+} CMDSN_SLOT;
+
 typedef struct istgt_sess_t {
 	int connections;
 	int max_conns;
@@ -339,6 +385,13 @@ typedef struct istgt_sess_t {
 
 	uint32_t ExpCmdSN;
 	uint32_t MaxCmdSN;
+
+	/* CmdSN reorder window for queued LUs, indexed by CmdSN */
+	CMDSN_SLOT *cmdsn_slot;
+	int cmdsn_held;
+	time_t cmdsn_stall;
+
+	ISTGT_STATS_Ptr stats;
 } SESS;
 typedef SESS *SESS_Ptr;
 
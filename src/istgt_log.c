@@ -29,14 +29,42 @@
 #include "config.h"
 #endif
 
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#endif
 
 #include "istgt.h"
 #include "istgt_log.h"
 #include "istgt_misc.h"
+#include "istgt_ring.h"
+
+#define ISTGT_LOG_LINE (MAX_TMPBUF + 256)
+#define ISTGT_LOG_RATE_HASH 256
+
+/* stderr only if priority is negative */
+typedef struct istgt_log_rec_t {
+	const char *format;
+	int priority;
+	char line[ISTGT_LOG_LINE];
+} ISTGT_LOG_REC;
+
+typedef struct istgt_log_rate_t {
+	const char *format;
+	int priority;
+	time_t sec;
+	int count;
+	int suppressed;
+} ISTGT_LOG_RATE;
 
 //static int g_trace_flag = 0;
 int g_trace_flag = 0;
@@ -44,6 +72,21 @@ int g_warn_flag = 1;
 static int g_log_facility = ISTGT_LOG_FACILITY;
 static int g_log_priority = ISTGT_LOG_PRIORITY;
 
+/* records are passed to the writer thread once istgt_log_start() is done */
+static int g_log_async = 0;
+static int g_log_started = 0;
+static int g_log_stop = 0;
+static int g_log_waiting = 0;
+static uint32_t g_log_dropped = 0;
+static ISTGT_LOG_REC *g_log_recs = NULL;
+static ISTGT_RING g_log_ring;
+static ISTGT_RING g_log_free;
+static pthread_t g_log_thread;
+static pthread_mutex_t g_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_log_cond = PTHREAD_COND_INITIALIZER;
+/* used by the writer thread only */
+static ISTGT_LOG_RATE g_log_rate[ISTGT_LOG_RATE_HASH];
+
 int
 istgt_set_log_facility(const char *facility)
 {
@@ -100,68 +143,97 @@ istgt_set_log_priority(const char *priority)
 	return 0;
 }
 
-void
-istgt_log(const char *file, const int line, const char *func, const char *format, ...)
+static void
+istgt_log_output(int priority, const char *line)
 {
-	char buf[MAX_TMPBUF];
-	va_list ap;
+	fprintf(stderr, "%s", line);
+	if (priority >= 0) {
+		syslog(priority, "%s", line);
+	}
+}
+
+static void
+istgt_vlog(int priority, const char *file, const int line, const char *func, const char *tag, const char *format, va_list ap)
+{
+	ISTGT_LOG_REC *rec;
+	char buf[ISTGT_LOG_LINE];
+	char *lp;
+	int n;
+
+	rec = NULL;
+	lp = buf;
+	if (__atomic_load_n(&g_log_async, __ATOMIC_ACQUIRE)) {
+		/* never wait for the writer, count it and go */
+		rec = istgt_ring_dequeue(&g_log_free);
+		if (rec == NULL) {
+			__sync_add_and_fetch(&g_log_dropped, 1);
+			return;
+		}
+		lp = rec->line;
+	}
 
-	va_start(ap, format);
-	vsnprintf(buf, sizeof buf, format, ap);
 	if (file != NULL) {
 		if (func != NULL) {
-			fprintf(stderr, "%s:%4d:%s: %s", file, line, func, buf);
-			syslog(g_log_priority, "%s:%4d:%s: %s", file, line, func, buf);
+			n = snprintf(lp, ISTGT_LOG_LINE, "%s:%4d:%s: %s",
+			    file, line, func, tag);
 		} else {
-			fprintf(stderr, "%s:%4d: %s", file, line, buf);
-			syslog(g_log_priority, "%s:%4d: %s", file, line, buf);
+			n = snprintf(lp, ISTGT_LOG_LINE, "%s:%4d: %s",
+			    file, line, tag);
 		}
 	} else {
-		fprintf(stderr, "%s", buf);
-		syslog(g_log_priority, "%s", buf);
+		n = snprintf(lp, ISTGT_LOG_LINE, "%s", tag);
+	}
+	if (n < 0 || n > ISTGT_LOG_LINE - MAX_TMPBUF) {
+		n = ISTGT_LOG_LINE - MAX_TMPBUF;
 	}
+	vsnprintf(lp + n, MAX_TMPBUF, format, ap);
+
+	if (rec == NULL) {
+		istgt_log_output(priority, lp);
+		return;
+	}
+	rec->format = format;
+	rec->priority = priority;
+	/* both rings have room for every record */
+	istgt_ring_enqueue(&g_log_ring, rec);
+
+	/* pairs with the store of g_log_waiting in the writer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&g_log_waiting, __ATOMIC_SEQ_CST))
+		return;
+	MTX_LOCK(&g_log_mutex);
+	pthread_cond_broadcast(&g_log_cond);
+	MTX_UNLOCK(&g_log_mutex);
+}
+
+void
+istgt_log(const char *file, const int line, const char *func, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	istgt_vlog(g_log_priority, file, line, func, "", format, ap);
 	va_end(ap);
 }
 
 void
 istgt_noticelog(const char *file, const int line, const char *func, const char *format, ...)
 {
-	char buf[MAX_TMPBUF];
 	va_list ap;
 
 	va_start(ap, format);
-	vsnprintf(buf, sizeof buf, format, ap);
-	if (file != NULL) {
-		if (func != NULL) {
-			fprintf(stderr, "%s:%4d:%s: %s", file, line, func, buf);
-			syslog(LOG_NOTICE, "%s:%4d:%s: %s", file, line, func, buf);
-		} else {
-			fprintf(stderr, "%s:%4d: %s", file, line, buf);
-			syslog(LOG_NOTICE, "%s:%4d: %s", file, line, buf);
-		}
-	} else {
-		fprintf(stderr, "%s", buf);
-		syslog(LOG_NOTICE, "%s", buf);
-	}
+	istgt_vlog(LOG_NOTICE, file, line, func, "", format, ap);
 	va_end(ap);
 }
 
 void
 istgt_tracelog(const int flag, const char *file, const int line, const char *func, const char *format, ...)
 {
-	char buf[MAX_TMPBUF];
 	va_list ap;
 
 	va_start(ap, format);
 	if (g_trace_flag & flag) {
-		vsnprintf(buf, sizeof buf, format, ap);
-		if (func != NULL) {
-			fprintf(stderr, "%s:%4d:%s: %s", file, line, func, buf);
-			//syslog(LOG_INFO, "%s:%4d:%s: %s", file, line, func, buf);
-		} else {
-			fprintf(stderr, "%s:%4d: %s", file, line, buf);
-			//syslog(LOG_INFO, "%s:%4d: %s", file, line, buf);
-		}
+		istgt_vlog(-1, file, line, func, "", format, ap);
 	}
 	va_end(ap);
 }
@@ -169,40 +241,184 @@ istgt_tracelog(const int flag, const char *file, const int line, const char *fun
 void
 istgt_errlog(const char *file, const int line, const char *func, const char *format, ...)
 {
-	char buf[MAX_TMPBUF];
 	va_list ap;
 
 	va_start(ap, format);
-	vsnprintf(buf, sizeof buf, format, ap);
-	if (func != NULL) {
-		fprintf(stderr, "%s:%4d:%s: ***ERROR*** %s", file, line, func, buf);
-		syslog(LOG_ERR, "%s:%4d:%s: ***ERROR*** %s", file, line, func, buf);
-	} else {
-		fprintf(stderr, "%s:%4d: ***ERROR*** %s", file, line, buf);
-		syslog(LOG_ERR, "%s:%4d: ***ERROR*** %s", file, line, buf);
-	}
+	istgt_vlog(LOG_ERR, file, line, func, "***ERROR*** ", format, ap);
 	va_end(ap);
 }
 
 void
 istgt_warnlog(const char *file, const int line, const char *func, const char *format, ...)
 {
-	char buf[MAX_TMPBUF];
 	va_list ap;
 
 	va_start(ap, format);
-	vsnprintf(buf, sizeof buf, format, ap);
-	if (func != NULL) {
-		fprintf(stderr, "%s:%4d:%s: ***WARNING*** %s", file, line, func, buf);
-		syslog(LOG_WARNING, "%s:%4d:%s: ***WARNING*** %s",
-			   file, line, func, buf);
-	} else {
-		fprintf(stderr, "%s:%4d: ***WARNING*** %s", file, line, buf);
-		syslog(LOG_WARNING, "%s:%4d: ***WARNING*** %s", file, line, buf);
-	}
+	istgt_vlog(LOG_WARNING, file, line, func, "***WARNING*** ", format, ap);
 	va_end(ap);
 }
 
+static void
+istgt_log_summary(ISTGT_LOG_RATE *rp)
+{
+	char buf[ISTGT_LOG_LINE];
+
+	if (rp->suppressed != 0) {
+		snprintf(buf, sizeof buf, "suppressed %d messages like: %s",
+		    rp->suppressed, rp->format);
+		istgt_log_output(rp->priority, buf);
+	}
+	rp->format = NULL;
+	rp->suppressed = 0;
+}
+
+static int
+istgt_log_admit(ISTGT_LOG_REC *rec, time_t now)
+{
+	ISTGT_LOG_RATE *rp;
+	int h;
+
+	/* trace is not limited, it is requested explicitly */
+	if (rec->priority < 0)
+		return 1;
+	/* the format string identifies the call site */
+	h = (int) (((uintptr_t) rec->format >> 3) & (ISTGT_LOG_RATE_HASH - 1));
+	rp = &g_log_rate[h];
+	if (rp->format != rec->format || rp->sec != now) {
+		istgt_log_summary(rp);
+		rp->format = rec->format;
+		rp->priority = rec->priority;
+		rp->sec = now;
+		rp->count = 0;
+	}
+	if (rp->count < ISTGT_LOG_RATE_LIMIT) {
+		rp->count++;
+		return 1;
+	}
+	rp->suppressed++;
+	return 0;
+}
+
+static void
+istgt_log_flush(time_t now, int all)
+{
+	char buf[ISTGT_LOG_LINE];
+	uint32_t dropped;
+	int i;
+
+	for (i = 0; i < ISTGT_LOG_RATE_HASH; i++) {
+		if (g_log_rate[i].format == NULL)
+			continue;
+		if (all || g_log_rate[i].sec != now) {
+			istgt_log_summary(&g_log_rate[i]);
+		}
+	}
+	dropped = __sync_lock_test_and_set(&g_log_dropped, 0);
+	if (dropped != 0) {
+		snprintf(buf, sizeof buf,
+		    "***WARNING*** log buffer full, %"PRIu32" messages dropped\n",
+		    dropped);
+		istgt_log_output(LOG_WARNING, buf);
+	}
+}
+
+static void *
+istgt_log_writer(void *arg __attribute__((__unused__)))
+{
+	ISTGT_LOG_REC *rec;
+	struct timespec abstime;
+	time_t now, last;
+	int stop;
+
+	last = 0;
+	while (1) {
+		stop = __atomic_load_n(&g_log_stop, __ATOMIC_ACQUIRE);
+		while ((rec = istgt_ring_dequeue(&g_log_ring)) != NULL) {
+			now = time(NULL);
+			if (istgt_log_admit(rec, now)) {
+				istgt_log_output(rec->priority, rec->line);
+			}
+			istgt_ring_enqueue(&g_log_free, rec);
+		}
+		now = time(NULL);
+		if (stop) {
+			istgt_log_flush(now, 1);
+			break;
+		}
+		if (now != last) {
+			istgt_log_flush(now, 0);
+			last = now;
+		}
+
+		/* producers signal only if g_log_waiting is set */
+		MTX_LOCK(&g_log_mutex);
+		__atomic_store_n(&g_log_waiting, 1, __ATOMIC_SEQ_CST);
+		if (istgt_ring_count(&g_log_ring) == 0
+		    && !__atomic_load_n(&g_log_stop, __ATOMIC_SEQ_CST)) {
+			abstime.tv_sec = now + 1;
+			abstime.tv_nsec = 0;
+			(void) pthread_cond_timedwait(&g_log_cond, &g_log_mutex,
+			    &abstime);
+		}
+		__atomic_store_n(&g_log_waiting, 0, __ATOMIC_SEQ_CST);
+		MTX_UNLOCK(&g_log_mutex);
+	}
+	return NULL;
+}
+
+int
+istgt_log_start(void)
+{
+	int rc;
+	int i;
+
+	if (g_log_started)
+		return 0;
+	/* records are kept after stop, late callers may still hold one */
+	if (g_log_recs == NULL) {
+		g_log_recs = xmalloc(ISTGT_LOG_RING_SIZE * sizeof *g_log_recs);
+		istgt_ring_init(&g_log_ring, ISTGT_LOG_RING_SIZE);
+		istgt_ring_init(&g_log_free, ISTGT_LOG_RING_SIZE);
+		for (i = 0; i < ISTGT_LOG_RING_SIZE; i++) {
+			istgt_ring_enqueue(&g_log_free, &g_log_recs[i]);
+		}
+	}
+	memset(g_log_rate, 0, sizeof g_log_rate);
+	g_log_stop = 0;
+
+	rc = pthread_create(&g_log_thread, NULL, &istgt_log_writer, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		return -1;
+	}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	pthread_set_name_np(g_log_thread, "logthread");
+#endif
+	g_log_started = 1;
+	__atomic_store_n(&g_log_async, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+istgt_log_stop(void)
+{
+	int rc;
+
+	if (!g_log_started)
+		return;
+	/* new messages go direct, the writer drains queued ones */
+	__atomic_store_n(&g_log_async, 0, __ATOMIC_RELEASE);
+	MTX_LOCK(&g_log_mutex);
+	__atomic_store_n(&g_log_stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&g_log_cond);
+	MTX_UNLOCK(&g_log_mutex);
+	rc = pthread_join(g_log_thread, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_join() failed\n");
+	}
+	g_log_started = 0;
+}
+
 void
 istgt_open_log(void)
 {
@@ -216,6 +432,7 @@ istgt_open_log(void)
 void
 istgt_close_log(void)
 {
+	istgt_log_stop();
 	closelog();
 }
 
@@ -43,6 +43,14 @@
 #define ISTGT_LOG_PRIORITY LOG_NOTICE
 #endif
 
+/* queued records, and messages per call site and second */
+#ifndef ISTGT_LOG_RING_SIZE
+#define ISTGT_LOG_RING_SIZE 1024
+#endif
+#ifndef ISTGT_LOG_RATE_LIMIT
+#define ISTGT_LOG_RATE_LIMIT 20
+#endif
+
 #define ISTGT_TRACE_ALL     (~0U)
 #define ISTGT_TRACE_NONE    0U
 #define ISTGT_TRACE_DEBUG   0x80000000U
@@ -91,6 +99,8 @@ void istgt_errlog(const char *file, const int line, const char *func, const char
 void istgt_warnlog(const char *file, const int line, const char *func, const char *format, ...) __attribute__((__format__(__printf__, 4, 5)));
 void istgt_open_log(void);
 void istgt_close_log(void);
+int istgt_log_start(void);
+void istgt_log_stop(void);
 void istgtcontrol_open_log(void);
 void istgtcontrol_close_log(void);
 void istgt_set_trace_flag(int flag);
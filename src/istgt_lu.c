@@ -203,7 +203,7 @@ istgt_lu_allow_netmask(const char *netmask, const char *addr)
 }
 
 int
-istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *addr)
+istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *addr, int *map)
 {
 	ISTGT_Ptr istgt;
 	INITIATOR_GROUP *igp;
@@ -247,6 +247,8 @@ istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *add
 				/* OK iqn, check netmask */
 				if (igp->nnetmasks == 0) {
 					/* OK, empty netmask as ALL */
+					if (map != NULL)
+						*map = i;
 					return 1;
 				}
 				for (k = 0; k < igp->nnetmasks; k++) {
@@ -256,6 +258,8 @@ istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *add
 					rc = istgt_lu_allow_netmask(igp->netmasks[k], addr);
 					if (rc > 0) {
 						/* OK netmask */
+						if (map != NULL)
+							*map = i;
 						return 1;
 					}
 				}
@@ -1277,6 +1281,50 @@ istgt_lu_set_local_settings(ISTGT_Ptr istgt, CF_SECTION *sp, ISTGT_LU_Ptr lu)
 	return 0;
 }
 
+/* MaxIOPS <iops> [burst] and MaxBandwidth <size> [burst] of a section */
+static int
+istgt_lu_parse_qos(CF_SECTION *sp, ISTGT_QOS_Ptr *qosp)
+{
+	uint64_t iops, iops_burst;
+	uint64_t bps, bps_burst;
+	const char *val;
+
+	*qosp = NULL;
+	iops = iops_burst = 0;
+	bps = bps_burst = 0;
+	val = istgt_get_nmval(sp, "MaxIOPS", 0, 0);
+	if (val != NULL) {
+		iops = (uint64_t) strtoull(val, NULL, 10);
+		val = istgt_get_nmval(sp, "MaxIOPS", 0, 1);
+		if (val != NULL) {
+			iops_burst = (uint64_t) strtoull(val, NULL, 10);
+		}
+	}
+	val = istgt_get_nmval(sp, "MaxBandwidth", 0, 0);
+	if (val != NULL) {
+		bps = istgt_lu_parse_size(val);
+		val = istgt_get_nmval(sp, "MaxBandwidth", 0, 1);
+		if (val != NULL) {
+			bps_burst = istgt_lu_parse_size(val);
+		}
+	}
+	if (iops > ISTGT_QOS_MAX || iops_burst > ISTGT_QOS_MAX
+	    || bps > ISTGT_QOS_MAX || bps_burst > ISTGT_QOS_MAX) {
+		ISTGT_ERRLOG("%s: MaxIOPS/MaxBandwidth too large\n", sp->name);
+		return -1;
+	}
+	if (iops == 0 && bps == 0) {
+		/* unlimited */
+		return 0;
+	}
+	*qosp = istgt_qos_create(iops, iops_burst, bps, bps_burst);
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "%s: MaxIOPS %"PRIu64" %"PRIu64", MaxBandwidth %"PRIu64" %"PRIu64"\n",
+	    sp->name, (*qosp)->iops.rate, (*qosp)->iops.burst,
+	    (*qosp)->bps.rate, (*qosp)->bps.burst);
+	return 0;
+}
+
 static int
 istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 {
@@ -1284,6 +1332,7 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 	ISTGT_LU_Ptr lu;
 	PORTAL_GROUP *pgp;
 	INITIATOR_GROUP *igp;
+	CF_SECTION *igsp;
 	const char *vendor, *product, *revision, *serial;
 	const char *pg_tag, *ig_tag;
 	const char *ag_tag;
@@ -1424,6 +1473,32 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 			    "Mapping PortalGroup%d InitiatorGroup%d\n",
 			    lu->map[i].pg_tag, lu->map[i].ig_tag);
 			lu->maxmap = i + 1;
+
+			/* per initiator group limits on this unit */
+			lu->map[i].weight = 1;
+			snprintf(buf, sizeof buf, "InitiatorGroup%d", ig_tag_i);
+			igsp = istgt_find_cf_section(istgt->config, buf);
+			if (igsp != NULL) {
+				rc = istgt_lu_parse_qos(igsp, &lu->map[i].qos);
+				if (rc < 0) {
+					goto error_return;
+				}
+				if (lu->map[i].qos != NULL) {
+					lu->qos_groups++;
+				}
+				val = istgt_get_val(igsp, "QueueWeight");
+				if (val != NULL) {
+					lu->map[i].weight = (int) strtol(val, NULL, 10);
+				}
+				if (lu->map[i].weight < 1
+				    || lu->map[i].weight > MAX_LU_WEIGHT) {
+					ISTGT_ERRLOG("%s: QueueWeight %s out of range\n",
+					    buf, val);
+					goto error_return;
+				}
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "QueueWeight %d\n",
+				    lu->map[i].weight);
+			}
 		}
 	}
 	if (lu->maxmap == 0) {
@@ -1679,6 +1754,80 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "QueueDepth %d\n",
 	    lu->queue_depth);
 
+	val = istgt_get_val(sp, "LUWorkers");
+	if (val == NULL) {
+		lu->luworkers = DEFAULT_LU_WORKERS;
+	} else {
+		lu->luworkers = (int) strtol(val, NULL, 10);
+	}
+	if (lu->luworkers < 1 || lu->luworkers > MAX_LU_WORKERS) {
+		ISTGT_ERRLOG("LU%d: LUWorkers range error\n", lu->num);
+		goto error_return;
+	}
+	if (lu->type != ISTGT_LU_TYPE_DISK) {
+		/* only disk supports parallel execution */
+		lu->luworkers = 1;
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LUWorkers %d\n",
+	    lu->luworkers);
+
+	lu->affinity = ISTGT_AFFINITY_NONE;
+	istgt_cpuset_zero(&lu->cpuset);
+	val = istgt_get_val(sp, "CPUAffinity");
+	if (val != NULL && strcasecmp(val, "None") != 0) {
+		rc = istgt_cpuset_parse(&lu->cpuset, val);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: CPUAffinity %s: format error\n",
+			    lu->num, val);
+			goto error_return;
+		}
+		lu->affinity = ISTGT_AFFINITY_LIST;
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "CPUAffinity %s\n", val);
+	}
+
+	rc = istgt_lu_parse_qos(sp, &lu->qos);
+	if (rc < 0) {
+		goto error_return;
+	}
+	if (lu->type == ISTGT_LU_TYPE_DISK && lu->queue_depth == 0
+	    && istgt->network_threads != 0
+	    && (lu->qos != NULL || lu->qos_groups != 0)) {
+		/* unqueued commands would be delayed in a shared network thread */
+		ISTGT_WARNLOG("LU%d: MaxIOPS/MaxBandwidth need QueueDepth with NetworkThreads, ignored\n",
+		    lu->num);
+		istgt_qos_destroy(lu->qos);
+		lu->qos = NULL;
+		for (i = 0; i < lu->maxmap; i++) {
+			istgt_qos_destroy(lu->map[i].qos);
+			lu->map[i].qos = NULL;
+		}
+		lu->qos_groups = 0;
+	}
+	if (lu->type != ISTGT_LU_TYPE_DISK
+	    && (lu->qos != NULL || lu->qos_groups != 0)) {
+		ISTGT_WARNLOG("LU%d: MaxIOPS/MaxBandwidth only for disk, ignored\n",
+		    lu->num);
+		istgt_qos_destroy(lu->qos);
+		lu->qos = NULL;
+		for (i = 0; i < lu->maxmap; i++) {
+			istgt_qos_destroy(lu->map[i].qos);
+			lu->map[i].qos = NULL;
+		}
+		lu->qos_groups = 0;
+	}
+
+	val = istgt_get_val(sp, "ReadCacheSize");
+	if (val == NULL) {
+		lu->readcache_size = 0;
+	} else {
+		lu->readcache_size = istgt_lu_parse_size(val);
+	}
+	if (lu->type != ISTGT_LU_TYPE_DISK) {
+		lu->readcache_size = 0;
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "ReadCacheSize %"PRIu64"\n",
+	    lu->readcache_size);
+
 	lu->maxlun = 0;
 	for (i = 0; i < MAX_LU_LUN; i++) {
 		lu->lun[i].type = ISTGT_LU_LUN_TYPE_NONE;
@@ -1686,12 +1835,18 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 		lu->lun[i].formfactor = DEFAULT_LU_FORMFACTOR;
 		lu->lun[i].readcache = 1;
 		lu->lun[i].writecache = 1;
+		lu->lun[i].asyncio = 0;
+		lu->lun[i].zerocopy = 0;
+		lu->lun[i].writeback = 0;
+		lu->lun[i].unmap = 0;
 		lu->lun[i].serial = NULL;
 		lu->lun[i].spec = NULL;
+		lu->lun[i].stats = NULL;
 		snprintf(buf, sizeof buf, "LUN%d", i);
 		val = istgt_get_val(sp, buf);
 		if (val == NULL)
 			continue;
+		lu->lun[i].stats = istgt_stats_create();
 		if (i != 0) {
 			/* default LUN serial (except LUN0) */
 			snprintf(buf2, sizeof buf2, "%sL%d", lu->inq_serial, i);
@@ -1744,10 +1899,46 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 				}
 				lu->lun[i].u.storage.fd = -1;
 				lu->lun[i].u.storage.file = xstrdup(file);
+				lu->lun[i].u.storage.disktype = NULL;
 				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
 				    "Storage file=%s, size=%"PRIu64"\n",
 				    lu->lun[i].u.storage.file,
 				    lu->lun[i].u.storage.size);
+			} else if (strcasecmp(val, "Null") == 0
+			    || strcasecmp(val, "Memory") == 0) {
+				if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_NONE) {
+					ISTGT_ERRLOG("LU%d: duplicate LUN%d\n", lu->num, i);
+					goto error_return;
+				}
+				lu->lun[i].type = ISTGT_LU_LUN_TYPE_STORAGE;
+
+				/* storage without backing file */
+				size = istgt_get_nmval(sp, buf, j, 1);
+				if (size == NULL) {
+					if (strcasecmp(val, "Memory") == 0) {
+						ISTGT_ERRLOG("LU%d: LUN%d: format error\n", lu->num, i);
+						goto error_return;
+					}
+					lu->lun[i].u.storage.size = DEFAULT_LU_NULL_SIZE;
+				} else {
+					lu->lun[i].u.storage.size = istgt_lu_parse_size(size);
+				}
+				if (lu->lun[i].u.storage.size == 0) {
+					ISTGT_ERRLOG("LU%d: LUN%d: size error (%s)\n", lu->num, i, size);
+					goto error_return;
+				}
+				lu->lun[i].u.storage.fd = -1;
+				if (strcasecmp(val, "Memory") == 0) {
+					lu->lun[i].u.storage.file = xstrdup("Memory");
+					lu->lun[i].u.storage.disktype = "MEMORY";
+				} else {
+					lu->lun[i].u.storage.file = xstrdup("Null");
+					lu->lun[i].u.storage.disktype = "NULL";
+				}
+				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+				    "Storage %s, size=%"PRIu64"\n",
+				    lu->lun[i].u.storage.disktype,
+				    lu->lun[i].u.storage.size);
 			} else if (strcasecmp(val, "Removable") == 0) {
 				if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_NONE) {
 					ISTGT_ERRLOG("LU%d: duplicate LUN%d\n", lu->num, i);
@@ -1884,6 +2075,41 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
 						    lu->num, i, val);
 					}
+				} else if (strcasecmp(key, "AsyncIO") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].asyncio = 1;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].asyncio = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
+				} else if (strcasecmp(key, "ZeroCopy") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].zerocopy = 1;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].zerocopy = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
+				} else if (strcasecmp(key, "Unmap") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].unmap = 1;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].unmap = 0;
+					} else {
+						ISTGT_ERRLOG("LU%d: LUN%d: unknown val(%s)\n",
+						    lu->num, i, val);
+					}
+				} else if (strcasecmp(key, "WriteBack") == 0) {
+					if (strcasecmp(val, "Enable") == 0) {
+						lu->lun[i].writeback = ISTGT_LU_WCACHE_DEFAULTSIZE;
+					} else if (strcasecmp(val, "Disable") == 0) {
+						lu->lun[i].writeback = 0;
+					} else {
+						lu->lun[i].writeback = istgt_lu_parse_size(val);
+					}
 				} else {
 					ISTGT_WARNLOG("LU%d: LUN%d: unknown key(%s)\n",
 					    lu->num, i, key);
@@ -1945,6 +2171,8 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 	xfree(lu->inq_product);
 	xfree(lu->inq_revision);
 	for (i = 0; i < MAX_LU_LUN; i++) {
+		istgt_stats_destroy(lu->lun[i].stats);
+		lu->lun[i].stats = NULL;
 		switch (lu->lun[i].type) {
 		case ISTGT_LU_LUN_TYPE_DEVICE:
 			xfree(lu->lun[i].u.device.file);
@@ -1968,7 +2196,9 @@ istgt_lu_add_unit(ISTGT_Ptr istgt, CF_SECTION *sp)
 	for (i = 0; i < MAX_LU_TSIH; i++) {
 		xfree(lu->tsih[i].initiator_port);
 	}
+	istgt_qos_destroy(lu->qos);
 	for (i = 0; i < lu->maxmap; i++) {
+		istgt_qos_destroy(lu->map[i].qos);
 		pg_tag_i = lu->map[i].pg_tag;
 		ig_tag_i = lu->map[i].ig_tag;
 		MTX_LOCK(&istgt->mutex);
@@ -2010,6 +2240,8 @@ istgt_lu_del_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 	xfree(lu->inq_serial);
 	for (i = 0; i < MAX_LU_LUN; i++) {
 		xfree(lu->lun[i].serial);
+		istgt_stats_destroy(lu->lun[i].stats);
+		lu->lun[i].stats = NULL;
 		switch (lu->lun[i].type) {
 		case ISTGT_LU_LUN_TYPE_DEVICE:
 			xfree(lu->lun[i].u.device.file);
@@ -2033,7 +2265,11 @@ istgt_lu_del_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 	for (i = 0; i < MAX_LU_TSIH; i++) {
 		xfree(lu->tsih[i].initiator_port);
 	}
+	istgt_qos_destroy(lu->qos);
+	lu->qos = NULL;
 	for (i = 0; i < lu->maxmap; i++) {
+		istgt_qos_destroy(lu->map[i].qos);
+		lu->map[i].qos = NULL;
 		pg_tag_i = lu->map[i].pg_tag;
 		ig_tag_i = lu->map[i].ig_tag;
 		//MTX_LOCK(&istgt->mutex);
@@ -2075,6 +2311,11 @@ static int istgt_lu_init_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 		ISTGT_ERRLOG("LU%d: cond_init() failed\n", lu->num);
 		return -1;
 	}
+	rc = pthread_mutex_init(&lu->qos_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", lu->num);
+		return -1;
+	}
 
 	switch (lu->type) {
 	case ISTGT_LU_TYPE_PASS:
@@ -2212,7 +2453,7 @@ retry:
 		if (rc < 0) {
 			istgt_lu_set_state(lu, ISTGT_STATE_SHUTDOWN);
 			MTX_LOCK(&lu->mutex);
-			if (lu->maxtsih > 1) {
+			if (lu->maxtsih > 1 || lu->xcopy_refs > 0) {
 				if (!warn_msg) {
 					warn_msg = 1;
 					ISTGT_WARNLOG("It is recommended that you disconnect the target before deletion.\n");
@@ -2471,34 +2712,71 @@ istgt_lu_set_all_state(ISTGT_Ptr istgt, ISTGT_STATE state)
 static int
 istgt_lu_create_thread(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 {
-#ifdef HAVE_PTHREAD_SET_NAME_NP
 	char buf[MAX_TMPBUF];
-#endif
 	int rc;
+	int i;
 
-	if (lu->queue_depth != 0) {
-		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "thread for LU%d\n", lu->num);
+	if (lu->type == ISTGT_LU_TYPE_DISK) {
+		rc = istgt_lu_disk_start_wcache(istgt, lu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: lu_disk_start_wcache() failed\n", lu->num);
+			return -1;
+		}
+		rc = istgt_lu_disk_start_rcache(istgt, lu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: lu_disk_start_rcache() failed\n", lu->num);
+			return -1;
+		}
+		rc = istgt_lu_disk_start_amap(istgt, lu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: lu_disk_start_amap() failed\n", lu->num);
+			return -1;
+		}
+	}
+	if (lu->queue_depth == 0)
+		return 0;
+	if (lu->type == ISTGT_LU_TYPE_DISK) {
+		rc = istgt_lu_disk_start_aio(istgt, lu);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: lu_disk_start_aio() failed\n", lu->num);
+			return -1;
+		}
+	}
+	for (i = 0; i < lu->luworkers; i++) {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "thread %d for LU%d\n",
+		    i, lu->num);
 		/* create LU thread */
 #ifdef ISTGT_STACKSIZE
-		rc = pthread_create(&lu->thread, &istgt->attr, &luworker, (void *)lu);
+		rc = pthread_create(&lu->thread[i], &istgt->attr, &luworker, (void *)lu);
 #else
-		rc = pthread_create(&lu->thread, NULL, &luworker, (void *)lu);
+		rc = pthread_create(&lu->thread[i], NULL, &luworker, (void *)lu);
 #endif
 		if (rc != 0) {
 			ISTGT_ERRLOG("pthread_create() failed\n");
 			return -1;
 		}
 #if 0
-		rc = pthread_detach(lu->thread);
+		rc = pthread_detach(lu->thread[i]);
 		if (rc != 0) {
 			ISTGT_ERRLOG("pthread_detach() failed\n");
 			return -1;
 		}
 #endif
 #ifdef HAVE_PTHREAD_SET_NAME_NP
-		snprintf(buf, sizeof buf, "luthread #%d", lu->num);
-		pthread_set_name_np(lu->thread, buf);
+		snprintf(buf, sizeof buf, "luthread #%d.%d", lu->num, i);
+		pthread_set_name_np(lu->thread[i], buf);
 #endif
+		if (lu->affinity != ISTGT_AFFINITY_NONE) {
+			rc = istgt_cpuset_apply(lu->thread[i], &lu->cpuset);
+			if (rc < 0) {
+				ISTGT_WARNLOG("LU%d: CPU affinity failed (errno=%d)\n",
+				    lu->num, errno);
+			} else if (i == 0) {
+				istgt_cpuset_format(buf, sizeof buf, &lu->cpuset);
+				ISTGT_NOTICELOG("LU%d: threads on CPU %s\n",
+				    lu->num, buf);
+			}
+		}
 	}
 
 	return 0;
@@ -2531,6 +2809,7 @@ static int
 istgt_lu_shutdown_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 {
 	int rc;
+	int i;
 
 	switch (lu->type) {
 	case ISTGT_LU_TYPE_PASS:
@@ -2580,13 +2859,19 @@ istgt_lu_shutdown_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 	}
 
 	if (lu->queue_depth != 0) {
+		MTX_LOCK(&lu->queue_mutex);
+		lu->queue_check = 1;
 		rc = pthread_cond_broadcast(&lu->queue_cond);
+		MTX_UNLOCK(&lu->queue_mutex);
 		if (rc != 0) {
 			ISTGT_ERRLOG("LU%d: cond_broadcast() failed\n", lu->num);
 		}
-		rc = pthread_join(lu->thread, NULL);
-		if (rc != 0) {
-			ISTGT_ERRLOG("LU%d: pthread_join() failed\n", lu->num);
+		for (i = 0; i < lu->luworkers; i++) {
+			rc = pthread_join(lu->thread[i], NULL);
+			if (rc != 0) {
+				ISTGT_ERRLOG("LU%d: pthread_join() failed\n",
+				    lu->num);
+			}
 		}
 	}
 	rc = pthread_cond_destroy(&lu->queue_cond);
@@ -2599,6 +2884,11 @@ istgt_lu_shutdown_unit(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu)
 		ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
 		/* ignore error */
 	}
+	rc = pthread_mutex_destroy(&lu->qos_mutex);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
+		/* ignore error */
+	}
 	rc = pthread_mutex_destroy(&lu->state_mutex);
 	if (rc != 0) {
 		ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
@@ -2779,6 +3069,8 @@ istgt_lu_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	}
 
 	rc = 0;
+	/* queued commands are stamped again by the worker */
+	lu_cmd->ts_start = istgt_clock_usec();
 	switch (lu->type) {
 	case ISTGT_LU_TYPE_PASS:
 		MTX_LOCK(&lu->mutex);
@@ -2800,6 +3092,7 @@ istgt_lu_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 				return -1;
 			}
 		} else {
+			istgt_lu_disk_throttle(conn, lu_cmd);
 			MTX_LOCK(&lu->mutex);
 			rc = istgt_lu_disk_execute(conn, lu_cmd);
 			MTX_UNLOCK(&lu->mutex);
@@ -2840,10 +3133,321 @@ istgt_lu_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 		ISTGT_ERRLOG("LU%d: unsupported type\n", lu->num);
 		return -1;
 	}
+	lu_cmd->ts_done = istgt_clock_usec();
+
+	return rc;
+}
+
+/* LU whose commands are queued to workers, so they may wait for CmdSN */
+int
+istgt_lu_queued(ISTGT_LU_Ptr lu)
+{
+	if (lu == NULL)
+		return 0;
+	return (lu->type == ISTGT_LU_TYPE_DISK && lu->queue_depth != 0);
+}
+
+/*
+ * like istgt_lu_execute() for a queued LU, but the task is returned in
+ * *lu_taskp and started later by istgt_lu_execute_task(); *lu_taskp is
+ * NULL if lu_cmd was answered already
+ */
+int
+istgt_lu_execute_defer(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr *lu_taskp)
+{
+	ISTGT_LU_Ptr lu;
+	int rc;
+
+	*lu_taskp = NULL;
+	if (lu_cmd == NULL)
+		return -1;
+	lu = lu_cmd->lu;
+	if (!istgt_lu_queued(lu))
+		return -1;
+
+	if (lu->online == 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "LU%d: offline\n", lu->num);
+		/* LOGICAL UNIT NOT READY, CAUSE NOT REPORTABLE */
+		lu_cmd->sense_data_len
+			= istgt_lu_scsi_build_sense_data(lu_cmd->sense_data,
+			    ISTGT_SCSI_SENSE_NOT_READY,
+			    0x04, 0x00);
+		lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+		return ISTGT_LU_TASK_RESULT_IMMEDIATE;
+	}
 
+	lu_cmd->ts_start = istgt_clock_usec();
+	rc = istgt_lu_disk_queue_create(conn, lu_cmd, lu_taskp);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: lu_disk_queue_create() failed\n",
+		    lu->num);
+		return -1;
+	}
+	lu_cmd->ts_done = istgt_clock_usec();
 	return rc;
 }
 
+/*
+ * start a task made by istgt_lu_execute_defer(); a full queue is
+ * reported in lu_cmd if given, or else answered by the task itself
+ */
+int
+istgt_lu_execute_task(ISTGT_LU_TASK_Ptr lu_task, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_LU_Ptr lu;
+	int rc;
+
+	lu = lu_task->lu_cmd.lu;
+	rc = istgt_lu_disk_queue_task(lu_task, lu_cmd);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: lu_disk_queue_task() failed\n",
+		    lu->num);
+		return -1;
+	}
+	return rc;
+}
+
+static ISTGT_STATS_Ptr
+istgt_lu_stats_lun(ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_LU_Ptr lu;
+	int lun_i;
+
+	lu = lu_cmd->lu;
+	if (lu == NULL)
+		return NULL;
+	lun_i = istgt_lu_islun2lun(lu_cmd->lun);
+	if (lun_i < 0 || lun_i >= lu->maxlun)
+		return NULL;
+	return lu->lun[lun_i].stats;
+}
+
+void
+istgt_lu_stats_begin(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	if (conn->sess != NULL)
+		istgt_stats_begin(conn->sess->stats);
+	istgt_stats_begin(istgt_lu_stats_lun(lu_cmd));
+}
+
+void
+istgt_lu_stats_update(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sent)
+{
+	uint64_t lat[ISTGT_STATS_PHASES];
+	uint64_t start, done, now;
+	uint64_t bytes;
+	int dir;
+	int error;
+
+	/* ts_recv is cleared once the command is accounted for */
+	if (lu_cmd->ts_recv == 0)
+		return;
+	now = istgt_clock_usec();
+	start = lu_cmd->ts_start;
+	if (start < lu_cmd->ts_recv)
+		start = lu_cmd->ts_recv;
+	done = lu_cmd->ts_done;
+	if (done < start)
+		done = start;
+	if (now < done)
+		now = done;
+	lat[ISTGT_STATS_QUEUE] = start - lu_cmd->ts_recv;
+	lat[ISTGT_STATS_IO] = done - start;
+	lat[ISTGT_STATS_SEND] = now - done;
+	lat[ISTGT_STATS_TOTAL] = now - lu_cmd->ts_recv;
+
+	if (lu_cmd->R_bit) {
+		dir = ISTGT_STATS_READ;
+		bytes = lu_cmd->data_len;
+		if (bytes > lu_cmd->transfer_len)
+			bytes = lu_cmd->transfer_len;
+	} else if (lu_cmd->W_bit) {
+		dir = ISTGT_STATS_WRITE;
+		bytes = lu_cmd->transfer_len;
+	} else {
+		dir = ISTGT_STATS_OTHER;
+		bytes = 0;
+	}
+	error = (!sent || lu_cmd->status != ISTGT_SCSI_STATUS_GOOD);
+	if (error)
+		bytes = 0;
+
+	if (conn != NULL && conn->sess != NULL) {
+		istgt_stats_end(conn->sess->stats, dir, bytes, error,
+		    sent ? lat : NULL);
+	}
+	istgt_stats_end(istgt_lu_stats_lun(lu_cmd), dir, bytes, error,
+	    sent ? lat : NULL);
+	lu_cmd->ts_recv = 0;
+}
+
+ISTGT_LU_TASK_POOL *
+istgt_lu_task_pool_create(void)
+{
+	ISTGT_LU_TASK_POOL *pool;
+	int rc;
+	int i;
+
+	pool = xmalloc(sizeof *pool);
+	memset(pool, 0, sizeof *pool);
+	rc = pthread_mutex_init(&pool->mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("mutex_init() failed\n");
+		xfree(pool);
+		/* allocate without pool */
+		return NULL;
+	}
+	pool->refcnt = 1;
+	pool->ntasks = 0;
+	pool->tasks = NULL;
+	pool->nbytes = 0;
+	for (i = 0; i < ISTGT_LU_TASK_POOL_CLASSES; i++) {
+		pool->nbufs[i] = 0;
+		pool->bufs[i] = NULL;
+	}
+	return pool;
+}
+
+static void
+istgt_lu_task_pool_free(ISTGT_LU_TASK_POOL *pool)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	void *buf;
+	int i;
+
+	while (pool->tasks != NULL) {
+		lu_task = pool->tasks;
+		pool->tasks = lu_task->pool_next;
+		xfree(lu_task->lu_cmd.pdu);
+		xfree(lu_task);
+	}
+	for (i = 0; i < ISTGT_LU_TASK_POOL_CLASSES; i++) {
+		while (pool->bufs[i] != NULL) {
+			buf = pool->bufs[i];
+			pool->bufs[i] = *(void **) buf;
+			xfree(buf);
+		}
+	}
+	(void) pthread_mutex_destroy(&pool->mutex);
+	xfree(pool);
+}
+
+void
+istgt_lu_task_pool_release(ISTGT_LU_TASK_POOL *pool)
+{
+	int refcnt;
+
+	if (pool == NULL)
+		return;
+	MTX_LOCK(&pool->mutex);
+	refcnt = --pool->refcnt;
+	MTX_UNLOCK(&pool->mutex);
+	if (refcnt == 0) {
+		istgt_lu_task_pool_free(pool);
+	}
+}
+
+static int
+istgt_lu_task_pool_class(size_t size)
+{
+	uint64_t class_size;
+	int i;
+
+	class_size = ISTGT_LU_TASK_POOL_MINBUF;
+	for (i = 0; i < ISTGT_LU_TASK_POOL_CLASSES; i++) {
+		if ((uint64_t) size <= class_size)
+			return i;
+		class_size <<= 1;
+	}
+	/* too large for pool */
+	return -1;
+}
+
+static uint8_t *
+istgt_lu_task_pool_get_buf(ISTGT_LU_TASK_POOL *pool, size_t size, size_t *alloc_len)
+{
+	void *buf;
+	int idx;
+
+	idx = istgt_lu_task_pool_class(size);
+	if (pool == NULL || idx < 0) {
+		*alloc_len = size;
+		return xmalloc(size);
+	}
+	*alloc_len = (size_t) (ISTGT_LU_TASK_POOL_MINBUF << idx);
+	MTX_LOCK(&pool->mutex);
+	buf = pool->bufs[idx];
+	if (buf != NULL) {
+		pool->bufs[idx] = *(void **) buf;
+		pool->nbufs[idx]--;
+		pool->nbytes -= *alloc_len;
+	}
+	MTX_UNLOCK(&pool->mutex);
+	if (buf == NULL) {
+		buf = xmalloc(*alloc_len);
+	}
+	return (uint8_t *) buf;
+}
+
+static void
+istgt_lu_task_pool_put_buf(ISTGT_LU_TASK_POOL *pool, uint8_t *buf, size_t alloc_len)
+{
+	int idx;
+
+	if (buf == NULL)
+		return;
+	idx = istgt_lu_task_pool_class(alloc_len);
+	if (pool == NULL || idx < 0
+	    || alloc_len != (size_t) (ISTGT_LU_TASK_POOL_MINBUF << idx)) {
+		xfree(buf);
+		return;
+	}
+	MTX_LOCK(&pool->mutex);
+	if (pool->nbytes + alloc_len > ISTGT_LU_TASK_POOL_MAXBYTES) {
+		MTX_UNLOCK(&pool->mutex);
+		xfree(buf);
+		return;
+	}
+	*(void **) buf = pool->bufs[idx];
+	pool->bufs[idx] = buf;
+	pool->nbufs[idx]++;
+	pool->nbytes += alloc_len;
+	MTX_UNLOCK(&pool->mutex);
+}
+
+ISTGT_LU_TASK_Ptr
+istgt_lu_alloc_task(CONN_Ptr conn)
+{
+	ISTGT_LU_TASK_POOL *pool;
+	ISTGT_LU_TASK_Ptr lu_task;
+	ISCSI_PDU_Ptr pdu;
+
+	pool = conn->task_pool;
+	lu_task = NULL;
+	if (pool != NULL) {
+		MTX_LOCK(&pool->mutex);
+		lu_task = pool->tasks;
+		if (lu_task != NULL) {
+			pool->tasks = lu_task->pool_next;
+			pool->ntasks--;
+		}
+		/* released by istgt_lu_destroy_task() */
+		pool->refcnt++;
+		MTX_UNLOCK(&pool->mutex);
+	}
+	if (lu_task != NULL) {
+		/* keep PDU of recycled task */
+		pdu = lu_task->lu_cmd.pdu;
+	} else {
+		lu_task = xmalloc(sizeof *lu_task);
+		pdu = NULL;
+	}
+	memset(lu_task, 0, sizeof *lu_task);
+	lu_task->lu_cmd.pdu = pdu;
+	lu_task->pool = pool;
+	return lu_task;
+}
+
 int
 istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr lu_task, int lun)
 {
@@ -2865,8 +3469,11 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr l
 	    sizeof lu_task->initiator_port);
 
 	lu_task->lun = (int) lun;
+	lu_task->qos = conn->qos;
+	lu_task->ts_throttle = 0;
 	lu_task->use_cond = 0;
 	lu_task->dup_iobuf = 0;
+	lu_task->hold_slot = 0;
 	lu_task->iobuf = NULL;
 	lu_task->data = NULL;
 	lu_task->sense_data = NULL;
@@ -2900,7 +3507,9 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr l
 	}
 #endif
 
-	lu_task->lu_cmd.pdu = xmalloc(sizeof *lu_task->lu_cmd.pdu);
+	if (lu_task->lu_cmd.pdu == NULL) {
+		lu_task->lu_cmd.pdu = xmalloc(sizeof *lu_task->lu_cmd.pdu);
+	}
 	memset(lu_task->lu_cmd.pdu, 0, sizeof *lu_task->lu_cmd.pdu);
 
 	/* copy PDU */
@@ -2951,6 +3560,18 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr l
 
 	/* pre allocate buffer */
 	lu_task->lu_cmd.iobufsize = lu_cmd->transfer_len + 65536;
+	lu_task->lu_cmd.zcopy = 0;
+	lu_task->lu_cmd.zcopy_fd = -1;
+#ifdef ISTGT_USE_SENDFILE
+	if (lu_cmd->R_bit && conn->data_digest == 0
+	    && lu_cmd->lu != NULL && lu_cmd->lu->type == ISTGT_LU_TYPE_DISK
+	    && lu_cmd->lu->lun[lun].zerocopy
+	    && (cdb[0] == SBC_READ_6 || cdb[0] == SBC_READ_10
+		|| cdb[0] == SBC_READ_12 || cdb[0] == SBC_READ_16)) {
+		/* data is sent from backing store by sender */
+		lu_task->lu_cmd.iobufsize = 0;
+	}
+#endif /* ISTGT_USE_SENDFILE */
 #if 0
 	lu_task->data = xmalloc(lu_cmd->alloc_len);
 	lu_task->sense_data = xmalloc(lu_cmd->sense_alloc_len);
@@ -2959,10 +3580,10 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr l
 	alloc_len = ISCSI_ALIGN(lu_cmd->alloc_len);
 	alloc_len += ISCSI_ALIGN(lu_cmd->sense_alloc_len);
 	alloc_len += ISCSI_ALIGN(lu_task->lu_cmd.iobufsize);
-	lu_task->data = xmalloc(alloc_len);
+	lu_task->data = istgt_lu_task_pool_get_buf(lu_task->pool,
+	    (size_t) alloc_len, &lu_task->alloc_len);
 	lu_task->sense_data = lu_task->data + ISCSI_ALIGN(lu_cmd->alloc_len);
 	lu_task->iobuf = lu_task->sense_data + ISCSI_ALIGN(lu_cmd->sense_alloc_len);
-	lu_task->alloc_len = alloc_len;
 #endif
 
 	/* creation time */
@@ -2979,11 +3600,25 @@ istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr l
 int
 istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task)
 {
+	ISTGT_LU_TASK_POOL *pool;
 	int rc;
 
 	if (lu_task == NULL)
 		return -1;
 
+	/* dropped before the response was sent */
+	istgt_lu_stats_update(lu_task->conn, &lu_task->lu_cmd, 0);
+
+	if (lu_task->lu_cmd.zcopy && lu_task->lu_cmd.zcopy_fd >= 0) {
+		close(lu_task->lu_cmd.zcopy_fd);
+		lu_task->lu_cmd.zcopy_fd = -1;
+	}
+	if (lu_task->hold_slot) {
+		/* DATA-IN is sent, the LBA range may be written now */
+		istgt_lu_disk_queue_release_task(lu_task);
+		lu_task->hold_slot = 0;
+	}
+
 	if (lu_task->use_cond != 0) {
 		rc = pthread_mutex_destroy(&lu_task->trans_mutex);
 		if (rc != 0) {
@@ -3009,7 +3644,6 @@ istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task)
 				xfree(lu_task->lu_cmd.pdu->data);
 			}
 		}
-		xfree(lu_task->lu_cmd.pdu);
 	}
 #if 0
 	if (lu_task->dup_iobuf == 0) {
@@ -3018,9 +3652,26 @@ istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task)
 	xfree(lu_task->data);
 	xfree(lu_task->sense_data);
 #else
-	xfree(lu_task->data);
+	pool = lu_task->pool;
+	istgt_lu_task_pool_put_buf(pool, lu_task->data, lu_task->alloc_len);
+	lu_task->data = NULL;
 #endif
-	xfree(lu_task);
+	if (pool != NULL) {
+		MTX_LOCK(&pool->mutex);
+		if (pool->ntasks < ISTGT_LU_TASK_POOL_MAXTASK) {
+			/* recycle with PDU */
+			lu_task->pool_next = pool->tasks;
+			pool->tasks = lu_task;
+			pool->ntasks++;
+			lu_task = NULL;
+		}
+		MTX_UNLOCK(&pool->mutex);
+		istgt_lu_task_pool_release(pool);
+	}
+	if (lu_task != NULL) {
+		xfree(lu_task->lu_cmd.pdu);
+		xfree(lu_task);
+	}
 	return 0;
 }
 
@@ -3166,6 +3817,26 @@ istgt_lu_clear_all_task(ISTGT_LU_Ptr lu, uint64_t lun)
 	return 0;
 }
 
+/* called with queue_mutex held, sleep until notified or credit is due */
+static void
+istgt_lu_queue_wait(ISTGT_LU_Ptr lu)
+{
+	struct timespec abstime;
+	uint64_t usec;
+
+	usec = lu->qos_wait;
+	lu->qos_wait = 0;
+	if (usec == 0 || clock_gettime(CLOCK_REALTIME, &abstime) < 0) {
+		pthread_cond_wait(&lu->queue_cond, &lu->queue_mutex);
+		return;
+	}
+	usec += (uint64_t) abstime.tv_nsec / 1000;
+	abstime.tv_sec += (time_t) (usec / 1000000);
+	abstime.tv_nsec = (long) (usec % 1000000) * 1000;
+	(void) pthread_cond_timedwait(&lu->queue_cond, &lu->queue_mutex,
+	    &abstime);
+}
+
 static void *
 luworker(void *arg)
 {
@@ -3176,6 +3847,7 @@ luworker(void *arg)
 	time_t now;
 	int timeout = 20; /* XXX */
 #endif
+	int blocked;
 	int qcnt;
 	int lun;
 	int rc;
@@ -3199,6 +3871,7 @@ luworker(void *arg)
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d loop start\n", lu->num);
 	lun = 0;
 	qcnt = 0;
+	blocked = 0;
 #if 0
 	memset(&abstime, 0, sizeof abstime);
 #endif
@@ -3217,6 +3890,10 @@ luworker(void *arg)
 						MTX_UNLOCK(&lu->queue_mutex);
 						continue;
 					}
+					if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING) {
+						MTX_UNLOCK(&lu->queue_mutex);
+						goto loop_exit;
+					}
 #if 0
 					now = time(NULL);
 					abstime.tv_sec = now + timeout;
@@ -3250,6 +3927,21 @@ luworker(void *arg)
 				rc = istgt_lu_disk_queue_start(lu, lun);
 			}
 			lun++;
+			if (rc == 1) {
+				/* head of queue waits for executing tasks or credit */
+				if (++blocked < lu->maxlun)
+					break;
+				blocked = 0;
+				MTX_LOCK(&lu->queue_mutex);
+				if (lu->queue_check == 0
+				    && istgt_lu_get_state(lu) == ISTGT_STATE_RUNNING) {
+					istgt_lu_queue_wait(lu);
+				}
+				lu->queue_check = 0;
+				MTX_UNLOCK(&lu->queue_mutex);
+				break;
+			}
+			blocked = 0;
 			if (rc == -2) {
 				ISTGT_WARNLOG("LU%d: lu_disk_queue_start() aborted\n",
 				    lu->num);
@@ -30,11 +30,14 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <sys/uio.h>
 #ifdef HAVE_UUID_H
 #include <uuid.h>
 #endif
 #include "istgt.h"
 #include "istgt_queue.h"
+#include "istgt_stats.h"
+#include "istgt_qos.h"
 
 #define MAX_LU_LUN 64
 #define MAX_LU_LUN_SLOT 8
@@ -43,7 +46,18 @@
 #define MAX_LU_SERIAL_STRING 32
 #define MAX_LU_RESERVE 256
 #define MAX_LU_RESERVE_IPT 256
+#define ISTGT_LU_PR_HASH 64
 #define MAX_LU_QUEUE_DEPTH 256
+#define MAX_LU_WORKERS 64
+#define MAX_LU_EXEC MAX_LU_QUEUE_DEPTH
+/* bytes a nexus of QueueWeight 1 may start per round, cost of non-I/O */
+#define ISTGT_LU_DRR_QUANTUM (64 * 1024)
+#define ISTGT_LU_DRR_MINCOST 4096
+#define MAX_LU_WEIGHT 255
+
+#if defined (HAVE_SYS_SENDFILE_H) || defined (__FreeBSD__)
+#define ISTGT_USE_SENDFILE
+#endif
 
 #define USE_LU_TAPE_DLT8000
 
@@ -52,8 +66,10 @@
 #define DEFAULT_LU_BLOCKLEN_DVD 2048
 #define DEFAULT_LU_BLOCKLEN_TAPE DEFAULT_LU_BLOCKLEN
 #define DEFAULT_LU_QUEUE_DEPTH 32
+#define DEFAULT_LU_WORKERS 1
 #define DEFAULT_LU_ROTATIONRATE 7200	/* 7200 rpm */
 #define DEFAULT_LU_FORMFACTOR 0x02	/* 3.5 inch */
+#define DEFAULT_LU_NULL_SIZE (1024ULL * ISTGT_LU_1GB)	/* 1TB */
 
 #if defined (__FreeBSD__)
 #define DEFAULT_LU_VENDOR "FreeBSD"
@@ -94,7 +110,28 @@
 #define ISTGT_LU_WORK_BLOCK_SIZE (1ULL * 1024ULL * 1024ULL)
 #define ISTGT_LU_WORK_ATS_BLOCK_SIZE (1ULL * 1024ULL * 1024ULL)
 #define ISTGT_LU_MAX_WRITE_CACHE_SIZE (8ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_WCACHE_DEFAULTSIZE (64ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_WCACHE_MINSIZE (4ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_WCACHE_FLUSHSIZE (4ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_WCACHE_DIRECTSIZE (1ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_WCACHE_AGE 5	/* seconds */
+#define ISTGT_LU_RCACHE_MINSIZE (4ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_RCACHE_CHUNKSIZE (64ULL * 1024ULL)
+#define ISTGT_LU_RCACHE_RAMIN (128ULL * 1024ULL)
+#define ISTGT_LU_RCACHE_RAMAX (2ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_RCACHE_STREAMS 8
+#define ISTGT_LU_RCACHE_RAQUEUE 16
+#define ISTGT_LU_AMAP_MINCHUNK (4ULL * 1024ULL)
+#define ISTGT_LU_AMAP_MAXCHUNKS (64ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_AMAP_SCANSIZE (64ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_XCOPY_MAX_CSCD 16
+#define ISTGT_LU_XCOPY_MAX_SEGMENT 64
+#define ISTGT_LU_XCOPY_MAX_DESC_LEN 4096
+#define ISTGT_LU_XCOPY_MAX_SEGMENT_LEN (32U * 1024U * 1024U)
+#define ISTGT_LU_XCOPY_CHUNKSIZE (1024U * 1024U)
+#define ISTGT_LU_XCOPY_RESULTS 16
 #define ISTGT_LU_MEDIA_SIZE_MIN (1ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_MAX_UNMAP_DESC 256
 #define ISTGT_LU_MEDIA_EXTEND_UNIT (256ULL * 1024ULL * 1024ULL)
 #define ISTGT_LU_1GB (1ULL * 1024ULL * 1024ULL * 1024ULL)
 #define ISTGT_LU_1MB (1ULL * 1024ULL * 1024ULL)
@@ -130,6 +167,8 @@ typedef struct istgt_lu_storage_t {
 	int fd;
 	char *file;
 	uint64_t size;
+	/* NULL: by extension of file */
+	const char *disktype;
 } ISTGT_LU_STORAGE;
 
 typedef struct istgt_lu_removable_t {
@@ -161,8 +200,13 @@ typedef struct istgt_lu_lun_t {
 	int formfactor;
 	int readcache;
 	int writecache;
+	int asyncio;
+	int zerocopy;
+	uint64_t writeback;
+	int unmap;
 	char *serial;
 	void *spec;
+	ISTGT_STATS_Ptr stats;
 } ISTGT_LU_LUN;
 typedef ISTGT_LU_LUN *ISTGT_LU_LUN_Ptr;
 
@@ -188,6 +232,8 @@ typedef struct istgt_lu_map_t {
 	int pg_tag;
 	int pg_aas;
 	int ig_tag;
+	ISTGT_QOS_Ptr qos;	/* limits of the initiator group, or NULL */
+	int weight;		/* QueueWeight of the initiator group */
 } ISTGT_LU_MAP;
 
 typedef struct istgt_lu_t {
@@ -206,7 +252,7 @@ typedef struct istgt_lu_t {
 	pthread_mutex_t state_mutex;
 	pthread_mutex_t queue_mutex;
 	pthread_cond_t queue_cond;
-	pthread_t thread;
+	pthread_t thread[MAX_LU_WORKERS];
 
 	uint16_t last_tsih;
 
@@ -235,6 +281,16 @@ typedef struct istgt_lu_t {
 	int blocklen;
 	int queue_depth;
 	int queue_check;
+	int luworkers;
+	ISTGT_AFFINITY affinity;
+	ISTGT_CPUSET cpuset;
+	uint64_t readcache_size;
+
+	/* MaxIOPS/MaxBandwidth of the unit and its groups, under qos_mutex */
+	ISTGT_QOS_Ptr qos;
+	int qos_groups;
+	pthread_mutex_t qos_mutex;
+	uint64_t qos_wait;	/* usec until credit, under queue_mutex */
 
 	int maxlun;
 	ISTGT_LU_LUN lun[MAX_LU_LUN];
@@ -242,6 +298,8 @@ typedef struct istgt_lu_t {
 	ISTGT_LU_TSIH tsih[MAX_LU_TSIH];
 	int maxmap;
 	ISTGT_LU_MAP map[MAX_LU_MAP];
+	/* used by EXTENDED COPY of other LUs, protected by mutex */
+	int xcopy_refs;
 } ISTGT_LU;
 typedef ISTGT_LU *ISTGT_LU_Ptr;
 
@@ -270,6 +328,16 @@ typedef struct istgt_lu_cmd_t {
 	uint8_t *sense_data;
 	size_t sense_data_len;
 	size_t sense_alloc_len;
+
+	/* DATA-IN sent by sendfile() from zcopy_fd instead of data */
+	int zcopy;
+	int zcopy_fd;
+	uint64_t zcopy_offset;
+
+	/* istgt_clock_usec() at receive, start and end of execution */
+	uint64_t ts_recv;
+	uint64_t ts_start;
+	uint64_t ts_done;
 } ISTGT_LU_CMD;
 typedef ISTGT_LU_CMD *ISTGT_LU_CMD_Ptr;
 
@@ -285,6 +353,46 @@ enum {
 	ISTGT_LU_TASK_REQUPDPDU = 2,
 } ISTGT_LU_TASK_TYPE;
 
+typedef enum {
+	ISTGT_LU_AIO_NOP = 0,
+	ISTGT_LU_AIO_READ = 1,
+	ISTGT_LU_AIO_WRITE = 2,
+	ISTGT_LU_AIO_SYNC = 3,
+} ISTGT_LU_AIO_OP;
+
+#define ISTGT_LU_AIO_FUA 0x00000001
+
+typedef struct istgt_lu_aio_t {
+	struct istgt_lu_aio_t *next;
+	int op;
+	int flags;
+	int fd;
+	struct iovec iov;
+	uint64_t offset;
+	/* bytes transferred or -errno */
+	int64_t result;
+	void (*done)(struct istgt_lu_aio_t *aio);
+	void *arg;
+} ISTGT_LU_AIO;
+
+#define ISTGT_LU_TASK_POOL_CLASSES 8
+#define ISTGT_LU_TASK_POOL_MINBUF (128ULL * 1024ULL)
+#define ISTGT_LU_TASK_POOL_MAXBYTES (16ULL * 1024ULL * 1024ULL)
+#define ISTGT_LU_TASK_POOL_MAXTASK MAX_LU_QUEUE_DEPTH
+
+/* per connection cache of tasks and I/O buffers */
+typedef struct istgt_lu_task_pool_t {
+	pthread_mutex_t mutex;
+	/* connection and each allocated task */
+	int refcnt;
+	int ntasks;
+	struct istgt_lu_task_t *tasks;
+	/* size-classed buffers, MINBUF << class */
+	uint64_t nbytes;
+	int nbufs[ISTGT_LU_TASK_POOL_CLASSES];
+	void *bufs[ISTGT_LU_TASK_POOL_CLASSES];
+} ISTGT_LU_TASK_POOL;
+
 typedef struct istgt_lu_task_t {
 	int type;
 
@@ -316,6 +424,22 @@ typedef struct istgt_lu_task_t {
 	int execute;
 	int complete;
 	int lock;
+
+	/* asynchronous execution */
+	int slot;
+	ISTGT_LU_AIO aio;
+	/* zero-copy READ keeps the slot until destroyed */
+	int hold_slot;
+
+	/* initiator group limits, and when a limit first put it off */
+	ISTGT_QOS_Ptr qos;
+	uint64_t ts_throttle;
+	/* arrival order in the LUN, 0 for HEAD OF QUEUE */
+	uint64_t seq;
+
+	/* allocated from */
+	ISTGT_LU_TASK_POOL *pool;
+	struct istgt_lu_task_t *pool_next;
 } ISTGT_LU_TASK;
 typedef ISTGT_LU_TASK *ISTGT_LU_TASK_Ptr;
 
@@ -335,6 +459,23 @@ typedef struct istgt_lu_pr_key_t {
 	int all_tpg;
 } ISTGT_LU_PR_KEY;
 
+typedef struct istgt_lu_disk_exec_t {
+	int busy;
+	int barrier;
+	int write;
+	uint64_t lba;
+	uint64_t len;
+} ISTGT_LU_DISK_EXEC;
+
+/* queued tasks of one I_T nexus, scheduled by deficit round robin */
+typedef struct istgt_lu_disk_nexus_t {
+	char initiator_port[MAX_INITIATOR_NAME];
+	ISTGT_QUEUE queue;
+	int weight;
+	int granted;		/* got its quantum this round */
+	int64_t deficit;	/* bytes it may still start */
+} ISTGT_LU_DISK_NEXUS;
+
 typedef struct istgt_lu_disk_t {
 	ISTGT_LU_Ptr lu;
 	int num;
@@ -344,8 +485,8 @@ typedef struct istgt_lu_disk_t {
 	const char *file;
 	const char *disktype;
 	void *exspec;
+	pthread_mutex_t fsize_mutex;
 	uint64_t fsize;
-	uint64_t foffset;
 	uint64_t size;
 	uint64_t blocklen;
 	uint64_t blockcnt;
@@ -367,17 +508,39 @@ typedef struct istgt_lu_disk_t {
 
 	/* thin provisioning */
 	int thin_provisioning;
-
-	/* for ats */
-	pthread_mutex_t ats_mutex;
-	int watssize;
-	uint8_t *watsbuf;
+	/* UNMAP granularity in blocks, zeroed after UNMAP */
+	uint32_t unmap_granularity;
+	int unmap_lbprz;
 
 	int queue_depth;
 	pthread_mutex_t cmd_queue_mutex;
-	ISTGT_QUEUE cmd_queue;
+	/* per nexus queues, protected by cmd_queue_mutex */
+	int queued;
+	int nordered;		/* queued ORDERED/HEAD OF QUEUE/ACA tasks */
+	uint64_t seq;
+	int nnexus;		/* slots in use are below */
+	int drr_cur;
+	ISTGT_LU_DISK_NEXUS nexus[MAX_LU_TSIH];
+	/* executing tasks, protected by cmd_queue_mutex */
+	int nexec;
+	int exec_barrier;
+	ISTGT_LU_DISK_EXEC exec[MAX_LU_EXEC];
 	pthread_mutex_t wait_lu_task_mutex;
-	ISTGT_LU_TASK_Ptr wait_lu_task;
+	ISTGT_LU_TASK_Ptr wait_lu_task[MAX_LU_EXEC];
+	/* shared by parallel I/O, exclusive for reset */
+	pthread_rwlock_t io_rwlock;
+	/* asynchronous I/O engine */
+	void *aio;
+	/* READ by sendfile() if no DataDigest */
+	int zerocopy;
+	/* write-back cache */
+	void *wcache;
+	/* read cache and readahead */
+	void *rcache;
+	/* allocation map of the backing file */
+	void *amap;
+	/* EXTENDED COPY results */
+	void *xcopy;
 
 	/* PERSISTENT RESERVE */
 	int npr_keys;
@@ -389,18 +552,24 @@ typedef struct istgt_lu_disk_t {
 	int rsv_scope;
 	int rsv_type;
 
+	/* registrations by initiator port, rebuilt by PERSISTENT RESERVE OUT */
+	uint32_t pr_epoch;
+	int pr_hash[ISTGT_LU_PR_HASH];
+	int pr_hash_next[MAX_LU_RESERVE];
+
 	/* SCSI sense code */
 	volatile int sense;
 
 	/* entry */
 	int (*open)(struct istgt_lu_disk_t *spec, int flags, int mode);
 	int (*close)(struct istgt_lu_disk_t *spec);
-	int64_t (*seek)(struct istgt_lu_disk_t *spec, uint64_t offset);
-	int64_t (*read)(struct istgt_lu_disk_t *spec, void *buf, uint64_t nbytes);
-	int64_t (*write)(struct istgt_lu_disk_t *spec, const void *buf, uint64_t nbytes);
+	int64_t (*pread)(struct istgt_lu_disk_t *spec, void *buf, uint64_t nbytes, uint64_t offset);
+	int64_t (*pwrite)(struct istgt_lu_disk_t *spec, const void *buf, uint64_t nbytes, uint64_t offset);
 	int64_t (*sync)(struct istgt_lu_disk_t *spec, uint64_t offset, uint64_t nbytes);
 	int (*allocate)(struct istgt_lu_disk_t *spec);
 	int (*setcache)(struct istgt_lu_disk_t *spec);
+	int (*unmap)(struct istgt_lu_disk_t *spec, uint64_t offset, uint64_t nbytes);
+	int (*zero)(struct istgt_lu_disk_t *spec, uint64_t offset, uint64_t nbytes);
 } ISTGT_LU_DISK;
 
 #endif /* ISTGT_LU_H */
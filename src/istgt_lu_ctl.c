@@ -1178,6 +1178,249 @@ istgt_uctl_cmd_info(UCTL_Ptr uctl)
 }
 
 
+static const char *istgt_uctl_stats_phase[ISTGT_STATS_PHASES] = {
+	"queue", "io", "send", "total",
+};
+
+static int
+istgt_uctl_stats_lines(UCTL_Ptr uctl, const char *label, ISTGT_STATS_Ptr stats)
+{
+	ISTGT_STATS_COUNTER snap;
+	uint64_t now;
+	int rc;
+	int i;
+
+	istgt_stats_snapshot(stats, &snap);
+	now = istgt_clock_usec();
+	istgt_uctl_snprintf(uctl, "%s %s time=%"PRIu64"s"
+	    " ops=%"PRIu64"/%"PRIu64"/%"PRIu64
+	    " bytes=%"PRIu64"/%"PRIu64" errors=%"PRIu64" qd=%d/%d\n",
+	    uctl->cmd, label, (uint64_t) ((now - stats->start) / 1000000),
+	    snap.read_ops, snap.write_ops, snap.other_ops,
+	    snap.read_bytes, snap.write_bytes, snap.errors,
+	    __atomic_load_n(&stats->inflight, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->max_inflight, __ATOMIC_RELAXED));
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return rc;
+	}
+	for (i = 0; i < ISTGT_STATS_PHASES; i++) {
+		istgt_uctl_snprintf(uctl, "%s %s %s avg=%"PRIu64
+		    " p50=%"PRIu64" p90=%"PRIu64" p99=%"PRIu64
+		    " p999=%"PRIu64" max=%"PRIu64" usec\n",
+		    uctl->cmd, label, istgt_uctl_stats_phase[i],
+		    istgt_stats_average(&snap, i),
+		    istgt_stats_percentile(&snap, i, 500),
+		    istgt_stats_percentile(&snap, i, 900),
+		    istgt_stats_percentile(&snap, i, 990),
+		    istgt_stats_percentile(&snap, i, 999),
+		    istgt_stats_percentile(&snap, i, 1000));
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+	}
+	return UCTL_CMD_OK;
+}
+
+static int
+istgt_uctl_cmd_stats(UCTL_Ptr uctl)
+{
+	ISTGT_LU_Ptr lu;
+	CONN_Ptr conn;
+	SESS_Ptr sess;
+	const char *delim = ARGS_DELIM;
+	char label[MAX_INITIATOR_NAME + 64];
+	char *arg;
+	char *iqn;
+	int ncount;
+	int rc;
+	int i, j;
+
+	arg = uctl->arg;
+	iqn = strsepq(&arg, delim);
+
+	if (arg != NULL) {
+		istgt_uctl_snprintf(uctl, "ERR invalid parameters\n");
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+		return UCTL_CMD_ERR;
+	}
+
+	ncount = 0;
+	MTX_LOCK(&uctl->istgt->mutex);
+	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+		lu = uctl->istgt->logical_unit[i];
+		if (lu == NULL)
+			continue;
+		if (iqn != NULL && strcasecmp(iqn, lu->name) != 0)
+			continue;
+
+		istgt_lock_gconns();
+		MTX_LOCK(&lu->mutex);
+		/* per LUN */
+		for (j = 0; j < lu->maxlun; j++) {
+			if (lu->lun[j].stats == NULL)
+				continue;
+			snprintf(label, sizeof label, "LU%d LUN%d", lu->num, j);
+			rc = istgt_uctl_stats_lines(uctl, label, lu->lun[j].stats);
+			if (rc != UCTL_CMD_OK) {
+				MTX_UNLOCK(&lu->mutex);
+				istgt_unlock_gconns();
+				MTX_UNLOCK(&uctl->istgt->mutex);
+				return rc;
+			}
+			ncount++;
+		}
+		/* per session */
+		for (j = 1; j < MAX_LU_TSIH; j++) {
+			if (lu->tsih[j].initiator_port != NULL
+				&& lu->tsih[j].tsih != 0) {
+				conn = istgt_find_conn(lu->tsih[j].initiator_port,
+				    lu->name, lu->tsih[j].tsih);
+				if (conn == NULL || conn->sess == NULL)
+					continue;
+
+				sess = conn->sess;
+				if (sess->stats == NULL)
+					continue;
+				snprintf(label, sizeof label, "LU%d %s TSIH=%u",
+				    lu->num, sess->initiator_port, sess->tsih);
+				rc = istgt_uctl_stats_lines(uctl, label, sess->stats);
+				if (rc != UCTL_CMD_OK) {
+					MTX_UNLOCK(&lu->mutex);
+					istgt_unlock_gconns();
+					MTX_UNLOCK(&uctl->istgt->mutex);
+					return rc;
+				}
+				ncount++;
+			}
+		}
+		MTX_UNLOCK(&lu->mutex);
+		istgt_unlock_gconns();
+	}
+	MTX_UNLOCK(&uctl->istgt->mutex);
+	if (ncount == 0) {
+		istgt_uctl_snprintf(uctl, "%s no unit\n", uctl->cmd);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+	}
+
+	/* stats succeeded */
+	istgt_uctl_snprintf(uctl, "OK %s\n", uctl->cmd);
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return rc;
+	}
+	return UCTL_CMD_OK;
+}
+
+static int
+istgt_uctl_qos_line(UCTL_Ptr uctl, const char *label, ISTGT_QOS_Ptr qos, uint64_t now)
+{
+	ISTGT_QOS snap;
+
+	istgt_qos_snapshot(qos, now, &snap);
+	istgt_uctl_snprintf(uctl, "%s %s iops=%"PRIu64"/%"PRIu64
+	    " bandwidth=%"PRIu64"/%"PRIu64
+	    " credit=%"PRId64"/%"PRId64
+	    " admitted=%"PRIu64" delayed=%"PRIu64" avgdelay=%"PRIu64"usec\n",
+	    uctl->cmd, label,
+	    snap.iops.rate, snap.iops.burst,
+	    snap.bps.rate, snap.bps.burst,
+	    snap.iops.credit / (int64_t) ISTGT_QOS_USEC,
+	    snap.bps.credit / (int64_t) ISTGT_QOS_USEC,
+	    snap.admitted, snap.delayed,
+	    (snap.delayed != 0) ? snap.delay_usec / snap.delayed : 0);
+	return istgt_uctl_writeline(uctl);
+}
+
+static int
+istgt_uctl_cmd_qos(UCTL_Ptr uctl)
+{
+	ISTGT_LU_Ptr lu;
+	const char *delim = ARGS_DELIM;
+	char label[MAX_TMPBUF];
+	char *arg;
+	char *iqn;
+	uint64_t now;
+	int ncount;
+	int rc;
+	int i, j;
+
+	arg = uctl->arg;
+	iqn = strsepq(&arg, delim);
+
+	if (arg != NULL) {
+		istgt_uctl_snprintf(uctl, "ERR invalid parameters\n");
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+		return UCTL_CMD_ERR;
+	}
+
+	ncount = 0;
+	MTX_LOCK(&uctl->istgt->mutex);
+	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+		lu = uctl->istgt->logical_unit[i];
+		if (lu == NULL)
+			continue;
+		if (iqn != NULL && strcasecmp(iqn, lu->name) != 0)
+			continue;
+		if (lu->qos == NULL && lu->qos_groups == 0)
+			continue;
+
+		MTX_LOCK(&lu->qos_mutex);
+		now = istgt_clock_usec();
+		if (lu->qos != NULL) {
+			snprintf(label, sizeof label, "LU%d", lu->num);
+			rc = istgt_uctl_qos_line(uctl, label, lu->qos, now);
+			if (rc != UCTL_CMD_OK) {
+				MTX_UNLOCK(&lu->qos_mutex);
+				MTX_UNLOCK(&uctl->istgt->mutex);
+				return rc;
+			}
+			ncount++;
+		}
+		for (j = 0; j < lu->maxmap; j++) {
+			if (lu->map[j].qos == NULL)
+				continue;
+			snprintf(label, sizeof label, "LU%d InitiatorGroup%d",
+			    lu->num, lu->map[j].ig_tag);
+			rc = istgt_uctl_qos_line(uctl, label, lu->map[j].qos, now);
+			if (rc != UCTL_CMD_OK) {
+				MTX_UNLOCK(&lu->qos_mutex);
+				MTX_UNLOCK(&uctl->istgt->mutex);
+				return rc;
+			}
+			ncount++;
+		}
+		MTX_UNLOCK(&lu->qos_mutex);
+	}
+	MTX_UNLOCK(&uctl->istgt->mutex);
+	if (ncount == 0) {
+		istgt_uctl_snprintf(uctl, "%s no limit\n", uctl->cmd);
+		rc = istgt_uctl_writeline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+	}
+
+	/* qos succeeded */
+	istgt_uctl_snprintf(uctl, "OK %s\n", uctl->cmd);
+	rc = istgt_uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return rc;
+	}
+	return UCTL_CMD_OK;
+}
+
+
 typedef struct istgt_uctl_cmd_table_t
 {
 	const char *name;
@@ -1196,6 +1439,8 @@ static ISTGT_UCTL_CMD_TABLE istgt_uctl_cmd_table[] =
 	{ "CHANGE",  istgt_uctl_cmd_change },
 	{ "RESET",   istgt_uctl_cmd_reset },
 	{ "INFO",    istgt_uctl_cmd_info },
+	{ "STATS",   istgt_uctl_cmd_stats },
+	{ "QOS",     istgt_uctl_cmd_qos },
 	{ NULL,      NULL },
 };
 
@@ -34,12 +34,22 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_DISK_H
+#include <sys/disk.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #ifdef HAVE_UUID_H
 #include <uuid.h>
@@ -104,8 +114,12 @@ typedef enum {
 	} while (0)
 
 static void istgt_lu_disk_free_pr_key(ISTGT_LU_PR_KEY *prkey);
+static void istgt_lu_disk_pr_rehash(ISTGT_LU_DISK *spec);
 static int istgt_lu_disk_build_sense_data(ISTGT_LU_DISK *spec, uint8_t *data, int sk, int asc, int ascq);
 static int istgt_lu_disk_queue_abort_ITL(ISTGT_LU_DISK *spec, const char *initiator_port);
+static void istgt_lu_disk_queue_init(ISTGT_LU_DISK *spec);
+static void istgt_lu_disk_queue_destroy(ISTGT_LU_DISK *spec);
+static int istgt_lu_disk_queue_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task);
 
 static int
 istgt_lu_disk_open_raw(ISTGT_LU_DISK *spec, int flags, int mode)
@@ -117,7 +131,6 @@ istgt_lu_disk_open_raw(ISTGT_LU_DISK *spec, int flags, int mode)
 		return -1;
 	}
 	spec->fd = rc;
-	spec->foffset = 0;
 	return 0;
 }
 
@@ -133,107 +146,92 @@ istgt_lu_disk_close_raw(ISTGT_LU_DISK *spec)
 		return -1;
 	}
 	spec->fd = -1;
-	spec->foffset = 0;
 	return 0;
 }
 
-#if 0
-static off_t
-istgt_lu_disk_lseek_raw(ISTGT_LU_DISK *spec, off_t offset, int whence)
-{
-	off_t rc;
-
-	rc = lseek(spec->fd, offset, whence);
-	if (rc < 0) {
-		return -1;
-	}
-	spec->foffset = offset;
-	return rc;
-}
-#endif
-
-static int64_t
-istgt_lu_disk_seek_raw(ISTGT_LU_DISK *spec, uint64_t offset)
+static void
+istgt_lu_disk_update_fsize(ISTGT_LU_DISK *spec, uint64_t end)
 {
-	off_t rc;
-
-	rc = lseek(spec->fd, (off_t) offset, SEEK_SET);
-	if (rc < 0) {
-		return -1;
+	/* writes may run in parallel */
+	MTX_LOCK(&spec->fsize_mutex);
+	if (end > spec->fsize) {
+		spec->fsize = end;
 	}
-	spec->foffset = offset;
-	return 0;
+	MTX_UNLOCK(&spec->fsize_mutex);
 }
 
 static int64_t
-istgt_lu_disk_read_raw(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes)
+istgt_lu_disk_pread_raw(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
 {
 	int64_t rc;
 
 	if (spec->lu->istgt->swmode >= ISTGT_SWMODE_EXPERIMENTAL) {
-		if (spec->foffset + nbytes <= spec->fsize) {
+		uint64_t fsize = spec->fsize;
+
+		if (offset + nbytes <= fsize) {
 			/* inside media */
-			rc = (int64_t) read(spec->fd, buf, (size_t) nbytes);
-		} else if (spec->foffset >= spec->fsize) {
+			rc = (int64_t) pread(spec->fd, buf, (size_t) nbytes,
+			    (off_t) offset);
+		} else if (offset >= fsize) {
 			/* outside media */
 			memset(buf, 0, nbytes);
 			rc = nbytes;
-			if (spec->foffset + nbytes >= spec->size) {
-				rc = spec->size - spec->foffset;
+			if (offset + nbytes >= spec->size) {
+				rc = spec->size - offset;
 			}
-		} else if (spec->foffset + nbytes > spec->fsize) {
+		} else {
 			/* both */
-			uint64_t request = spec->fsize - spec->foffset;
+			uint64_t request = fsize - offset;
 			memset(buf, 0, nbytes);
 			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
 			    "read %"PRIu64" bytes at %"PRIu64"/%"PRIu64"\n",
-				    request, spec->foffset, spec->fsize);
-			rc = (int64_t) read(spec->fd, buf, (size_t) request);
+			    request, offset, fsize);
+			rc = (int64_t) pread(spec->fd, buf, (size_t) request,
+			    (off_t) offset);
 			if (rc < 0) {
 				return -1;
 			}
 			if ((uint64_t) rc != request) {
 				/* read size < request */
-				if (spec->foffset + rc >= spec->size) {
-					rc = spec->size - spec->foffset;
+				if (offset + rc >= spec->size) {
+					rc = spec->size - offset;
 				}
-				spec->foffset += rc;
 				return rc;
 			}
 			rc = nbytes;
-			if (spec->foffset + nbytes >= spec->size) {
-				rc = spec->size - spec->foffset;
+			if (offset + nbytes >= spec->size) {
+				rc = spec->size - offset;
 			}
-		} else {
-			rc = -1;
 		}
 		if (rc < 0) {
 			return -1;
 		}
-		spec->foffset += rc;
 		return rc;
 	}
-	rc = (int64_t) read(spec->fd, buf, (size_t) nbytes);
+	rc = (int64_t) pread(spec->fd, buf, (size_t) nbytes, (off_t) offset);
 	if (rc < 0) {
 		return -1;
 	}
-	spec->foffset += rc;
 	return rc;
 }
 
 static int64_t
-istgt_lu_disk_write_raw(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes)
+istgt_lu_disk_pwrite_raw(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
 {
 	int64_t rc;
 
 	if (spec->lu->istgt->swmode >= ISTGT_SWMODE_EXPERIMENTAL) {
-		if (spec->foffset + nbytes <= spec->fsize) {
+		uint64_t fsize = spec->fsize;
+
+		if (offset + nbytes <= fsize) {
 			/* inside media */
-			rc = (int64_t) write(spec->fd, buf, (size_t) nbytes);
-		} else if (spec->foffset + nbytes <= ISTGT_LU_MEDIA_SIZE_MIN) {
+			rc = (int64_t) pwrite(spec->fd, buf, (size_t) nbytes,
+			    (off_t) offset);
+		} else if (offset + nbytes <= ISTGT_LU_MEDIA_SIZE_MIN) {
 			/* allways write in minimum size */
-			rc = (int64_t) write(spec->fd, buf, (size_t) nbytes);
-		} else if (spec->foffset >= spec->fsize) {
+			rc = (int64_t) pwrite(spec->fd, buf, (size_t) nbytes,
+			    (off_t) offset);
+		} else if (offset >= fsize) {
 			/* outside media */
 			const uint8_t *p = (const uint8_t *) buf;
 			uint64_t n;
@@ -245,43 +243,35 @@ istgt_lu_disk_write_raw(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes)
 				/* write all zero (skip) */
 				ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
 				    "write zero %"PRIu64" bytes at %"PRIu64"/%"PRIu64"\n",
-				    nbytes, spec->foffset, spec->fsize);
-				rc = nbytes;
-				spec->foffset += rc;
-				return rc;
+				    nbytes, offset, fsize);
+				return (int64_t) nbytes;
 			}
 			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
 			    "write %"PRIu64" bytes at %"PRIu64"/%"PRIu64"\n",
-			    nbytes, spec->foffset, spec->fsize);
-			rc = (int64_t) write(spec->fd, buf, (size_t) nbytes);
-		} else if (spec->foffset + nbytes > spec->fsize) {
-			/* both */
-			rc = (int64_t) write(spec->fd, buf, (size_t) nbytes);
+			    nbytes, offset, fsize);
+			rc = (int64_t) pwrite(spec->fd, buf, (size_t) nbytes,
+			    (off_t) offset);
 		} else {
-			rc = -1;
+			/* both */
+			rc = (int64_t) pwrite(spec->fd, buf, (size_t) nbytes,
+			    (off_t) offset);
 		}
 		if (rc < 0) {
 			return -1;
 		}
-		spec->foffset += rc;
-		if (spec->foffset > spec->fsize) {
-			spec->fsize = spec->foffset;
-		}
+		istgt_lu_disk_update_fsize(spec, offset + rc);
 		return rc;
 	}
-	rc = (int64_t) write(spec->fd, buf, (size_t) nbytes);
+	rc = (int64_t) pwrite(spec->fd, buf, (size_t) nbytes, (off_t) offset);
 	if (rc < 0) {
 		return -1;
 	}
-	spec->foffset += rc;
-	if (spec->foffset > spec->fsize) {
-		spec->fsize = spec->foffset;
-	}
+	istgt_lu_disk_update_fsize(spec, offset + rc);
 	return rc;
 }
 
 static int64_t
-istgt_lu_disk_sync_raw(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+istgt_lu_disk_sync_raw(ISTGT_LU_DISK *spec, uint64_t offset __attribute__((__unused__)), uint64_t nbytes __attribute__((__unused__)))
 {
 	int64_t rc;
 
@@ -289,7 +279,6 @@ istgt_lu_disk_sync_raw(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
 	if (rc < 0) {
 		return -1;
 	}
-	spec->foffset = offset + nbytes;
 	return rc;
 }
 
@@ -318,13 +307,7 @@ istgt_lu_disk_allocate_raw(ISTGT_LU_DISK *spec)
 	spec->fsize = fsize;
 
 	offset = size - nbytes;
-	rc = istgt_lu_disk_seek_raw(spec, offset);
-	if (rc == -1) {
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		xfree(data);
-		return -1;
-	}
-	rc = istgt_lu_disk_read_raw(spec, data, nbytes);
+	rc = istgt_lu_disk_pread_raw(spec, data, nbytes, offset);
 	/* EOF is OK */
 	if (rc == -1) {
 		ISTGT_ERRLOG("lu_disk_read() failed\n");
@@ -339,36 +322,22 @@ istgt_lu_disk_allocate_raw(ISTGT_LU_DISK *spec)
 				fsize = size;
 			}
 			offset = fsize - nbytes;
-			rc = istgt_lu_disk_seek_raw(spec, offset);
-			if (rc == -1) {
-				ISTGT_ERRLOG("lu_disk_seek() failed\n");
-				xfree(data);
-				return -1;
-			}
-			rc = istgt_lu_disk_write_raw(spec, data, nbytes);
+			rc = istgt_lu_disk_pwrite_raw(spec, data, nbytes, offset);
 			if (rc == -1 || (uint64_t) rc != nbytes) {
 				ISTGT_ERRLOG("lu_disk_write() failed\n");
 				xfree(data);
 				return -1;
 			}
 			spec->fsize = fsize;
-			spec->foffset = fsize;
 		}
 	} else {
 		/* allocate complete size */
-		rc = istgt_lu_disk_seek_raw(spec, offset);
-		if (rc == -1) {
-			ISTGT_ERRLOG("lu_disk_seek() failed\n");
-			xfree(data);
-			return -1;
-		}
-		rc = istgt_lu_disk_write_raw(spec, data, nbytes);
+		rc = istgt_lu_disk_pwrite_raw(spec, data, nbytes, offset);
 		if (rc == -1 || (uint64_t) rc != nbytes) {
 			ISTGT_ERRLOG("lu_disk_write() failed\n");
 			xfree(data);
 			return -1;
 		}
-		spec->foffset = size;
 	}
 
 	xfree(data);
@@ -414,6 +383,158 @@ istgt_lu_disk_setcache_raw(ISTGT_LU_DISK *spec)
 	return 0;
 }
 
+static int
+istgt_lu_disk_unmap_raw(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	struct stat st;
+	int rc;
+
+	rc = fstat(spec->fd, &st);
+	if (rc < 0) {
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+#if defined (FALLOC_FL_PUNCH_HOLE) && defined (FALLOC_FL_KEEP_SIZE)
+		rc = fallocate(spec->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    (off_t) offset, (off_t) nbytes);
+#elif defined (SPACECTL_DEALLOC)
+		struct spacectl_range range;
+
+		range.r_offset = (off_t) offset;
+		range.r_len = (off_t) nbytes;
+		rc = fspacectl(spec->fd, SPACECTL_DEALLOC, &range, 0, NULL);
+#else
+		errno = EOPNOTSUPP;
+		rc = -1;
+#endif
+	} else {
+#if defined (BLKDISCARD)
+		uint64_t range[2];
+
+		range[0] = offset;
+		range[1] = nbytes;
+		rc = ioctl(spec->fd, BLKDISCARD, &range);
+#elif defined (DIOCGDELETE)
+		off_t range[2];
+
+		range[0] = (off_t) offset;
+		range[1] = (off_t) nbytes;
+		rc = ioctl(spec->fd, DIOCGDELETE, range);
+#else
+		errno = EOPNOTSUPP;
+		rc = -1;
+#endif
+	}
+	if (rc < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+istgt_lu_disk_zero_raw(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	struct stat st;
+	int rc;
+
+	rc = fstat(spec->fd, &st);
+	if (rc < 0) {
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+#if defined (FALLOC_FL_ZERO_RANGE) && defined (FALLOC_FL_KEEP_SIZE)
+		/* keep the blocks allocated, only mark them as zero */
+		rc = fallocate(spec->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		    (off_t) offset, (off_t) nbytes);
+#else
+		errno = EOPNOTSUPP;
+		rc = -1;
+#endif
+	} else {
+#if defined (BLKZEROOUT)
+		uint64_t range[2];
+
+		range[0] = offset;
+		range[1] = nbytes;
+		rc = ioctl(spec->fd, BLKZEROOUT, &range);
+#else
+		errno = EOPNOTSUPP;
+		rc = -1;
+#endif
+	}
+	if (rc < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+istgt_lu_disk_setunmap_raw(ISTGT_LU_DISK *spec)
+{
+	struct stat st;
+	uint64_t granularity;
+	int supported;
+	int rc;
+
+	rc = fstat(spec->fd, &st);
+	if (rc < 0) {
+		return -1;
+	}
+	supported = 0;
+	granularity = 0;
+	if (S_ISREG(st.st_mode)) {
+#if (defined (FALLOC_FL_PUNCH_HOLE) && defined (FALLOC_FL_KEEP_SIZE)) \
+	|| defined (SPACECTL_DEALLOC)
+		/* a hole past EOF keeps the data, but the fs must support it */
+		rc = istgt_lu_disk_unmap_raw(spec, (uint64_t) st.st_size,
+		    (uint64_t) st.st_blksize);
+		if (rc < 0) {
+			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+			    "punch hole failed (errno=%d)\n", errno);
+			return -1;
+		}
+		/* hole is read as zero */
+		supported = 1;
+		granularity = (uint64_t) st.st_blksize;
+		spec->unmap_lbprz = 1;
+#endif
+	} else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+#if defined (BLKDISCARD)
+		supported = 1;
+#ifdef BLKPBSZGET
+		{
+			unsigned int pbsz;
+			rc = ioctl(spec->fd, BLKPBSZGET, &pbsz);
+			if (rc != -1) {
+				granularity = (uint64_t) pbsz;
+			}
+		}
+#endif /* BLKPBSZGET */
+#elif defined (DIOCGDELETE)
+		supported = 1;
+#ifdef DIOCGSTRIPESIZE
+		{
+			off_t stripesize;
+			rc = ioctl(spec->fd, DIOCGSTRIPESIZE, &stripesize);
+			if (rc != -1) {
+				granularity = (uint64_t) stripesize;
+			}
+		}
+#endif /* DIOCGSTRIPESIZE */
+#endif
+		/* contents after discard depends on the device */
+		spec->unmap_lbprz = 0;
+	}
+	if (!supported) {
+		return -1;
+	}
+	spec->unmap_granularity = (uint32_t) (granularity / spec->blocklen);
+	if (spec->unmap_granularity == 0) {
+		spec->unmap_granularity = 1;
+	}
+	return 0;
+}
+
 static const char *
 istgt_get_disktype_by_ext(const char *file)
 {
@@ -505,14 +626,21 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		spec->req_write_cache = 0;
 		spec->err_write_cache = 0;
 		spec->thin_provisioning = 0;
-		spec->watssize = 0;
-		spec->watsbuf = NULL;
+		spec->unmap_granularity = 0;
+		spec->unmap_lbprz = 0;
+		spec->unmap = NULL;
+		spec->zero = NULL;
 
-		rc = pthread_mutex_init(&spec->ats_mutex, NULL);
+		rc = pthread_mutex_init(&spec->fsize_mutex, NULL);
 		if (rc != 0) {
 			ISTGT_ERRLOG("LU%d: mutex_init() failed\n", lu->num);
 			return -1;
 		}
+		rc = pthread_rwlock_init(&spec->io_rwlock, NULL);
+		if (rc != 0) {
+			ISTGT_ERRLOG("LU%d: rwlock_init() failed\n", lu->num);
+			return -1;
+		}
 
 		spec->queue_depth = lu->queue_depth;
 		rc = pthread_mutex_init(&spec->cmd_queue_mutex, &istgt->mutex_attr);
@@ -520,13 +648,19 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			ISTGT_ERRLOG("LU%d: mutex_init() failed\n", lu->num);
 			return -1;
 		}
-		istgt_queue_init(&spec->cmd_queue);
+		istgt_lu_disk_queue_init(spec);
 		rc = pthread_mutex_init(&spec->wait_lu_task_mutex, NULL);
 		if (rc != 0) {
 			ISTGT_ERRLOG("LU%d: mutex_init() failed\n", lu->num);
 			return -1;
 		}
-		spec->wait_lu_task = NULL;
+		spec->nexec = 0;
+		spec->exec_barrier = 0;
+		spec->aio = NULL;
+		for (j = 0; j < MAX_LU_EXEC; j++) {
+			spec->exec[j].busy = 0;
+			spec->wait_lu_task[j] = NULL;
+		}
 
 		spec->npr_keys = 0;
 		/* spec is cleared, only pointer is handled */
@@ -540,6 +674,7 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		spec->rsv_key = 0;
 		spec->rsv_scope = 0;
 		spec->rsv_type = 0;
+		istgt_lu_disk_pr_rehash(spec);
 
 		spec->sense = 0;
 		{
@@ -559,8 +694,9 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			ISTGT_ERRLOG("LU%d: LUN%d: uuid_create() failed\n", lu->num, i);
 			(void) pthread_mutex_destroy(&spec->wait_lu_task_mutex);
 			(void) pthread_mutex_destroy(&spec->cmd_queue_mutex);
-			(void) pthread_mutex_destroy(&spec->ats_mutex);
-			istgt_queue_destroy(&spec->cmd_queue);
+			(void) pthread_rwlock_destroy(&spec->io_rwlock);
+			(void) pthread_mutex_destroy(&spec->fsize_mutex);
+			istgt_lu_disk_queue_destroy(spec);
 			xfree(spec);
 			return -1;
 		}
@@ -568,7 +704,11 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 
 		spec->file = lu->lun[i].u.storage.file;
 		spec->size = lu->lun[i].u.storage.size;
-		spec->disktype = istgt_get_disktype_by_ext(spec->file);
+		if (lu->lun[i].u.storage.disktype != NULL) {
+			spec->disktype = lu->lun[i].u.storage.disktype;
+		} else {
+			spec->disktype = istgt_get_disktype_by_ext(spec->file);
+		}
 		if (strcasecmp(spec->disktype, "VDI") == 0
 		    || strcasecmp(spec->disktype, "VHD") == 0
 		    || strcasecmp(spec->disktype, "VMDK") == 0
@@ -581,12 +721,19 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 				    lu->num, i);
 				goto error_return;
 			}
+		} else if (strcasecmp(spec->disktype, "NULL") == 0
+		    || strcasecmp(spec->disktype, "MEMORY") == 0) {
+			rc = istgt_lu_disk_mem_lun_init(spec, istgt, lu);
+			if (rc < 0) {
+				ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_mem_lun_init() failed\n",
+				    lu->num, i);
+				goto error_return;
+			}
 		} else if (strcasecmp(spec->disktype, "RAW") == 0) {
 			spec->open = istgt_lu_disk_open_raw;
 			spec->close = istgt_lu_disk_close_raw;
-			spec->seek = istgt_lu_disk_seek_raw;
-			spec->read = istgt_lu_disk_read_raw;
-			spec->write = istgt_lu_disk_write_raw;
+			spec->pread = istgt_lu_disk_pread_raw;
+			spec->pwrite = istgt_lu_disk_pwrite_raw;
 			spec->sync = istgt_lu_disk_sync_raw;
 			spec->allocate = istgt_lu_disk_allocate_raw;
 			spec->setcache = istgt_lu_disk_setcache_raw;
@@ -608,8 +755,9 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 			error_return:
 				(void) pthread_mutex_destroy(&spec->wait_lu_task_mutex);
 				(void) pthread_mutex_destroy(&spec->cmd_queue_mutex);
-				(void) pthread_mutex_destroy(&spec->ats_mutex);
-				istgt_queue_destroy(&spec->cmd_queue);
+				(void) pthread_rwlock_destroy(&spec->io_rwlock);
+				(void) pthread_mutex_destroy(&spec->fsize_mutex);
+				istgt_lu_disk_queue_destroy(spec);
 				xfree(spec);
 				return -1;
 			}
@@ -659,11 +807,64 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 				ISTGT_ERRLOG("LU%d: LUN%d: setcache error\n", lu->num, i);
 				goto error_return;
 			}
+			if (lu->lun[i].unmap && !lu->readonly) {
+				rc = istgt_lu_disk_setunmap_raw(spec);
+				if (rc < 0) {
+					ISTGT_WARNLOG("LU%d: LUN%d: UNMAP not supported\n",
+					    lu->num, i);
+				} else {
+					spec->unmap = istgt_lu_disk_unmap_raw;
+					spec->thin_provisioning = 1;
+				}
+			}
+			if (!lu->readonly
+			    && lu->istgt->swmode < ISTGT_SWMODE_EXPERIMENTAL) {
+				/* fsize is not tracked for zeroing */
+				spec->zero = istgt_lu_disk_zero_raw;
+			}
 		} else {
 			ISTGT_ERRLOG("LU%d: LUN%d: unsupported format\n", lu->num, i);
 			goto error_return;
 		}
 
+		spec->zerocopy = 0;
+		if (lu->lun[i].zerocopy) {
+#ifdef ISTGT_USE_SENDFILE
+			if (strcasecmp(spec->disktype, "RAW") == 0) {
+				spec->zerocopy = 1;
+			} else {
+				ISTGT_WARNLOG("LU%d: LUN%d: zero-copy not supported for %s\n",
+				    lu->num, i, spec->disktype);
+			}
+#else
+			ISTGT_WARNLOG("LU%d: LUN%d: zero-copy not supported\n",
+			    lu->num, i);
+#endif /* ISTGT_USE_SENDFILE */
+			/* also referred by lu_create_task() */
+			lu->lun[i].zerocopy = spec->zerocopy;
+		}
+		spec->wcache = NULL;
+		spec->rcache = NULL;
+		spec->amap = NULL;
+		spec->xcopy = NULL;
+		if (lu->lun[i].writeback != 0) {
+			if (lu->readonly) {
+				lu->lun[i].writeback = 0;
+			} else if (strcasecmp(spec->disktype, "RAW") != 0) {
+				ISTGT_WARNLOG("LU%d: LUN%d: write-back cache not supported for %s\n",
+				    lu->num, i, spec->disktype);
+				lu->lun[i].writeback = 0;
+			} else if (lu->lun[i].writeback < ISTGT_LU_WCACHE_MINSIZE) {
+				lu->lun[i].writeback = ISTGT_LU_WCACHE_MINSIZE;
+			}
+			if (lu->lun[i].writeback != 0 && lu->lun[i].asyncio) {
+				/* writes must go through the cache */
+				ISTGT_WARNLOG("LU%d: LUN%d: async I/O disabled by write-back cache\n",
+				    lu->num, i);
+				lu->lun[i].asyncio = 0;
+			}
+		}
+
 		gb_size = spec->size / ISTGT_LU_1GB;
 		mb_size = (spec->size % ISTGT_LU_1GB) / ISTGT_LU_1MB;
 		if (gb_size > 0) {
@@ -709,12 +910,31 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		}
 		printf("\n");
 		if (spec->queue_depth != 0) {
-			printf("LU%d: LUN%d command queuing enabled, depth %d\n",
-			    lu->num, i, spec->queue_depth);
+			printf("LU%d: LUN%d command queuing enabled, depth %d, "
+			    "workers %d\n",
+			    lu->num, i, spec->queue_depth, lu->luworkers);
+			if (lu->lun[i].asyncio) {
+				printf("LU%d: LUN%d async I/O enabled\n",
+				    lu->num, i);
+			}
 		} else {
 			printf("LU%d: LUN%d command queuing disabled\n",
 			    lu->num, i);
 		}
+		if (spec->zerocopy) {
+			printf("LU%d: LUN%d zero-copy read enabled\n",
+			    lu->num, i);
+		}
+		if (spec->thin_provisioning) {
+			printf("LU%d: LUN%d thin provisioning enabled, "
+			    "UNMAP granularity %u blocks\n",
+			    lu->num, i, spec->unmap_granularity);
+		}
+		if (lu->lun[i].writeback != 0) {
+			mb_size = (lu->lun[i].writeback / ISTGT_LU_1MB);
+			printf("LU%d: LUN%d write-back cache %"PRIu64"MB\n",
+			    lu->num, i, mb_size);
+		}
 #if 0
 		if (spec->write_cache && spec->wbufsize) {
 			mb_size = (spec->wbufsize / ISTGT_LU_1MB);
@@ -723,12 +943,156 @@ istgt_lu_disk_init(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 		}
 #endif
 
+		rc = istgt_lu_disk_xcopy_init(spec);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: LUN%d: xcopy_init() failed\n", lu->num, i);
+			goto error_return;
+		}
+
 		lu->lun[i].spec = spec;
 	}
 
 	return 0;
 }
 
+int
+istgt_lu_disk_start_aio(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_DISK *spec;
+	int rc;
+	int i;
+
+	/* engine threads must be created after daemon() */
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		if (!lu->lun[i].asyncio)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL || spec->aio != NULL)
+			continue;
+		if (strcasecmp(spec->disktype, "RAW") != 0) {
+			ISTGT_WARNLOG("LU%d: LUN%d: async I/O not supported for %s\n",
+			    lu->num, i, spec->disktype);
+			continue;
+		}
+		rc = istgt_lu_disk_aio_init(spec, spec->queue_depth);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_aio_init() failed\n",
+			    lu->num, i);
+			return -1;
+		}
+		ISTGT_NOTICELOG("LU%d: LUN%d async I/O by %s\n",
+		    lu->num, i, istgt_lu_disk_aio_engine(spec));
+	}
+	return 0;
+}
+
+int
+istgt_lu_disk_start_wcache(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_DISK *spec;
+	int rc;
+	int i;
+
+	/* flusher must be created after daemon() */
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		if (lu->lun[i].writeback == 0)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL || spec->wcache != NULL)
+			continue;
+		rc = istgt_lu_disk_wcache_init(spec, lu->lun[i].writeback);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_wcache_init() failed\n",
+			    lu->num, i);
+			return -1;
+		}
+		ISTGT_NOTICELOG("LU%d: LUN%d write-back cache %"PRIu64"MB\n",
+		    lu->num, i, (uint64_t) (istgt_lu_disk_wcache_size(spec) / ISTGT_LU_1MB));
+	}
+	return 0;
+}
+
+int
+istgt_lu_disk_start_rcache(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_DISK *spec;
+	uint64_t size;
+	int nluns;
+	int rc;
+	int i;
+
+	if (lu->readcache_size == 0)
+		return 0;
+	/* ReadCacheSize is shared by LUNs of the LU */
+	nluns = 0;
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL || strcasecmp(spec->disktype, "RAW") != 0)
+			continue;
+		nluns++;
+	}
+	if (nluns == 0) {
+		ISTGT_WARNLOG("LU%d: read cache not supported\n", lu->num);
+		return 0;
+	}
+	size = lu->readcache_size / nluns;
+
+	/* readahead thread must be created after daemon() */
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL || spec->rcache != NULL)
+			continue;
+		if (strcasecmp(spec->disktype, "RAW") != 0)
+			continue;
+		/* above the write-back cache, if any */
+		rc = istgt_lu_disk_rcache_init(spec, size);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_rcache_init() failed\n",
+			    lu->num, i);
+			return -1;
+		}
+		ISTGT_NOTICELOG("LU%d: LUN%d read cache %"PRIu64"MB\n",
+		    lu->num, i, (uint64_t) (istgt_lu_disk_rcache_size(spec) / ISTGT_LU_1MB));
+	}
+	return 0;
+}
+
+int
+istgt_lu_disk_start_amap(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_DISK *spec;
+	int rc;
+	int i;
+
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL || spec->amap != NULL)
+			continue;
+		if (strcasecmp(spec->disktype, "RAW") != 0)
+			continue;
+		if (!spec->thin_provisioning || !spec->unmap_lbprz)
+			continue;
+		/* above the caches, dirty data is already mapped */
+		rc = istgt_lu_disk_amap_init(spec);
+		if (rc < 0) {
+			ISTGT_WARNLOG("LU%d: LUN%d: allocation map not supported\n",
+			    lu->num, i);
+			continue;
+		}
+	}
+	return 0;
+}
+
 int
 istgt_lu_disk_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
 {
@@ -765,7 +1129,38 @@ istgt_lu_disk_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr
 				    lu->num);
 				/* ignore error */
 			}
+		} else if (strcasecmp(spec->disktype, "NULL") == 0
+		    || strcasecmp(spec->disktype, "MEMORY") == 0) {
+			rc = istgt_lu_disk_mem_lun_shutdown(spec, istgt, lu);
+			if (rc < 0) {
+				ISTGT_ERRLOG("LU%d: lu_disk_mem_lun_shutdown() failed\n",
+				    lu->num);
+				/* ignore error */
+			}
 		} else if (strcasecmp(spec->disktype, "RAW") == 0) {
+			rc = istgt_lu_disk_amap_shutdown(spec);
+			if (rc < 0) {
+				ISTGT_ERRLOG("LU%d: lu_disk_amap_shutdown() failed\n",
+				    lu->num);
+				/* ignore error */
+			}
+			rc = istgt_lu_disk_rcache_shutdown(spec);
+			if (rc < 0) {
+				ISTGT_ERRLOG("LU%d: lu_disk_rcache_shutdown() failed\n",
+				    lu->num);
+				/* ignore error */
+			}
+			rc = istgt_lu_disk_wcache_shutdown(spec);
+			if (rc < 0) {
+				ISTGT_ERRLOG("LU%d: lu_disk_wcache_shutdown() failed\n",
+				    lu->num);
+				/* ignore error */
+			}
+			rc = istgt_lu_disk_aio_shutdown(spec);
+			if (rc < 0) {
+				//ISTGT_ERRLOG("LU%d: lu_disk_aio_shutdown() failed\n", lu->num);
+				/* ignore error */
+			}
 			if (!spec->lu->readonly) {
 				rc = spec->sync(spec, 0, spec->size);
 				if (rc < 0) {
@@ -791,14 +1186,24 @@ istgt_lu_disk_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr
 			xfree(spec->rsv_port);
 			spec->rsv_port = NULL;
 		}
+		rc = istgt_lu_disk_xcopy_shutdown(spec);
+		if (rc < 0) {
+			//ISTGT_ERRLOG("LU%d: xcopy_shutdown() failed\n", lu->num);
+			/* ignore error */
+		}
 
-		rc = pthread_mutex_destroy(&spec->ats_mutex);
+		rc = pthread_mutex_destroy(&spec->fsize_mutex);
 		if (rc != 0) {
 			//ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
 			/* ignore error */
 		}
+		rc = pthread_rwlock_destroy(&spec->io_rwlock);
+		if (rc != 0) {
+			//ISTGT_ERRLOG("LU%d: rwlock_destroy() failed\n", lu->num);
+			/* ignore error */
+		}
 
-		istgt_queue_destroy(&spec->cmd_queue);
+		istgt_lu_disk_queue_destroy(spec);
 		rc = pthread_mutex_destroy(&spec->cmd_queue_mutex);
 		if (rc != 0) {
 			//ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
@@ -809,7 +1214,6 @@ istgt_lu_disk_shutdown(ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr
 			//ISTGT_ERRLOG("LU%d: mutex_destroy() failed\n", lu->num);
 			/* ignore error */
 		}
-		xfree(spec->watsbuf);
 		xfree(spec->wbuf);
 		xfree(spec);
 		lu->lun[i].spec = NULL;
@@ -1137,7 +1541,7 @@ istgt_lu_disk_scsi_inquiry(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cdb, uin
 			data[12]= 0xb1; /* SBC Block Device Characteristics */
 			len = 13 - hlen;
 			if (spec->thin_provisioning) {
-				data[13]= 0xb2; /* SBC Thin Provisioning */
+				data[13]= 0xb2; /* SBC Logical Block Provisioning */
 				len++;
 			}
 
@@ -1609,23 +2013,39 @@ istgt_lu_disk_scsi_inquiry(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cdb, uin
 			}
 			len = 20 - hlen;
 
-			if (1 || spec->thin_provisioning) {
+			if (spec->thin_provisioning) {
 				/* MAXIMUM UNMAP LBA COUNT */
-				DSET32(&data[20], 0); /* not implement UNMAP */
+				DSET32(&data[20], 0xffffffffU); /* no limit */
 				/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT */
-				DSET32(&data[24], 0); /* not implement UNMAP */
+				DSET32(&data[24], ISTGT_LU_MAX_UNMAP_DESC);
 				/* OPTIMAL UNMAP GRANULARITY */
-				DSET32(&data[28], 0); /* not specified */
+				DSET32(&data[28], spec->unmap_granularity);
 				/* UNMAP GRANULARITY ALIGNMENT */
 				DSET32(&data[32], (0 & 0x7fffffffU));
 				/* UGAVALID(7) */
-				BDADD8(&data[32], 0, 7); /* not valid ALIGNMENT */
+				BDADD8(&data[32], 1, 7); /* valid ALIGNMENT */
 				/* MAXIMUM WRITE SAME LENGTH */
 				DSET64(&data[36], 0); /* no limit */
 				/* Reserved */
 				memset(&data[44], 0x00, 64-44);
 				len = 64 - hlen;
-			}
+			} else {
+				/* MAXIMUM UNMAP LBA COUNT */
+				DSET32(&data[20], 0); /* not support UNMAP */
+				/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT */
+				DSET32(&data[24], 0); /* not support UNMAP */
+				/* OPTIMAL UNMAP GRANULARITY */
+				DSET32(&data[28], 0); /* not specified */
+				/* UNMAP GRANULARITY ALIGNMENT */
+				DSET32(&data[32], (0 & 0x7fffffffU));
+				/* UGAVALID(7) */
+				BDADD8(&data[32], 0, 7); /* not valid ALIGNMENT */
+				/* MAXIMUM WRITE SAME LENGTH */
+				DSET64(&data[36], 0); /* no limit */
+				/* Reserved */
+				memset(&data[44], 0x00, 64-44);
+				len = 64 - hlen;
+			}
 
 			DSET16(&data[2], len);
 			break;
@@ -1665,7 +2085,7 @@ istgt_lu_disk_scsi_inquiry(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cdb, uin
 			DSET16(&data[2], len);
 			break;
 
-		case 0xb2: /* SBC Thin Provisioning */
+		case 0xb2: /* SBC Logical Block Provisioning */
 			if (!spec->thin_provisioning) {
 				ISTGT_ERRLOG("unsupported INQUIRY VPD page 0x%x\n", pc);
 				return -1;
@@ -1682,11 +2102,16 @@ istgt_lu_disk_scsi_inquiry(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cdb, uin
 
 			/* THRESHOLD EXPONENT */
 			data[4] = 0;
-			/* DP(0) */
-			BDSET8(&data[5], 0, 0);
+			/* LBPU(7) LBPWS(6) LBPWS10(5) LBPRZ(2) ANC_SUP(1) DP(0) */
+			BDSET8(&data[5], 1, 7); /* UNMAP command */
+			BDADD8(&data[5], 1, 6); /* WRITE SAME(16) with UNMAP */
+			BDADD8(&data[5], 1, 5); /* WRITE SAME(10) with UNMAP */
+			BDADD8(&data[5], spec->unmap_lbprz, 2);
+			/* PROVISIONING TYPE(2-0) */
+			BDSET8W(&data[6], 0x02, 2, 3); /* thin provisioned */
 			/* Reserved */
-			DSET16(&data[6], 0);
-			len = 6 - hlen;
+			data[7] = 0;
+			len = 8 - hlen;
 #if 0
 			/* XXX not yet */
 			/* PROVISIONING GROUP DESCRIPTOR ... */
@@ -1726,6 +2151,7 @@ istgt_lu_disk_scsi_inquiry(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cdb, uin
 		data[5] = 0;
 		//BDADD8W(&data[5], 1, 7, 1); /* storage array controller */
 		BDADD8W(&data[5], 0x00, 5, 2); /* Not support TPGS */
+		BDADD8(&data[5], 1, 3);        /* third-party copy */
 		//BDADD8W(&data[5], 0x01, 5, 2); /* Only implicit */
 		//BDADD8W(&data[5], 0x02, 5, 2); /* Only explicit */
 		//BDADD8W(&data[5], 0x03, 5, 2); /* Both explicit and implicit */
@@ -2713,6 +3139,74 @@ istgt_lu_disk_find_pr_key(ISTGT_LU_DISK *spec, const char *initiator_port, const
 	return NULL;
 }
 
+static uint32_t g_pr_epoch;
+
+static int
+istgt_lu_disk_pr_hash(const char *initiator_port)
+{
+	const uint8_t *cp;
+	uint32_t h;
+
+	/* FNV-1a */
+	h = 2166136261U;
+	for (cp = (const uint8_t *) initiator_port; *cp != '\0'; cp++) {
+		h ^= *cp;
+		h *= 16777619U;
+	}
+	return (int) (h & (ISTGT_LU_PR_HASH - 1));
+}
+
+static void
+istgt_lu_disk_pr_rehash(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_PR_KEY *prkey;
+	uint32_t epoch;
+	int h;
+	int i;
+
+	for (i = 0; i < ISTGT_LU_PR_HASH; i++) {
+		spec->pr_hash[i] = -1;
+	}
+	/* insert backwards so that each chain keeps the array order */
+	for (i = spec->npr_keys - 1; i >= 0; i--) {
+		prkey = &spec->pr_keys[i];
+		h = istgt_lu_disk_pr_hash(prkey->registered_initiator_port);
+		spec->pr_hash_next[i] = spec->pr_hash[h];
+		spec->pr_hash[h] = i;
+	}
+
+	/* invalidate the state cached by each connection, 0 is never used */
+	do {
+		epoch = __sync_add_and_fetch(&g_pr_epoch, 1);
+	} while (epoch == 0);
+	spec->pr_epoch = epoch;
+}
+
+static ISTGT_LU_PR_KEY *
+istgt_lu_disk_lookup_pr_key(ISTGT_LU_DISK *spec, const char *initiator_port, const char *target_port)
+{
+	ISTGT_LU_PR_KEY *prkey;
+	int i;
+
+	/* same as find_pr_key() with key 0, but only walks one chain */
+	if (initiator_port == NULL)
+		return NULL;
+	i = spec->pr_hash[istgt_lu_disk_pr_hash(initiator_port)];
+	for ( ; i >= 0; i = spec->pr_hash_next[i]) {
+		prkey = &spec->pr_keys[i];
+		if (strcmp(prkey->registered_initiator_port,
+			initiator_port) != 0)
+			continue;
+		if (prkey->all_tpg != 0
+		    || target_port == NULL
+		    || strcmp(prkey->registered_target_port,
+			target_port) == 0) {
+			return prkey;
+		}
+	}
+	return NULL;
+}
+
 static int
 istgt_lu_disk_remove_other_pr_key(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), const char *initiator_port, const char *target_port, uint64_t key)
 {
@@ -3048,7 +3542,7 @@ istgt_lu_disk_scsi_persistent_reserve_in(ISTGT_LU_DISK *spec, CONN_Ptr conn __at
 }
 
 static int
-istgt_lu_disk_scsi_persistent_reserve_out(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sa, int scope, int type, uint8_t *data, int len)
+istgt_lu_disk_scsi_persistent_reserve_out_internal(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sa, int scope, int type, uint8_t *data, int len)
 {
 	ISTGT_LU_PR_KEY *prkey;
 	uint8_t *sense_data;
@@ -3784,10 +4278,28 @@ istgt_lu_disk_scsi_persistent_reserve_out(ISTGT_LU_DISK *spec, CONN_Ptr conn, IS
 	return 0;
 }
 
+static int
+istgt_lu_disk_scsi_persistent_reserve_out(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sa, int scope, int type, uint8_t *data, int len)
+{
+	int rc;
+
+	rc = istgt_lu_disk_scsi_persistent_reserve_out_internal(spec, conn,
+	    lu_cmd, sa, scope, type, data, len);
+	/* registrations or reservation may be changed even if failed */
+	istgt_lu_disk_pr_rehash(spec);
+	return rc;
+}
+
+#define PR_STATE_NONE 1
+#define PR_STATE_REGISTRANT 2
+#define PR_STATE_HOLDER 3
+
 static int
 istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
 {
 	ISTGT_LU_PR_KEY *prkey;
+	uint64_t cache;
+	int state;
 
 #ifdef ISTGT_TRACE_DISK
 	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
@@ -3795,20 +4307,39 @@ istgt_lu_disk_check_pr(ISTGT_LU_DISK *spec, CONN_Ptr conn, int pr_allow)
 	    spec->rsv_key, spec->rsv_type, pr_allow);
 #endif /* ISTGT_TRACE_DISK */
 
-	prkey = istgt_lu_disk_find_pr_key(spec, conn->initiator_port,
-	    conn->target_port, 0);
-	if (prkey != NULL) {
+	/* nexus state is valid until next PERSISTENT RESERVE OUT */
+	cache = 0;
+	if (spec->lun >= 0 && spec->lun < MAX_LU_LUN)
+		cache = conn->pr_cache[spec->lun];
+	if ((uint32_t) (cache >> 32) == spec->pr_epoch) {
+		state = (int) (cache & 0xffffffffU);
+	} else {
+		prkey = istgt_lu_disk_lookup_pr_key(spec, conn->initiator_port,
+		    conn->target_port);
+		if (prkey == NULL) {
+			state = PR_STATE_NONE;
+		} else if (spec->rsv_key == prkey->key) {
+			state = PR_STATE_HOLDER;
+		} else {
+			state = PR_STATE_REGISTRANT;
+		}
+		if (spec->lun >= 0 && spec->lun < MAX_LU_LUN) {
+			conn->pr_cache[spec->lun]
+				= ((uint64_t) spec->pr_epoch << 32) | state;
+		}
+	}
+
+	if (state != PR_STATE_NONE) {
 #ifdef ISTGT_TRACE_DISK
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
-		    "PRKEY(0x%16.16"PRIx64") found for %s\n",
-		    prkey->key, conn->initiator_port);
+		    "PRKEY found for %s\n",
+		    conn->initiator_port);
 #endif /* ISTGT_TRACE_DISK */
 
-		if (spec->rsv_key == prkey->key) {
+		if (state == PR_STATE_HOLDER) {
 			/* reservation holder */
 			return 0;
 		}
-
 		switch (spec->rsv_type) {
 		case ISTGT_LU_PR_TYPE_WRITE_EXCLUSIVE_ALL_REGISTRANTS:
 			if (pr_allow & PR_ALLOW_ALLRR)
@@ -4048,7 +4579,7 @@ istgt_lu_disk_scsi_reserve(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 }
 
 static int
-istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
+istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
 {
 	uint8_t *data;
 	uint64_t maxlba;
@@ -4079,6 +4610,32 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 		return -1;
 	}
 
+#ifdef ISTGT_USE_SENDFILE
+	if (spec->zerocopy && conn != NULL && conn->data_digest == 0
+	    && lu_cmd->iobufsize == 0) {
+		/* data is sent from backing store by sender */
+		rc = istgt_lu_disk_wcache_flush(spec, offset, nbytes);
+		if (rc < 0) {
+			ISTGT_ERRLOG("lu_disk_wcache_flush() failed\n");
+			return -1;
+		}
+		/* own descriptor, reset may re-open spec->fd before sending */
+		rc = dup(spec->fd);
+		if (rc < 0) {
+			ISTGT_ERRLOG("dup() failed (errno=%d)\n", errno);
+			return -1;
+		}
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+		    "Read %"PRIu64" bytes by zero-copy\n", nbytes);
+		lu_cmd->zcopy = 1;
+		lu_cmd->zcopy_fd = (int) rc;
+		lu_cmd->zcopy_offset = offset;
+		lu_cmd->data = NULL;
+		lu_cmd->data_len = nbytes;
+		return 0;
+	}
+#endif /* ISTGT_USE_SENDFILE */
+
 	if (nbytes > lu_cmd->iobufsize) {
 		ISTGT_ERRLOG("nbytes(%zu) > iobufsize(%zu)\n",
 		    (size_t) nbytes, lu_cmd->iobufsize);
@@ -4086,13 +4643,7 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 	}
 	data = lu_cmd->iobuf;
 
-	rc = spec->seek(spec, offset);
-	if (rc < 0) {
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		return -1;
-	}
-
-	rc = spec->read(spec, data, nbytes);
+	rc = spec->pread(spec, data, nbytes, offset);
 	if (rc < 0) {
 		ISTGT_ERRLOG("lu_disk_read() failed\n");
 		return -1;
@@ -4107,7 +4658,7 @@ istgt_lu_disk_lbread(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused_
 }
 
 static int
-istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
+istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len, int fua)
 {
 	uint8_t *data;
 	uint64_t maxlba;
@@ -4157,19 +4708,21 @@ istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cm
 	}
 
 	spec->req_write_cache = 0;
-	rc = spec->seek(spec, offset);
-	if (rc < 0) {
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		return -1;
-	}
-
-	rc = spec->write(spec, data, nbytes);
+	rc = spec->pwrite(spec, data, nbytes, offset);
 	if (rc < 0 || (uint64_t) rc != nbytes) {
 		ISTGT_ERRLOG("lu_disk_write() failed\n");
 		return -1;
 	}
 	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Wrote %"PRId64"/%"PRIu64" bytes\n",
 	    rc, nbytes);
+	if (fua && spec->write_cache) {
+		/* FUA: data must be on the medium before completion */
+		rc = spec->sync(spec, offset, nbytes);
+		if (rc < 0) {
+			ISTGT_ERRLOG("lu_disk_sync() failed\n");
+			return -1;
+		}
+	}
 
 	lu_cmd->data_len = rc;
 
@@ -4177,7 +4730,7 @@ istgt_lu_disk_lbwrite(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cm
 }
 
 static int
-istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
+istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len, int unmap)
 {
 	uint8_t *data;
 	uint64_t maxlba;
@@ -4187,6 +4740,7 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 	uint64_t nbytes;
 	uint64_t nblocks;
 	uint64_t wblocks;
+	uint64_t filled;
 	int64_t rc;
 
 	maxlba = spec->blockcnt;
@@ -4241,16 +4795,33 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 	}
 
 	spec->req_write_cache = 0;
-	rc = spec->seek(spec, offset);
-	if (rc < 0) {
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		return -1;
+
+	if (istgt_memiszero(data, (size_t) nbytes)) {
+		/* unmapped blocks are read as zero */
+		if (unmap && spec->thin_provisioning && spec->unmap_lbprz) {
+			rc = spec->unmap(spec, offset, llen * nbytes);
+			if (rc == 0) {
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+				    "Unmapped %"PRIu64" bytes\n", (llen * nbytes));
+				goto done;
+			}
+		}
+		if (spec->zero != NULL) {
+			rc = spec->zero(spec, offset, llen * nbytes);
+			if (rc == 0) {
+				ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+				    "Zeroed %"PRIu64" bytes\n", (llen * nbytes));
+				goto done;
+			}
+		}
+		/* not supported by the backing store, write it */
 	}
 
 #if 0
 	nblocks = 0;
 	while (nblocks < llen) {
-		rc = spec->write(spec, data, nbytes);
+		rc = spec->pwrite(spec, data, nbytes,
+		    offset + (nblocks * nbytes));
 		if (rc < 0 || rc != nbytes) {
 			ISTGT_ERRLOG("lu_disk_write() failed\n");
 			return -1;
@@ -4258,16 +4829,20 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 		nblocks++;
 	}
 #else
-	nblocks = 0;
-	while (nblocks < wblocks) {
-		memcpy(conn->workbuf + (nblocks * nbytes), data, nbytes);
-		nblocks++;
+	/* replicate the pattern by doubling */
+	memcpy(conn->workbuf, data, nbytes);
+	filled = nbytes;
+	while (filled < wblocks * nbytes) {
+		uint64_t n = DMIN64(filled, (wblocks * nbytes) - filled);
+		memcpy(conn->workbuf + filled, conn->workbuf, n);
+		filled += n;
 	}
 
 	nblocks = 0;
 	while (nblocks < llen) {
 		uint64_t reqblocks = DMIN64(wblocks, (llen - nblocks));
-		rc = spec->write(spec, conn->workbuf, (reqblocks * nbytes));
+		rc = spec->pwrite(spec, conn->workbuf, (reqblocks * nbytes),
+		    offset + (nblocks * nbytes));
 		if (rc < 0 || (uint64_t) rc != (reqblocks * nbytes)) {
 			ISTGT_ERRLOG("lu_disk_write() failed\n");
 			return -1;
@@ -4278,6 +4853,7 @@ istgt_lu_disk_lbwrite_same(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr
 	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Wrote %"PRId64"/%"PRIu64" bytes\n",
 	    (nblocks * nbytes), (llen * nbytes));
 
+ done:
 	lu_cmd->data_len = nbytes;
 
 	return 0;
@@ -4287,6 +4863,7 @@ static int
 istgt_lu_disk_lbwrite_ats(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint32_t len)
 {
 	uint8_t *data;
+	uint8_t *watsbuf;
 	uint64_t maxlba;
 	uint64_t llen;
 	uint64_t blen;
@@ -4339,30 +4916,22 @@ istgt_lu_disk_lbwrite_ats(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr l
 		return -1;
 	}
 
-	if (spec->watsbuf == NULL) {
-		spec->watssize = ISTGT_LU_WORK_ATS_BLOCK_SIZE;
-		spec->watsbuf = xmalloc(spec->watssize);
-	}
-	if (nbytes > (uint64_t) spec->watssize) {
-		ISTGT_ERRLOG("nbytes(%zu) > watssize(%zu)\n",
-		    (size_t) nbytes, (size_t) spec->watssize);
+	if (nbytes > ISTGT_LU_WORK_ATS_BLOCK_SIZE) {
+		ISTGT_ERRLOG("nbytes(%zu) > ATS block size(%zu)\n",
+		    (size_t) nbytes, (size_t) ISTGT_LU_WORK_ATS_BLOCK_SIZE);
 		return -1;
 	}
 
+	/*
+	 * The range is owned by this command: the queue does not start
+	 * an overlapping one, and the unqueued path runs under lu->mutex.
+	 */
 	spec->req_write_cache = 0;
 	/* start atomic test and set */
-	MTX_LOCK(&spec->ats_mutex);
-
-	rc = spec->seek(spec, offset);
-	if (rc < 0) {
-		MTX_UNLOCK(&spec->ats_mutex);
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		return -1;
-	}
-
-	rc = spec->read(spec, spec->watsbuf, nbytes);
+	watsbuf = xmalloc((size_t) nbytes);
+	rc = spec->pread(spec, watsbuf, nbytes, offset);
 	if (rc < 0 || (uint64_t) rc != nbytes) {
-		MTX_UNLOCK(&spec->ats_mutex);
+		xfree(watsbuf);
 		ISTGT_ERRLOG("lu_disk_read() failed\n");
 		return -1;
 	}
@@ -4370,32 +4939,24 @@ istgt_lu_disk_lbwrite_ats(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr l
 #if 0
 	ISTGT_TRACEDUMP(ISTGT_TRACE_DEBUG, "ATS VERIFY", data, nbytes);
 	ISTGT_TRACEDUMP(ISTGT_TRACE_DEBUG, "ATS WRITE", data + nbytes, nbytes);
-	ISTGT_TRACEDUMP(ISTGT_TRACE_DEBUG, "ATS DATA", spec->watsbuf, nbytes);
+	ISTGT_TRACEDUMP(ISTGT_TRACE_DEBUG, "ATS DATA", watsbuf, nbytes);
 #endif
-	if (memcmp(spec->watsbuf, data, nbytes) != 0) {
-		MTX_UNLOCK(&spec->ats_mutex);
+	if (memcmp(watsbuf, data, nbytes) != 0) {
+		xfree(watsbuf);
 		//ISTGT_ERRLOG("compare failed\n");
 		/* MISCOMPARE DURING VERIFY OPERATION */
 		BUILD_SENSE(MISCOMPARE, 0x1d, 0x00);
 		return -1;
 	}
+	xfree(watsbuf);
 
-	rc = spec->seek(spec, offset);
-	if (rc < 0) {
-		MTX_UNLOCK(&spec->ats_mutex);
-		ISTGT_ERRLOG("lu_disk_seek() failed\n");
-		return -1;
-	}
-	rc = spec->write(spec, data + nbytes, nbytes);
+	rc = spec->pwrite(spec, data + nbytes, nbytes, offset);
 	if (rc < 0 || (uint64_t) rc != nbytes) {
-		MTX_UNLOCK(&spec->ats_mutex);
 		ISTGT_ERRLOG("lu_disk_write() failed\n");
 		return -1;
 	}
 	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Wrote %"PRId64"/%"PRIu64" bytes\n",
 	    rc, nbytes);
-
-	MTX_UNLOCK(&spec->ats_mutex);
 	/* end atomic test and set */
 
 	lu_cmd->data_len = nbytes * 2;
@@ -4403,6 +4964,192 @@ istgt_lu_disk_lbwrite_ats(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr l
 	return 0;
 }
 
+typedef struct istgt_lu_unmap_desc_t {
+	uint64_t lba;
+	uint64_t blocks;
+} ISTGT_LU_UNMAP_DESC;
+
+static int
+istgt_lu_disk_unmap_desc_cmp(const void *a, const void *b)
+{
+	const ISTGT_LU_UNMAP_DESC *da = a;
+	const ISTGT_LU_UNMAP_DESC *db = b;
+
+	if (da->lba < db->lba)
+		return -1;
+	if (da->lba > db->lba)
+		return 1;
+	return 0;
+}
+
+static int
+istgt_lu_disk_lbunmap(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd, uint8_t *data, int len)
+{
+	ISTGT_LU_UNMAP_DESC desc[ISTGT_LU_MAX_UNMAP_DESC];
+	uint8_t *sense_data;
+	size_t *sense_len;
+	uint64_t maxlba;
+	uint64_t lba;
+	uint64_t blocks;
+	uint64_t blen;
+	int desc_len;
+	int ndesc;
+	int nmerged;
+	int rc;
+	int i;
+
+	sense_data = lu_cmd->sense_data;
+	sense_len = &lu_cmd->sense_data_len;
+	*sense_len = 0;
+
+	if (len < 8) {
+		/* PARAMETER LIST LENGTH ERROR */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+		return -1;
+	}
+	/* UNMAP BLOCK DESCRIPTOR DATA LENGTH */
+	desc_len = (int) DGET16(&data[2]);
+	if (desc_len > len - 8) {
+		desc_len = len - 8;
+	}
+	ndesc = desc_len / 16;
+	if (ndesc == 0) {
+		return 0;
+	}
+	if (ndesc > ISTGT_LU_MAX_UNMAP_DESC) {
+		/* INVALID FIELD IN PARAMETER LIST */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+		return -1;
+	}
+	if (spec->lu->readonly) {
+		ISTGT_ERRLOG("LU%d: readonly unit\n", spec->lu->num);
+		/* WRITE PROTECTED */
+		BUILD_SENSE(DATA_PROTECT, 0x27, 0x00);
+		return -1;
+	}
+
+	maxlba = spec->blockcnt;
+	blen = spec->blocklen;
+	nmerged = 0;
+	for (i = 0; i < ndesc; i++) {
+		lba = DGET64(&data[8 + i * 16]);
+		blocks = (uint64_t) DGET32(&data[8 + i * 16 + 8]);
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+		    "UNMAP: lba=%"PRIu64", blocks=%"PRIu64"\n", lba, blocks);
+		if (lba > maxlba || blocks > maxlba || lba > (maxlba - blocks)) {
+			ISTGT_ERRLOG("end of media\n");
+			/* LOGICAL BLOCK ADDRESS OUT OF RANGE */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x21, 0x00);
+			return -1;
+		}
+		if (blocks == 0)
+			continue;
+		desc[nmerged].lba = lba;
+		desc[nmerged].blocks = blocks;
+		nmerged++;
+	}
+	if (nmerged == 0) {
+		return 0;
+	}
+
+	/* sort and coalesce into as few backend calls as possible */
+	qsort(desc, nmerged, sizeof desc[0], istgt_lu_disk_unmap_desc_cmp);
+	ndesc = nmerged;
+	nmerged = 0;
+	for (i = 1; i < ndesc; i++) {
+		if (desc[i].lba <= desc[nmerged].lba + desc[nmerged].blocks) {
+			if (desc[i].lba + desc[i].blocks
+			    > desc[nmerged].lba + desc[nmerged].blocks) {
+				desc[nmerged].blocks = desc[i].lba + desc[i].blocks
+				    - desc[nmerged].lba;
+			}
+			continue;
+		}
+		nmerged++;
+		desc[nmerged] = desc[i];
+	}
+	nmerged++;
+
+	for (i = 0; i < nmerged; i++) {
+		rc = spec->unmap(spec, desc[i].lba * blen, desc[i].blocks * blen);
+		if (rc < 0) {
+			ISTGT_ERRLOG("LU%d: LUN%d: unmap failed (lba=%"PRIu64")\n",
+			    spec->lu->num, spec->lun, desc[i].lba);
+			/* WRITE ERROR */
+			BUILD_SENSE(MEDIUM_ERROR, 0x0c, 0x00);
+			return -1;
+		}
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "UNMAP: %d descriptors, %d ranges\n",
+	    ndesc, nmerged);
+	return 0;
+}
+
+static int
+istgt_lu_disk_get_lba_status(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd, uint64_t lba, uint8_t *data, int alloc_len)
+{
+	uint8_t *sense_data;
+	size_t *sense_len;
+	uint64_t maxlba;
+	uint64_t blen;
+	uint64_t maxbytes;
+	uint64_t nbytes;
+	uint64_t blocks;
+	int unmapped;
+	int hlen, len;
+
+	sense_data = lu_cmd->sense_data;
+	sense_len = &lu_cmd->sense_data_len;
+	*sense_len = 0;
+
+	maxlba = spec->blockcnt;
+	blen = spec->blocklen;
+	if (lba >= maxlba) {
+		ISTGT_ERRLOG("end of media\n");
+		/* LOGICAL BLOCK ADDRESS OUT OF RANGE */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x21, 0x00);
+		return -1;
+	}
+
+	/* PARAMETER DATA LENGTH */
+	DSET32(&data[0], 0);
+	/* Reserved */
+	DSET32(&data[4], 0);
+	hlen = 8;
+	len = hlen;
+
+	/* at least one descriptor is returned */
+	do {
+		maxbytes = (maxlba - lba) * blen;
+		if (maxbytes > 0xffffffffULL * blen) {
+			maxbytes = 0xffffffffULL * blen;
+		}
+		unmapped = istgt_lu_disk_amap_lookup(spec, lba * blen, maxbytes,
+		    &nbytes);
+		blocks = nbytes / blen;
+		if (blocks == 0) {
+			blocks = 1;
+		}
+		/* LBA STATUS LOGICAL BLOCK ADDRESS */
+		DSET64(&data[len + 0], lba);
+		/* NUMBER OF LOGICAL BLOCKS */
+		DSET32(&data[len + 8], (uint32_t) blocks);
+		/* PROVISIONING STATUS(3-0) */
+		data[len + 12] = unmapped ? 0x01 : 0x00;
+		/* Reserved */
+		memset(&data[len + 13], 0, 3);
+		len += 16;
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+		    "LBA STATUS: lba=%"PRIu64", blocks=%"PRIu64", %s\n",
+		    lba, blocks, unmapped ? "deallocated" : "mapped");
+		lba += blocks;
+	} while (lba < maxlba && len + 16 <= alloc_len);
+
+	/* PARAMETER DATA LENGTH */
+	DSET32(&data[0], len - 4);
+	return len;
+}
+
 static int
 istgt_lu_disk_lbsync(ISTGT_LU_DISK *spec, CONN_Ptr conn __attribute__((__unused__)), ISTGT_LU_CMD_Ptr lu_cmd __attribute__((__unused__)), uint64_t lba, uint32_t len)
 {
@@ -4615,6 +5362,12 @@ istgt_lu_disk_reset(ISTGT_LU_Ptr lu, int lun)
 		}
 	}
 
+	if (strcasecmp(spec->disktype, "NULL") == 0
+	    || strcasecmp(spec->disktype, "MEMORY") == 0) {
+		/* no file to re-open, the contents of memory are kept */
+		return 0;
+	}
+
 	/* re-open file */
 	if (!spec->lu->readonly) {
 		rc = spec->sync(spec, 0, spec->size);
@@ -4624,6 +5377,10 @@ istgt_lu_disk_reset(ISTGT_LU_Ptr lu, int lun)
 			/* ignore error */
 		}
 	}
+	/* wait for parallel I/O */
+	RW_WRLOCK(&spec->io_rwlock);
+	istgt_lu_disk_aio_drain(spec);
+	(void) istgt_lu_disk_wcache_flush(spec, 0, spec->size);
 	rc = spec->close(spec);
 	if (rc < 0) {
 		ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_close() failed\n",
@@ -4633,21 +5390,123 @@ istgt_lu_disk_reset(ISTGT_LU_Ptr lu, int lun)
 	flags = lu->readonly ? O_RDONLY : O_RDWR;
 	rc = spec->open(spec, flags, 0666);
 	if (rc < 0) {
+		RW_UNLOCK(&spec->io_rwlock);
 		ISTGT_ERRLOG("LU%d: LUN%d: lu_disk_open() failed\n",
 		    lu->num, lun);
 		return -1;
 	}
+	RW_UNLOCK(&spec->io_rwlock);
 
 	return 0;
 }
 
+static void
+istgt_lu_disk_queue_init(ISTGT_LU_DISK *spec)
+{
+	int i;
+
+	spec->queued = 0;
+	spec->nordered = 0;
+	spec->seq = 0;
+	spec->nnexus = 0;
+	spec->drr_cur = 0;
+	for (i = 0; i < MAX_LU_TSIH; i++) {
+		spec->nexus[i].initiator_port[0] = '\0';
+		istgt_queue_init(&spec->nexus[i].queue);
+		spec->nexus[i].weight = 1;
+		spec->nexus[i].granted = 0;
+		spec->nexus[i].deficit = 0;
+	}
+}
+
+static void
+istgt_lu_disk_queue_destroy(ISTGT_LU_DISK *spec)
+{
+	int i;
+
+	for (i = 0; i < MAX_LU_TSIH; i++) {
+		istgt_queue_destroy(&spec->nexus[i].queue);
+	}
+}
+
+static int
+istgt_lu_disk_task_ordered(ISTGT_LU_TASK_Ptr lu_task)
+{
+	switch (lu_task->lu_cmd.Attr_bit) {
+	case 0x02: /* Ordered */
+	case 0x03: /* Head of Queue */
+	case 0x04: /* ACA */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* called with cmd_queue_mutex held, queue of the I_T nexus or NULL */
+static ISTGT_LU_DISK_NEXUS *
+istgt_lu_disk_nexus_find(ISTGT_LU_DISK *spec, const char *initiator_port)
+{
+	ISTGT_LU_DISK_NEXUS *np;
+	int i;
+
+	for (i = 0; i < spec->nnexus; i++) {
+		np = &spec->nexus[i];
+		if (np->initiator_port[0] != '\0'
+		    && strcasecmp(np->initiator_port, initiator_port) == 0) {
+			return np;
+		}
+	}
+	return NULL;
+}
+
+/* called with cmd_queue_mutex held, take a free slot for a new nexus */
+static ISTGT_LU_DISK_NEXUS *
+istgt_lu_disk_nexus_alloc(ISTGT_LU_DISK *spec, const char *initiator_port, int weight)
+{
+	ISTGT_LU_DISK_NEXUS *np;
+	int i;
+
+	for (i = 0; i < MAX_LU_TSIH; i++) {
+		np = &spec->nexus[i];
+		if (np->initiator_port[0] != '\0')
+			continue;
+		strlcpy(np->initiator_port, initiator_port,
+		    sizeof np->initiator_port);
+		np->weight = (weight < 1) ? 1 : weight;
+		np->granted = 0;
+		np->deficit = 0;
+		if (i >= spec->nnexus)
+			spec->nnexus = i + 1;
+		return np;
+	}
+	return NULL;
+}
+
+/* called with cmd_queue_mutex held, free the slot of a drained nexus */
+static void
+istgt_lu_disk_nexus_release(ISTGT_LU_DISK *spec, ISTGT_LU_DISK_NEXUS *np)
+{
+	if (istgt_queue_count(&np->queue) != 0)
+		return;
+	/* an idle nexus keeps no credit */
+	np->initiator_port[0] = '\0';
+	np->granted = 0;
+	np->deficit = 0;
+	while (spec->nnexus > 0
+	    && spec->nexus[spec->nnexus - 1].initiator_port[0] == '\0') {
+		spec->nnexus--;
+	}
+}
+
 static int
 istgt_lu_disk_queue_clear_internal(ISTGT_LU_DISK *spec, const char *initiator_port, int all_cmds, uint32_t CmdSN)
 {
+	ISTGT_LU_DISK_NEXUS *np;
 	ISTGT_LU_TASK_Ptr lu_task;
 	ISTGT_QUEUE saved_queue;
 	time_t now;
 	int rc;
+	int i;
 
 	if (spec == NULL)
 		return -1;
@@ -4664,17 +5523,19 @@ istgt_lu_disk_queue_clear_internal(ISTGT_LU_DISK *spec, const char *initiator_po
 
 	now = time(NULL);
 	MTX_LOCK(&spec->cmd_queue_mutex);
-	while (1) {
-		lu_task = istgt_queue_dequeue(&spec->cmd_queue);
+	np = istgt_lu_disk_nexus_find(spec, initiator_port);
+	while (np != NULL) {
+		lu_task = istgt_queue_dequeue(&np->queue);
 		if (lu_task == NULL)
 			break;
-		if (((all_cmds != 0) || (lu_task->lu_cmd.CmdSN == CmdSN))
-		    && (strcasecmp(lu_task->initiator_port,
-			    initiator_port) == 0)) {
+		if ((all_cmds != 0) || (lu_task->lu_cmd.CmdSN == CmdSN)) {
 			ISTGT_LOG("CmdSN(%u), OP=0x%x, ElapsedTime=%lu cleared\n",
 			    lu_task->lu_cmd.CmdSN,
 			    lu_task->lu_cmd.cdb[0],
 			    (unsigned long) (now - lu_task->create_time));
+			spec->queued--;
+			if (istgt_lu_disk_task_ordered(lu_task))
+				spec->nordered--;
 			rc = istgt_lu_destroy_task(lu_task);
 			if (rc < 0) {
 				MTX_UNLOCK(&spec->cmd_queue_mutex);
@@ -4690,23 +5551,28 @@ istgt_lu_disk_queue_clear_internal(ISTGT_LU_DISK *spec, const char *initiator_po
 			goto error_return;
 		}
 	}
-	while (1) {
+	while (np != NULL) {
 		lu_task = istgt_queue_dequeue(&saved_queue);
 		if (lu_task == NULL)
 			break;
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		if (rc < 0) {
 			MTX_UNLOCK(&spec->cmd_queue_mutex);
 			ISTGT_ERRLOG("queue_enqueue() failed\n");
 			goto error_return;
 		}
 	}
+	if (np != NULL) {
+		istgt_lu_disk_nexus_release(spec, np);
+	}
 	MTX_UNLOCK(&spec->cmd_queue_mutex);
 
 	/* check wait task */
 	MTX_LOCK(&spec->wait_lu_task_mutex);
-	lu_task = spec->wait_lu_task;
-	if (lu_task != NULL) {
+	for (i = 0; i < MAX_LU_EXEC; i++) {
+		lu_task = spec->wait_lu_task[i];
+		if (lu_task == NULL)
+			continue;
 		if (((all_cmds != 0) || (lu_task->lu_cmd.CmdSN == CmdSN))
 		    && (strcasecmp(lu_task->initiator_port,
 			    initiator_port) == 0)) {
@@ -4842,10 +5708,12 @@ istgt_lu_disk_queue_clear_ITLQ(CONN_Ptr conn, ISTGT_LU_Ptr lu, int lun, uint32_t
 int
 istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 {
+	ISTGT_LU_DISK_NEXUS *np;
 	ISTGT_LU_TASK_Ptr lu_task;
 	ISTGT_LU_DISK *spec;
 	time_t now;
 	int rc;
+	int i;
 
 	if (lu == NULL)
 		return -1;
@@ -4864,27 +5732,36 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 
 	now = time(NULL);
 	MTX_LOCK(&spec->cmd_queue_mutex);
-	while (1) {
-		lu_task = istgt_queue_dequeue(&spec->cmd_queue);
-		if (lu_task == NULL)
-			break;
-		ISTGT_LOG("CmdSN(%u), OP=0x%x, ElapsedTime=%lu cleared\n",
-		    lu_task->lu_cmd.CmdSN,
-		    lu_task->lu_cmd.cdb[0],
-		    (unsigned long) (now - lu_task->create_time));
-		rc = istgt_lu_destroy_task(lu_task);
-		if (rc < 0) {
-			MTX_UNLOCK(&spec->cmd_queue_mutex);
-			ISTGT_ERRLOG("lu_destory_task() failed\n");
-			return -1;
+	for (i = 0; i < spec->nnexus; i++) {
+		np = &spec->nexus[i];
+		while (1) {
+			lu_task = istgt_queue_dequeue(&np->queue);
+			if (lu_task == NULL)
+				break;
+			ISTGT_LOG("CmdSN(%u), OP=0x%x, ElapsedTime=%lu cleared\n",
+			    lu_task->lu_cmd.CmdSN,
+			    lu_task->lu_cmd.cdb[0],
+			    (unsigned long) (now - lu_task->create_time));
+			spec->queued--;
+			if (istgt_lu_disk_task_ordered(lu_task))
+				spec->nordered--;
+			rc = istgt_lu_destroy_task(lu_task);
+			if (rc < 0) {
+				MTX_UNLOCK(&spec->cmd_queue_mutex);
+				ISTGT_ERRLOG("lu_destory_task() failed\n");
+				return -1;
+			}
 		}
+		istgt_lu_disk_nexus_release(spec, np);
 	}
 	MTX_UNLOCK(&spec->cmd_queue_mutex);
 
 	/* check wait task */
 	MTX_LOCK(&spec->wait_lu_task_mutex);
-	lu_task = spec->wait_lu_task;
-	if (lu_task != NULL) {
+	for (i = 0; i < MAX_LU_EXEC; i++) {
+		lu_task = spec->wait_lu_task[i];
+		if (lu_task == NULL)
+			continue;
 		/* conn had gone? */
 		rc = pthread_mutex_trylock(&lu_task->trans_mutex);
 		if (rc == 0) {
@@ -4905,7 +5782,7 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 	MTX_UNLOCK(&spec->wait_lu_task_mutex);
 
 	MTX_LOCK(&spec->cmd_queue_mutex);
-	rc = istgt_queue_count(&spec->cmd_queue);
+	rc = spec->queued;
 	MTX_UNLOCK(&spec->cmd_queue_mutex);
 	if (rc != 0) {
 		ISTGT_ERRLOG("cmd queue is not empty\n");
@@ -4915,8 +5792,13 @@ istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun)
 	return 0;
 }
 
+/*
+ * copy the command into a new task without queueing it; returns
+ * ISTGT_LU_TASK_RESULT_QUEUE_OK with *lu_taskp set, or
+ * ISTGT_LU_TASK_RESULT_IMMEDIATE if lu_cmd holds the response already
+ */
 int
-istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+istgt_lu_disk_queue_create(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr *lu_taskp)
 {
 	ISTGT_LU_TASK_Ptr lu_task;
 	ISTGT_LU_Ptr lu;
@@ -4929,10 +5811,9 @@ istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	uint8_t *sense_data;
 	size_t *sense_len;
 	int lun_i;
-	int maxq;
-	int qcnt;
 	int rc;
 
+	*lu_taskp = NULL;
 	if (lu_cmd == NULL)
 		return -1;
 	lu = lu_cmd->lu;
@@ -4992,21 +5873,66 @@ istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	/* ready to enqueue, spec is valid for LUN access */
 
 	/* allocate task and copy LU_CMD(PDU) */
-	lu_task = xmalloc(sizeof *lu_task);
-	memset(lu_task, 0, sizeof *lu_task);
+	lu_task = istgt_lu_alloc_task(conn);
 	rc = istgt_lu_create_task(conn, lu_cmd, lu_task, lun_i);
 	if (rc < 0) {
 		ISTGT_ERRLOG("lu_create_task() failed\n");
-		xfree(lu_task);
+		(void) istgt_lu_destroy_task(lu_task);
 		return -1;
 	}
+	/* the task accounts the command from now on */
+	lu_task->lu_cmd.ts_recv = lu_cmd->ts_recv;
+	lu_cmd->ts_recv = 0;
+
+	*lu_taskp = lu_task;
+	return ISTGT_LU_TASK_RESULT_QUEUE_OK;
+}
+
+/*
+ * enqueue a task made by istgt_lu_disk_queue_create(); if the queue is
+ * full the task is answered with TASK SET FULL, through lu_cmd if given
+ * or else through the sender of its connection
+ */
+int
+istgt_lu_disk_queue_task(ISTGT_LU_TASK_Ptr lu_task, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_LU_DISK_NEXUS *np;
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_DISK *spec;
+	CONN_Ptr conn;
+	int maxq;
+	int qcnt;
+	int rc;
+
+	conn = lu_task->conn;
+	lu = lu_task->lu_cmd.lu;
+	spec = (ISTGT_LU_DISK *) lu->lun[lu_task->lun].spec;
 
 	/* enqueue SCSI command */
 	MTX_LOCK(&spec->cmd_queue_mutex);
-	rc = istgt_queue_count(&spec->cmd_queue);
+	rc = spec->queued;
 	maxq = spec->queue_depth * lu->istgt->MaxSessions;
-	if (rc > maxq) {
+	np = istgt_lu_disk_nexus_find(spec, lu_task->initiator_port);
+	if (np == NULL && rc <= maxq) {
+		np = istgt_lu_disk_nexus_alloc(spec, lu_task->initiator_port,
+		    conn->weight);
+	}
+	if (rc > maxq || np == NULL) {
 		MTX_UNLOCK(&spec->cmd_queue_mutex);
+		if (lu_cmd == NULL) {
+			lu_task->lu_cmd.data_len = 0;
+			lu_task->lu_cmd.status = ISTGT_SCSI_STATUS_TASK_SET_FULL;
+			lu_task->execute = 1;
+			rc = istgt_lu_disk_queue_response(conn, lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_disk_queue_response() failed\n");
+				goto error_return;
+			}
+			return ISTGT_LU_TASK_RESULT_QUEUE_OK;
+		}
+		/* answered by the caller */
+		lu_cmd->ts_recv = lu_task->lu_cmd.ts_recv;
+		lu_task->lu_cmd.ts_recv = 0;
 		lu_cmd->data_len = 0;
 		lu_cmd->status = ISTGT_SCSI_STATUS_TASK_SET_FULL;
 		rc = istgt_lu_destroy_task(lu_task);
@@ -5019,35 +5945,43 @@ istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	qcnt = rc;
 	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
 	    "Queue(%d), CmdSN=%u, OP=0x%x, LUN=0x%16.16"PRIx64"\n",
-	    qcnt, lu_cmd->CmdSN, lu_cmd->cdb[0], lu_cmd->lun);
+	    qcnt, lu_task->lu_cmd.CmdSN, lu_task->lu_cmd.cdb[0],
+	    lu_task->lu_cmd.lun);
 
-	/* enqueue task to LUN */
-	switch (lu_cmd->Attr_bit) {
+	/* enqueue task to the queue of its I_T nexus */
+	lu_task->seq = ++spec->seq;
+	switch (lu_task->lu_cmd.Attr_bit) {
 	case 0x03: /* Head of Queue */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert Head of Queue\n");
-		rc = istgt_queue_enqueue_first(&spec->cmd_queue, lu_task);
+		lu_task->seq = 0;
+		rc = istgt_queue_enqueue_first(&np->queue, lu_task);
 		break;
 	case 0x00: /* Untagged */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert Untagged\n");
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		break;
 	case 0x01: /* Simple */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert Simple\n");
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		break;
 	case 0x02: /* Ordered */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert Ordered\n");
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		break;
 	case 0x04: /* ACA */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert ACA\n");
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		break;
 	default: /* Reserved */
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "insert Reserved Attribute\n");
-		rc = istgt_queue_enqueue(&spec->cmd_queue, lu_task);
+		rc = istgt_queue_enqueue(&np->queue, lu_task);
 		break;
 	}
+	if (rc == 0) {
+		spec->queued++;
+		if (istgt_lu_disk_task_ordered(lu_task))
+			spec->nordered++;
+	}
 	MTX_UNLOCK(&spec->cmd_queue_mutex);
 	if (rc < 0) {
 		ISTGT_ERRLOG("queue_enqueue() failed\n");
@@ -5073,6 +6007,18 @@ istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	return ISTGT_LU_TASK_RESULT_QUEUE_OK;
 }
 
+int
+istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_LU_TASK_Ptr lu_task;
+	int rc;
+
+	rc = istgt_lu_disk_queue_create(conn, lu_cmd, &lu_task);
+	if (lu_task == NULL)
+		return rc;
+	return istgt_lu_disk_queue_task(lu_task, lu_cmd);
+}
+
 int
 istgt_lu_disk_queue_count(ISTGT_LU_Ptr lu, int *lun)
 {
@@ -5105,7 +6051,7 @@ istgt_lu_disk_queue_count(ISTGT_LU_Ptr lu, int *lun)
 		}
 
 		MTX_LOCK(&spec->cmd_queue_mutex);
-		qcnt = istgt_queue_count(&spec->cmd_queue);
+		qcnt = spec->queued;
 		MTX_UNLOCK(&spec->cmd_queue_mutex);
 		if (qcnt > 0) {
 			ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
@@ -5124,38 +6070,630 @@ istgt_lu_disk_queue_count(ISTGT_LU_Ptr lu, int *lun)
 	return qcnt;
 }
 
-int
-istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
+static int
+istgt_lu_disk_rw_range(uint8_t *cdb, uint64_t *lba, uint64_t *len, int *write)
 {
-	ISTGT_Ptr istgt;
+	switch (cdb[0]) {
+	case SBC_READ_6:
+	case SBC_WRITE_6:
+		*lba = (uint64_t) (DGET24(&cdb[1]) & 0x001fffffU);
+		*len = (uint64_t) DGET8(&cdb[4]);
+		if (*len == 0) {
+			*len = 256;
+		}
+		break;
+	case SBC_READ_10:
+	case SBC_WRITE_10:
+	case SBC_WRITE_AND_VERIFY_10:
+		*lba = (uint64_t) DGET32(&cdb[2]);
+		*len = (uint64_t) DGET16(&cdb[7]);
+		break;
+	case SBC_READ_12:
+	case SBC_WRITE_12:
+	case SBC_WRITE_AND_VERIFY_12:
+		*lba = (uint64_t) DGET32(&cdb[2]);
+		*len = (uint64_t) DGET32(&cdb[6]);
+		break;
+	case SBC_READ_16:
+	case SBC_WRITE_16:
+	case SBC_WRITE_AND_VERIFY_16:
+		*lba = (uint64_t) DGET64(&cdb[2]);
+		*len = (uint64_t) DGET32(&cdb[10]);
+		break;
+	default:
+		return -1;
+	}
+	switch (cdb[0]) {
+	case SBC_READ_6:
+	case SBC_READ_10:
+	case SBC_READ_12:
+	case SBC_READ_16:
+		*write = 0;
+		break;
+	default:
+		*write = 1;
+		break;
+	}
+	return 0;
+}
+
+/* LBA range locked during execution, -1 if the command needs the LUN */
+static int
+istgt_lu_disk_exec_range(uint8_t *cdb, uint64_t *lba, uint64_t *len, int *write)
+{
+	if (istgt_lu_disk_rw_range(cdb, lba, len, write) == 0)
+		return 0;
+	switch (cdb[0]) {
+	case SBC_COMPARE_AND_WRITE:
+		/* atomic against overlapping commands only */
+		*lba = (uint64_t) DGET64(&cdb[2]);
+		*len = (uint64_t) DGET8(&cdb[13]);
+		*write = 1;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* called with cmd_queue_mutex held, return slot or -1 if range is busy */
+static int
+istgt_lu_disk_queue_claim_range(ISTGT_LU_DISK *spec, uint64_t lba, uint64_t len, int write, int barrier)
+{
+	ISTGT_LU_DISK_EXEC *ep;
+	int slot;
+	int i;
+
+	if (spec->exec_barrier) {
+		/* ORDERED or non-I/O command is executing */
+		return -1;
+	}
+	if (barrier && spec->nexec != 0) {
+		return -1;
+	}
+
+	slot = -1;
+	for (i = 0; i < MAX_LU_EXEC; i++) {
+		ep = &spec->exec[i];
+		if (!ep->busy) {
+			if (slot < 0)
+				slot = i;
+			continue;
+		}
+		if (!write && !ep->write)
+			continue;
+		if (lba < ep->lba + ep->len && ep->lba < lba + len) {
+			/* overlapped LBA range */
+			return -1;
+		}
+	}
+	if (slot < 0) {
+		return -1;
+	}
+	ep = &spec->exec[slot];
+	ep->busy = 1;
+	ep->barrier = barrier;
+	ep->write = write;
+	ep->lba = lba;
+	ep->len = len;
+	spec->nexec++;
+	if (barrier) {
+		spec->exec_barrier = 1;
+	}
+	return slot;
+}
+
+/* called with cmd_queue_mutex held, return slot or -1 if task must wait */
+static int
+istgt_lu_disk_queue_dispatch(ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr lu_task)
+{
+	uint64_t lba, len;
+	int barrier, write;
+
+	lba = len = 0;
+	write = 0;
+	barrier = 0;
+	if (lu_task->lu_cmd.Attr_bit == 0x02		/* Ordered */
+	    || lu_task->lu_cmd.Attr_bit == 0x04) {	/* ACA */
+		barrier = 1;
+	} else if (istgt_lu_disk_exec_range(lu_task->lu_cmd.cdb,
+		&lba, &len, &write) < 0) {
+		barrier = 1;
+	}
+	return istgt_lu_disk_queue_claim_range(spec, lba, len, write, barrier);
+}
+
+/*
+ * called with cmd_queue_mutex and qos_mutex held, check the unit and
+ * group limits for the task; returns usec until it may start or 0.
+ * *w1p tells whether the unit itself is out of credit.
+ */
+static uint64_t
+istgt_lu_disk_queue_limit(ISTGT_LU_Ptr lu, ISTGT_LU_TASK_Ptr lu_task, uint64_t now, uint64_t *w1p)
+{
+	uint64_t lba, len, bytes;
+	uint64_t w1, w2;
+	int write;
+
+	*w1p = 0;
+	if (istgt_lu_disk_exec_range(lu_task->lu_cmd.cdb,
+		&lba, &len, &write) < 0) {
+		/* only READ/WRITE and COMPARE AND WRITE are charged */
+		return 0;
+	}
+	bytes = (uint64_t) lu_task->lu_cmd.transfer_len;
+	w1 = istgt_qos_wait(lu->qos, bytes, now);
+	w2 = istgt_qos_wait(lu_task->qos, bytes, now);
+	if (w1 == 0 && w2 == 0)
+		return 0;
+	if (lu_task->ts_throttle == 0)
+		lu_task->ts_throttle = now;
+	*w1p = w1;
+	return (w1 > w2) ? w1 : w2;
+}
+
+static void
+istgt_lu_disk_queue_charge(ISTGT_LU_Ptr lu, ISTGT_LU_TASK_Ptr lu_task, uint64_t now)
+{
+	uint64_t lba, len, bytes, waited;
+	int write;
+
+	if (istgt_lu_disk_exec_range(lu_task->lu_cmd.cdb,
+		&lba, &len, &write) < 0)
+		return;
+	bytes = (uint64_t) lu_task->lu_cmd.transfer_len;
+	waited = 0;
+	if (lu_task->ts_throttle != 0)
+		waited = now - lu_task->ts_throttle;
+	istgt_qos_charge(lu->qos, bytes, waited);
+	istgt_qos_charge(lu_task->qos, bytes, waited);
+}
+
+/*
+ * called with cmd_queue_mutex held, take the next task to start and
+ * return it with its slot; *waitp is set to the usec until credit is due.
+ *
+ * Each I_T nexus has its own queue, served by deficit round robin on the
+ * bytes transferred: a nexus gets QueueWeight * ISTGT_LU_DRR_QUANTUM per
+ * round, so a deep queue of large writes cannot starve a shallow queue of
+ * small reads. A nexus throttled by its group limit is passed over. While
+ * ORDERED, HEAD OF QUEUE or ACA tasks are queued the LUN falls back to
+ * arrival order across all nexus.
+ */
+static ISTGT_LU_TASK_Ptr
+istgt_lu_disk_queue_pick(ISTGT_LU_Ptr lu, ISTGT_LU_DISK *spec, int *slotp, uint64_t *waitp)
+{
+	ISTGT_LU_DISK_NEXUS *np, *first;
+	ISTGT_LU_TASK_Ptr lu_task, t;
+	uint64_t now, wait, w1;
+	int64_t cost;
+	int idle;
+	int i;
+
+	*waitp = 0;
+	now = istgt_clock_usec();
+	MTX_LOCK(&lu->qos_mutex);
+	if (spec->nordered != 0) {
+		/* oldest head of all nexus, HEAD OF QUEUE has seq 0 */
+		first = NULL;
+		lu_task = NULL;
+		for (i = 0; i < spec->nnexus; i++) {
+			np = &spec->nexus[i];
+			t = istgt_queue_first(&np->queue);
+			if (t == NULL)
+				continue;
+			if (lu_task == NULL || t->seq < lu_task->seq) {
+				first = np;
+				lu_task = t;
+			}
+		}
+		if (lu_task == NULL) {
+			MTX_UNLOCK(&lu->qos_mutex);
+			return NULL;
+		}
+		wait = istgt_lu_disk_queue_limit(lu, lu_task, now, &w1);
+		if (wait != 0) {
+			MTX_UNLOCK(&lu->qos_mutex);
+			*waitp = wait;
+			return NULL;
+		}
+		*slotp = istgt_lu_disk_queue_dispatch(spec, lu_task);
+		if (*slotp < 0) {
+			MTX_UNLOCK(&lu->qos_mutex);
+			return NULL;
+		}
+		istgt_lu_disk_queue_charge(lu, lu_task, now);
+		MTX_UNLOCK(&lu->qos_mutex);
+		(void) istgt_queue_dequeue(&first->queue);
+		spec->queued--;
+		if (istgt_lu_disk_task_ordered(lu_task))
+			spec->nordered--;
+		istgt_lu_disk_nexus_release(spec, first);
+		return lu_task;
+	}
+
+	idle = 0;
+	while (1) {
+		if (spec->drr_cur >= spec->nnexus)
+			spec->drr_cur = 0;
+		np = &spec->nexus[spec->drr_cur];
+		lu_task = istgt_queue_first(&np->queue);
+		wait = 0;
+		if (lu_task != NULL) {
+			wait = istgt_lu_disk_queue_limit(lu, lu_task, now, &w1);
+			if (w1 != 0) {
+				/* the unit itself is out of credit */
+				MTX_UNLOCK(&lu->qos_mutex);
+				*waitp = wait;
+				return NULL;
+			}
+			if (wait != 0) {
+				if (*waitp == 0 || wait < *waitp)
+					*waitp = wait;
+			}
+		}
+		if (lu_task == NULL || wait != 0) {
+			/* nothing to start on this nexus, pass over it */
+			np->granted = 0;
+			spec->drr_cur++;
+			if (++idle > spec->nnexus) {
+				MTX_UNLOCK(&lu->qos_mutex);
+				return NULL;
+			}
+			continue;
+		}
+		cost = (int64_t) lu_task->lu_cmd.transfer_len;
+		if (cost < ISTGT_LU_DRR_MINCOST)
+			cost = ISTGT_LU_DRR_MINCOST;
+		if (np->deficit < cost && np->granted == 0) {
+			/* new round for this nexus */
+			np->deficit += (int64_t) np->weight * ISTGT_LU_DRR_QUANTUM;
+			np->granted = 1;
+		}
+		if (np->deficit < cost) {
+			/* quantum used up, next nexus */
+			np->granted = 0;
+			spec->drr_cur++;
+			idle = 0;
+			continue;
+		}
+		*slotp = istgt_lu_disk_queue_dispatch(spec, lu_task);
+		if (*slotp < 0) {
+			MTX_UNLOCK(&lu->qos_mutex);
+			return NULL;
+		}
+		istgt_lu_disk_queue_charge(lu, lu_task, now);
+		MTX_UNLOCK(&lu->qos_mutex);
+		(void) istgt_queue_dequeue(&np->queue);
+		spec->queued--;
+		np->deficit -= cost;
+		istgt_lu_disk_nexus_release(spec, np);
+		return lu_task;
+	}
+	/* NOTREACHED */
+}
+
+static void
+istgt_lu_disk_queue_wakeup(ISTGT_LU_Ptr lu)
+{
+	/* notify waiting workers */
+	MTX_LOCK(&lu->queue_mutex);
+	lu->queue_check = 1;
+	pthread_cond_broadcast(&lu->queue_cond);
+	MTX_UNLOCK(&lu->queue_mutex);
+}
+
+static void
+istgt_lu_disk_queue_release(ISTGT_LU_Ptr lu, ISTGT_LU_DISK *spec, int slot)
+{
+	MTX_LOCK(&spec->cmd_queue_mutex);
+	if (spec->exec[slot].barrier) {
+		spec->exec_barrier = 0;
+	}
+	spec->exec[slot].busy = 0;
+	spec->nexec--;
+	MTX_UNLOCK(&spec->cmd_queue_mutex);
+
+	if (lu->luworkers > 1 || spec->aio != NULL) {
+		istgt_lu_disk_queue_wakeup(lu);
+	}
+}
+
+static int
+istgt_lu_disk_queue_response(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task)
+{
+	char tmp[1];
+	int rc;
+
+	lu_task->lu_cmd.ts_done = istgt_clock_usec();
+	if (conn->use_sender == 0) {
+		rc = istgt_iscsi_queue_task(conn, lu_task);
+		if (rc < 0) {
+			ISTGT_ERRLOG("queue_task() failed\n");
+			return -1;
+		}
+		tmp[0] = 'Q';
+		rc = write(conn->task_pipe[1], tmp, 1);
+		if(rc < 0 || rc != 1) {
+			ISTGT_ERRLOG("write() failed\n");
+			return -1;
+		}
+	} else {
+		rc = istgt_iscsi_queue_result(conn, lu_task);
+		if (rc < 0) {
+			ISTGT_ERRLOG("queue_result() failed\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+istgt_lu_disk_queue_aio_done(ISTGT_LU_AIO *aio)
+{
+	ISTGT_LU_Ptr lu;
 	ISTGT_LU_DISK *spec;
 	ISTGT_LU_TASK_Ptr lu_task;
-	CONN_Ptr conn;
 	ISTGT_LU_CMD_Ptr lu_cmd;
-	struct timespec abstime;
-	time_t start, now;
-	uint8_t *iobuf;
-	char tmp[1];
-	int abort_task = 0;
+	CONN_Ptr conn;
+	int slot;
 	int rc;
 
-	if (lun < 0 || lun >= lu->maxlun) {
-		return -1;
+	lu_task = (ISTGT_LU_TASK_Ptr) aio->arg;
+	conn = lu_task->conn;
+	lu_cmd = &lu_task->lu_cmd;
+	lu = lu_cmd->lu;
+	spec = (ISTGT_LU_DISK *) lu->lun[istgt_lu_islun2lun(lu_cmd->lun)].spec;
+	slot = lu_task->slot;
+
+	switch (aio->op) {
+	case ISTGT_LU_AIO_READ:
+		if (aio->result < 0) {
+			ISTGT_ERRLOG("lu_disk_read() failed (errno=%d)\n",
+			    (int) -aio->result);
+			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+			break;
+		}
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Read %"PRId64"/%zu bytes\n",
+		    aio->result, aio->iov.iov_len);
+		lu_cmd->data = lu_cmd->iobuf;
+		lu_cmd->data_len = (size_t) aio->result;
+		lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+		break;
+	case ISTGT_LU_AIO_WRITE:
+		/* bypassed spec->pwrite, drop the range before the status */
+		istgt_lu_disk_rcache_invalidate(spec, aio->offset,
+		    (uint64_t) aio->iov.iov_len);
+		if (aio->result < 0
+		    || (uint64_t) aio->result != (uint64_t) aio->iov.iov_len) {
+			ISTGT_ERRLOG("lu_disk_write() failed (errno=%d)\n",
+			    aio->result < 0 ? (int) -aio->result : 0);
+			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+			break;
+		}
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "Wrote %"PRId64"/%zu bytes\n",
+		    aio->result, aio->iov.iov_len);
+		istgt_lu_disk_update_fsize(spec, aio->offset + aio->result);
+		lu_cmd->data_len = (size_t) aio->result;
+		lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+		break;
+	case ISTGT_LU_AIO_SYNC:
+		if (aio->result < 0) {
+			ISTGT_ERRLOG("lu_disk_sync() failed (errno=%d)\n",
+			    (int) -aio->result);
+			lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+			break;
+		}
+		lu_cmd->data_len = 0;
+		lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+		break;
+	default:
+		lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+		break;
 	}
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+	    "SCSI OP=0x%x, LUN=0x%16.16"PRIx64" status=0x%x,"
+	    " complete (aio)\n",
+	    lu_cmd->cdb[0], lu_cmd->lun, lu_cmd->status);
+	lu_task->execute = 1;
 
-	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "LU%d: LUN%d queue start\n",
-	    lu->num, lun);
-	spec = (ISTGT_LU_DISK *) lu->lun[lun].spec;
-	if (spec == NULL)
-		return -1;
+	/* lu_task may be freed after response */
+	rc = istgt_lu_disk_queue_response(conn, lu_task);
+	if (rc < 0) {
+		ISTGT_ERRLOG("lu_disk_queue_response() failed\n");
+		(void) istgt_lu_destroy_task(lu_task);
+	}
+	istgt_lu_disk_queue_release(lu, spec, slot);
+}
+
+/* lock an LBA range written from outside the queue, -1 if it is busy */
+int
+istgt_lu_disk_queue_claim(ISTGT_LU_DISK *spec, uint64_t lba, uint64_t len)
+{
+	int slot;
 
 	MTX_LOCK(&spec->cmd_queue_mutex);
-	lu_task = istgt_queue_dequeue(&spec->cmd_queue);
+	slot = istgt_lu_disk_queue_claim_range(spec, lba, len, 1, 0);
 	MTX_UNLOCK(&spec->cmd_queue_mutex);
-	if (lu_task == NULL) {
-		/* cleared or empty queue */
+	return slot;
+}
+
+void
+istgt_lu_disk_queue_unclaim(ISTGT_LU_DISK *spec, int slot)
+{
+	istgt_lu_disk_queue_release(spec->lu, spec, slot);
+	if (spec->lu->luworkers <= 1 && spec->aio == NULL) {
+		istgt_lu_disk_queue_wakeup(spec->lu);
+	}
+}
+
+/* release the slot held by a zero-copy READ after its DATA-IN */
+void
+istgt_lu_disk_queue_release_task(ISTGT_LU_TASK_Ptr lu_task)
+{
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_DISK *spec;
+
+	lu = lu_task->lu_cmd.lu;
+	spec = (ISTGT_LU_DISK *)
+	    lu->lun[istgt_lu_islun2lun(lu_task->lu_cmd.lun)].spec;
+	istgt_lu_disk_queue_release(lu, spec, lu_task->slot);
+	if (lu->luworkers <= 1 && spec->aio == NULL) {
+		/* a single worker may wait for this range */
+		istgt_lu_disk_queue_wakeup(lu);
+	}
+}
+
+/* return 1 if submitted to aio engine, 0 if it must be executed here */
+static int
+istgt_lu_disk_queue_submit_aio(ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr lu_task, int slot)
+{
+	ISTGT_LU_CMD_Ptr lu_cmd;
+	ISTGT_LU_AIO *aio;
+	uint8_t *cdb;
+	uint64_t maxlba;
+	uint64_t lba, len;
+	uint64_t offset;
+	uint64_t nbytes;
+	int write;
+	int op, flags;
+	int rc;
+
+	lu_cmd = &lu_task->lu_cmd;
+	cdb = lu_cmd->cdb;
+	if (spec->sense != 0 || istgt_lu_disk_wcache_error(spec, NULL)
+	    || spec->rsv_key != 0) {
+		/* sense or reservation is handled by execute */
+		return 0;
+	}
+
+	flags = 0;
+	if (istgt_lu_disk_rw_range(cdb, &lba, &len, &write) == 0) {
+		if (len == 0)
+			return 0;
+		if (write) {
+			if (lu_cmd->W_bit == 0 || spec->lu->readonly)
+				return 0;
+			op = ISTGT_LU_AIO_WRITE;
+			if (cdb[0] != SBC_WRITE_6 && BGET8(&cdb[1], 3)
+			    && spec->write_cache) {
+				/* FUA */
+				flags |= ISTGT_LU_AIO_FUA;
+			}
+		} else {
+			if (lu_cmd->R_bit == 0)
+				return 0;
+			op = ISTGT_LU_AIO_READ;
+		}
+	} else if (cdb[0] == SBC_SYNCHRONIZE_CACHE_10) {
+		lba = (uint64_t) DGET32(&cdb[2]);
+		len = (uint64_t) DGET16(&cdb[7]);
+		op = ISTGT_LU_AIO_SYNC;
+	} else if (cdb[0] == SBC_SYNCHRONIZE_CACHE_16) {
+		lba = (uint64_t) DGET64(&cdb[2]);
+		len = (uint64_t) DGET32(&cdb[10]);
+		op = ISTGT_LU_AIO_SYNC;
+	} else {
+		return 0;
+	}
+	maxlba = spec->blockcnt;
+	if (op == ISTGT_LU_AIO_SYNC && len == 0) {
+		len = maxlba;
+	}
+	if (lba >= maxlba || len > maxlba || lba > (maxlba - len)) {
+		/* error is reported by execute */
+		return 0;
+	}
+	offset = lba * spec->blocklen;
+	nbytes = len * spec->blocklen;
+	if (op != ISTGT_LU_AIO_SYNC) {
+		if (nbytes > lu_cmd->iobufsize) {
+			/* including zero-copy READ without iobuf */
+			return 0;
+		}
+		if (spec->lu->istgt->swmode >= ISTGT_SWMODE_EXPERIMENTAL) {
+			/* outside of allocated media is emulated */
+			MTX_LOCK(&spec->fsize_mutex);
+			rc = (offset + nbytes > spec->fsize);
+			MTX_UNLOCK(&spec->fsize_mutex);
+			if (rc)
+				return 0;
+		}
+	}
+
+	aio = &lu_task->aio;
+	memset(aio, 0, sizeof *aio);
+	aio->op = op;
+	aio->flags = flags;
+	aio->fd = spec->fd;
+	if (op != ISTGT_LU_AIO_SYNC) {
+		aio->iov.iov_base = lu_cmd->iobuf;
+		aio->iov.iov_len = (size_t) nbytes;
+		aio->offset = offset;
+	}
+	aio->done = istgt_lu_disk_queue_aio_done;
+	aio->arg = (void *) lu_task;
+	lu_task->slot = slot;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+	    "AIO op=%d: lba=%"PRIu64", len=%"PRIu64", flags=%x\n",
+	    op, lba, len, flags);
+	if (op == ISTGT_LU_AIO_WRITE) {
+		istgt_lu_disk_amap_mapped(spec, offset, nbytes);
+	}
+	rc = istgt_lu_disk_aio_submit(spec, aio);
+	if (rc < 0) {
 		return 0;
 	}
+	return 1;
+}
+
+static int
+istgt_lu_disk_queue_exec_cmd(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task, int slot)
+{
+	ISTGT_LU_CMD_Ptr lu_cmd;
+	int rc;
+
+	lu_cmd = &lu_task->lu_cmd;
+	lu_cmd->ts_start = istgt_clock_usec();
+	if (spec->aio != NULL) {
+		/* reset waits for submitted I/O */
+		RW_RDLOCK(&spec->io_rwlock);
+		rc = istgt_lu_disk_queue_submit_aio(spec, lu_task, slot);
+		RW_UNLOCK(&spec->io_rwlock);
+		if (rc > 0) {
+			/* completion releases the slot */
+			return 1;
+		}
+	}
+
+	if (spec->exec[slot].barrier) {
+		MTX_LOCK(&lu_cmd->lu->mutex);
+		rc = istgt_lu_disk_execute(conn, lu_cmd);
+		MTX_UNLOCK(&lu_cmd->lu->mutex);
+	} else {
+		/* independent READ/WRITE/COMPARE AND WRITE */
+		RW_RDLOCK(&spec->io_rwlock);
+		rc = istgt_lu_disk_execute(conn, lu_cmd);
+		RW_UNLOCK(&spec->io_rwlock);
+	}
+	return rc;
+}
+
+static int
+istgt_lu_disk_queue_start_task(ISTGT_LU_Ptr lu, int lun, ISTGT_LU_DISK *spec, ISTGT_LU_TASK_Ptr lu_task, int slot)
+{
+	ISTGT_Ptr istgt;
+	CONN_Ptr conn;
+	ISTGT_LU_CMD_Ptr lu_cmd;
+	struct timespec abstime;
+	time_t start, now;
+	uint8_t *iobuf;
+	char tmp[1];
+	int abort_task = 0;
+	int hold_slot;
+	int rc;
+
 	lu_task->thread = pthread_self();
 	conn = lu_task->conn;
 	istgt = conn->istgt;
@@ -5190,9 +6728,11 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 #endif
 			lu_cmd->iobuf = iobuf;
 
-			MTX_LOCK(&lu_cmd->lu->mutex);
-			rc = istgt_lu_disk_execute(conn, lu_cmd);
-			MTX_UNLOCK(&lu_cmd->lu->mutex);
+			rc = istgt_lu_disk_queue_exec_cmd(spec, conn, lu_task, slot);
+			if (rc > 0) {
+				/* response by aio completion */
+				return 1;
+			}
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_execute() failed\n");
 			error_return:
@@ -5206,33 +6746,10 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 			lu_task->execute = 1;
 
 			/* response */
-			if (conn->use_sender == 0) {
-				MTX_LOCK(&conn->task_queue_mutex);
-				rc = istgt_queue_enqueue(&conn->task_queue, lu_task);
-				MTX_UNLOCK(&conn->task_queue_mutex);
-				if (rc < 0) {
-					ISTGT_ERRLOG("queue_enqueue() failed\n");
-					goto error_return;
-				}
-				rc = write(conn->task_pipe[1], tmp, 1);
-				if(rc < 0 || rc != 1) {
-					ISTGT_ERRLOG("write() failed\n");
-					goto error_return;
-				}
-			} else {
-				MTX_LOCK(&conn->result_queue_mutex);
-				rc = istgt_queue_enqueue(&conn->result_queue, lu_task);
-				if (rc < 0) {
-					MTX_UNLOCK(&conn->result_queue_mutex);
-					ISTGT_ERRLOG("queue_enqueue() failed\n");
-					goto error_return;
-				}
-				rc = pthread_cond_broadcast(&conn->result_queue_cond);
-				MTX_UNLOCK(&conn->result_queue_mutex);
-				if (rc != 0) {
-					ISTGT_ERRLOG("cond_broadcast() failed\n");
-					goto error_return;
-				}
+			rc = istgt_lu_disk_queue_response(conn, lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_disk_queue_response() failed\n");
+				goto error_return;
 			}
 
 #if 0
@@ -5254,7 +6771,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 
 #if 0
 			MTX_LOCK(&spec->wait_lu_task_mutex);
-			spec->wait_lu_task = NULL;
+			spec->wait_lu_task[slot] = NULL;
 			MTX_UNLOCK(&spec->wait_lu_task_mutex);
 #endif
 			rc = pthread_mutex_init(&lu_task->trans_mutex, NULL);
@@ -5287,12 +6804,10 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 			abstime.tv_sec = 0;
 			abstime.tv_nsec = 0;
 
-			MTX_LOCK(&conn->task_queue_mutex);
-			rc = istgt_queue_enqueue(&conn->task_queue, lu_task);
-			MTX_UNLOCK(&conn->task_queue_mutex);
+			rc = istgt_iscsi_queue_task(conn, lu_task);
 			if (rc < 0) {
 				MTX_UNLOCK(&lu_task->trans_mutex);
-				ISTGT_ERRLOG("queue_enqueue() failed\n");
+				ISTGT_ERRLOG("queue_task() failed\n");
 				goto error_return;
 			}
 			rc = write(conn->task_pipe[1], tmp, 1);
@@ -5310,7 +6825,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 #endif
 			MTX_LOCK(&lu_task->trans_mutex);
 			MTX_LOCK(&spec->wait_lu_task_mutex);
-			spec->wait_lu_task = lu_task;
+			spec->wait_lu_task[slot] = lu_task;
 			MTX_UNLOCK(&spec->wait_lu_task_mutex);
 			rc = 0;
 			while (lu_task->req_transfer_out == 1) {
@@ -5321,7 +6836,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 					if (lu_task->req_transfer_out == 1) {
 						lu_task->error = 1;
 						MTX_LOCK(&spec->wait_lu_task_mutex);
-						spec->wait_lu_task = NULL;
+						spec->wait_lu_task[slot] = NULL;
 						MTX_UNLOCK(&spec->wait_lu_task_mutex);
 						MTX_UNLOCK(&lu_task->trans_mutex);
 						now = time(NULL);
@@ -5345,7 +6860,7 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 				}
 			}
 			MTX_LOCK(&spec->wait_lu_task_mutex);
-			spec->wait_lu_task = NULL;
+			spec->wait_lu_task[slot] = NULL;
 			MTX_UNLOCK(&spec->wait_lu_task_mutex);
 			MTX_UNLOCK(&lu_task->trans_mutex);
 			if (rc != 0) {
@@ -5377,9 +6892,11 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 				ISTGT_ERRLOG("wrong request\n");
 				goto error_return;
 			}
-			MTX_LOCK(&lu_cmd->lu->mutex);
-			rc = istgt_lu_disk_execute(conn, lu_cmd);
-			MTX_UNLOCK(&lu_cmd->lu->mutex);
+			rc = istgt_lu_disk_queue_exec_cmd(spec, conn, lu_task, slot);
+			if (rc > 0) {
+				/* response by aio completion */
+				return 1;
+			}
 			if (rc < 0) {
 				lu_task->error = 1;
 				ISTGT_ERRLOG("lu_disk_execute() failed\n");
@@ -5388,33 +6905,10 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 			lu_task->execute = 1;
 
 			/* response */
-			if (conn->use_sender == 0) {
-				MTX_LOCK(&conn->task_queue_mutex);
-				rc = istgt_queue_enqueue(&conn->task_queue, lu_task);
-				MTX_UNLOCK(&conn->task_queue_mutex);
-				if (rc < 0) {
-					ISTGT_ERRLOG("queue_enqueue() failed\n");
-					goto error_return;
-				}
-				rc = write(conn->task_pipe[1], tmp, 1);
-				if(rc < 0 || rc != 1) {
-					ISTGT_ERRLOG("write() failed\n");
-					goto error_return;
-				}
-			} else {
-				MTX_LOCK(&conn->result_queue_mutex);
-				rc = istgt_queue_enqueue(&conn->result_queue, lu_task);
-				if (rc < 0) {
-					MTX_UNLOCK(&conn->result_queue_mutex);
-					ISTGT_ERRLOG("queue_enqueue() failed\n");
-					goto error_return;
-				}
-				rc = pthread_cond_broadcast(&conn->result_queue_cond);
-				MTX_UNLOCK(&conn->result_queue_mutex);
-				if (rc != 0) {
-					ISTGT_ERRLOG("cond_broadcast() failed\n");
-					goto error_return;
-				}
+			rc = istgt_lu_disk_queue_response(conn, lu_task);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_disk_queue_response() failed\n");
+				goto error_return;
 			}
 
 #if 0
@@ -5443,43 +6937,35 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 		iobuf = lu_task->iobuf;
 #endif
 		lu_cmd->iobuf = iobuf;
-		MTX_LOCK(&lu_cmd->lu->mutex);
-		rc = istgt_lu_disk_execute(conn, lu_cmd);
-		MTX_UNLOCK(&lu_cmd->lu->mutex);
+		rc = istgt_lu_disk_queue_exec_cmd(spec, conn, lu_task, slot);
+		if (rc > 0) {
+			/* response by aio completion */
+			return 1;
+		}
 		if (rc < 0) {
 			ISTGT_ERRLOG("lu_disk_execute() failed\n");
 			goto error_return;
 		}
 		lu_task->execute = 1;
 
+		if (lu_cmd->zcopy) {
+			/* data is read at sending, keep the LBA range locked */
+			lu_task->slot = slot;
+			lu_task->hold_slot = 1;
+		}
+		hold_slot = lu_task->hold_slot;
+
 		/* response */
-		if (conn->use_sender == 0) {
-			MTX_LOCK(&conn->task_queue_mutex);
-			rc = istgt_queue_enqueue(&conn->task_queue, lu_task);
-			MTX_UNLOCK(&conn->task_queue_mutex);
-			if (rc < 0) {
-				ISTGT_ERRLOG("queue_enqueue() failed\n");
-				goto error_return;
-			}
-			rc = write(conn->task_pipe[1], tmp, 1);
-			if(rc < 0 || rc != 1) {
-				ISTGT_ERRLOG("write() failed\n");
-				goto error_return;
-			}
-		} else {
-			MTX_LOCK(&conn->result_queue_mutex);
-			rc = istgt_queue_enqueue(&conn->result_queue, lu_task);
-			if (rc < 0) {
-				MTX_UNLOCK(&conn->result_queue_mutex);
-				ISTGT_ERRLOG("queue_enqueue() failed\n");
-				goto error_return;
-			}
-			rc = pthread_cond_broadcast(&conn->result_queue_cond);
-			MTX_UNLOCK(&conn->result_queue_mutex);
-			if (rc != 0) {
-				ISTGT_ERRLOG("cond_broadcast() failed\n");
-				goto error_return;
-			}
+		rc = istgt_lu_disk_queue_response(conn, lu_task);
+		if (rc < 0) {
+			ISTGT_ERRLOG("lu_disk_queue_response() failed\n");
+			/* released by caller */
+			lu_task->hold_slot = 0;
+			goto error_return;
+		}
+		if (hold_slot) {
+			/* slot is released by lu_destroy_task() */
+			return 1;
 		}
 	}
 
@@ -5493,6 +6979,97 @@ istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
 	return 0;
 }
 
+int
+istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun)
+{
+	ISTGT_LU_DISK *spec;
+	ISTGT_LU_TASK_Ptr lu_task;
+	uint64_t wait;
+	int slot;
+	int rc;
+
+	if (lun < 0 || lun >= lu->maxlun) {
+		return -1;
+	}
+
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "LU%d: LUN%d queue start\n",
+	    lu->num, lun);
+	spec = (ISTGT_LU_DISK *) lu->lun[lun].spec;
+	if (spec == NULL)
+		return -1;
+
+	MTX_LOCK(&spec->cmd_queue_mutex);
+	if (spec->queued == 0) {
+		MTX_UNLOCK(&spec->cmd_queue_mutex);
+		/* cleared or empty queue */
+		return 0;
+	}
+	lu_task = istgt_lu_disk_queue_pick(lu, spec, &slot, &wait);
+	MTX_UNLOCK(&spec->cmd_queue_mutex);
+	if (lu_task == NULL) {
+		if (wait != 0) {
+			/* wake up the worker when credit is due */
+			MTX_LOCK(&lu->queue_mutex);
+			if (lu->qos_wait == 0 || wait < lu->qos_wait)
+				lu->qos_wait = wait;
+			MTX_UNLOCK(&lu->queue_mutex);
+		}
+		/* wait for executing tasks or credit */
+		return 1;
+	}
+
+	rc = istgt_lu_disk_queue_start_task(lu, lun, spec, lu_task, slot);
+	if (rc == 1) {
+		/* executing asynchronously */
+		return 0;
+	}
+	istgt_lu_disk_queue_release(lu, spec, slot);
+	return rc;
+}
+
+/* hold an unqueued command back until the unit and group limits allow */
+void
+istgt_lu_disk_throttle(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
+{
+	ISTGT_LU_Ptr lu;
+	struct timespec ts;
+	uint64_t lba, len, bytes;
+	uint64_t start, now, w1, w2;
+	int write;
+
+	lu = lu_cmd->lu;
+	if (lu->qos == NULL && conn->qos == NULL)
+		return;
+	if (istgt_lu_disk_exec_range(lu_cmd->cdb, &lba, &len, &write) < 0)
+		return;
+	bytes = (uint64_t) lu_cmd->transfer_len;
+	start = 0;
+	while (1) {
+		now = istgt_clock_usec();
+		MTX_LOCK(&lu->qos_mutex);
+		w1 = istgt_qos_wait(lu->qos, bytes, now);
+		w2 = istgt_qos_wait(conn->qos, bytes, now);
+		if (w1 == 0 && w2 == 0) {
+			istgt_qos_charge(lu->qos, bytes,
+			    (start != 0) ? now - start : 0);
+			istgt_qos_charge(conn->qos, bytes,
+			    (start != 0) ? now - start : 0);
+			MTX_UNLOCK(&lu->qos_mutex);
+			return;
+		}
+		MTX_UNLOCK(&lu->qos_mutex);
+		if (start == 0)
+			start = now;
+		if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING)
+			return;
+		if (w2 > w1)
+			w1 = w2;
+		ts.tv_sec = (time_t) (w1 / 1000000);
+		ts.tv_nsec = (long) (w1 % 1000000) * 1000;
+		(void) nanosleep(&ts, NULL);
+	}
+}
+
 int
 istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 {
@@ -5503,6 +7080,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 	uint32_t allocation_len;
 	int data_len;
 	int data_alloc_len;
+	uint64_t woffset;
 	uint64_t lba;
 	uint32_t len;
 	uint32_t transfer_len;
@@ -5589,15 +7167,14 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 		}
 	}
 
-	if (spec->err_write_cache) {
+	if (istgt_lu_disk_wcache_error(spec, &woffset)) {
 		/* WRITE ERROR - AUTO REALLOCATION FAILED */
 		BUILD_SENSE2(MEDIUM_ERROR, 0x0c, 0x02);
 #if 0
 		/* WRITE ERROR - RECOMMEND REASSIGNMENT */
 		BUILD_SENSE2(MEDIUM_ERROR, 0x0c, 0x03);
 #endif
-		spec->err_write_cache = 0;
-		lba = spec->woffset / spec->blocklen;
+		lba = woffset / spec->blocklen;
 		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
 		    "Deferred error (write cache) at %"PRIu64"\n", lba);
 		if (lba > 0xffffffffULL) {
@@ -5757,10 +7334,49 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			DSET32(&data[8], (uint32_t) spec->blocklen);
 			data[12] = 0;                   /* RTO_EN(1) PROT_EN(0) */
 			memset(&data[13], 0, 32 - (8 + 4 + 1));     /* Reserved */
+			if (spec->thin_provisioning) {
+				/* LBPME(7) LBPRZ(6) */
+				BDSET8(&data[14], 1, 7);
+				BDADD8(&data[14], spec->unmap_lbprz, 6);
+			}
 			data_len = 32;
 			lu_cmd->data_len = DMIN32((size_t)data_len, lu_cmd->transfer_len);
 			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
 			break;
+		case SBC_SAI_GET_LBA_STATUS:
+			if (lu_cmd->R_bit == 0) {
+				ISTGT_ERRLOG("R_bit == 0\n");
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				return -1;
+			}
+			if (spec->rsv_key) {
+				rc = istgt_lu_disk_check_pr(spec, conn, PR_ALLOW(1,0,1,1,0));
+				if (rc != 0) {
+					lu_cmd->status = ISTGT_SCSI_STATUS_RESERVATION_CONFLICT;
+					break;
+				}
+			}
+			lba = DGET64(&cdb[2]);
+			allocation_len = DGET32(&cdb[10]);
+			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+			    "GET_LBA_STATUS(lba %"PRIu64", len %u)\n",
+			    lba, allocation_len);
+			if (allocation_len == 0) {
+				lu_cmd->data_len = 0;
+				lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+				break;
+			}
+			data_len = istgt_lu_disk_get_lba_status(spec, conn, lu_cmd,
+			    lba, data, DMIN32(allocation_len, (size_t) data_alloc_len));
+			if (data_len < 0) {
+				/* sense data build by function */
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			lu_cmd->data_len = DMIN32((size_t)data_len, lu_cmd->transfer_len);
+			lu_cmd->data_len = DMIN32(lu_cmd->data_len, allocation_len);
+			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+			break;
 		case SBC_SAI_READ_LONG_16:
 		default:
 			/* INVALID COMMAND OPERATION CODE */
@@ -6235,7 +7851,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
 			    "WRITE_6(lba %"PRIu64", len %u blocks)\n",
 			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len);
+			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len, 0);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6272,7 +7888,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
 			    "WRITE_10(lba %"PRIu64", len %u blocks)\n",
 			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len);
+			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len, fua);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6309,7 +7925,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
 			    "WRITE_12(lba %"PRIu64", len %u blocks)\n",
 			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len);
+			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len, fua);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6346,7 +7962,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
 			    "WRITE_16(lba %"PRIu64", len %u blocks)\n",
 			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len);
+			rc = istgt_lu_disk_lbwrite(spec, conn, lu_cmd, lba, transfer_len, fua);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6430,7 +8046,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 
 	case SBC_WRITE_SAME_10:
 		{
-			int wprotect, pbdata, lbdata, group_no;
+			int wprotect, unmap, pbdata, lbdata, group_no;
 
 			if (spec->rsv_key) {
 				rc = istgt_lu_disk_check_pr(spec, conn, PR_ALLOW(0,0,1,0,0));
@@ -6447,6 +8063,7 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			}
 
 			wprotect = BGET8W(&cdb[1], 7, 3);
+			unmap = BGET8(&cdb[1], 3);
 			pbdata = BGET8(&cdb[1], 2);
 			lbdata = BGET8(&cdb[1], 1);
 			lba = (uint64_t) DGET32(&cdb[2]);
@@ -6460,11 +8077,18 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
 				break;
 			}
+			/* UNMAP=1 requires LBPWS/LBPWS10 */
+			if (unmap && !spec->thin_provisioning) {
+				/* INVALID FIELD IN CDB */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
 
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
-			    "WRITE_SAME_10(lba %"PRIu64", len %u blocks)\n",
-			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite_same(spec, conn, lu_cmd, lba, transfer_len);
+			    "WRITE_SAME_10(lba %"PRIu64", len %u blocks, unmap %d)\n",
+			    lba, transfer_len, unmap);
+			rc = istgt_lu_disk_lbwrite_same(spec, conn, lu_cmd, lba, transfer_len, unmap);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite_same() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6511,6 +8135,13 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
 				break;
 			}
+			/* UNMAP=1 requires LBPWS/LBPWS10 */
+			if (unmap && !spec->thin_provisioning) {
+				/* INVALID FIELD IN CDB */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
 			if (anchor) {
 				/* INVALID FIELD IN CDB */
 				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
@@ -6519,9 +8150,9 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			}
 
 			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
-			    "WRITE_SAME_16(lba %"PRIu64", len %u blocks)\n",
-			    lba, transfer_len);
-			rc = istgt_lu_disk_lbwrite_same(spec, conn, lu_cmd, lba, transfer_len);
+			    "WRITE_SAME_16(lba %"PRIu64", len %u blocks, unmap %d)\n",
+			    lba, transfer_len, unmap);
+			rc = istgt_lu_disk_lbwrite_same(spec, conn, lu_cmd, lba, transfer_len, unmap);
 			if (rc < 0) {
 				ISTGT_ERRLOG("lu_disk_lbwrite_same() failed\n");
 				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
@@ -6531,6 +8162,67 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 			break;
 		}
 
+	case SBC_UNMAP:
+		{
+			int anchor;
+
+			if (spec->rsv_key) {
+				rc = istgt_lu_disk_check_pr(spec, conn, PR_ALLOW(0,0,1,0,0));
+				if (rc != 0) {
+					lu_cmd->status = ISTGT_SCSI_STATUS_RESERVATION_CONFLICT;
+					break;
+				}
+			}
+
+			if (!spec->thin_provisioning) {
+				/* INVALID COMMAND OPERATION CODE */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x20, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+
+			anchor = BGET8(&cdb[1], 0);
+			parameter_len = DGET16(&cdb[7]);
+			if (anchor) {
+				/* INVALID FIELD IN CDB */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			if (parameter_len == 0) {
+				lu_cmd->data_len = 0;
+				lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+				break;
+			}
+			if (parameter_len > lu_cmd->iobufsize) {
+				/* PARAMETER LIST LENGTH ERROR */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+
+			rc = istgt_lu_disk_transfer_data(conn, lu_cmd, lu_cmd->iobuf,
+			    lu_cmd->iobufsize, parameter_len);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_disk_transfer_data() failed\n");
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+
+			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+			    "UNMAP(parameter list %u bytes)\n", parameter_len);
+			rc = istgt_lu_disk_lbunmap(spec, conn, lu_cmd, lu_cmd->iobuf,
+			    (int) parameter_len);
+			if (rc < 0) {
+				/* sense data build by function */
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			lu_cmd->data_len = 0;
+			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+			break;
+		}
+
 	case SBC_COMPARE_AND_WRITE:
 		{
 			int64_t maxlen;
@@ -6916,10 +8608,106 @@ istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd)
 		lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
 		break;
 	case SPC_EXTENDED_COPY:
-		/* INVALID COMMAND OPERATION CODE */
-		BUILD_SENSE(ILLEGAL_REQUEST, 0x20, 0x00);
-		lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+		{
+			int sa;
+
+			sa = BGET8W(&cdb[1], 4, 5);
+			parameter_len = DGET32(&cdb[10]);
+			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+			    "EXTENDED_COPY sa=0x%2.2x, len=%d\n",
+			    sa, parameter_len);
+
+			if (sa != 0x00) {
+				/* LID4 is not supported */
+				/* INVALID FIELD IN CDB */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			if (parameter_len == 0) {
+				lu_cmd->data_len = 0;
+				lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+				break;
+			}
+			if (parameter_len > lu_cmd->iobufsize) {
+				/* PARAMETER LIST LENGTH ERROR */
+				BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+
+			if (spec->rsv_key) {
+				rc = istgt_lu_disk_check_pr(spec, conn, PR_ALLOW(0,0,1,0,0));
+				if (rc != 0) {
+					lu_cmd->status = ISTGT_SCSI_STATUS_RESERVATION_CONFLICT;
+					break;
+				}
+			}
+
+			rc = istgt_lu_disk_transfer_data(conn, lu_cmd, lu_cmd->iobuf,
+			    lu_cmd->iobufsize, parameter_len);
+			if (rc < 0) {
+				ISTGT_ERRLOG("lu_disk_transfer_data() failed\n");
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+
+			rc = istgt_lu_disk_xcopy(spec, conn, lu_cmd, lu_cmd->iobuf,
+			    (int) parameter_len);
+			if (rc == -2) {
+				/* destination is in use, retry later */
+				lu_cmd->data_len = 0;
+				lu_cmd->status = ISTGT_SCSI_STATUS_BUSY;
+				break;
+			}
+			if (rc < 0) {
+				/* sense data build by function */
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			lu_cmd->data_len = parameter_len;
+			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+		}
+		break;
+
+	case SPC_RECEIVE_COPY_RESULTS:
+		{
+			int sa, list_id;
+
+			if (lu_cmd->R_bit == 0) {
+				ISTGT_ERRLOG("R_bit == 0\n");
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				return -1;
+			}
+
+			sa = BGET8W(&cdb[1], 4, 5);
+			list_id = cdb[2];
+			allocation_len = DGET32(&cdb[10]);
+			ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+			    "RECEIVE_COPY_RESULTS sa=0x%2.2x, list=%d\n",
+			    sa, list_id);
+			if (allocation_len > (size_t) data_alloc_len) {
+				ISTGT_ERRLOG("data_alloc_len(%d) too small\n",
+				    data_alloc_len);
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				return -1;
+			}
+			memset(data, 0, allocation_len);
+
+			data_len = istgt_lu_disk_receive_copy_results(spec, conn,
+			    lu_cmd, sa, list_id, data, data_alloc_len);
+			if (data_len < 0) {
+				/* sense data build by function */
+				lu_cmd->status = ISTGT_SCSI_STATUS_CHECK_CONDITION;
+				break;
+			}
+			ISTGT_TRACEDUMP(ISTGT_TRACE_DEBUG, "RECEIVE_COPY_RESULTS",
+			    data, data_len);
+			lu_cmd->data_len = DMIN32((size_t)data_len, allocation_len);
+			lu_cmd->status = ISTGT_SCSI_STATUS_GOOD;
+		}
 		break;
+
 	case SPC2_RELEASE_6:
 		ISTGT_TRACELOG(ISTGT_TRACE_SCSI, "RELEASE_6\n");
 		rc = istgt_lu_disk_scsi_release(spec, conn, lu_cmd);
@@ -0,0 +1,714 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+#if defined (__linux__) && defined (HAVE_LINUX_IO_URING_H) \
+	&& defined (__NR_io_uring_setup) && defined (__NR_io_uring_enter)
+#define USE_LU_AIO_URING
+#endif
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC 0x00000002
+#endif
+
+#define ISTGT_LU_AIO_THREADS 4
+
+typedef enum {
+	ISTGT_LU_AIO_ENGINE_THREAD = 0,
+	ISTGT_LU_AIO_ENGINE_URING = 1,
+} ISTGT_LU_AIO_ENGINE_TYPE;
+
+typedef struct istgt_lu_disk_aio_t {
+	ISTGT_LU_DISK *spec;
+	int type;
+	int depth;
+
+	pthread_mutex_t mutex;
+	/* signaled when a request completed */
+	pthread_cond_t done_cond;
+	int inflight;
+	int stop;
+
+	/* thread pool */
+	pthread_cond_t work_cond;
+	ISTGT_LU_AIO *head;
+	ISTGT_LU_AIO *tail;
+	int nthreads;
+	pthread_t thread[ISTGT_LU_AIO_THREADS];
+
+#ifdef USE_LU_AIO_URING
+	/* io_uring */
+	int ring_fd;
+	pthread_t cq_thread;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif /* USE_LU_AIO_URING */
+} ISTGT_LU_DISK_AIO;
+
+static void
+istgt_lu_disk_aio_complete(ISTGT_LU_DISK_AIO *aiop, ISTGT_LU_AIO *aio, int64_t result)
+{
+	aio->result = result;
+	if (aio->done != NULL) {
+		aio->done(aio);
+	}
+
+	/* the callback has finished with the request */
+	MTX_LOCK(&aiop->mutex);
+	aiop->inflight--;
+	pthread_cond_broadcast(&aiop->done_cond);
+	MTX_UNLOCK(&aiop->mutex);
+}
+
+static int64_t
+istgt_lu_disk_aio_execute(ISTGT_LU_AIO *aio)
+{
+	uint8_t *buf;
+	uint64_t nbytes;
+	uint64_t offset;
+	int64_t total;
+	ssize_t rc;
+
+	buf = (uint8_t *) aio->iov.iov_base;
+	nbytes = (uint64_t) aio->iov.iov_len;
+	offset = aio->offset;
+	total = 0;
+
+	switch (aio->op) {
+	case ISTGT_LU_AIO_NOP:
+		return 0;
+	case ISTGT_LU_AIO_READ:
+		while ((uint64_t) total < nbytes) {
+			rc = pread(aio->fd, buf + total, (size_t) (nbytes - total),
+			    (off_t) (offset + total));
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (rc == 0) {
+				/* EOF */
+				break;
+			}
+			total += rc;
+		}
+		return total;
+	case ISTGT_LU_AIO_WRITE:
+		while ((uint64_t) total < nbytes) {
+			rc = pwrite(aio->fd, buf + total, (size_t) (nbytes - total),
+			    (off_t) (offset + total));
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			total += rc;
+		}
+		if (aio->flags & ISTGT_LU_AIO_FUA) {
+			rc = fdatasync(aio->fd);
+			if (rc < 0) {
+				return -errno;
+			}
+		}
+		return total;
+	case ISTGT_LU_AIO_SYNC:
+		rc = fsync(aio->fd);
+		if (rc < 0) {
+			return -errno;
+		}
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static void *
+istgt_lu_disk_aio_worker(void *arg)
+{
+	ISTGT_LU_DISK_AIO *aiop = (ISTGT_LU_DISK_AIO *) arg;
+	ISTGT_LU_AIO *aio;
+	int64_t result;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d aio worker start\n",
+	    aiop->spec->num, aiop->spec->lun);
+	while (1) {
+		MTX_LOCK(&aiop->mutex);
+		while (aiop->head == NULL && !aiop->stop) {
+			pthread_cond_wait(&aiop->work_cond, &aiop->mutex);
+		}
+		aio = aiop->head;
+		if (aio == NULL) {
+			/* stop and no more request */
+			MTX_UNLOCK(&aiop->mutex);
+			break;
+		}
+		aiop->head = aio->next;
+		if (aiop->head == NULL) {
+			aiop->tail = NULL;
+		}
+		aio->next = NULL;
+		MTX_UNLOCK(&aiop->mutex);
+
+		result = istgt_lu_disk_aio_execute(aio);
+		istgt_lu_disk_aio_complete(aiop, aio, result);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d aio worker end\n",
+	    aiop->spec->num, aiop->spec->lun);
+	return NULL;
+}
+
+static int
+istgt_lu_disk_aio_thread_init(ISTGT_LU_DISK_AIO *aiop)
+{
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	char buf[MAX_TMPBUF];
+#endif
+	int rc;
+	int i;
+
+	aiop->head = NULL;
+	aiop->tail = NULL;
+	aiop->nthreads = 0;
+	for (i = 0; i < ISTGT_LU_AIO_THREADS; i++) {
+#ifdef ISTGT_STACKSIZE
+		rc = pthread_create(&aiop->thread[i], &aiop->spec->lu->istgt->attr,
+		    &istgt_lu_disk_aio_worker, (void *) aiop);
+#else
+		rc = pthread_create(&aiop->thread[i], NULL,
+		    &istgt_lu_disk_aio_worker, (void *) aiop);
+#endif
+		if (rc != 0) {
+			ISTGT_ERRLOG("pthread_create() failed\n");
+			break;
+		}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+		snprintf(buf, sizeof buf, "aiothread #%d.%d.%d",
+		    aiop->spec->num, aiop->spec->lun, i);
+		pthread_set_name_np(aiop->thread[i], buf);
+#endif
+		aiop->nthreads++;
+	}
+	if (aiop->nthreads == 0) {
+		return -1;
+	}
+	aiop->type = ISTGT_LU_AIO_ENGINE_THREAD;
+	return 0;
+}
+
+static void
+istgt_lu_disk_aio_thread_shutdown(ISTGT_LU_DISK_AIO *aiop)
+{
+	int i;
+
+	MTX_LOCK(&aiop->mutex);
+	aiop->stop = 1;
+	pthread_cond_broadcast(&aiop->work_cond);
+	MTX_UNLOCK(&aiop->mutex);
+	for (i = 0; i < aiop->nthreads; i++) {
+		(void) pthread_join(aiop->thread[i], NULL);
+	}
+	aiop->nthreads = 0;
+}
+
+static void
+istgt_lu_disk_aio_thread_submit(ISTGT_LU_DISK_AIO *aiop, ISTGT_LU_AIO *aio)
+{
+	/* called with mutex held */
+	aio->next = NULL;
+	if (aiop->tail == NULL) {
+		aiop->head = aio;
+	} else {
+		aiop->tail->next = aio;
+	}
+	aiop->tail = aio;
+	pthread_cond_signal(&aiop->work_cond);
+}
+
+#ifdef USE_LU_AIO_URING
+static int
+istgt_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+istgt_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, NULL, 0);
+}
+
+static void *
+istgt_lu_disk_aio_uring_worker(void *arg)
+{
+	ISTGT_LU_DISK_AIO *aiop = (ISTGT_LU_DISK_AIO *) arg;
+	struct io_uring_cqe *cqe;
+	ISTGT_LU_AIO *aio;
+	uint32_t head, tail;
+	int64_t result;
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d io_uring worker start\n",
+	    aiop->spec->num, aiop->spec->lun);
+	while (1) {
+		head = *aiop->cq_head;
+		tail = __atomic_load_n(aiop->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			rc = istgt_io_uring_enter(aiop->ring_fd, 0, 1,
+			    IORING_ENTER_GETEVENTS);
+			if (rc < 0 && errno != EINTR) {
+				ISTGT_ERRLOG("io_uring_enter() failed (errno=%d)\n",
+				    errno);
+				break;
+			}
+			continue;
+		}
+		cqe = &aiop->cqes[head & *aiop->cq_mask];
+		aio = (ISTGT_LU_AIO *) (uintptr_t) cqe->user_data;
+		result = (int64_t) cqe->res;
+		__atomic_store_n(aiop->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (aio == NULL) {
+			/* wakeup by shutdown */
+			if (aiop->stop)
+				break;
+			continue;
+		}
+		istgt_lu_disk_aio_complete(aiop, aio, result);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d io_uring worker end\n",
+	    aiop->spec->num, aiop->spec->lun);
+	return NULL;
+}
+
+static void
+istgt_lu_disk_aio_uring_unmap(ISTGT_LU_DISK_AIO *aiop)
+{
+	if (aiop->sqes != NULL && aiop->sqes != MAP_FAILED) {
+		munmap(aiop->sqes, aiop->sqes_size);
+	}
+	if (aiop->cq_ptr != NULL && aiop->cq_ptr != MAP_FAILED
+	    && aiop->cq_ptr != aiop->sq_ptr) {
+		munmap(aiop->cq_ptr, aiop->cq_size);
+	}
+	if (aiop->sq_ptr != NULL && aiop->sq_ptr != MAP_FAILED) {
+		munmap(aiop->sq_ptr, aiop->sq_size);
+	}
+	aiop->sqes = NULL;
+	aiop->cq_ptr = NULL;
+	aiop->sq_ptr = NULL;
+	if (aiop->ring_fd >= 0) {
+		close(aiop->ring_fd);
+		aiop->ring_fd = -1;
+	}
+}
+
+static int
+istgt_lu_disk_aio_uring_init(ISTGT_LU_DISK_AIO *aiop)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+	int rc;
+
+	memset(&p, 0, sizeof p);
+	aiop->sq_ptr = aiop->cq_ptr = NULL;
+	aiop->sqes = NULL;
+	aiop->ring_fd = istgt_io_uring_setup((unsigned) aiop->depth, &p);
+	if (aiop->ring_fd < 0) {
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+		    "io_uring_setup() failed (errno=%d)\n", errno);
+		return -1;
+	}
+
+	aiop->sq_size = p.sq_off.array + p.sq_entries * sizeof (uint32_t);
+	aiop->cq_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof (struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aiop->cq_size > aiop->sq_size)
+			aiop->sq_size = aiop->cq_size;
+		aiop->cq_size = aiop->sq_size;
+	}
+#endif /* IORING_FEAT_SINGLE_MMAP */
+	aiop->sq_ptr = mmap(NULL, aiop->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, aiop->ring_fd, IORING_OFF_SQ_RING);
+	if (aiop->sq_ptr == MAP_FAILED) {
+		ISTGT_ERRLOG("mmap() failed (errno=%d)\n", errno);
+		goto error_return;
+	}
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aiop->cq_ptr = aiop->sq_ptr;
+	} else
+#endif /* IORING_FEAT_SINGLE_MMAP */
+	{
+		aiop->cq_ptr = mmap(NULL, aiop->cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, aiop->ring_fd, IORING_OFF_CQ_RING);
+		if (aiop->cq_ptr == MAP_FAILED) {
+			ISTGT_ERRLOG("mmap() failed (errno=%d)\n", errno);
+			goto error_return;
+		}
+	}
+	aiop->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	aiop->sqes = mmap(NULL, aiop->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, aiop->ring_fd, IORING_OFF_SQES);
+	if (aiop->sqes == MAP_FAILED) {
+		ISTGT_ERRLOG("mmap() failed (errno=%d)\n", errno);
+		goto error_return;
+	}
+
+	sq = (uint8_t *) aiop->sq_ptr;
+	cq = (uint8_t *) aiop->cq_ptr;
+	aiop->sq_head = (uint32_t *) (sq + p.sq_off.head);
+	aiop->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+	aiop->sq_mask = (uint32_t *) (sq + p.sq_off.ring_mask);
+	aiop->sq_array = (uint32_t *) (sq + p.sq_off.array);
+	aiop->cq_head = (uint32_t *) (cq + p.cq_off.head);
+	aiop->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+	aiop->cq_mask = (uint32_t *) (cq + p.cq_off.ring_mask);
+	aiop->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	/* never exceed SQ entries, CQ has at least the same size */
+	aiop->depth = (int) p.sq_entries;
+
+#ifdef ISTGT_STACKSIZE
+	rc = pthread_create(&aiop->cq_thread, &aiop->spec->lu->istgt->attr,
+	    &istgt_lu_disk_aio_uring_worker, (void *) aiop);
+#else
+	rc = pthread_create(&aiop->cq_thread, NULL,
+	    &istgt_lu_disk_aio_uring_worker, (void *) aiop);
+#endif
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		goto error_return;
+	}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	{
+		char buf[MAX_TMPBUF];
+		snprintf(buf, sizeof buf, "aiothread #%d.%d",
+		    aiop->spec->num, aiop->spec->lun);
+		pthread_set_name_np(aiop->cq_thread, buf);
+	}
+#endif
+	aiop->type = ISTGT_LU_AIO_ENGINE_URING;
+	return 0;
+
+ error_return:
+	istgt_lu_disk_aio_uring_unmap(aiop);
+	return -1;
+}
+
+/* called with mutex held, on failure the entry is taken back from SQ */
+static int
+istgt_lu_disk_aio_uring_submit(ISTGT_LU_DISK_AIO *aiop, ISTGT_LU_AIO *aio)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t tail, idx;
+	uint32_t pending;
+	int rc;
+
+	tail = *aiop->sq_tail;
+	idx = tail & *aiop->sq_mask;
+	sqe = &aiop->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = (uint64_t) (uintptr_t) aio;
+	if (aio == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->fd = -1;
+	} else {
+		sqe->fd = aio->fd;
+		switch (aio->op) {
+		case ISTGT_LU_AIO_READ:
+			sqe->opcode = IORING_OP_READV;
+			sqe->addr = (uint64_t) (uintptr_t) &aio->iov;
+			sqe->len = 1;
+			sqe->off = aio->offset;
+			break;
+		case ISTGT_LU_AIO_WRITE:
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (uint64_t) (uintptr_t) &aio->iov;
+			sqe->len = 1;
+			sqe->off = aio->offset;
+			if (aio->flags & ISTGT_LU_AIO_FUA) {
+				sqe->rw_flags = RWF_DSYNC;
+			}
+			break;
+		case ISTGT_LU_AIO_SYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			break;
+		default:
+			sqe->opcode = IORING_OP_NOP;
+			break;
+		}
+	}
+	aiop->sq_array[idx] = idx;
+	tail++;
+	__atomic_store_n(aiop->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (1) {
+		pending = tail - __atomic_load_n(aiop->sq_head, __ATOMIC_ACQUIRE);
+		if (pending == 0)
+			break;
+		rc = istgt_io_uring_enter(aiop->ring_fd, pending, 0, 0);
+		if (rc > 0)
+			continue;
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc == 0 || errno == EAGAIN || errno == EBUSY) {
+			/* let completion thread reap */
+			sched_yield();
+			continue;
+		}
+		/* every submit empties SQ, so only this entry is left */
+		ISTGT_ERRLOG("io_uring_enter() failed (errno=%d)\n", errno);
+		__atomic_store_n(aiop->sq_tail, tail - 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+istgt_lu_disk_aio_uring_shutdown(ISTGT_LU_DISK_AIO *aiop)
+{
+	int rc;
+
+	MTX_LOCK(&aiop->mutex);
+	aiop->stop = 1;
+	rc = istgt_lu_disk_aio_uring_submit(aiop, NULL);
+	MTX_UNLOCK(&aiop->mutex);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: wakeup io_uring failed\n",
+		    aiop->spec->num, aiop->spec->lun);
+		(void) pthread_cancel(aiop->cq_thread);
+	}
+	(void) pthread_join(aiop->cq_thread, NULL);
+	istgt_lu_disk_aio_uring_unmap(aiop);
+}
+#endif /* USE_LU_AIO_URING */
+
+int
+istgt_lu_disk_aio_init(ISTGT_LU_DISK *spec, int depth)
+{
+	ISTGT_LU_DISK_AIO *aiop;
+	int rc;
+
+	aiop = xmalloc(sizeof *aiop);
+	memset(aiop, 0, sizeof *aiop);
+	aiop->spec = spec;
+	aiop->depth = depth;
+	if (aiop->depth < 1) {
+		aiop->depth = 1;
+	}
+	aiop->inflight = 0;
+	aiop->stop = 0;
+
+	rc = pthread_mutex_init(&aiop->mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		xfree(aiop);
+		return -1;
+	}
+	rc = pthread_cond_init(&aiop->done_cond, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_mutex_destroy(&aiop->mutex);
+		xfree(aiop);
+		return -1;
+	}
+	rc = pthread_cond_init(&aiop->work_cond, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_cond_destroy(&aiop->done_cond);
+		(void) pthread_mutex_destroy(&aiop->mutex);
+		xfree(aiop);
+		return -1;
+	}
+
+	rc = -1;
+#ifdef USE_LU_AIO_URING
+	rc = istgt_lu_disk_aio_uring_init(aiop);
+	if (rc < 0) {
+		ISTGT_WARNLOG("LU%d: LUN%d: io_uring unavailable, "
+		    "use thread pool\n", spec->num, spec->lun);
+	}
+#endif /* USE_LU_AIO_URING */
+	if (rc < 0) {
+		rc = istgt_lu_disk_aio_thread_init(aiop);
+	}
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: aio engine init failed\n",
+		    spec->num, spec->lun);
+		istgt_lu_disk_aio_thread_shutdown(aiop);
+		(void) pthread_cond_destroy(&aiop->work_cond);
+		(void) pthread_cond_destroy(&aiop->done_cond);
+		(void) pthread_mutex_destroy(&aiop->mutex);
+		xfree(aiop);
+		return -1;
+	}
+
+	spec->aio = (void *) aiop;
+	return 0;
+}
+
+int
+istgt_lu_disk_aio_shutdown(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_AIO *aiop;
+
+	aiop = (ISTGT_LU_DISK_AIO *) spec->aio;
+	if (aiop == NULL)
+		return 0;
+
+	istgt_lu_disk_aio_drain(spec);
+#ifdef USE_LU_AIO_URING
+	if (aiop->type == ISTGT_LU_AIO_ENGINE_URING) {
+		istgt_lu_disk_aio_uring_shutdown(aiop);
+	} else
+#endif /* USE_LU_AIO_URING */
+	{
+		istgt_lu_disk_aio_thread_shutdown(aiop);
+	}
+	(void) pthread_cond_destroy(&aiop->work_cond);
+	(void) pthread_cond_destroy(&aiop->done_cond);
+	(void) pthread_mutex_destroy(&aiop->mutex);
+	xfree(aiop);
+	spec->aio = NULL;
+	return 0;
+}
+
+const char *
+istgt_lu_disk_aio_engine(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_AIO *aiop;
+
+	aiop = (ISTGT_LU_DISK_AIO *) spec->aio;
+	if (aiop == NULL)
+		return "none";
+	if (aiop->type == ISTGT_LU_AIO_ENGINE_URING)
+		return "io_uring";
+	return "threads";
+}
+
+int
+istgt_lu_disk_aio_submit(ISTGT_LU_DISK *spec, ISTGT_LU_AIO *aio)
+{
+	ISTGT_LU_DISK_AIO *aiop;
+	int rc;
+
+	aiop = (ISTGT_LU_DISK_AIO *) spec->aio;
+	if (aiop == NULL || aio == NULL)
+		return -1;
+
+	MTX_LOCK(&aiop->mutex);
+	if (aiop->stop) {
+		MTX_UNLOCK(&aiop->mutex);
+		return -1;
+	}
+	/* limit requests in flight */
+	while (aiop->inflight >= aiop->depth) {
+		pthread_cond_wait(&aiop->done_cond, &aiop->mutex);
+	}
+	aiop->inflight++;
+#ifdef USE_LU_AIO_URING
+	if (aiop->type == ISTGT_LU_AIO_ENGINE_URING) {
+		/* once queued, the request always completes via callback */
+		rc = istgt_lu_disk_aio_uring_submit(aiop, aio);
+		if (rc < 0) {
+			/* not queued, caller executes it by itself */
+			aiop->inflight--;
+			pthread_cond_broadcast(&aiop->done_cond);
+			MTX_UNLOCK(&aiop->mutex);
+			return -1;
+		}
+	} else
+#endif /* USE_LU_AIO_URING */
+	{
+		istgt_lu_disk_aio_thread_submit(aiop, aio);
+	}
+	MTX_UNLOCK(&aiop->mutex);
+	return 0;
+}
+
+void
+istgt_lu_disk_aio_drain(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_AIO *aiop;
+
+	aiop = (ISTGT_LU_DISK_AIO *) spec->aio;
+	if (aiop == NULL)
+		return;
+
+	MTX_LOCK(&aiop->mutex);
+	while (aiop->inflight > 0) {
+		pthread_cond_wait(&aiop->done_cond, &aiop->mutex);
+	}
+	MTX_UNLOCK(&aiop->mutex);
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+/*
+ * Allocation map of a sparse backing file.
+ *
+ * The media is divided into chunks of the UNMAP granularity (at least
+ * 4KB) and each chunk has one of three states.  Unknown chunks are
+ * resolved lazily, a whole scan window at a time, by SEEK_DATA and
+ * SEEK_HOLE.  A chunk is unmapped only if it lies entirely in a hole, so
+ * reading it returns zeros without touching the backing store.
+ *
+ * A write marks its chunks mapped before it is passed down, and a scan
+ * only resolves chunks that are still unknown, so a scan racing with a
+ * write never hides the written data.  An UNMAP marks the chunks it
+ * covers completely as unmapped after the backing store released them.
+ */
+
+#define ISTGT_LU_AMAP_UNKNOWN	0
+#define ISTGT_LU_AMAP_MAPPED	1
+#define ISTGT_LU_AMAP_UNMAPPED	2
+
+typedef struct istgt_lu_disk_amap_t {
+	ISTGT_LU_DISK *spec;
+	uint64_t size;
+	uint64_t chunksize;
+	uint64_t nchunks;
+	/* chunks resolved by one scan */
+	uint64_t scanchunks;
+	/* 2 bits per chunk */
+	uint8_t *map;
+
+	/* protects the map, also serializes lseek() on the fd */
+	pthread_mutex_t mutex;
+	uint64_t scans;
+	uint64_t zero_bytes;
+
+	/* backing store */
+	int64_t (*pread)(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset);
+	int64_t (*pwrite)(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset);
+	int (*unmap)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+	int (*zero)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+} ISTGT_LU_DISK_AMAP;
+
+static int
+istgt_lu_amap_get(ISTGT_LU_DISK_AMAP *am, uint64_t chunk)
+{
+	return (am->map[chunk >> 2] >> ((chunk & 3) * 2)) & 3;
+}
+
+static void
+istgt_lu_amap_set(ISTGT_LU_DISK_AMAP *am, uint64_t chunk, int state)
+{
+	int shift = (int) ((chunk & 3) * 2);
+
+	am->map[chunk >> 2] &= (uint8_t) ~(3 << shift);
+	am->map[chunk >> 2] |= (uint8_t) (state << shift);
+}
+
+/* set chunks in [start, end), unknown ones only unless forced */
+static void
+istgt_lu_amap_resolve(ISTGT_LU_DISK_AMAP *am, uint64_t start, uint64_t end, int state, int force)
+{
+	uint64_t first, last, c;
+
+	if (start >= end)
+		return;
+	if (state == ISTGT_LU_AMAP_UNMAPPED) {
+		/* only chunks entirely inside the hole */
+		first = (start + am->chunksize - 1) / am->chunksize;
+		if (end >= am->size) {
+			last = am->nchunks;
+		} else {
+			last = end / am->chunksize;
+		}
+	} else {
+		first = start / am->chunksize;
+		last = (end + am->chunksize - 1) / am->chunksize;
+	}
+	if (last > am->nchunks)
+		last = am->nchunks;
+	for (c = first; c < last; c++) {
+		if (force || istgt_lu_amap_get(am, c) == ISTGT_LU_AMAP_UNKNOWN) {
+			istgt_lu_amap_set(am, c, state);
+		}
+	}
+}
+
+/* called with mutex held */
+static void
+istgt_lu_amap_scan(ISTGT_LU_DISK_AMAP *am, uint64_t chunk)
+{
+	ISTGT_LU_DISK *spec = am->spec;
+	uint64_t first, last;
+	uint64_t start, end;
+#if defined (SEEK_DATA) && defined (SEEK_HOLE)
+	off_t data, hole;
+#endif
+
+	first = chunk - (chunk % am->scanchunks);
+	last = first + am->scanchunks;
+	if (last > am->nchunks)
+		last = am->nchunks;
+	start = first * am->chunksize;
+	end = last * am->chunksize;
+	if (end > am->size)
+		end = am->size;
+	am->scans++;
+
+#if defined (SEEK_DATA) && defined (SEEK_HOLE)
+	while (start < end) {
+		data = lseek(spec->fd, (off_t) start, SEEK_DATA);
+		if (data == -1) {
+			if (errno != ENXIO) {
+				ISTGT_WARNLOG("LU%d: LUN%d: lseek(SEEK_DATA) failed: %s\n",
+				    spec->num, spec->lun, strerror(errno));
+				break;
+			}
+			/* no data up to EOF */
+			data = (off_t) end;
+		}
+		if ((uint64_t) data > end)
+			data = (off_t) end;
+		istgt_lu_amap_resolve(am, start, (uint64_t) data,
+		    ISTGT_LU_AMAP_UNMAPPED, 0);
+		if ((uint64_t) data >= end)
+			break;
+		hole = lseek(spec->fd, data, SEEK_HOLE);
+		if (hole == -1) {
+			ISTGT_WARNLOG("LU%d: LUN%d: lseek(SEEK_HOLE) failed: %s\n",
+			    spec->num, spec->lun, strerror(errno));
+			break;
+		}
+		if ((uint64_t) hole > end)
+			hole = (off_t) end;
+		istgt_lu_amap_resolve(am, (uint64_t) data, (uint64_t) hole,
+		    ISTGT_LU_AMAP_MAPPED, 0);
+		start = (uint64_t) hole;
+	}
+#endif /* SEEK_DATA && SEEK_HOLE */
+	/* anything left after an error is treated as mapped */
+	istgt_lu_amap_resolve(am, first * am->chunksize, end,
+	    ISTGT_LU_AMAP_MAPPED, 0);
+}
+
+/* called with mutex held */
+static int
+istgt_lu_amap_run(ISTGT_LU_DISK_AMAP *am, uint64_t offset, uint64_t maxbytes, uint64_t *nbytes)
+{
+	uint64_t chunk, end, next;
+	int state, st;
+
+	chunk = offset / am->chunksize;
+	state = istgt_lu_amap_get(am, chunk);
+	if (state == ISTGT_LU_AMAP_UNKNOWN) {
+		istgt_lu_amap_scan(am, chunk);
+		state = istgt_lu_amap_get(am, chunk);
+	}
+	end = offset + maxbytes;
+	for (chunk++; chunk < am->nchunks; chunk++) {
+		next = chunk * am->chunksize;
+		if (next >= end)
+			break;
+		st = istgt_lu_amap_get(am, chunk);
+		if (st == ISTGT_LU_AMAP_UNKNOWN) {
+			istgt_lu_amap_scan(am, chunk);
+			st = istgt_lu_amap_get(am, chunk);
+		}
+		if (st != state) {
+			end = next;
+			break;
+		}
+	}
+	*nbytes = end - offset;
+	return state;
+}
+
+static void
+istgt_lu_amap_mark(ISTGT_LU_DISK_AMAP *am, uint64_t offset, uint64_t nbytes, int state)
+{
+	MTX_LOCK(&am->mutex);
+	istgt_lu_amap_resolve(am, offset, offset + nbytes, state, 1);
+	MTX_UNLOCK(&am->mutex);
+}
+
+static int64_t
+istgt_lu_amap_pread(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_AMAP *am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+	uint8_t *p = (uint8_t *) buf;
+	uint64_t total, len;
+	int64_t rc;
+	int state;
+
+	total = 0;
+	while (total < nbytes) {
+		MTX_LOCK(&am->mutex);
+		state = istgt_lu_amap_run(am, offset + total, nbytes - total, &len);
+		if (state == ISTGT_LU_AMAP_UNMAPPED) {
+			am->zero_bytes += len;
+		}
+		MTX_UNLOCK(&am->mutex);
+		if (state == ISTGT_LU_AMAP_UNMAPPED) {
+			/* unallocated, no I/O */
+			memset(p + total, 0, len);
+			total += len;
+			continue;
+		}
+		rc = am->pread(spec, p + total, len, offset + total);
+		if (rc < 0) {
+			return -1;
+		}
+		total += (uint64_t) rc;
+		if ((uint64_t) rc != len) {
+			break;
+		}
+	}
+	return (int64_t) total;
+}
+
+static int64_t
+istgt_lu_amap_pwrite(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_AMAP *am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+
+	istgt_lu_amap_mark(am, offset, nbytes, ISTGT_LU_AMAP_MAPPED);
+	return am->pwrite(spec, buf, nbytes, offset);
+}
+
+static int
+istgt_lu_amap_unmap(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_AMAP *am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+	int rc;
+
+	rc = am->unmap(spec, offset, nbytes);
+	if (rc < 0) {
+		return rc;
+	}
+	istgt_lu_amap_mark(am, offset, nbytes, ISTGT_LU_AMAP_UNMAPPED);
+	return rc;
+}
+
+static int
+istgt_lu_amap_zero(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_AMAP *am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+
+	/* zeroed range stays allocated */
+	istgt_lu_amap_mark(am, offset, nbytes, ISTGT_LU_AMAP_MAPPED);
+	return am->zero(spec, offset, nbytes);
+}
+
+int
+istgt_lu_disk_amap_init(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_AMAP *am;
+	struct stat st;
+	uint64_t chunksize;
+	int rc;
+
+	rc = fstat(spec->fd, &st);
+	if (rc < 0 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+#if defined (SEEK_DATA) && defined (SEEK_HOLE)
+	/* filesystem without hole support fails with EINVAL */
+	if (lseek(spec->fd, 0, SEEK_DATA) == -1 && errno != ENXIO) {
+		return -1;
+	}
+#else
+	return -1;
+#endif
+
+	chunksize = (uint64_t) spec->unmap_granularity * spec->blocklen;
+	if (chunksize < ISTGT_LU_AMAP_MINCHUNK) {
+		chunksize = ISTGT_LU_AMAP_MINCHUNK;
+	}
+	while (spec->size / chunksize > ISTGT_LU_AMAP_MAXCHUNKS) {
+		chunksize *= 2;
+	}
+
+	am = xmalloc(sizeof *am);
+	memset(am, 0, sizeof *am);
+	am->spec = spec;
+	am->size = spec->size;
+	am->chunksize = chunksize;
+	am->nchunks = (spec->size + chunksize - 1) / chunksize;
+	am->scanchunks = ISTGT_LU_AMAP_SCANSIZE / chunksize;
+	if (am->scanchunks == 0)
+		am->scanchunks = 1;
+	am->map = xmalloc((size_t) ((am->nchunks + 3) / 4));
+	memset(am->map, 0, (size_t) ((am->nchunks + 3) / 4));
+	am->pread = spec->pread;
+	am->pwrite = spec->pwrite;
+	am->unmap = spec->unmap;
+	am->zero = spec->zero;
+
+	rc = pthread_mutex_init(&am->mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		xfree(am->map);
+		xfree(am);
+		return -1;
+	}
+
+	spec->amap = (void *) am;
+	spec->pread = istgt_lu_amap_pread;
+	spec->pwrite = istgt_lu_amap_pwrite;
+	if (am->unmap != NULL) {
+		spec->unmap = istgt_lu_amap_unmap;
+	}
+	if (am->zero != NULL) {
+		spec->zero = istgt_lu_amap_zero;
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "LU%d: LUN%d allocation map %"PRIu64" chunks of %"PRIu64" bytes\n",
+	    spec->num, spec->lun, am->nchunks, am->chunksize);
+	return 0;
+}
+
+int
+istgt_lu_disk_amap_shutdown(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_AMAP *am;
+
+	am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+	if (am == NULL)
+		return 0;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "LU%d: LUN%d allocation map scans %"PRIu64", zero read %"PRIu64
+	    " bytes\n",
+	    spec->num, spec->lun, am->scans, am->zero_bytes);
+
+	spec->pread = am->pread;
+	spec->pwrite = am->pwrite;
+	spec->unmap = am->unmap;
+	spec->zero = am->zero;
+	spec->amap = NULL;
+
+	(void) pthread_mutex_destroy(&am->mutex);
+	xfree(am->map);
+	xfree(am);
+	return 0;
+}
+
+/*
+ * Return 1 if the range at offset is unmapped, 0 if it is mapped, and
+ * the length of the run in the same state up to maxbytes in *nbytes.
+ */
+int
+istgt_lu_disk_amap_lookup(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t maxbytes, uint64_t *nbytes)
+{
+	ISTGT_LU_DISK_AMAP *am;
+	int state;
+
+	am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+	if (am == NULL) {
+		*nbytes = maxbytes;
+		return 0;
+	}
+	MTX_LOCK(&am->mutex);
+	state = istgt_lu_amap_run(am, offset, maxbytes, nbytes);
+	MTX_UNLOCK(&am->mutex);
+	return (state == ISTGT_LU_AMAP_UNMAPPED) ? 1 : 0;
+}
+
+/* for writes not going through spec->pwrite */
+void
+istgt_lu_disk_amap_mapped(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_AMAP *am;
+
+	am = (ISTGT_LU_DISK_AMAP *) spec->amap;
+	if (am == NULL)
+		return;
+	istgt_lu_amap_mark(am, offset, nbytes, ISTGT_LU_AMAP_MAPPED);
+}
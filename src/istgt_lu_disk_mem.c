@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined (MAP_ANONYMOUS) && defined (MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* size of a huge page tried for the Memory type */
+#define ISTGT_LU_MEM_HUGEPAGE (2ULL * 1024ULL * 1024ULL)
+
+typedef struct istgt_lu_disk_mem_t {
+	uint8_t *base;
+	size_t length;
+	size_t pagesize;
+	int hugetlb;
+} ISTGT_LU_DISK_MEM;
+
+/*
+ * Null: writes are discarded and reads return zero,
+ * only the SCSI and iSCSI layers are measured.
+ */
+
+static int
+istgt_lu_disk_open_null(ISTGT_LU_DISK *spec, int flags __attribute__((__unused__)), int mode __attribute__((__unused__)))
+{
+	spec->fd = -1;
+	return 0;
+}
+
+static int
+istgt_lu_disk_close_null(ISTGT_LU_DISK *spec __attribute__((__unused__)))
+{
+	return 0;
+}
+
+static int64_t
+istgt_lu_disk_pread_null(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
+{
+	if (offset >= spec->size || nbytes > spec->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(buf, 0, (size_t) nbytes);
+	return (int64_t) nbytes;
+}
+
+static int64_t
+istgt_lu_disk_pwrite_null(ISTGT_LU_DISK *spec, const void *buf __attribute__((__unused__)), uint64_t nbytes, uint64_t offset)
+{
+	if (offset >= spec->size || nbytes > spec->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	return (int64_t) nbytes;
+}
+
+static int64_t
+istgt_lu_disk_sync_null(ISTGT_LU_DISK *spec __attribute__((__unused__)), uint64_t offset __attribute__((__unused__)), uint64_t nbytes __attribute__((__unused__)))
+{
+	return 0;
+}
+
+static int
+istgt_lu_disk_allocate_null(ISTGT_LU_DISK *spec __attribute__((__unused__)))
+{
+	return 0;
+}
+
+static int
+istgt_lu_disk_setcache_null(ISTGT_LU_DISK *spec __attribute__((__unused__)))
+{
+	return 0;
+}
+
+static int
+istgt_lu_disk_unmap_null(ISTGT_LU_DISK *spec __attribute__((__unused__)), uint64_t offset __attribute__((__unused__)), uint64_t nbytes __attribute__((__unused__)))
+{
+	return 0;
+}
+
+/*
+ * Memory: anonymous private mapping, huge pages are used if available.
+ * Untouched and released pages are read as zero.
+ */
+
+static int
+istgt_lu_disk_open_mem(ISTGT_LU_DISK *spec, int flags __attribute__((__unused__)), int mode __attribute__((__unused__)))
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+	void *p;
+	size_t length;
+
+	spec->fd = -1;
+	exspec->base = NULL;
+	exspec->hugetlb = 0;
+	exspec->pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	/* needs reserved pages (vm.nr_hugepages), fails if not enough */
+	length = (size_t) ((spec->size + ISTGT_LU_MEM_HUGEPAGE - 1)
+	    & ~(ISTGT_LU_MEM_HUGEPAGE - 1));
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		exspec->hugetlb = 1;
+		exspec->pagesize = (size_t) ISTGT_LU_MEM_HUGEPAGE;
+	}
+#endif /* MAP_HUGETLB */
+	if (p == MAP_FAILED) {
+		length = (size_t) ((spec->size + exspec->pagesize - 1)
+		    & ~((uint64_t) exspec->pagesize - 1));
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) {
+			ISTGT_ERRLOG("mmap() failed (errno=%d)\n", errno);
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		/* transparent huge pages, ignore error */
+		(void) madvise(p, length, MADV_HUGEPAGE);
+#endif
+	}
+	exspec->base = (uint8_t *) p;
+	exspec->length = length;
+	return 0;
+}
+
+static int
+istgt_lu_disk_close_mem(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+	int rc;
+
+	if (exspec->base == NULL)
+		return 0;
+	rc = munmap(exspec->base, exspec->length);
+	exspec->base = NULL;
+	exspec->length = 0;
+	if (rc < 0) {
+		ISTGT_ERRLOG("munmap() failed (errno=%d)\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int64_t
+istgt_lu_disk_pread_mem(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+
+	if (offset >= spec->size || nbytes > spec->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(buf, exspec->base + offset, (size_t) nbytes);
+	return (int64_t) nbytes;
+}
+
+static int64_t
+istgt_lu_disk_pwrite_mem(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+
+	if (offset >= spec->size || nbytes > spec->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(exspec->base + offset, buf, (size_t) nbytes);
+	return (int64_t) nbytes;
+}
+
+static int
+istgt_lu_disk_unmap_mem(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+	uint64_t mask;
+	uint64_t start, end;
+	int rc;
+
+	if (offset >= spec->size || nbytes > spec->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* release whole pages, clear partial pages at the edges */
+	mask = (uint64_t) exspec->pagesize - 1;
+	start = (offset + mask) & ~mask;
+	end = (offset + nbytes) & ~mask;
+	rc = -1;
+#if defined (__linux__) && defined (MADV_DONTNEED)
+	/* private anonymous pages are refilled with zero */
+	if (start < end) {
+		rc = madvise(exspec->base + start, (size_t) (end - start),
+		    MADV_DONTNEED);
+	}
+#endif
+	if (rc < 0) {
+		memset(exspec->base + offset, 0, (size_t) nbytes);
+		return 0;
+	}
+	memset(exspec->base + offset, 0, (size_t) (start - offset));
+	memset(exspec->base + end, 0, (size_t) (offset + nbytes - end));
+	return 0;
+}
+
+int
+istgt_lu_disk_mem_lun_init(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu)
+{
+	ISTGT_LU_DISK_MEM *exspec;
+	int memory;
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "istgt_lu_disk_mem_lun_init\n");
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d for disktype=%s\n",
+	    spec->num, spec->lun, spec->disktype);
+
+	memory = (strcasecmp(spec->disktype, "MEMORY") == 0);
+	if (memory) {
+		spec->open = istgt_lu_disk_open_mem;
+		spec->close = istgt_lu_disk_close_mem;
+		spec->pread = istgt_lu_disk_pread_mem;
+		spec->pwrite = istgt_lu_disk_pwrite_mem;
+	} else {
+		spec->open = istgt_lu_disk_open_null;
+		spec->close = istgt_lu_disk_close_null;
+		spec->pread = istgt_lu_disk_pread_null;
+		spec->pwrite = istgt_lu_disk_pwrite_null;
+	}
+	spec->sync = istgt_lu_disk_sync_null;
+	spec->allocate = istgt_lu_disk_allocate_null;
+	spec->setcache = istgt_lu_disk_setcache_null;
+
+	spec->blocklen = lu->blocklen;
+	if (spec->blocklen < 512 || spec->blocklen > 524288
+	    || (spec->blocklen & (spec->blocklen - 1)) != 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: invalid blocklen %"PRIu64"\n",
+		    spec->num, spec->lun, spec->blocklen);
+		return -1;
+	}
+	spec->blockcnt = spec->size / spec->blocklen;
+	if (spec->blockcnt == 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: size zero\n", spec->num, spec->lun);
+		return -1;
+	}
+	/* partial block at the end is not accessible */
+	spec->size = spec->blockcnt * spec->blocklen;
+
+	printf("LU%d: LUN%d %s, size=%"PRIu64"\n",
+	    spec->num, spec->lun, spec->file, spec->size);
+	printf("LU%d: LUN%d %"PRIu64" blocks, %"PRIu64" bytes/block\n",
+	    spec->num, spec->lun, spec->blockcnt, spec->blocklen);
+
+	exspec = xmalloc(sizeof *exspec);
+	memset(exspec, 0, sizeof *exspec);
+	spec->exspec = exspec;
+
+	rc = spec->open(spec, lu->readonly ? O_RDONLY : O_RDWR, 0666);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: open error(errno=%d)\n",
+		    spec->num, spec->lun, errno);
+		xfree(exspec);
+		spec->exspec = NULL;
+		return -1;
+	}
+	if (memory) {
+		printf("LU%d: LUN%d %s pages of %zuKB\n",
+		    spec->num, spec->lun,
+		    exspec->hugetlb ? "huge" : "anonymous",
+		    exspec->pagesize / 1024);
+	}
+
+	/* nothing to wait for, I/O is done by the LU thread */
+	if (lu->lun[spec->lun].asyncio) {
+		ISTGT_WARNLOG("LU%d: LUN%d: async I/O not supported for %s\n",
+		    spec->num, spec->lun, spec->disktype);
+		lu->lun[spec->lun].asyncio = 0;
+	}
+
+	if (lu->lun[spec->lun].unmap && !lu->readonly) {
+		/* released blocks are read as zero */
+		if (memory) {
+			spec->unmap = istgt_lu_disk_unmap_mem;
+			spec->unmap_granularity
+				= (uint32_t) (exspec->pagesize / spec->blocklen);
+			if (spec->unmap_granularity == 0) {
+				spec->unmap_granularity = 1;
+			}
+		} else {
+			spec->unmap = istgt_lu_disk_unmap_null;
+			spec->unmap_granularity = 1;
+		}
+		spec->unmap_lbprz = 1;
+		spec->thin_provisioning = 1;
+	}
+	if (!lu->readonly) {
+		spec->zero = memory
+			? istgt_lu_disk_unmap_mem : istgt_lu_disk_unmap_null;
+	}
+	return 0;
+}
+
+int
+istgt_lu_disk_mem_lun_shutdown(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt __attribute__((__unused__)), ISTGT_LU_Ptr lu __attribute__((__unused__)))
+{
+	ISTGT_LU_DISK_MEM *exspec = (ISTGT_LU_DISK_MEM *)spec->exspec;
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "istgt_lu_disk_mem_lun_shutdown\n");
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d for disktype=%s\n",
+	    spec->num, spec->lun, spec->disktype);
+
+	if (exspec == NULL)
+		return 0;
+	rc = spec->close(spec);
+	if (rc < 0) {
+		//ISTGT_ERRLOG("LU%d: lu_disk_close() failed\n", lu->num);
+		/* ignore error */
+	}
+
+	xfree(exspec);
+	spec->exspec = NULL;
+	return 0;
+}
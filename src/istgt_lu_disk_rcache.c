@@ -0,0 +1,773 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+/*
+ * Read cache for a LUN.
+ *
+ * The media is cached in fixed size chunks managed by 2Q: a chunk read
+ * for the first time enters the A1in FIFO, a chunk referenced again after
+ * it left A1in (still remembered by the A1out ghost list) enters the Am
+ * LRU.  One-time scans pass through A1in without flushing the hot set.
+ *
+ * A write goes to the backing store first and then drops the cached
+ * chunks it touched.  A chunk being filled when a write arrives is
+ * marked invalid and discarded after the fill, so a stale read is never
+ * inserted.
+ *
+ * Sequential streams are detected by the next expected offset and data
+ * ahead of the stream is prefetched by a readahead thread.  The window
+ * doubles while the stream continues.
+ */
+
+typedef enum {
+	ISTGT_LU_RCACHE_FILL = 1,
+	ISTGT_LU_RCACHE_A1IN = 2,
+	ISTGT_LU_RCACHE_AM = 3,
+	ISTGT_LU_RCACHE_A1OUT = 4,
+} ISTGT_LU_RCACHE_STATE;
+
+typedef struct istgt_lu_rcache_ent_t {
+	struct istgt_lu_rcache_ent_t *hnext;
+	struct istgt_lu_rcache_ent_t *prev;
+	struct istgt_lu_rcache_ent_t *next;
+	uint64_t chunk;
+	int state;
+	/* fill result goes to Am */
+	int ghost;
+	/* written while filling */
+	int invalid;
+	uint8_t *data;
+} ISTGT_LU_RCACHE_ENT;
+
+typedef struct istgt_lu_rcache_list_t {
+	ISTGT_LU_RCACHE_ENT *head;
+	ISTGT_LU_RCACHE_ENT *tail;
+	int num;
+} ISTGT_LU_RCACHE_LIST;
+
+typedef struct istgt_lu_rcache_stream_t {
+	uint64_t next;
+	uint64_t ra_next;
+	uint64_t window;
+	uint64_t tick;
+	int hits;
+} ISTGT_LU_RCACHE_STREAM;
+
+typedef struct istgt_lu_rcache_ra_t {
+	uint64_t offset;
+	uint64_t nbytes;
+} ISTGT_LU_RCACHE_RA;
+
+typedef struct istgt_lu_disk_rcache_t {
+	ISTGT_LU_DISK *spec;
+	uint64_t size;
+	uint64_t chunksize;
+	/* chunks with data (A1in, Am and filling) */
+	int maxchunks;
+	int nchunks;
+	/* 2Q parameters */
+	int kin;
+	int kout;
+
+	pthread_mutex_t mutex;
+	/* signaled when a fill completed */
+	pthread_cond_t fill_cond;
+	ISTGT_LU_RCACHE_ENT **hash;
+	uint64_t hashmask;
+	ISTGT_LU_RCACHE_LIST a1in;
+	ISTGT_LU_RCACHE_LIST am;
+	ISTGT_LU_RCACHE_LIST a1out;
+
+	/* sequential detection */
+	ISTGT_LU_RCACHE_STREAM stream[ISTGT_LU_RCACHE_STREAMS];
+	uint64_t tick;
+
+	/* readahead thread */
+	pthread_cond_t ra_cond;
+	ISTGT_LU_RCACHE_RA ra[ISTGT_LU_RCACHE_RAQUEUE];
+	int ra_head;
+	int ra_num;
+	int stop;
+	pthread_t thread;
+
+	/* statistics */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t prefetched;
+
+	/* backing store */
+	int64_t (*pread)(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset);
+	int64_t (*pwrite)(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset);
+	int (*unmap)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+	int (*zero)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+} ISTGT_LU_DISK_RCACHE;
+
+static ISTGT_LU_RCACHE_ENT **
+istgt_lu_rcache_bucket(ISTGT_LU_DISK_RCACHE *rc, uint64_t chunk)
+{
+	uint64_t h;
+
+	h = chunk * 0x9e3779b97f4a7c15ULL;
+	return &rc->hash[(h >> 32) & rc->hashmask];
+}
+
+static ISTGT_LU_RCACHE_ENT *
+istgt_lu_rcache_lookup(ISTGT_LU_DISK_RCACHE *rc, uint64_t chunk)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+
+	for (ent = *istgt_lu_rcache_bucket(rc, chunk); ent != NULL;
+	    ent = ent->hnext) {
+		if (ent->chunk == chunk)
+			return ent;
+	}
+	return NULL;
+}
+
+static void
+istgt_lu_rcache_hash_remove(ISTGT_LU_DISK_RCACHE *rc, ISTGT_LU_RCACHE_ENT *ent)
+{
+	ISTGT_LU_RCACHE_ENT **pp;
+
+	for (pp = istgt_lu_rcache_bucket(rc, ent->chunk); *pp != NULL;
+	    pp = &(*pp)->hnext) {
+		if (*pp == ent) {
+			*pp = ent->hnext;
+			break;
+		}
+	}
+	ent->hnext = NULL;
+}
+
+static void
+istgt_lu_rcache_list_insert(ISTGT_LU_RCACHE_LIST *list, ISTGT_LU_RCACHE_ENT *ent)
+{
+	ent->prev = NULL;
+	ent->next = list->head;
+	if (list->head != NULL) {
+		list->head->prev = ent;
+	} else {
+		list->tail = ent;
+	}
+	list->head = ent;
+	list->num++;
+}
+
+static void
+istgt_lu_rcache_list_remove(ISTGT_LU_RCACHE_LIST *list, ISTGT_LU_RCACHE_ENT *ent)
+{
+	if (ent->prev != NULL) {
+		ent->prev->next = ent->next;
+	} else {
+		list->head = ent->next;
+	}
+	if (ent->next != NULL) {
+		ent->next->prev = ent->prev;
+	} else {
+		list->tail = ent->prev;
+	}
+	ent->prev = NULL;
+	ent->next = NULL;
+	list->num--;
+}
+
+static ISTGT_LU_RCACHE_LIST *
+istgt_lu_rcache_list(ISTGT_LU_DISK_RCACHE *rc, ISTGT_LU_RCACHE_ENT *ent)
+{
+	switch (ent->state) {
+	case ISTGT_LU_RCACHE_A1IN:
+		return &rc->a1in;
+	case ISTGT_LU_RCACHE_AM:
+		return &rc->am;
+	case ISTGT_LU_RCACHE_A1OUT:
+		return &rc->a1out;
+	default:
+		return NULL;
+	}
+}
+
+static void
+istgt_lu_rcache_free_ent(ISTGT_LU_DISK_RCACHE *rc, ISTGT_LU_RCACHE_ENT *ent)
+{
+	ISTGT_LU_RCACHE_LIST *list;
+
+	list = istgt_lu_rcache_list(rc, ent);
+	if (list != NULL) {
+		istgt_lu_rcache_list_remove(list, ent);
+	}
+	if (ent->state != ISTGT_LU_RCACHE_A1OUT) {
+		rc->nchunks--;
+	}
+	istgt_lu_rcache_hash_remove(rc, ent);
+	xfree(ent->data);
+	xfree(ent);
+}
+
+static void
+istgt_lu_rcache_reclaim(ISTGT_LU_DISK_RCACHE *rc)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+
+	while (rc->nchunks >= rc->maxchunks) {
+		if (rc->a1in.tail != NULL
+		    && (rc->a1in.num > rc->kin || rc->am.tail == NULL)) {
+			/* remember the chunk in A1out */
+			ent = rc->a1in.tail;
+			istgt_lu_rcache_list_remove(&rc->a1in, ent);
+			xfree(ent->data);
+			ent->data = NULL;
+			ent->state = ISTGT_LU_RCACHE_A1OUT;
+			istgt_lu_rcache_list_insert(&rc->a1out, ent);
+			rc->nchunks--;
+			if (rc->a1out.num > rc->kout) {
+				istgt_lu_rcache_free_ent(rc, rc->a1out.tail);
+			}
+		} else if (rc->am.tail != NULL) {
+			istgt_lu_rcache_free_ent(rc, rc->am.tail);
+		} else {
+			/* all chunks are being filled */
+			break;
+		}
+	}
+}
+
+static int
+istgt_lu_rcache_start_fill(ISTGT_LU_DISK_RCACHE *rc, uint64_t chunk)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+	int ghost = 0;
+
+	/* called with mutex held, returns 0 if cached or being filled */
+	ent = istgt_lu_rcache_lookup(rc, chunk);
+	if (ent != NULL) {
+		if (ent->state != ISTGT_LU_RCACHE_A1OUT)
+			return 0;
+		/* referenced again after leaving A1in */
+		istgt_lu_rcache_list_remove(&rc->a1out, ent);
+		ghost = 1;
+	} else {
+		ent = xmalloc(sizeof *ent);
+		ent->chunk = chunk;
+		ent->hnext = *istgt_lu_rcache_bucket(rc, chunk);
+		*istgt_lu_rcache_bucket(rc, chunk) = ent;
+	}
+	istgt_lu_rcache_reclaim(rc);
+	ent->prev = NULL;
+	ent->next = NULL;
+	ent->state = ISTGT_LU_RCACHE_FILL;
+	ent->ghost = ghost;
+	ent->invalid = 0;
+	ent->data = NULL;
+	rc->nchunks++;
+	return 1;
+}
+
+static void
+istgt_lu_rcache_end_fill(ISTGT_LU_DISK_RCACHE *rc, uint64_t chunk, const uint8_t *data, int error)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+
+	/* called with mutex held */
+	ent = istgt_lu_rcache_lookup(rc, chunk);
+	if (ent == NULL || ent->state != ISTGT_LU_RCACHE_FILL)
+		return;
+	if (error || ent->invalid) {
+		istgt_lu_rcache_free_ent(rc, ent);
+		return;
+	}
+	ent->data = xmalloc(rc->chunksize);
+	memcpy(ent->data, data, rc->chunksize);
+	if (ent->ghost) {
+		ent->state = ISTGT_LU_RCACHE_AM;
+		istgt_lu_rcache_list_insert(&rc->am, ent);
+	} else {
+		ent->state = ISTGT_LU_RCACHE_A1IN;
+		istgt_lu_rcache_list_insert(&rc->a1in, ent);
+	}
+}
+
+static int
+istgt_lu_rcache_fill(ISTGT_LU_DISK_RCACHE *rc, uint64_t chunk, int nchunks, uint8_t *buf, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK *spec = rc->spec;
+	uint8_t *tmp;
+	uint64_t start;
+	uint64_t len;
+	uint64_t s, e;
+	int64_t rv;
+	int error;
+	int i;
+
+	/* read filling chunks from backing store, copy requested part to buf */
+	start = chunk * rc->chunksize;
+	len = (uint64_t) nchunks * rc->chunksize;
+	tmp = xmalloc(len);
+	if (start + len > spec->size) {
+		rv = rc->pread(spec, tmp, spec->size - start, start);
+	} else {
+		rv = rc->pread(spec, tmp, len, start);
+	}
+	error = (rv < 0);
+	if (!error && (uint64_t) rv < len) {
+		memset(tmp + rv, 0, len - rv);
+	}
+	if (!error && buf != NULL) {
+		s = (offset > start) ? offset : start;
+		e = (offset + nbytes < start + len) ? offset + nbytes : start + len;
+		memcpy(buf + (s - offset), tmp + (s - start), e - s);
+	}
+
+	MTX_LOCK(&rc->mutex);
+	for (i = 0; i < nchunks; i++) {
+		istgt_lu_rcache_end_fill(rc, chunk + i,
+		    tmp + (uint64_t) i * rc->chunksize, error);
+	}
+	pthread_cond_broadcast(&rc->fill_cond);
+	MTX_UNLOCK(&rc->mutex);
+	xfree(tmp);
+	return error ? -1 : 0;
+}
+
+static int
+istgt_lu_rcache_read(ISTGT_LU_DISK_RCACHE *rc, uint8_t *buf, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+	uint64_t chunk, last;
+	uint64_t cstart;
+	uint64_t s, e;
+	uint64_t end;
+	int maxrun;
+	int n;
+
+	/* buf == NULL is prefetch, chunks being filled are skipped */
+	end = offset + nbytes;
+	chunk = offset / rc->chunksize;
+	last = (end - 1) / rc->chunksize;
+	maxrun = (int) (ISTGT_LU_RCACHE_RAMAX / rc->chunksize);
+	while (chunk <= last) {
+		MTX_LOCK(&rc->mutex);
+		ent = istgt_lu_rcache_lookup(rc, chunk);
+		if (ent != NULL && ent->state == ISTGT_LU_RCACHE_FILL) {
+			if (buf == NULL) {
+				MTX_UNLOCK(&rc->mutex);
+				chunk++;
+				continue;
+			}
+			/* share the read in progress */
+			pthread_cond_wait(&rc->fill_cond, &rc->mutex);
+			MTX_UNLOCK(&rc->mutex);
+			continue;
+		}
+		if (ent != NULL && ent->state != ISTGT_LU_RCACHE_A1OUT) {
+			if (buf != NULL) {
+				cstart = chunk * rc->chunksize;
+				s = (offset > cstart) ? offset : cstart;
+				e = (end < cstart + rc->chunksize)
+				    ? end : cstart + rc->chunksize;
+				memcpy(buf + (s - offset), ent->data + (s - cstart),
+				    e - s);
+				if (ent->state == ISTGT_LU_RCACHE_AM) {
+					istgt_lu_rcache_list_remove(&rc->am, ent);
+					istgt_lu_rcache_list_insert(&rc->am, ent);
+				}
+				rc->hits++;
+			}
+			MTX_UNLOCK(&rc->mutex);
+			chunk++;
+			continue;
+		}
+
+		/* miss, fill the following missing chunks by one read */
+		n = 0;
+		while (chunk + n <= last && n < maxrun) {
+			if (!istgt_lu_rcache_start_fill(rc, chunk + n))
+				break;
+			n++;
+		}
+		if (buf != NULL) {
+			rc->misses += n;
+		} else {
+			rc->prefetched += n;
+		}
+		MTX_UNLOCK(&rc->mutex);
+
+		if (istgt_lu_rcache_fill(rc, chunk, n, buf, offset, nbytes) < 0)
+			return -1;
+		chunk += n;
+	}
+	return 0;
+}
+
+static void
+istgt_lu_rcache_detect(ISTGT_LU_DISK_RCACHE *rc, uint64_t offset, uint64_t end)
+{
+	ISTGT_LU_RCACHE_STREAM *sp, *victim;
+	ISTGT_LU_RCACHE_RA *rap;
+	uint64_t ra_end;
+	int i;
+
+	/* called with mutex held */
+	victim = sp = NULL;
+	for (i = 0; i < ISTGT_LU_RCACHE_STREAMS; i++) {
+		if (rc->stream[i].next == offset && rc->stream[i].tick != 0) {
+			sp = &rc->stream[i];
+			break;
+		}
+		if (victim == NULL || rc->stream[i].tick < victim->tick) {
+			victim = &rc->stream[i];
+		}
+	}
+	if (sp == NULL) {
+		/* new stream */
+		sp = victim;
+		sp->next = end;
+		sp->ra_next = end;
+		sp->window = ISTGT_LU_RCACHE_RAMIN;
+		sp->hits = 0;
+		sp->tick = ++rc->tick;
+		return;
+	}
+	sp->next = end;
+	sp->hits++;
+	sp->tick = ++rc->tick;
+	if (sp->hits > 1 && sp->window < ISTGT_LU_RCACHE_RAMAX) {
+		sp->window *= 2;
+	}
+	if (sp->ra_next < end) {
+		sp->ra_next = end;
+	}
+	/* keep at least a half window ahead */
+	if (sp->ra_next - end > sp->window / 2)
+		return;
+	if (sp->ra_next >= rc->spec->size)
+		return;
+	ra_end = end + sp->window;
+	if (ra_end > rc->spec->size) {
+		ra_end = rc->spec->size;
+	}
+	if (rc->ra_num >= ISTGT_LU_RCACHE_RAQUEUE)
+		return;
+	rap = &rc->ra[(rc->ra_head + rc->ra_num) % ISTGT_LU_RCACHE_RAQUEUE];
+	rap->offset = sp->ra_next;
+	rap->nbytes = ra_end - sp->ra_next;
+	rc->ra_num++;
+	sp->ra_next = ra_end;
+	pthread_cond_signal(&rc->ra_cond);
+}
+
+static void *
+istgt_lu_rcache_readahead(void *arg)
+{
+	ISTGT_LU_DISK_RCACHE *rc = (ISTGT_LU_DISK_RCACHE *) arg;
+	ISTGT_LU_RCACHE_RA ra;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d readahead start\n",
+	    rc->spec->num, rc->spec->lun);
+	while (1) {
+		MTX_LOCK(&rc->mutex);
+		while (rc->ra_num == 0 && !rc->stop) {
+			pthread_cond_wait(&rc->ra_cond, &rc->mutex);
+		}
+		if (rc->stop) {
+			MTX_UNLOCK(&rc->mutex);
+			break;
+		}
+		ra = rc->ra[rc->ra_head];
+		rc->ra_head = (rc->ra_head + 1) % ISTGT_LU_RCACHE_RAQUEUE;
+		rc->ra_num--;
+		MTX_UNLOCK(&rc->mutex);
+
+		ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+		    "LU%d: LUN%d readahead %"PRIu64" bytes at %"PRIu64"\n",
+		    rc->spec->num, rc->spec->lun, ra.nbytes, ra.offset);
+		/* reset closes and reopens spec->fd under the write lock */
+		RW_RDLOCK(&rc->spec->io_rwlock);
+		(void) istgt_lu_rcache_read(rc, NULL, ra.offset, ra.nbytes);
+		RW_UNLOCK(&rc->spec->io_rwlock);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d readahead end\n",
+	    rc->spec->num, rc->spec->lun);
+	return NULL;
+}
+
+static int64_t
+istgt_lu_rcache_pread(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_RCACHE *rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	int rv;
+
+	if (!spec->read_cache || nbytes == 0 || offset + nbytes > spec->size) {
+		/* disabled by MODE SELECT (RCD=1) */
+		return rc->pread(spec, buf, nbytes, offset);
+	}
+
+	MTX_LOCK(&rc->mutex);
+	istgt_lu_rcache_detect(rc, offset, offset + nbytes);
+	MTX_UNLOCK(&rc->mutex);
+
+	rv = istgt_lu_rcache_read(rc, (uint8_t *) buf, offset, nbytes);
+	if (rv < 0)
+		return -1;
+	return (int64_t) nbytes;
+}
+
+static void
+istgt_lu_rcache_invalidate(ISTGT_LU_DISK_RCACHE *rc, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_RCACHE_ENT *ent;
+	uint64_t chunk, last;
+
+	if (nbytes == 0)
+		return;
+	chunk = offset / rc->chunksize;
+	last = (offset + nbytes - 1) / rc->chunksize;
+	MTX_LOCK(&rc->mutex);
+	for ( ; chunk <= last; chunk++) {
+		ent = istgt_lu_rcache_lookup(rc, chunk);
+		if (ent == NULL)
+			continue;
+		if (ent->state == ISTGT_LU_RCACHE_FILL) {
+			ent->invalid = 1;
+		} else if (ent->state != ISTGT_LU_RCACHE_A1OUT) {
+			istgt_lu_rcache_free_ent(rc, ent);
+		}
+	}
+	MTX_UNLOCK(&rc->mutex);
+}
+
+static int64_t
+istgt_lu_rcache_pwrite(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_RCACHE *rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	int64_t rv;
+
+	/* drop after writing, a fill started before is marked invalid */
+	rv = rc->pwrite(spec, buf, nbytes, offset);
+	istgt_lu_rcache_invalidate(rc, offset, nbytes);
+	return rv;
+}
+
+static int
+istgt_lu_rcache_unmap(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_RCACHE *rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	int rv;
+
+	rv = rc->unmap(spec, offset, nbytes);
+	istgt_lu_rcache_invalidate(rc, offset, nbytes);
+	return rv;
+}
+
+static int
+istgt_lu_rcache_zero(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_RCACHE *rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	int rv;
+
+	rv = rc->zero(spec, offset, nbytes);
+	istgt_lu_rcache_invalidate(rc, offset, nbytes);
+	return rv;
+}
+
+int
+istgt_lu_disk_rcache_init(ISTGT_LU_DISK *spec, uint64_t size)
+{
+	ISTGT_LU_DISK_RCACHE *rc;
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	char buf[MAX_TMPBUF];
+#endif
+	uint64_t nhash;
+	int rv;
+
+	if (size < ISTGT_LU_RCACHE_MINSIZE) {
+		size = ISTGT_LU_RCACHE_MINSIZE;
+	}
+
+	rc = xmalloc(sizeof *rc);
+	memset(rc, 0, sizeof *rc);
+	rc->spec = spec;
+	rc->size = size;
+	rc->chunksize = ISTGT_LU_RCACHE_CHUNKSIZE;
+	rc->maxchunks = (int) (size / rc->chunksize);
+	rc->nchunks = 0;
+	rc->kin = rc->maxchunks / 4;
+	rc->kout = rc->maxchunks / 2;
+	for (nhash = 1; nhash < (uint64_t) rc->maxchunks * 2; nhash <<= 1)
+		;
+	rc->hash = xmalloc(nhash * sizeof *rc->hash);
+	memset(rc->hash, 0, nhash * sizeof *rc->hash);
+	rc->hashmask = nhash - 1;
+	rc->ra_head = 0;
+	rc->ra_num = 0;
+	rc->stop = 0;
+	rc->pread = spec->pread;
+	rc->pwrite = spec->pwrite;
+	rc->unmap = spec->unmap;
+	rc->zero = spec->zero;
+
+	rv = pthread_mutex_init(&rc->mutex, NULL);
+	if (rv != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		goto error_return;
+	}
+	rv = pthread_cond_init(&rc->fill_cond, NULL);
+	if (rv != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_mutex_destroy(&rc->mutex);
+		goto error_return;
+	}
+	rv = pthread_cond_init(&rc->ra_cond, NULL);
+	if (rv != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_cond_destroy(&rc->fill_cond);
+		(void) pthread_mutex_destroy(&rc->mutex);
+		goto error_return;
+	}
+
+#ifdef ISTGT_STACKSIZE
+	rv = pthread_create(&rc->thread, &spec->lu->istgt->attr,
+	    &istgt_lu_rcache_readahead, (void *) rc);
+#else
+	rv = pthread_create(&rc->thread, NULL,
+	    &istgt_lu_rcache_readahead, (void *) rc);
+#endif
+	if (rv != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		(void) pthread_cond_destroy(&rc->ra_cond);
+		(void) pthread_cond_destroy(&rc->fill_cond);
+		(void) pthread_mutex_destroy(&rc->mutex);
+		goto error_return;
+	}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	snprintf(buf, sizeof buf, "rathread #%d.%d", spec->num, spec->lun);
+	pthread_set_name_np(rc->thread, buf);
+#endif
+
+	spec->rcache = (void *) rc;
+	spec->pread = istgt_lu_rcache_pread;
+	spec->pwrite = istgt_lu_rcache_pwrite;
+	if (rc->unmap != NULL) {
+		spec->unmap = istgt_lu_rcache_unmap;
+	}
+	if (rc->zero != NULL) {
+		spec->zero = istgt_lu_rcache_zero;
+	}
+	return 0;
+
+ error_return:
+	xfree(rc->hash);
+	xfree(rc);
+	return -1;
+}
+
+int
+istgt_lu_disk_rcache_shutdown(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_RCACHE *rc;
+	ISTGT_LU_RCACHE_ENT *ent, *next;
+	uint64_t i;
+
+	rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	if (rc == NULL)
+		return 0;
+
+	MTX_LOCK(&rc->mutex);
+	rc->stop = 1;
+	pthread_cond_broadcast(&rc->ra_cond);
+	MTX_UNLOCK(&rc->mutex);
+	(void) pthread_join(rc->thread, NULL);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "LU%d: LUN%d read cache hits %"PRIu64", misses %"PRIu64
+	    ", prefetched %"PRIu64"\n",
+	    spec->num, spec->lun, rc->hits, rc->misses, rc->prefetched);
+
+	spec->pread = rc->pread;
+	spec->pwrite = rc->pwrite;
+	spec->unmap = rc->unmap;
+	spec->zero = rc->zero;
+	spec->rcache = NULL;
+
+	for (i = 0; i <= rc->hashmask; i++) {
+		for (ent = rc->hash[i]; ent != NULL; ent = next) {
+			next = ent->hnext;
+			xfree(ent->data);
+			xfree(ent);
+		}
+	}
+	(void) pthread_cond_destroy(&rc->ra_cond);
+	(void) pthread_cond_destroy(&rc->fill_cond);
+	(void) pthread_mutex_destroy(&rc->mutex);
+	xfree(rc->hash);
+	xfree(rc);
+	return 0;
+}
+
+uint64_t
+istgt_lu_disk_rcache_size(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_RCACHE *rc;
+
+	rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	if (rc == NULL)
+		return 0;
+	return rc->size;
+}
+
+/* for writes not going through spec->pwrite */
+void
+istgt_lu_disk_rcache_invalidate(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_RCACHE *rc;
+
+	rc = (ISTGT_LU_DISK_RCACHE *) spec->rcache;
+	if (rc == NULL)
+		return;
+	istgt_lu_rcache_invalidate(rc, offset, nbytes);
+}
@@ -209,45 +209,30 @@ istgt_lu_disk_close_vbox(ISTGT_LU_DISK *spec)
 }
 
 static int64_t
-istgt_lu_disk_seek_vbox(ISTGT_LU_DISK *spec, uint64_t offset)
-{
-	//ISTGT_LU_DISK_VBOX *exspec = (ISTGT_LU_DISK_VBOX *)spec->exspec;
-
-	spec->foffset = offset;
-	return 0;
-}
-
-static int64_t
-istgt_lu_disk_read_vbox(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes)
+istgt_lu_disk_pread_vbox(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
 {
 	ISTGT_LU_DISK_VBOX *exspec = (ISTGT_LU_DISK_VBOX *)spec->exspec;
-	uint64_t offset;
 	int rc;
 
-	offset = spec->foffset;
 	rc = VDRead(exspec->pDisk, offset, buf, (size_t)nbytes);
 	if (RT_FAILURE(rc)) {
 		ISTGT_ERRLOG("VDRead error\n");
 		return -1;
 	}
-	spec->foffset += nbytes;
 	return (int64_t)nbytes;
 }
 
 static int64_t
-istgt_lu_disk_write_vbox(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes)
+istgt_lu_disk_pwrite_vbox(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
 {
 	ISTGT_LU_DISK_VBOX *exspec = (ISTGT_LU_DISK_VBOX *)spec->exspec;
-	uint64_t offset;
 	int rc;
 
-	offset = spec->foffset;
 	rc = VDWrite(exspec->pDisk, offset, buf, (size_t)nbytes);
 	if (RT_FAILURE(rc)) {
 		ISTGT_ERRLOG("VDWrite error\n");
 		return -1;
 	}
-	spec->foffset += nbytes;
 	return (int64_t)nbytes;
 }
 
@@ -301,9 +286,8 @@ istgt_lu_disk_vbox_lun_init(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt __attribute__((
 
 	spec->open = istgt_lu_disk_open_vbox;
 	spec->close = istgt_lu_disk_close_vbox;
-	spec->seek = istgt_lu_disk_seek_vbox;
-	spec->read = istgt_lu_disk_read_vbox;
-	spec->write = istgt_lu_disk_write_vbox;
+	spec->pread = istgt_lu_disk_pread_vbox;
+	spec->pwrite = istgt_lu_disk_pwrite_vbox;
 	spec->sync = istgt_lu_disk_sync_vbox;
 	spec->allocate = istgt_lu_disk_allocate_vbox;
 	spec->setcache = istgt_lu_disk_setcache_vbox;
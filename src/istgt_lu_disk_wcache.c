@@ -0,0 +1,863 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+/*
+ * Write-back cache for a LUN.
+ *
+ * Dirty data is kept as non-overlapping extents in a treap ordered by
+ * offset, so an overlap query is a predecessor lookup plus an in-order
+ * walk.  A newer write trims or splits any older extent it covers.
+ * The flusher thread writes runs of adjacent extents with one large
+ * request to the backing store.  Each extent carries a sequence number;
+ * after the write completes only extents that were not modified in the
+ * meantime are dropped.
+ */
+
+typedef struct istgt_lu_wcache_ext_t {
+	struct istgt_lu_wcache_ext_t *left;
+	struct istgt_lu_wcache_ext_t *right;
+	uint32_t prio;
+	uint64_t offset;
+	uint64_t nbytes;
+	uint64_t seq;
+	uint8_t *data;
+} ISTGT_LU_WCACHE_EXT;
+
+typedef struct istgt_lu_wcache_rec_t {
+	uint64_t offset;
+	uint64_t seq;
+} ISTGT_LU_WCACHE_REC;
+
+typedef struct istgt_lu_wcache_gap_t {
+	uint64_t offset;
+	uint64_t nbytes;
+} ISTGT_LU_WCACHE_GAP;
+
+typedef struct istgt_lu_disk_wcache_t {
+	ISTGT_LU_DISK *spec;
+	/* limit of dirty bytes */
+	uint64_t size;
+	/* flusher starts at hiwat and stops at lowat */
+	uint64_t hiwat;
+	uint64_t lowat;
+	/* larger writes bypass the cache */
+	uint64_t direct;
+
+	/* protects the tree and counters */
+	pthread_mutex_t mutex;
+	/* wakes up the flusher */
+	pthread_cond_t flush_cond;
+	/* wakes up throttled writers */
+	pthread_cond_t space_cond;
+	ISTGT_LU_WCACHE_EXT *root;
+	uint64_t dirty;
+	uint64_t seq;
+	uint32_t rand;
+	time_t dirty_since;
+	int waiters;
+	int stop;
+
+	/* serializes writes to the backing store, lock before mutex */
+	pthread_mutex_t flush_mutex;
+	uint8_t *flushbuf;
+	uint64_t flushsize;
+	ISTGT_LU_WCACHE_REC *rec;
+	int maxrec;
+	uint64_t cursor;
+	pthread_t thread;
+
+	/* backing store */
+	int64_t (*pread)(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset);
+	int64_t (*pwrite)(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset);
+	int64_t (*sync)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+	int (*unmap)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+	int (*zero)(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+} ISTGT_LU_DISK_WCACHE;
+
+static uint32_t
+istgt_lu_wcache_rand(ISTGT_LU_DISK_WCACHE *wc)
+{
+	uint32_t x;
+
+	/* xorshift32 */
+	x = wc->rand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	wc->rand = x;
+	return x;
+}
+
+static void
+istgt_lu_wcache_split(ISTGT_LU_WCACHE_EXT *t, uint64_t key, ISTGT_LU_WCACHE_EXT **l, ISTGT_LU_WCACHE_EXT **r)
+{
+	/* l gets offset < key, r gets offset >= key */
+	if (t == NULL) {
+		*l = NULL;
+		*r = NULL;
+		return;
+	}
+	if (t->offset < key) {
+		istgt_lu_wcache_split(t->right, key, &t->right, r);
+		*l = t;
+	} else {
+		istgt_lu_wcache_split(t->left, key, l, &t->left);
+		*r = t;
+	}
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_merge(ISTGT_LU_WCACHE_EXT *l, ISTGT_LU_WCACHE_EXT *r)
+{
+	/* all offsets in l are less than r */
+	if (l == NULL)
+		return r;
+	if (r == NULL)
+		return l;
+	if (l->prio > r->prio) {
+		l->right = istgt_lu_wcache_merge(l->right, r);
+		return l;
+	}
+	r->left = istgt_lu_wcache_merge(l, r->left);
+	return r;
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_find(ISTGT_LU_WCACHE_EXT *t, uint64_t key)
+{
+	while (t != NULL) {
+		if (key == t->offset)
+			return t;
+		t = (key < t->offset) ? t->left : t->right;
+	}
+	return NULL;
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_lookup_ge(ISTGT_LU_WCACHE_EXT *t, uint64_t key)
+{
+	ISTGT_LU_WCACHE_EXT *found = NULL;
+
+	while (t != NULL) {
+		if (t->offset >= key) {
+			found = t;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return found;
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_lookup_lt(ISTGT_LU_WCACHE_EXT *t, uint64_t key)
+{
+	ISTGT_LU_WCACHE_EXT *found = NULL;
+
+	while (t != NULL) {
+		if (t->offset < key) {
+			found = t;
+			t = t->right;
+		} else {
+			t = t->left;
+		}
+	}
+	return found;
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_first(ISTGT_LU_DISK_WCACHE *wc, uint64_t start, uint64_t end)
+{
+	ISTGT_LU_WCACHE_EXT *ext;
+
+	/* first extent overlapping [start, end) */
+	ext = istgt_lu_wcache_lookup_lt(wc->root, start);
+	if (ext != NULL && ext->offset + ext->nbytes > start)
+		return ext;
+	ext = istgt_lu_wcache_lookup_ge(wc->root, start);
+	if (ext != NULL && ext->offset < end)
+		return ext;
+	return NULL;
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_new_ext(ISTGT_LU_DISK_WCACHE *wc, uint64_t offset, uint64_t nbytes, uint8_t *data)
+{
+	ISTGT_LU_WCACHE_EXT *ext;
+
+	ext = xmalloc(sizeof *ext);
+	ext->left = NULL;
+	ext->right = NULL;
+	ext->prio = istgt_lu_wcache_rand(wc);
+	ext->offset = offset;
+	ext->nbytes = nbytes;
+	ext->seq = ++wc->seq;
+	ext->data = data;
+	return ext;
+}
+
+static void
+istgt_lu_wcache_free_ext(ISTGT_LU_WCACHE_EXT *ext)
+{
+	xfree(ext->data);
+	xfree(ext);
+}
+
+static ISTGT_LU_WCACHE_EXT *
+istgt_lu_wcache_tail(ISTGT_LU_DISK_WCACHE *wc, ISTGT_LU_WCACHE_EXT *ext, uint64_t end)
+{
+	uint64_t skip;
+	uint64_t nbytes;
+	uint8_t *data;
+
+	/* new extent for the part of ext at or after end */
+	skip = end - ext->offset;
+	nbytes = ext->nbytes - skip;
+	data = xmalloc(nbytes);
+	memcpy(data, ext->data + skip, nbytes);
+	return istgt_lu_wcache_new_ext(wc, end, nbytes, data);
+}
+
+static void
+istgt_lu_wcache_punch_tree(ISTGT_LU_DISK_WCACHE *wc, ISTGT_LU_WCACHE_EXT *t, uint64_t end, ISTGT_LU_WCACHE_EXT **r)
+{
+	uint64_t ext_end;
+
+	if (t == NULL)
+		return;
+	istgt_lu_wcache_punch_tree(wc, t->left, end, r);
+	istgt_lu_wcache_punch_tree(wc, t->right, end, r);
+	ext_end = t->offset + t->nbytes;
+	if (ext_end > end) {
+		/* only the last one can cross the end */
+		*r = istgt_lu_wcache_merge(istgt_lu_wcache_tail(wc, t, end), *r);
+		wc->dirty -= end - t->offset;
+	} else {
+		wc->dirty -= t->nbytes;
+	}
+	istgt_lu_wcache_free_ext(t);
+}
+
+static void
+istgt_lu_wcache_punch(ISTGT_LU_DISK_WCACHE *wc, uint64_t start, uint64_t end)
+{
+	ISTGT_LU_WCACHE_EXT *l, *m, *r;
+	ISTGT_LU_WCACHE_EXT *prev;
+	uint64_t prev_end;
+
+	/* remove cached data in [start, end), called with mutex held */
+	istgt_lu_wcache_split(wc->root, start, &l, &r);
+	istgt_lu_wcache_split(r, end, &m, &r);
+
+	prev = istgt_lu_wcache_lookup_lt(l, start);
+	if (prev != NULL && prev->offset + prev->nbytes > start) {
+		prev_end = prev->offset + prev->nbytes;
+		if (prev_end > end) {
+			/* the range is inside of prev */
+			r = istgt_lu_wcache_merge(istgt_lu_wcache_tail(wc, prev, end), r);
+			wc->dirty -= end - start;
+		} else {
+			wc->dirty -= prev_end - start;
+		}
+		prev->nbytes = start - prev->offset;
+		prev->data = xrealloc(prev->data, prev->nbytes);
+		prev->seq = ++wc->seq;
+	}
+	istgt_lu_wcache_punch_tree(wc, m, end, &r);
+	wc->root = istgt_lu_wcache_merge(l, r);
+}
+
+static void
+istgt_lu_wcache_insert(ISTGT_LU_DISK_WCACHE *wc, ISTGT_LU_WCACHE_EXT *ext)
+{
+	ISTGT_LU_WCACHE_EXT *l, *r;
+
+	/* called with mutex held */
+	istgt_lu_wcache_punch(wc, ext->offset, ext->offset + ext->nbytes);
+	istgt_lu_wcache_split(wc->root, ext->offset, &l, &r);
+	wc->root = istgt_lu_wcache_merge(istgt_lu_wcache_merge(l, ext), r);
+	if (wc->dirty == 0) {
+		wc->dirty_since = time(NULL);
+	}
+	wc->dirty += ext->nbytes;
+}
+
+static void
+istgt_lu_wcache_remove(ISTGT_LU_DISK_WCACHE *wc, uint64_t offset, uint64_t seq)
+{
+	ISTGT_LU_WCACHE_EXT *ext;
+	ISTGT_LU_WCACHE_EXT *l, *m, *r;
+
+	/* drop the extent if it was not modified since it was flushed */
+	ext = istgt_lu_wcache_find(wc->root, offset);
+	if (ext == NULL || ext->seq != seq)
+		return;
+	istgt_lu_wcache_split(wc->root, offset, &l, &r);
+	istgt_lu_wcache_split(r, offset + 1, &m, &r);
+	wc->dirty -= m->nbytes;
+	istgt_lu_wcache_free_ext(m);
+	wc->root = istgt_lu_wcache_merge(l, r);
+}
+
+static void
+istgt_lu_wcache_free_tree(ISTGT_LU_WCACHE_EXT *t)
+{
+	if (t == NULL)
+		return;
+	istgt_lu_wcache_free_tree(t->left);
+	istgt_lu_wcache_free_tree(t->right);
+	istgt_lu_wcache_free_ext(t);
+}
+
+static int
+istgt_lu_wcache_flush_run(ISTGT_LU_DISK_WCACHE *wc, uint64_t start, uint64_t end, uint64_t *next)
+{
+	ISTGT_LU_DISK *spec = wc->spec;
+	ISTGT_LU_WCACHE_EXT *ext;
+	uint64_t offset;
+	uint64_t nbytes;
+	int64_t rc;
+	int nrec;
+	int i;
+
+	/* write adjacent extents from [start, end), called with flush_mutex */
+	MTX_LOCK(&wc->mutex);
+	ext = istgt_lu_wcache_first(wc, start, end);
+	if (ext == NULL) {
+		MTX_UNLOCK(&wc->mutex);
+		return 0;
+	}
+	offset = ext->offset;
+	nbytes = 0;
+	nrec = 0;
+	while (ext != NULL) {
+		if (nbytes + ext->nbytes > wc->flushsize || nrec >= wc->maxrec)
+			break;
+		memcpy(wc->flushbuf + nbytes, ext->data, ext->nbytes);
+		wc->rec[nrec].offset = ext->offset;
+		wc->rec[nrec].seq = ext->seq;
+		nrec++;
+		nbytes += ext->nbytes;
+		ext = istgt_lu_wcache_find(wc->root, ext->offset + ext->nbytes);
+	}
+	MTX_UNLOCK(&wc->mutex);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG,
+	    "LU%d: LUN%d flush %"PRIu64" bytes at %"PRIu64" (%d extents)\n",
+	    spec->num, spec->lun, nbytes, offset, nrec);
+	rc = wc->pwrite(spec, wc->flushbuf, nbytes, offset);
+
+	MTX_LOCK(&wc->mutex);
+	for (i = 0; i < nrec; i++) {
+		istgt_lu_wcache_remove(wc, wc->rec[i].offset, wc->rec[i].seq);
+	}
+	if (wc->dirty == 0) {
+		wc->dirty_since = 0;
+	}
+	if (rc < 0 || (uint64_t) rc != nbytes) {
+		/* reported as deferred error by next command */
+		spec->woffset = offset;
+		spec->err_write_cache = 1;
+	}
+	pthread_cond_broadcast(&wc->space_cond);
+	MTX_UNLOCK(&wc->mutex);
+
+	*next = offset + nbytes;
+	if (rc < 0 || (uint64_t) rc != nbytes) {
+		ISTGT_ERRLOG("LU%d: LUN%d: write back failed at %"PRIu64"\n",
+		    spec->num, spec->lun, offset);
+		return -1;
+	}
+	return 1;
+}
+
+static int
+istgt_lu_wcache_flush_range(ISTGT_LU_DISK_WCACHE *wc, uint64_t start, uint64_t end)
+{
+	uint64_t next;
+	int error = 0;
+	int rc;
+
+	MTX_LOCK(&wc->mutex);
+	rc = (istgt_lu_wcache_first(wc, start, end) != NULL);
+	MTX_UNLOCK(&wc->mutex);
+	if (!rc)
+		return 0;
+
+	MTX_LOCK(&wc->flush_mutex);
+	while ((rc = istgt_lu_wcache_flush_run(wc, start, end, &next)) != 0) {
+		if (rc < 0) {
+			error = 1;
+		}
+	}
+	MTX_UNLOCK(&wc->flush_mutex);
+	return error ? -1 : 0;
+}
+
+static void *
+istgt_lu_wcache_flusher(void *arg)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) arg;
+	struct timespec abstime;
+	time_t now;
+	uint64_t target;
+	uint64_t next;
+	int rc;
+
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d write back flusher start\n",
+	    wc->spec->num, wc->spec->lun);
+	while (1) {
+		MTX_LOCK(&wc->mutex);
+		while (1) {
+			if (wc->stop)
+				break;
+			if (wc->dirty >= wc->hiwat || wc->waiters > 0) {
+				target = wc->lowat;
+				break;
+			}
+			now = time(NULL);
+			if (wc->dirty != 0
+			    && istgt_difftime(now, wc->dirty_since) >= ISTGT_LU_WCACHE_AGE) {
+				/* write out everything when aged */
+				target = 0;
+				wc->dirty_since = now;
+				break;
+			}
+			abstime.tv_sec = now + 1;
+			abstime.tv_nsec = 0;
+			(void) pthread_cond_timedwait(&wc->flush_cond, &wc->mutex,
+			    &abstime);
+		}
+		if (wc->stop) {
+			MTX_UNLOCK(&wc->mutex);
+			break;
+		}
+		MTX_UNLOCK(&wc->mutex);
+
+		/* elevator order from the last position */
+		MTX_LOCK(&wc->flush_mutex);
+		while (1) {
+			rc = istgt_lu_wcache_flush_run(wc, wc->cursor, UINT64_MAX,
+			    &next);
+			if (rc == 0) {
+				if (wc->cursor == 0)
+					break;
+				wc->cursor = 0;
+				continue;
+			}
+			wc->cursor = next;
+			MTX_LOCK(&wc->mutex);
+			if (wc->stop
+			    || (wc->dirty <= target && wc->waiters == 0)) {
+				MTX_UNLOCK(&wc->mutex);
+				break;
+			}
+			MTX_UNLOCK(&wc->mutex);
+		}
+		MTX_UNLOCK(&wc->flush_mutex);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_DEBUG, "LU%d: LUN%d write back flusher end\n",
+	    wc->spec->num, wc->spec->lun);
+	return NULL;
+}
+
+static int64_t
+istgt_lu_wcache_pread(ISTGT_LU_DISK *spec, void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	ISTGT_LU_WCACHE_EXT *ext;
+	ISTGT_LU_WCACHE_GAP *gaps;
+	uint8_t *data = (uint8_t *) buf;
+	uint64_t end;
+	uint64_t pos;
+	uint64_t s, e;
+	int64_t rc;
+	int ngaps;
+	int maxgaps;
+	int i;
+
+	end = offset + nbytes;
+	MTX_LOCK(&wc->mutex);
+	ext = istgt_lu_wcache_first(wc, offset, end);
+	if (ext == NULL) {
+		MTX_UNLOCK(&wc->mutex);
+		return wc->pread(spec, buf, nbytes, offset);
+	}
+
+	/* copy dirty data now, the rest is read after unlock */
+	gaps = NULL;
+	ngaps = maxgaps = 0;
+	pos = offset;
+	while (pos < end) {
+		if (ext != NULL && ext->offset < end) {
+			s = (ext->offset > offset) ? ext->offset : offset;
+			e = ext->offset + ext->nbytes;
+			if (e > end) {
+				e = end;
+			}
+		} else {
+			s = e = end;
+		}
+		if (s > pos) {
+			if (ngaps == maxgaps) {
+				maxgaps = (maxgaps == 0) ? 8 : maxgaps * 2;
+				gaps = xrealloc(gaps, maxgaps * sizeof *gaps);
+			}
+			gaps[ngaps].offset = pos;
+			gaps[ngaps].nbytes = s - pos;
+			ngaps++;
+		}
+		if (e > s) {
+			memcpy(data + (s - offset), ext->data + (s - ext->offset),
+			    e - s);
+		}
+		pos = e;
+		if (ext != NULL) {
+			ext = istgt_lu_wcache_lookup_ge(wc->root,
+			    ext->offset + ext->nbytes);
+		}
+	}
+	MTX_UNLOCK(&wc->mutex);
+
+	for (i = 0; i < ngaps; i++) {
+		rc = wc->pread(spec, data + (gaps[i].offset - offset),
+		    gaps[i].nbytes, gaps[i].offset);
+		if (rc < 0) {
+			xfree(gaps);
+			return -1;
+		}
+		if ((uint64_t) rc < gaps[i].nbytes) {
+			memset(data + (gaps[i].offset - offset) + rc, 0,
+			    gaps[i].nbytes - rc);
+		}
+	}
+	xfree(gaps);
+	return (int64_t) nbytes;
+}
+
+static int64_t
+istgt_lu_wcache_pwrite(ISTGT_LU_DISK *spec, const void *buf, uint64_t nbytes, uint64_t offset)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	ISTGT_LU_WCACHE_EXT *ext;
+	uint8_t *data;
+
+	if (nbytes == 0)
+		return 0;
+	if (!spec->write_cache) {
+		/* WCE=0, write through; older data under this range goes first */
+		if (istgt_lu_wcache_flush_range(wc, offset, offset + nbytes) < 0)
+			return -1;
+	}
+	if (!spec->write_cache || nbytes >= wc->direct) {
+		/* no flush must land on the range after this write */
+		MTX_LOCK(&wc->flush_mutex);
+		MTX_LOCK(&wc->mutex);
+		istgt_lu_wcache_punch(wc, offset, offset + nbytes);
+		pthread_cond_broadcast(&wc->space_cond);
+		MTX_UNLOCK(&wc->mutex);
+		MTX_UNLOCK(&wc->flush_mutex);
+		return wc->pwrite(spec, buf, nbytes, offset);
+	}
+
+	data = xmalloc(nbytes);
+	memcpy(data, buf, nbytes);
+
+	MTX_LOCK(&wc->mutex);
+	while (wc->dirty + nbytes > wc->size && !wc->stop) {
+		/* throttle until the flusher makes room */
+		wc->waiters++;
+		pthread_cond_signal(&wc->flush_cond);
+		pthread_cond_wait(&wc->space_cond, &wc->mutex);
+		wc->waiters--;
+	}
+	ext = istgt_lu_wcache_new_ext(wc, offset, nbytes, data);
+	istgt_lu_wcache_insert(wc, ext);
+	if (wc->dirty >= wc->hiwat) {
+		pthread_cond_signal(&wc->flush_cond);
+	}
+	MTX_UNLOCK(&wc->mutex);
+	return (int64_t) nbytes;
+}
+
+static int64_t
+istgt_lu_wcache_sync(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	int64_t rc;
+
+	rc = istgt_lu_wcache_flush_range(wc, offset, offset + nbytes);
+	if (rc < 0) {
+		(void) wc->sync(spec, offset, nbytes);
+		return -1;
+	}
+	return wc->sync(spec, offset, nbytes);
+}
+
+static int
+istgt_lu_wcache_unmap(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+
+	/* drop dirty data so that no flush resurrects the range */
+	MTX_LOCK(&wc->flush_mutex);
+	MTX_LOCK(&wc->mutex);
+	istgt_lu_wcache_punch(wc, offset, offset + nbytes);
+	pthread_cond_broadcast(&wc->space_cond);
+	MTX_UNLOCK(&wc->mutex);
+	MTX_UNLOCK(&wc->flush_mutex);
+	return wc->unmap(spec, offset, nbytes);
+}
+
+static int
+istgt_lu_wcache_zero(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_WCACHE *wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+
+	/* same as unmap, dirty data must not overwrite zeros later */
+	MTX_LOCK(&wc->flush_mutex);
+	MTX_LOCK(&wc->mutex);
+	istgt_lu_wcache_punch(wc, offset, offset + nbytes);
+	pthread_cond_broadcast(&wc->space_cond);
+	MTX_UNLOCK(&wc->mutex);
+	MTX_UNLOCK(&wc->flush_mutex);
+	return wc->zero(spec, offset, nbytes);
+}
+
+int
+istgt_lu_disk_wcache_init(ISTGT_LU_DISK *spec, uint64_t size)
+{
+	ISTGT_LU_DISK_WCACHE *wc;
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	char buf[MAX_TMPBUF];
+#endif
+	int rc;
+
+	if (size < ISTGT_LU_WCACHE_MINSIZE) {
+		size = ISTGT_LU_WCACHE_MINSIZE;
+	}
+
+	wc = xmalloc(sizeof *wc);
+	memset(wc, 0, sizeof *wc);
+	wc->spec = spec;
+	wc->size = size;
+	wc->hiwat = size / 2;
+	wc->lowat = size / 4;
+	wc->direct = size / 4;
+	if (wc->direct > ISTGT_LU_WCACHE_DIRECTSIZE) {
+		wc->direct = ISTGT_LU_WCACHE_DIRECTSIZE;
+	}
+	wc->root = NULL;
+	wc->dirty = 0;
+	wc->seq = 0;
+	wc->rand = (uint32_t) time(NULL) | 1U;
+	wc->dirty_since = 0;
+	wc->waiters = 0;
+	wc->stop = 0;
+	wc->flushsize = ISTGT_LU_WCACHE_FLUSHSIZE;
+	wc->flushbuf = xmalloc(wc->flushsize);
+	wc->maxrec = (int) (wc->flushsize / spec->blocklen);
+	wc->rec = xmalloc(wc->maxrec * sizeof *wc->rec);
+	wc->cursor = 0;
+	wc->pread = spec->pread;
+	wc->pwrite = spec->pwrite;
+	wc->sync = spec->sync;
+	wc->unmap = spec->unmap;
+	wc->zero = spec->zero;
+
+	rc = pthread_mutex_init(&wc->mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		goto error_return;
+	}
+	rc = pthread_mutex_init(&wc->flush_mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		(void) pthread_mutex_destroy(&wc->mutex);
+		goto error_return;
+	}
+	rc = pthread_cond_init(&wc->flush_cond, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_mutex_destroy(&wc->flush_mutex);
+		(void) pthread_mutex_destroy(&wc->mutex);
+		goto error_return;
+	}
+	rc = pthread_cond_init(&wc->space_cond, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: cond_init() failed\n", spec->num);
+		(void) pthread_cond_destroy(&wc->flush_cond);
+		(void) pthread_mutex_destroy(&wc->flush_mutex);
+		(void) pthread_mutex_destroy(&wc->mutex);
+		goto error_return;
+	}
+
+#ifdef ISTGT_STACKSIZE
+	rc = pthread_create(&wc->thread, &spec->lu->istgt->attr,
+	    &istgt_lu_wcache_flusher, (void *) wc);
+#else
+	rc = pthread_create(&wc->thread, NULL,
+	    &istgt_lu_wcache_flusher, (void *) wc);
+#endif
+	if (rc != 0) {
+		ISTGT_ERRLOG("pthread_create() failed\n");
+		(void) pthread_cond_destroy(&wc->space_cond);
+		(void) pthread_cond_destroy(&wc->flush_cond);
+		(void) pthread_mutex_destroy(&wc->flush_mutex);
+		(void) pthread_mutex_destroy(&wc->mutex);
+		goto error_return;
+	}
+#ifdef HAVE_PTHREAD_SET_NAME_NP
+	snprintf(buf, sizeof buf, "wbthread #%d.%d", spec->num, spec->lun);
+	pthread_set_name_np(wc->thread, buf);
+#endif
+
+	spec->wcache = (void *) wc;
+	spec->pread = istgt_lu_wcache_pread;
+	spec->pwrite = istgt_lu_wcache_pwrite;
+	spec->sync = istgt_lu_wcache_sync;
+	if (wc->unmap != NULL) {
+		spec->unmap = istgt_lu_wcache_unmap;
+	}
+	if (wc->zero != NULL) {
+		spec->zero = istgt_lu_wcache_zero;
+	}
+	return 0;
+
+ error_return:
+	xfree(wc->rec);
+	xfree(wc->flushbuf);
+	xfree(wc);
+	return -1;
+}
+
+int
+istgt_lu_disk_wcache_shutdown(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_WCACHE *wc;
+	int rc;
+
+	wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	if (wc == NULL)
+		return 0;
+
+	MTX_LOCK(&wc->mutex);
+	wc->stop = 1;
+	pthread_cond_broadcast(&wc->flush_cond);
+	pthread_cond_broadcast(&wc->space_cond);
+	MTX_UNLOCK(&wc->mutex);
+	(void) pthread_join(wc->thread, NULL);
+
+	/* write out all dirty data */
+	rc = istgt_lu_wcache_flush_range(wc, 0, UINT64_MAX);
+	if (rc < 0) {
+		ISTGT_ERRLOG("LU%d: LUN%d: write back flush failed\n",
+		    spec->num, spec->lun);
+	}
+
+	spec->pread = wc->pread;
+	spec->pwrite = wc->pwrite;
+	spec->sync = wc->sync;
+	spec->unmap = wc->unmap;
+	spec->zero = wc->zero;
+	spec->wcache = NULL;
+
+	istgt_lu_wcache_free_tree(wc->root);
+	(void) pthread_cond_destroy(&wc->space_cond);
+	(void) pthread_cond_destroy(&wc->flush_cond);
+	(void) pthread_mutex_destroy(&wc->flush_mutex);
+	(void) pthread_mutex_destroy(&wc->mutex);
+	xfree(wc->rec);
+	xfree(wc->flushbuf);
+	xfree(wc);
+	return rc;
+}
+
+int
+istgt_lu_disk_wcache_flush(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes)
+{
+	ISTGT_LU_DISK_WCACHE *wc;
+
+	wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	if (wc == NULL)
+		return 0;
+	return istgt_lu_wcache_flush_range(wc, offset, offset + nbytes);
+}
+
+int
+istgt_lu_disk_wcache_error(ISTGT_LU_DISK *spec, uint64_t *offset)
+{
+	ISTGT_LU_DISK_WCACHE *wc;
+	int err;
+
+	/* peek if offset is NULL, otherwise take the deferred error */
+	wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	if (wc == NULL)
+		return 0;
+	MTX_LOCK(&wc->mutex);
+	err = spec->err_write_cache;
+	if (err && offset != NULL) {
+		*offset = spec->woffset;
+		spec->err_write_cache = 0;
+	}
+	MTX_UNLOCK(&wc->mutex);
+	return err;
+}
+
+uint64_t
+istgt_lu_disk_wcache_size(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_WCACHE *wc;
+
+	wc = (ISTGT_LU_DISK_WCACHE *) spec->wcache;
+	if (wc == NULL)
+		return 0;
+	return wc->size;
+}
@@ -0,0 +1,728 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "istgt.h"
+#include "istgt_log.h"
+#include "istgt_misc.h"
+#include "istgt_iscsi.h"
+#include "istgt_lu.h"
+#include "istgt_proto.h"
+#include "istgt_scsi.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+/*
+ * EXTENDED COPY (LID1) and RECEIVE COPY RESULTS.
+ *
+ * Copy targets are named by the NAA designator of the Device
+ * Identification VPD page and are resolved among the disk LUs of this
+ * instance that the initiator is allowed to access on the same portal
+ * group.  Only block to block segments are supported, inline and held
+ * data are not.
+ *
+ * A segment between two RAW files is cloned by FICLONERANGE or copied
+ * in the kernel by copy_file_range() when the destination has no cache
+ * layer in between, and is copied in chunks through the normal
+ * pread/pwrite path otherwise or if neither works.
+ *
+ * Commands run to completion, so RECEIVE COPY RESULTS only reports the
+ * outcome of the lists recently completed by the I_T nexus.
+ */
+
+#define BUILD_SENSE(SK,ASC,ASCQ)					\
+	do {								\
+		*sense_len =						\
+			istgt_lu_scsi_build_sense_data(sense_data,	\
+			    ISTGT_SCSI_SENSE_ ## SK,			\
+			    (ASC), (ASCQ));				\
+	} while (0)
+
+#define ISTGT_LU_XCOPY_CSCD_ID		0xe4
+#define ISTGT_LU_XCOPY_SEG_BLOCK	0x02
+#define ISTGT_LU_XCOPY_CSCD_LEN		32
+#define ISTGT_LU_XCOPY_SEG_BLOCK_LEN	28
+
+#define ISTGT_LU_XCOPY_STATUS_GOOD	0x01
+#define ISTGT_LU_XCOPY_STATUS_ERROR	0x02
+
+typedef struct istgt_lu_xcopy_result_t {
+	char *initiator_port;
+	int list_id;
+	int status;
+	int segments;
+	uint64_t transfer;
+	uint64_t seq;
+} ISTGT_LU_XCOPY_RESULT;
+
+typedef struct istgt_lu_disk_xcopy_t {
+	pthread_mutex_t mutex;
+	uint64_t seq;
+	ISTGT_LU_XCOPY_RESULT results[ISTGT_LU_XCOPY_RESULTS];
+} ISTGT_LU_DISK_XCOPY;
+
+static ISTGT_LU_DISK *
+istgt_lu_xcopy_match(ISTGT_LU_Ptr lu, uint8_t *id, int idlen)
+{
+	ISTGT_LU_DISK *spec;
+	uint8_t lid[16];
+	int plen;
+	int i;
+
+	if (lu->type != ISTGT_LU_TYPE_DISK)
+		return NULL;
+	for (i = 0; i < lu->maxlun; i++) {
+		if (lu->lun[i].type != ISTGT_LU_LUN_TYPE_STORAGE)
+			continue;
+		spec = (ISTGT_LU_DISK *) lu->lun[i].spec;
+		if (spec == NULL)
+			continue;
+		/* same as Device Identification VPD */
+		plen = istgt_lu_set_lid(lid, istgt_get_lui(lu->name, i & 0xffffU));
+		if (plen == idlen && memcmp(lid, id, (size_t) plen) == 0)
+			return spec;
+	}
+	return NULL;
+}
+
+/* returns a referenced disk, or NULL if not reachable */
+static ISTGT_LU_DISK *
+istgt_lu_xcopy_get_cscd(ISTGT_LU_DISK *spec, CONN_Ptr conn, uint8_t *cscd)
+{
+	ISTGT_Ptr istgt = spec->lu->istgt;
+	ISTGT_LU_Ptr lu;
+	ISTGT_LU_DISK *target;
+	uint8_t *id;
+	int code_set, type, idlen;
+	int i;
+
+	/* designation descriptor */
+	code_set = BGET8W(&cscd[4], 3, 4);
+	type = BGET8W(&cscd[5], 3, 4);
+	idlen = cscd[7];
+	id = &cscd[8];
+	if (code_set != SPC_VPD_CODE_SET_BINARY
+	    || type != SPC_VPD_IDENTIFIER_TYPE_NAA
+	    || idlen > 16) {
+		return NULL;
+	}
+
+	/* the common case is a copy inside the LU */
+	target = istgt_lu_xcopy_match(spec->lu, id, idlen);
+	if (target != NULL) {
+		return target;
+	}
+
+	target = NULL;
+	MTX_LOCK(&istgt->mutex);
+	for (i = 0; i < MAX_LOGICAL_UNIT; i++) {
+		lu = istgt->logical_unit[i];
+		if (lu == NULL || lu == spec->lu)
+			continue;
+		if (istgt_lu_get_state(lu) != ISTGT_STATE_RUNNING)
+			continue;
+		target = istgt_lu_xcopy_match(lu, id, idlen);
+		if (target == NULL)
+			continue;
+		if (!istgt_lu_access(conn, lu, conn->initiator_name,
+			conn->initiator_addr, NULL)) {
+			target = NULL;
+			break;
+		}
+		/* hold the LU against reload while copying */
+		MTX_LOCK(&lu->mutex);
+		lu->xcopy_refs++;
+		MTX_UNLOCK(&lu->mutex);
+		break;
+	}
+	MTX_UNLOCK(&istgt->mutex);
+	return target;
+}
+
+static void
+istgt_lu_xcopy_put_cscd(ISTGT_LU_DISK *spec, ISTGT_LU_DISK *target)
+{
+	if (target == NULL || target->lu == spec->lu)
+		return;
+	MTX_LOCK(&target->lu->mutex);
+	target->lu->xcopy_refs--;
+	MTX_UNLOCK(&target->lu->mutex);
+}
+
+static int
+istgt_lu_xcopy_offload(ISTGT_LU_DISK *src, uint64_t soff, ISTGT_LU_DISK *dst, uint64_t doff, uint64_t nbytes, uint64_t *copied)
+{
+	int rc;
+
+	*copied = 0;
+	if (strcasecmp(src->disktype, "RAW") != 0
+	    || strcasecmp(dst->disktype, "RAW") != 0)
+		return -1;
+	/* dirty data would be overwritten later, fsize is not tracked */
+	if (dst->wcache != NULL
+	    || dst->lu->istgt->swmode >= ISTGT_SWMODE_EXPERIMENTAL)
+		return -1;
+	if (src == dst && soff < doff + nbytes && doff < soff + nbytes)
+		return -1;
+	rc = istgt_lu_disk_wcache_flush(src, soff, nbytes);
+	if (rc < 0)
+		return -1;
+	istgt_lu_disk_amap_mapped(dst, doff, nbytes);
+
+#ifdef FICLONERANGE
+	{
+		struct file_clone_range fcr;
+
+		fcr.src_fd = (int64_t) src->fd;
+		fcr.src_offset = soff;
+		fcr.src_length = nbytes;
+		fcr.dest_offset = doff;
+		rc = ioctl(dst->fd, FICLONERANGE, &fcr);
+		if (rc == 0) {
+			*copied = nbytes;
+			goto done;
+		}
+	}
+#endif /* FICLONERANGE */
+#ifdef HAVE_COPY_FILE_RANGE
+	{
+		off_t so = (off_t) soff;
+		off_t dso = (off_t) doff;
+		ssize_t n;
+
+		while (*copied < nbytes) {
+			n = copy_file_range(src->fd, &so, dst->fd, &dso,
+			    (size_t) (nbytes - *copied), 0);
+			if (n <= 0)
+				break;
+			*copied += (uint64_t) n;
+		}
+	}
+#endif /* HAVE_COPY_FILE_RANGE */
+	if (*copied == 0)
+		return -1;
+
+ done:
+	istgt_lu_disk_rcache_invalidate(dst, doff, *copied);
+	if (!dst->write_cache) {
+		rc = (int) dst->sync(dst, doff, *copied);
+		if (rc < 0) {
+			/* retry through the normal path */
+			*copied = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Other LUs are used like their own commands do: io_rwlock against
+ * reset, and the destination LBA range against executing commands.
+ * The LU of the XCOPY is already held by it as a barrier.
+ * Return -2 if either is busy.
+ */
+static int
+istgt_lu_xcopy_lock(ISTGT_LU_DISK *spec, ISTGT_LU_DISK *src, ISTGT_LU_DISK *dst, uint64_t doff, uint64_t nbytes, int *slot)
+{
+	*slot = -1;
+	if (src != spec && src != dst) {
+		if (pthread_rwlock_tryrdlock(&src->io_rwlock) != 0)
+			return -2;
+	}
+	if (dst != spec) {
+		if (pthread_rwlock_tryrdlock(&dst->io_rwlock) != 0)
+			goto busy_src;
+		*slot = istgt_lu_disk_queue_claim(dst, doff / dst->blocklen,
+		    nbytes / dst->blocklen);
+		if (*slot < 0) {
+			RW_UNLOCK(&dst->io_rwlock);
+			goto busy_src;
+		}
+	}
+	return 0;
+
+ busy_src:
+	if (src != spec && src != dst) {
+		RW_UNLOCK(&src->io_rwlock);
+	}
+	return -2;
+}
+
+static void
+istgt_lu_xcopy_unlock(ISTGT_LU_DISK *spec, ISTGT_LU_DISK *src, ISTGT_LU_DISK *dst, int slot)
+{
+	if (dst != spec) {
+		istgt_lu_disk_queue_unclaim(dst, slot);
+		RW_UNLOCK(&dst->io_rwlock);
+	}
+	if (src != spec && src != dst) {
+		RW_UNLOCK(&src->io_rwlock);
+	}
+}
+
+static int
+istgt_lu_xcopy_range(ISTGT_LU_DISK *src, uint64_t soff, ISTGT_LU_DISK *dst, uint64_t doff, uint64_t nbytes, uint8_t **buf)
+{
+	uint64_t copied;
+	uint64_t n;
+	int64_t rc;
+
+	/* whatever is not offloaded is copied below */
+	(void) istgt_lu_xcopy_offload(src, soff, dst, doff, nbytes, &copied);
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+	    "XCOPY offloaded %"PRIu64"/%"PRIu64" bytes\n", copied, nbytes);
+
+	/* copy the rest through the LUs */
+	while (copied < nbytes) {
+		if (*buf == NULL) {
+			*buf = xmalloc(ISTGT_LU_XCOPY_CHUNKSIZE);
+		}
+		n = DMIN64(ISTGT_LU_XCOPY_CHUNKSIZE, nbytes - copied);
+		rc = src->pread(src, *buf, n, soff + copied);
+		if (rc < 0 || (uint64_t) rc != n) {
+			ISTGT_ERRLOG("LU%d: LUN%d: XCOPY read failed\n",
+			    src->num, src->lun);
+			return -1;
+		}
+		rc = dst->pwrite(dst, *buf, n, doff + copied);
+		if (rc < 0 || (uint64_t) rc != n) {
+			ISTGT_ERRLOG("LU%d: LUN%d: XCOPY write failed\n",
+			    dst->num, dst->lun);
+			return -1;
+		}
+		copied += n;
+	}
+	return 0;
+}
+
+static void
+istgt_lu_xcopy_record(ISTGT_LU_DISK *spec, CONN_Ptr conn, int list_id, int status, int segments, uint64_t transfer)
+{
+	ISTGT_LU_DISK_XCOPY *xc = (ISTGT_LU_DISK_XCOPY *) spec->xcopy;
+	ISTGT_LU_XCOPY_RESULT *r, *slot;
+	int i;
+
+	if (xc == NULL)
+		return;
+	MTX_LOCK(&xc->mutex);
+	slot = NULL;
+	for (i = 0; i < ISTGT_LU_XCOPY_RESULTS; i++) {
+		r = &xc->results[i];
+		if (r->initiator_port != NULL && r->list_id == list_id
+		    && strcasecmp(r->initiator_port, conn->initiator_port) == 0) {
+			slot = r;
+			break;
+		}
+		/* replace the oldest */
+		if (slot == NULL || r->seq < slot->seq)
+			slot = r;
+	}
+	if (slot->initiator_port == NULL
+	    || strcasecmp(slot->initiator_port, conn->initiator_port) != 0) {
+		xfree(slot->initiator_port);
+		slot->initiator_port = xstrdup(conn->initiator_port);
+	}
+	slot->list_id = list_id;
+	slot->status = status;
+	slot->segments = segments;
+	slot->transfer = transfer;
+	slot->seq = ++xc->seq;
+	MTX_UNLOCK(&xc->mutex);
+}
+
+int
+istgt_lu_disk_xcopy(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint8_t *data, int len)
+{
+	ISTGT_LU_DISK *cscd[ISTGT_LU_XCOPY_MAX_CSCD];
+	ISTGT_LU_DISK *src, *dst;
+	uint8_t *sense_data;
+	size_t *sense_len;
+	uint8_t *buf;
+	uint8_t *cp;
+	uint64_t slba, dlba, nblocks;
+	uint64_t transfer;
+	int list_id, list_id_usage;
+	int cscd_len, seg_len, inline_len;
+	int ncscd, nseg;
+	int sidx, didx, dlen;
+	int blocklen;
+	int slot;
+	int status;
+	int rc;
+	int i;
+
+	sense_data = lu_cmd->sense_data;
+	sense_len = &lu_cmd->sense_data_len;
+	*sense_len = 0;
+
+	if (len < 16) {
+		/* PARAMETER LIST LENGTH ERROR */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+		return -1;
+	}
+	list_id = data[0];
+	list_id_usage = BGET8W(&data[1], 4, 2);
+	cscd_len = (int) DGET16(&data[2]);
+	seg_len = (int) DGET32(&data[8]);
+	inline_len = (int) DGET32(&data[12]);
+
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+	    "XCOPY list=%d usage=%d cscd=%d seg=%d inline=%d\n",
+	    list_id, list_id_usage, cscd_len, seg_len, inline_len);
+	if (cscd_len < 0 || seg_len < 0 || inline_len < 0
+	    || cscd_len + seg_len > ISTGT_LU_XCOPY_MAX_DESC_LEN
+	    || 16 + cscd_len + seg_len + inline_len > len) {
+		/* PARAMETER LIST LENGTH ERROR */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+		return -1;
+	}
+	if (inline_len != 0 || list_id_usage == 0x01
+	    || (cscd_len % ISTGT_LU_XCOPY_CSCD_LEN) != 0) {
+		/* INVALID FIELD IN PARAMETER LIST */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+		return -1;
+	}
+	ncscd = cscd_len / ISTGT_LU_XCOPY_CSCD_LEN;
+	if (ncscd > ISTGT_LU_XCOPY_MAX_CSCD) {
+		/* TOO MANY TARGET DESCRIPTORS */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x06);
+		return -1;
+	}
+
+	/* resolve copy targets */
+	memset(cscd, 0, sizeof cscd);
+	status = 0;
+	for (i = 0; i < ncscd; i++) {
+		cp = &data[16 + i * ISTGT_LU_XCOPY_CSCD_LEN];
+		if (cp[0] != ISTGT_LU_XCOPY_CSCD_ID
+		    || BGET8W(&cp[1], 4, 5) != SPC_PERIPHERAL_DEVICE_TYPE_DISK) {
+			/* UNSUPPORTED TARGET DESCRIPTOR TYPE CODE */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x07);
+			status = -1;
+			break;
+		}
+		cscd[i] = istgt_lu_xcopy_get_cscd(spec, conn, cp);
+		if (cscd[i] == NULL) {
+			ISTGT_ERRLOG("LU%d: XCOPY target %d not found\n",
+			    spec->lu->num, i);
+			/* COPY TARGET DEVICE NOT REACHABLE */
+			BUILD_SENSE(COPY_ABORTED, 0x0d, 0x02);
+			status = -1;
+			break;
+		}
+		/* DISK BLOCK LENGTH */
+		blocklen = (int) DGET24(&cp[29]);
+		if (blocklen != 0 && (uint64_t) blocklen != cscd[i]->blocklen) {
+			/* INVALID FIELD IN PARAMETER LIST */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+			status = -1;
+			break;
+		}
+		if (cscd[i]->lu != spec->lu && cscd[i]->rsv_key != 0) {
+			/* reservations of other LUs are not evaluated */
+			ISTGT_ERRLOG("LU%d: XCOPY target %d is reserved\n",
+			    spec->lu->num, i);
+			BUILD_SENSE(COPY_ABORTED, 0x0d, 0x02);
+			status = -1;
+			break;
+		}
+	}
+
+	/* process segments in order */
+	buf = NULL;
+	nseg = 0;
+	transfer = 0;
+	cp = &data[16 + cscd_len];
+	while (status == 0 && cp < &data[16 + cscd_len + seg_len]) {
+		if (nseg >= ISTGT_LU_XCOPY_MAX_SEGMENT) {
+			/* TOO MANY SEGMENT DESCRIPTORS */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x08);
+			status = -1;
+			break;
+		}
+		if (cp + 4 > &data[16 + cscd_len + seg_len]) {
+			/* PARAMETER LIST LENGTH ERROR */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x1a, 0x00);
+			status = -1;
+			break;
+		}
+		dlen = (int) DGET16(&cp[2]);
+		if (cp[0] != ISTGT_LU_XCOPY_SEG_BLOCK) {
+			/* UNSUPPORTED SEGMENT DESCRIPTOR TYPE CODE */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x09);
+			status = -1;
+			break;
+		}
+		if (dlen + 4 != ISTGT_LU_XCOPY_SEG_BLOCK_LEN
+		    || cp + 4 + dlen > &data[16 + cscd_len + seg_len]) {
+			/* INVALID FIELD IN PARAMETER LIST */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+			status = -1;
+			break;
+		}
+		sidx = (int) DGET16(&cp[4]);
+		didx = (int) DGET16(&cp[6]);
+		nblocks = (uint64_t) DGET16(&cp[10]);
+		slba = DGET64(&cp[12]);
+		dlba = DGET64(&cp[20]);
+		if (sidx >= ncscd || didx >= ncscd) {
+			/* INVALID FIELD IN PARAMETER LIST */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+			status = -1;
+			break;
+		}
+		src = cscd[sidx];
+		dst = cscd[didx];
+		ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+		    "XCOPY segment %d: LU%d:%d lba %"PRIu64" -> LU%d:%d lba %"PRIu64
+		    ", %"PRIu64" blocks\n", nseg,
+		    src->num, src->lun, slba, dst->num, dst->lun, dlba, nblocks);
+		if (src->blocklen != dst->blocklen
+		    || nblocks * src->blocklen > ISTGT_LU_XCOPY_MAX_SEGMENT_LEN) {
+			/* INVALID FIELD IN PARAMETER LIST */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x26, 0x00);
+			status = -1;
+			break;
+		}
+		if (slba >= src->blockcnt || nblocks > src->blockcnt
+		    || slba > src->blockcnt - nblocks
+		    || dlba >= dst->blockcnt || nblocks > dst->blockcnt
+		    || dlba > dst->blockcnt - nblocks) {
+			/* LOGICAL BLOCK ADDRESS OUT OF RANGE */
+			BUILD_SENSE(COPY_ABORTED, 0x21, 0x00);
+			status = -1;
+			break;
+		}
+		if (dst->lu->readonly) {
+			/* WRITE PROTECTED */
+			BUILD_SENSE(DATA_PROTECT, 0x27, 0x00);
+			status = -1;
+			break;
+		}
+		if (nblocks != 0) {
+			rc = istgt_lu_xcopy_lock(spec, src, dst,
+			    dlba * dst->blocklen, nblocks * dst->blocklen, &slot);
+			if (rc < 0) {
+				/* reported as BUSY, no sense data */
+				status = -2;
+				break;
+			}
+			rc = istgt_lu_xcopy_range(src, slba * src->blocklen,
+			    dst, dlba * dst->blocklen, nblocks * src->blocklen, &buf);
+			istgt_lu_xcopy_unlock(spec, src, dst, slot);
+			if (rc < 0) {
+				/* THIRD PARTY DEVICE FAILURE */
+				BUILD_SENSE(COPY_ABORTED, 0x0d, 0x01);
+				status = -1;
+				break;
+			}
+		}
+		transfer += nblocks * src->blocklen;
+		nseg++;
+		cp += 4 + dlen;
+	}
+	xfree(buf);
+
+	for (i = 0; i < ncscd; i++) {
+		istgt_lu_xcopy_put_cscd(spec, cscd[i]);
+	}
+	if (list_id_usage != 0x03) {
+		istgt_lu_xcopy_record(spec, conn, list_id,
+		    (status == 0) ? ISTGT_LU_XCOPY_STATUS_GOOD
+		    : ISTGT_LU_XCOPY_STATUS_ERROR, nseg, transfer);
+	}
+	ISTGT_TRACELOG(ISTGT_TRACE_SCSI,
+	    "XCOPY list=%d done %d segments %"PRIu64" bytes\n",
+	    list_id, nseg, transfer);
+	return status;
+}
+
+int
+istgt_lu_disk_receive_copy_results(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sa, int list_id, uint8_t *data, int alloc_len)
+{
+	ISTGT_LU_DISK_XCOPY *xc = (ISTGT_LU_DISK_XCOPY *) spec->xcopy;
+	ISTGT_LU_XCOPY_RESULT *r;
+	uint8_t *sense_data;
+	size_t *sense_len;
+	uint64_t transfer;
+	int units;
+	int len;
+	int i;
+
+	sense_data = lu_cmd->sense_data;
+	sense_len = &lu_cmd->sense_data_len;
+	*sense_len = 0;
+
+	if (alloc_len < 64) {
+		ISTGT_ERRLOG("data_alloc_len(%d) too small\n", alloc_len);
+		return -1;
+	}
+	memset(data, 0, 64);
+	switch (sa) {
+	case 0x03: /* OPERATING PARAMETERS */
+		/* SNLID(0) */
+		BDSET8(&data[4], 1, 0);
+		/* MAXIMUM CSCD DESCRIPTOR COUNT */
+		DSET16(&data[8], ISTGT_LU_XCOPY_MAX_CSCD);
+		/* MAXIMUM SEGMENT DESCRIPTOR COUNT */
+		DSET16(&data[10], ISTGT_LU_XCOPY_MAX_SEGMENT);
+		/* MAXIMUM DESCRIPTOR LIST LENGTH */
+		DSET32(&data[12], ISTGT_LU_XCOPY_MAX_DESC_LEN);
+		/* MAXIMUM SEGMENT LENGTH */
+		DSET32(&data[16], ISTGT_LU_XCOPY_MAX_SEGMENT_LEN);
+		/* MAXIMUM INLINE DATA LENGTH */
+		DSET32(&data[20], 0);
+		/* HELD DATA LIMIT */
+		DSET32(&data[24], 0);
+		/* MAXIMUM STREAM DEVICE TRANSFER SIZE */
+		DSET32(&data[28], 0);
+		/* TOTAL CONCURRENT COPIES */
+		DSET16(&data[34], 1);
+		/* MAXIMUM CONCURRENT COPIES */
+		data[36] = 1;
+		/* DATA SEGMENT GRANULARITY (log 2) */
+		data[37] = 9;
+		/* INLINE DATA GRANULARITY (log 2) */
+		data[38] = 0;
+		/* HELD DATA GRANULARITY (log 2) */
+		data[39] = 0;
+		/* IMPLEMENTED DESCRIPTOR LIST LENGTH */
+		data[43] = 2;
+		/* LIST OF IMPLEMENTED DESCRIPTOR TYPE CODES */
+		data[44] = ISTGT_LU_XCOPY_SEG_BLOCK;
+		data[45] = ISTGT_LU_XCOPY_CSCD_ID;
+		len = 46;
+		break;
+
+	case 0x00: /* COPY STATUS */
+		r = NULL;
+		if (xc != NULL) {
+			MTX_LOCK(&xc->mutex);
+			for (i = 0; i < ISTGT_LU_XCOPY_RESULTS; i++) {
+				if (xc->results[i].initiator_port != NULL
+				    && xc->results[i].list_id == list_id
+				    && strcasecmp(xc->results[i].initiator_port,
+					conn->initiator_port) == 0) {
+					r = &xc->results[i];
+					break;
+				}
+			}
+			if (r != NULL) {
+				/* HDD(7) COPY MANAGER STATUS(6-0) */
+				data[4] = (uint8_t) r->status;
+				/* SEGMENTS PROCESSED */
+				DSET16(&data[5], (uint16_t) r->segments);
+				transfer = r->transfer;
+			}
+			MTX_UNLOCK(&xc->mutex);
+		}
+		if (r == NULL) {
+			/* INVALID FIELD IN CDB */
+			BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+			return -1;
+		}
+		/* TRANSFER COUNT UNITS */
+		units = 0;
+		while (transfer > 0xffffffffULL) {
+			transfer >>= 10;
+			units++;
+		}
+		data[7] = (uint8_t) units;
+		/* TRANSFER COUNT */
+		DSET32(&data[8], (uint32_t) transfer);
+		len = 12;
+		break;
+
+	default:
+		/* RECEIVE DATA and FAILED SEGMENT DETAILS are not supported */
+		/* INVALID FIELD IN CDB */
+		BUILD_SENSE(ILLEGAL_REQUEST, 0x24, 0x00);
+		return -1;
+	}
+
+	/* AVAILABLE DATA */
+	DSET32(&data[0], len - 4);
+	return len;
+}
+
+int
+istgt_lu_disk_xcopy_init(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_XCOPY *xc;
+	int rc;
+
+	xc = xmalloc(sizeof *xc);
+	memset(xc, 0, sizeof *xc);
+	rc = pthread_mutex_init(&xc->mutex, NULL);
+	if (rc != 0) {
+		ISTGT_ERRLOG("LU%d: mutex_init() failed\n", spec->num);
+		xfree(xc);
+		return -1;
+	}
+	spec->xcopy = (void *) xc;
+	return 0;
+}
+
+int
+istgt_lu_disk_xcopy_shutdown(ISTGT_LU_DISK *spec)
+{
+	ISTGT_LU_DISK_XCOPY *xc;
+	int i;
+
+	xc = (ISTGT_LU_DISK_XCOPY *) spec->xcopy;
+	if (xc == NULL)
+		return 0;
+	spec->xcopy = NULL;
+	for (i = 0; i < ISTGT_LU_XCOPY_RESULTS; i++) {
+		xfree(xc->results[i].initiator_port);
+	}
+	(void) pthread_mutex_destroy(&xc->mutex);
+	xfree(xc);
+	return 0;
+}
@@ -619,6 +619,40 @@ istgt_yield(void)
 #endif
 }
 
+int
+istgt_memiszero(const void *buf, size_t len)
+{
+	const uint8_t *cp = (const uint8_t *) buf;
+	size_t head;
+	size_t i;
+
+	/* check the head by bytes, the rest by the (vectorized) memcmp */
+	head = (len < 16) ? len : 16;
+	for (i = 0; i < head; i++) {
+		if (cp[i] != 0)
+			return 0;
+	}
+	if (len <= head)
+		return 1;
+	return memcmp(cp, cp + head, len - head) == 0;
+}
+
+uint64_t
+istgt_clock_usec(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+#else
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		return 0;
+#endif
+	return ((uint64_t) ts.tv_sec * 1000000ULL)
+	    + ((uint64_t) ts.tv_nsec / 1000ULL);
+}
+
 #ifndef HAVE_STRLCPY
 size_t
 strlcpy(char *dst, const char *src, size_t size)
@@ -191,5 +191,7 @@ int istgt_difftime(time_t a, time_t b);
 void istgt_dump(const char *label, const uint8_t *buf, size_t len);
 void istgt_fdump(FILE *fp, const char *label, const uint8_t *buf, size_t len);
 void istgt_yield(void);
+int istgt_memiszero(const void *buf, size_t len);
+uint64_t istgt_clock_usec(void);
 
 #endif /* ISTGT_MISC_H */
@@ -79,11 +79,14 @@ int istgt_stop_conns(void);
 CONN_Ptr istgt_find_conn(const char *initiator_port, const char *target_name, uint16_t tsih);
 int istgt_iscsi_init(ISTGT_Ptr istgt);
 int istgt_iscsi_shutdown(ISTGT_Ptr istgt);
+int istgt_iscsi_create_network_threads(ISTGT_Ptr istgt);
+int istgt_iscsi_queue_result(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task);
+int istgt_iscsi_queue_task(CONN_Ptr conn, ISTGT_LU_TASK_Ptr lu_task);
 int istgt_iscsi_copy_pdu(ISCSI_PDU_Ptr dst_pdu, ISCSI_PDU_Ptr src_pdu);
 
 /* istgt_lu.c */
 int istgt_lu_allow_netmask(const char *netmask, const char *addr);
-int istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *addr);
+int istgt_lu_access(CONN_Ptr conn, ISTGT_LU_Ptr lu, const char *iqn, const char *addr, int *map);
 int istgt_lu_visible(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu, const char *iqn, int pg_tag);
 int istgt_lu_sendtargets(CONN_Ptr conn, const char *iiqn, const char *iaddr, const char *tiqn, uint8_t *data, int alloc_len, int data_len);
 ISTGT_LU_Ptr istgt_lu_find_target(ISTGT_Ptr istgt, const char *target_name);
@@ -107,6 +110,14 @@ int istgt_lu_islun2lun(uint64_t islun);
 uint64_t istgt_lu_lun2islun(int lun, int maxlun);
 int istgt_lu_reset(ISTGT_LU_Ptr lu, uint64_t lun);
 int istgt_lu_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
+int istgt_lu_queued(ISTGT_LU_Ptr lu);
+int istgt_lu_execute_defer(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr *lu_taskp);
+int istgt_lu_execute_task(ISTGT_LU_TASK_Ptr lu_task, ISTGT_LU_CMD_Ptr lu_cmd);
+void istgt_lu_stats_begin(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
+void istgt_lu_stats_update(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sent);
+ISTGT_LU_TASK_POOL *istgt_lu_task_pool_create(void);
+void istgt_lu_task_pool_release(ISTGT_LU_TASK_POOL *pool);
+ISTGT_LU_TASK_Ptr istgt_lu_alloc_task(CONN_Ptr conn);
 int istgt_lu_create_task(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr lu_task, int lun);
 int istgt_lu_destroy_task(ISTGT_LU_TASK_Ptr lu_task);
 int istgt_lu_clear_task_IT(CONN_Ptr conn, ISTGT_LU_Ptr lu);
@@ -134,22 +145,68 @@ int istgt_lu_set_extid(uint8_t *buf, uint64_t vid, uint64_t vide);
 int istgt_lu_scsi_build_sense_data(uint8_t *data, int sk, int asc, int ascq);
 int istgt_lu_scsi_build_sense_data2(uint8_t *data, int sk, int asc, int ascq);
 int istgt_lu_disk_init(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+int istgt_lu_disk_start_aio(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+int istgt_lu_disk_start_wcache(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+int istgt_lu_disk_start_rcache(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+int istgt_lu_disk_start_amap(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 int istgt_lu_disk_shutdown(ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 int istgt_lu_disk_reset(ISTGT_LU_Ptr lu, int lun);
+void istgt_lu_disk_throttle(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
 int istgt_lu_disk_execute(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
 int istgt_lu_disk_queue_clear_IT(CONN_Ptr conn, ISTGT_LU_Ptr lu);
 int istgt_lu_disk_queue_clear_ITL(CONN_Ptr conn, ISTGT_LU_Ptr lu, int lun);
 int istgt_lu_disk_queue_clear_ITLQ(CONN_Ptr conn, ISTGT_LU_Ptr lu, int lun, uint32_t CmdSN);
 int istgt_lu_disk_queue_clear_all(ISTGT_LU_Ptr lu, int lun);
+int istgt_lu_disk_queue_create(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, ISTGT_LU_TASK_Ptr *lu_taskp);
+int istgt_lu_disk_queue_task(ISTGT_LU_TASK_Ptr lu_task, ISTGT_LU_CMD_Ptr lu_cmd);
 int istgt_lu_disk_queue(CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd);
 int istgt_lu_disk_queue_count(ISTGT_LU_Ptr lu, int *lun);
 int istgt_lu_disk_queue_start(ISTGT_LU_Ptr lu, int lun);
+void istgt_lu_disk_queue_release_task(ISTGT_LU_TASK_Ptr lu_task);
+int istgt_lu_disk_queue_claim(ISTGT_LU_DISK *spec, uint64_t lba, uint64_t len);
+void istgt_lu_disk_queue_unclaim(ISTGT_LU_DISK *spec, int slot);
 void istgt_lu_disk_aio_done(siginfo_t *info);
 
 /* istgt_lu_disk_vbox.c */
 int istgt_lu_disk_vbox_lun_init(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 int istgt_lu_disk_vbox_lun_shutdown(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
 
+/* istgt_lu_disk_mem.c */
+int istgt_lu_disk_mem_lun_init(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+int istgt_lu_disk_mem_lun_shutdown(ISTGT_LU_DISK *spec, ISTGT_Ptr istgt, ISTGT_LU_Ptr lu);
+
+/* istgt_lu_disk_aio.c */
+int istgt_lu_disk_aio_init(ISTGT_LU_DISK *spec, int depth);
+int istgt_lu_disk_aio_shutdown(ISTGT_LU_DISK *spec);
+const char *istgt_lu_disk_aio_engine(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_aio_submit(ISTGT_LU_DISK *spec, ISTGT_LU_AIO *aio);
+void istgt_lu_disk_aio_drain(ISTGT_LU_DISK *spec);
+
+/* istgt_lu_disk_wcache.c */
+int istgt_lu_disk_wcache_init(ISTGT_LU_DISK *spec, uint64_t size);
+int istgt_lu_disk_wcache_shutdown(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_wcache_flush(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+int istgt_lu_disk_wcache_error(ISTGT_LU_DISK *spec, uint64_t *offset);
+uint64_t istgt_lu_disk_wcache_size(ISTGT_LU_DISK *spec);
+
+/* istgt_lu_disk_rcache.c */
+int istgt_lu_disk_rcache_init(ISTGT_LU_DISK *spec, uint64_t size);
+int istgt_lu_disk_rcache_shutdown(ISTGT_LU_DISK *spec);
+void istgt_lu_disk_rcache_invalidate(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+uint64_t istgt_lu_disk_rcache_size(ISTGT_LU_DISK *spec);
+
+/* istgt_lu_disk_amap.c */
+int istgt_lu_disk_amap_init(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_amap_shutdown(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_amap_lookup(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t maxbytes, uint64_t *nbytes);
+void istgt_lu_disk_amap_mapped(ISTGT_LU_DISK *spec, uint64_t offset, uint64_t nbytes);
+
+/* istgt_lu_disk_xcopy.c */
+int istgt_lu_disk_xcopy_init(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_xcopy_shutdown(ISTGT_LU_DISK *spec);
+int istgt_lu_disk_xcopy(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, uint8_t *data, int len);
+int istgt_lu_disk_receive_copy_results(ISTGT_LU_DISK *spec, CONN_Ptr conn, ISTGT_LU_CMD_Ptr lu_cmd, int sa, int list_id, uint8_t *data, int alloc_len);
+
 /* istgt_lu_dvd.c */
 struct istgt_lu_dvd_t;
 int istgt_lu_dvd_media_present(struct istgt_lu_dvd_t *spec);
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "istgt_misc.h"
+#include "istgt_qos.h"
+
+static void
+istgt_qos_bucket_init(ISTGT_QOS_BUCKET *b, uint64_t rate, uint64_t burst)
+{
+	b->rate = rate;
+	if (burst == 0) {
+		/* one second worth by default */
+		burst = rate;
+	}
+	b->burst = burst;
+	b->credit = (int64_t) (burst * ISTGT_QOS_USEC);
+}
+
+static void
+istgt_qos_bucket_refill(ISTGT_QOS_BUCKET *b, uint64_t elapsed)
+{
+	int64_t cap;
+	uint64_t room;
+
+	if (b->rate == 0)
+		return;
+	cap = (int64_t) (b->burst * ISTGT_QOS_USEC);
+	room = (uint64_t) (cap - b->credit);
+	if (elapsed > room / b->rate) {
+		b->credit = cap;
+		return;
+	}
+	b->credit += (int64_t) (b->rate * elapsed);
+}
+
+static uint64_t
+istgt_qos_bucket_wait(ISTGT_QOS_BUCKET *b, uint64_t cost)
+{
+	int64_t need;
+
+	if (b->rate == 0)
+		return 0;
+	if (cost > b->burst)
+		cost = b->burst;
+	need = (int64_t) (cost * ISTGT_QOS_USEC);
+	if (b->credit >= need)
+		return 0;
+	return ((uint64_t) (need - b->credit) + b->rate - 1) / b->rate;
+}
+
+ISTGT_QOS_Ptr
+istgt_qos_create(uint64_t iops, uint64_t iops_burst, uint64_t bps, uint64_t bps_burst)
+{
+	ISTGT_QOS_Ptr qos;
+
+	qos = xmalloc(sizeof *qos);
+	memset(qos, 0, sizeof *qos);
+	istgt_qos_bucket_init(&qos->iops, iops, iops_burst);
+	istgt_qos_bucket_init(&qos->bps, bps, bps_burst);
+	qos->last = istgt_clock_usec();
+	return qos;
+}
+
+void
+istgt_qos_destroy(ISTGT_QOS_Ptr qos)
+{
+	if (qos == NULL)
+		return;
+	xfree(qos);
+}
+
+/* usec until a command of bytes may start, 0 if it fits now */
+uint64_t
+istgt_qos_wait(ISTGT_QOS_Ptr qos, uint64_t bytes, uint64_t now)
+{
+	uint64_t w1, w2;
+
+	if (qos == NULL)
+		return 0;
+	if (now > qos->last) {
+		istgt_qos_bucket_refill(&qos->iops, now - qos->last);
+		istgt_qos_bucket_refill(&qos->bps, now - qos->last);
+		qos->last = now;
+	}
+	w1 = istgt_qos_bucket_wait(&qos->iops, 1);
+	w2 = istgt_qos_bucket_wait(&qos->bps, bytes);
+	return (w1 > w2) ? w1 : w2;
+}
+
+/* account a started command, waited is its throttle delay in usec */
+void
+istgt_qos_charge(ISTGT_QOS_Ptr qos, uint64_t bytes, uint64_t waited)
+{
+	if (qos == NULL)
+		return;
+	if (qos->iops.rate != 0)
+		qos->iops.credit -= (int64_t) ISTGT_QOS_USEC;
+	if (qos->bps.rate != 0)
+		qos->bps.credit -= (int64_t) (bytes * ISTGT_QOS_USEC);
+	qos->admitted++;
+	if (waited != 0) {
+		qos->delayed++;
+		qos->delay_usec += waited;
+	}
+}
+
+void
+istgt_qos_snapshot(ISTGT_QOS_Ptr qos, uint64_t now, ISTGT_QOS *snap)
+{
+	(void) istgt_qos_wait(qos, 0, now);
+	memcpy(snap, qos, sizeof *snap);
+}
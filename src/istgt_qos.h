@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef ISTGT_QOS_H
+#define ISTGT_QOS_H
+
+#include <stdint.h>
+
+/* upper bound of MaxIOPS/MaxBandwidth and their bursts */
+#define ISTGT_QOS_MAX (1ULL << 40)
+#define ISTGT_QOS_USEC 1000000ULL
+
+/*
+ * Token bucket; credit is kept in units x usec so that a refill of a
+ * few microseconds is never rounded away. Commands larger than the
+ * burst start on a full bucket and leave it in debt.
+ */
+typedef struct istgt_qos_bucket_t {
+	uint64_t rate;		/* units per second, 0 = unlimited */
+	uint64_t burst;		/* units */
+	int64_t credit;
+} ISTGT_QOS_BUCKET;
+
+/* not locked, the owner serializes wait/charge/snapshot */
+typedef struct istgt_qos_t {
+	ISTGT_QOS_BUCKET iops;
+	ISTGT_QOS_BUCKET bps;
+	uint64_t last;		/* usec of the last refill */
+	uint64_t admitted;	/* commands charged */
+	uint64_t delayed;	/* commands put off at least once */
+	uint64_t delay_usec;	/* total time delayed commands waited */
+} ISTGT_QOS;
+typedef ISTGT_QOS *ISTGT_QOS_Ptr;
+
+ISTGT_QOS_Ptr istgt_qos_create(uint64_t iops, uint64_t iops_burst, uint64_t bps, uint64_t bps_burst);
+void istgt_qos_destroy(ISTGT_QOS_Ptr qos);
+uint64_t istgt_qos_wait(ISTGT_QOS_Ptr qos, uint64_t bytes, uint64_t now);
+void istgt_qos_charge(ISTGT_QOS_Ptr qos, uint64_t bytes, uint64_t waited);
+void istgt_qos_snapshot(ISTGT_QOS_Ptr qos, uint64_t now, ISTGT_QOS *snap);
+
+#endif /* ISTGT_QOS_H */
@@ -144,6 +144,19 @@ istgt_queue_dequeue(ISTGT_QUEUE_Ptr head)
 	return elem;
 }
 
+void *
+istgt_queue_first(ISTGT_QUEUE_Ptr head)
+{
+	ISTGT_QUEUE_Ptr first;
+
+	if (head == NULL)
+		return NULL;
+	first = head->next;
+	if (first == NULL || first == head)
+		return NULL;
+	return first->elem;
+}
+
 int
 istgt_queue_enqueue_first(ISTGT_QUEUE_Ptr head, void *elem)
 {
@@ -43,6 +43,7 @@ void istgt_queue_destroy(ISTGT_QUEUE_Ptr head);
 int istgt_queue_count(ISTGT_QUEUE_Ptr head);
 int istgt_queue_enqueue(ISTGT_QUEUE_Ptr head, void *elem);
 void *istgt_queue_dequeue(ISTGT_QUEUE_Ptr head);
+void *istgt_queue_first(ISTGT_QUEUE_Ptr head);
 int istgt_queue_enqueue_first(ISTGT_QUEUE_Ptr head, void *elem);
 
 #endif /* ISTGT_QUEUE_H */
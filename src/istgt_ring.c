@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "istgt_misc.h"
+#include "istgt_ring.h"
+
+/*
+ * Each slot carries a sequence number telling whose turn it is:
+ * seq == pos means free for the producer of pos, seq == pos + 1 means
+ * filled for the consumer of pos.  Positions are claimed by CAS, the
+ * element is published by the release store of seq.
+ */
+
+int
+istgt_ring_init(ISTGT_RING_Ptr ring, int size)
+{
+	uint64_t n;
+	uint64_t i;
+
+	if (ring == NULL || size <= 0)
+		return -1;
+	for (n = 1; n < (uint64_t) size; n <<= 1)
+		;
+	memset(ring, 0, sizeof *ring);
+	ring->slots = xmalloc(n * sizeof *ring->slots);
+	for (i = 0; i < n; i++) {
+		ring->slots[i].seq = i;
+		ring->slots[i].elem = NULL;
+	}
+	ring->mask = n - 1;
+	ring->enq = 0;
+	ring->deq = 0;
+	return 0;
+}
+
+void
+istgt_ring_destroy(ISTGT_RING_Ptr ring)
+{
+	if (ring == NULL)
+		return;
+	xfree(ring->slots);
+	ring->slots = NULL;
+	ring->mask = 0;
+}
+
+int
+istgt_ring_count(ISTGT_RING_Ptr ring)
+{
+	uint64_t enq, deq;
+
+	if (ring == NULL || ring->slots == NULL)
+		return 0;
+	deq = __atomic_load_n(&ring->deq, __ATOMIC_ACQUIRE);
+	enq = __atomic_load_n(&ring->enq, __ATOMIC_ACQUIRE);
+	if (enq < deq)
+		return 0;
+	return (int) (enq - deq);
+}
+
+/* return -1 if full */
+int
+istgt_ring_enqueue(ISTGT_RING_Ptr ring, void *elem)
+{
+	ISTGT_RING_SLOT *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	pos = __atomic_load_n(&ring->enq, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t) seq - (int64_t) pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->enq, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			/* pos is reloaded by the failed CAS */
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->enq, __ATOMIC_RELAXED);
+		}
+	}
+	slot->elem = elem;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* return NULL if empty */
+void *
+istgt_ring_dequeue(ISTGT_RING_Ptr ring)
+{
+	ISTGT_RING_SLOT *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+	void *elem;
+
+	pos = __atomic_load_n(&ring->deq, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t) seq - (int64_t) (pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->deq, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ring->deq, __ATOMIC_RELAXED);
+		}
+	}
+	elem = slot->elem;
+	slot->elem = NULL;
+	__atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return elem;
+}
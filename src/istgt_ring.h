@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef ISTGT_RING_H
+#define ISTGT_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ISTGT_RING_CACHELINE 64
+
+typedef struct istgt_ring_slot_t {
+	uint64_t seq;
+	void *elem;
+} ISTGT_RING_SLOT;
+
+/*
+ * Bounded lock-free FIFO of pointers (Vyukov's array queue).
+ * Any thread may enqueue and dequeue; the indexes of producers and
+ * consumers live on separate cache lines.
+ */
+typedef struct istgt_ring_t {
+	ISTGT_RING_SLOT *slots;
+	uint64_t mask;
+	uint8_t pad0[ISTGT_RING_CACHELINE - sizeof (void *) - sizeof (uint64_t)];
+	uint64_t enq;
+	uint8_t pad1[ISTGT_RING_CACHELINE - sizeof (uint64_t)];
+	uint64_t deq;
+	uint8_t pad2[ISTGT_RING_CACHELINE - sizeof (uint64_t)];
+} ISTGT_RING;
+typedef ISTGT_RING *ISTGT_RING_Ptr;
+
+int istgt_ring_init(ISTGT_RING_Ptr ring, int size);
+void istgt_ring_destroy(ISTGT_RING_Ptr ring);
+int istgt_ring_count(ISTGT_RING_Ptr ring);
+int istgt_ring_enqueue(ISTGT_RING_Ptr ring, void *elem);
+void *istgt_ring_dequeue(ISTGT_RING_Ptr ring);
+
+#endif /* ISTGT_RING_H */
@@ -187,6 +187,7 @@ typedef enum {
 
 	SBC_SAI_READ_CAPACITY_16 = 0x10,
 	SBC_SAI_READ_LONG_16 = 0x11,
+	SBC_SAI_GET_LBA_STATUS = 0x12,
 	SBC_SAO_WRITE_LONG_16 = 0x11,
 
 	SBC_VL_READ_32 = 0x0009,
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
+#include "istgt_misc.h"
+#include "istgt_stats.h"
+
+static int
+istgt_stats_shard(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu >= 0)
+		return cpu & (ISTGT_STATS_SHARDS - 1);
+#endif
+	{
+		/* threads run on distinct stacks, spread by the stack page */
+		uintptr_t sp = (uintptr_t) &sp;
+
+		sp >>= 16;
+		sp ^= sp >> 7;
+		return (int) (sp & (ISTGT_STATS_SHARDS - 1));
+	}
+}
+
+static int
+istgt_stats_bucket(uint64_t usec)
+{
+	int e;
+	int sub;
+
+	if (usec < ISTGT_STATS_LINEAR)
+		return (int) usec;
+	e = 63 - __builtin_clzll(usec);
+	if (e > ISTGT_STATS_MAXEXP)
+		return ISTGT_STATS_BUCKETS - 1;
+	sub = (int) ((usec >> (e - ISTGT_STATS_SUBBITS))
+	    & ((1 << ISTGT_STATS_SUBBITS) - 1));
+	return ISTGT_STATS_LINEAR
+	    + (e - ISTGT_STATS_SUBBITS - 1) * (1 << ISTGT_STATS_SUBBITS) + sub;
+}
+
+static uint64_t
+istgt_stats_bucket_upper(int idx)
+{
+	uint64_t lower;
+	int e;
+	int sub;
+
+	if (idx < ISTGT_STATS_LINEAR)
+		return (uint64_t) idx;
+	e = ISTGT_STATS_SUBBITS + 1
+	    + (idx - ISTGT_STATS_LINEAR) / (1 << ISTGT_STATS_SUBBITS);
+	sub = (idx - ISTGT_STATS_LINEAR) % (1 << ISTGT_STATS_SUBBITS);
+	lower = (1ULL << e) + ((uint64_t) sub << (e - ISTGT_STATS_SUBBITS));
+	return lower + (1ULL << (e - ISTGT_STATS_SUBBITS)) - 1;
+}
+
+ISTGT_STATS_Ptr
+istgt_stats_create(void)
+{
+	ISTGT_STATS_Ptr stats;
+	uintptr_t p;
+
+	stats = xmalloc(sizeof *stats);
+	memset(stats, 0, sizeof *stats);
+	stats->mem = xmalloc(ISTGT_STATS_SHARDS * sizeof (ISTGT_STATS_SHARD)
+	    + ISTGT_STATS_CACHELINE);
+	p = (uintptr_t) stats->mem;
+	p = (p + ISTGT_STATS_CACHELINE - 1)
+	    & ~((uintptr_t) ISTGT_STATS_CACHELINE - 1);
+	stats->shards = (ISTGT_STATS_SHARD *) p;
+	memset(stats->shards, 0, ISTGT_STATS_SHARDS * sizeof (ISTGT_STATS_SHARD));
+	stats->start = istgt_clock_usec();
+	return stats;
+}
+
+void
+istgt_stats_destroy(ISTGT_STATS_Ptr stats)
+{
+	if (stats == NULL)
+		return;
+	xfree(stats->mem);
+	xfree(stats);
+}
+
+void
+istgt_stats_begin(ISTGT_STATS_Ptr stats)
+{
+	int cur, max;
+
+	if (stats == NULL)
+		return;
+	cur = __atomic_add_fetch(&stats->inflight, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&stats->max_inflight, __ATOMIC_RELAXED);
+	while (cur > max) {
+		if (__atomic_compare_exchange_n(&stats->max_inflight, &max, cur,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+void
+istgt_stats_end(ISTGT_STATS_Ptr stats, int dir, uint64_t bytes, int error, const uint64_t *lat)
+{
+	ISTGT_STATS_COUNTER *cp;
+	int i;
+
+	if (stats == NULL)
+		return;
+	cp = &stats->shards[istgt_stats_shard()].c;
+	switch (dir) {
+	case ISTGT_STATS_READ:
+		__atomic_add_fetch(&cp->read_ops, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cp->read_bytes, bytes, __ATOMIC_RELAXED);
+		break;
+	case ISTGT_STATS_WRITE:
+		__atomic_add_fetch(&cp->write_ops, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cp->write_bytes, bytes, __ATOMIC_RELAXED);
+		break;
+	default:
+		__atomic_add_fetch(&cp->other_ops, 1, __ATOMIC_RELAXED);
+		break;
+	}
+	if (error)
+		__atomic_add_fetch(&cp->errors, 1, __ATOMIC_RELAXED);
+	if (lat != NULL) {
+		for (i = 0; i < ISTGT_STATS_PHASES; i++) {
+			__atomic_add_fetch(&cp->hist[i][istgt_stats_bucket(lat[i])],
+			    1, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_sub_fetch(&stats->inflight, 1, __ATOMIC_RELAXED);
+}
+
+void
+istgt_stats_snapshot(ISTGT_STATS_Ptr stats, ISTGT_STATS_COUNTER *snap)
+{
+	ISTGT_STATS_COUNTER *cp;
+	int i, j, k;
+
+	memset(snap, 0, sizeof *snap);
+	if (stats == NULL)
+		return;
+	for (i = 0; i < ISTGT_STATS_SHARDS; i++) {
+		cp = &stats->shards[i].c;
+		snap->read_ops += __atomic_load_n(&cp->read_ops, __ATOMIC_RELAXED);
+		snap->write_ops += __atomic_load_n(&cp->write_ops, __ATOMIC_RELAXED);
+		snap->other_ops += __atomic_load_n(&cp->other_ops, __ATOMIC_RELAXED);
+		snap->read_bytes += __atomic_load_n(&cp->read_bytes, __ATOMIC_RELAXED);
+		snap->write_bytes += __atomic_load_n(&cp->write_bytes, __ATOMIC_RELAXED);
+		snap->errors += __atomic_load_n(&cp->errors, __ATOMIC_RELAXED);
+		for (j = 0; j < ISTGT_STATS_PHASES; j++) {
+			for (k = 0; k < ISTGT_STATS_BUCKETS; k++) {
+				snap->hist[j][k]
+				    += __atomic_load_n(&cp->hist[j][k], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+uint64_t
+istgt_stats_percentile(const ISTGT_STATS_COUNTER *snap, int phase, int permille)
+{
+	uint64_t total, limit, sum;
+	int k;
+
+	total = 0;
+	for (k = 0; k < ISTGT_STATS_BUCKETS; k++) {
+		total += snap->hist[phase][k];
+	}
+	if (total == 0)
+		return 0;
+	/* smallest bucket holding at least permille/1000 of the samples */
+	limit = (total * (uint64_t) permille + 999) / 1000;
+	if (limit == 0)
+		limit = 1;
+	sum = 0;
+	for (k = 0; k < ISTGT_STATS_BUCKETS; k++) {
+		sum += snap->hist[phase][k];
+		if (sum >= limit)
+			return istgt_stats_bucket_upper(k);
+	}
+	return istgt_stats_bucket_upper(ISTGT_STATS_BUCKETS - 1);
+}
+
+uint64_t
+istgt_stats_average(const ISTGT_STATS_COUNTER *snap, int phase)
+{
+	uint64_t total, sum, lower;
+	int k;
+
+	/* bucket midpoints; accurate to the bucket width */
+	total = 0;
+	sum = 0;
+	for (k = 0; k < ISTGT_STATS_BUCKETS; k++) {
+		if (snap->hist[phase][k] == 0)
+			continue;
+		lower = (k == 0) ? 0 : istgt_stats_bucket_upper(k - 1) + 1;
+		total += snap->hist[phase][k];
+		sum += snap->hist[phase][k]
+		    * ((lower + istgt_stats_bucket_upper(k)) / 2);
+	}
+	if (total == 0)
+		return 0;
+	return sum / total;
+}
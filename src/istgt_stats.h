@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef ISTGT_STATS_H
+#define ISTGT_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ISTGT_STATS_CACHELINE 64
+#define ISTGT_STATS_SHARDS 8
+
+/* latency phases of a command */
+#define ISTGT_STATS_QUEUE 0	/* received to picked up by the LU */
+#define ISTGT_STATS_IO 1	/* executed by the LU (incl. Data-Out) */
+#define ISTGT_STATS_SEND 2	/* completed to response sent */
+#define ISTGT_STATS_TOTAL 3	/* received to response sent */
+#define ISTGT_STATS_PHASES 4
+
+/*
+ * Log-linear histogram in microseconds: values below 8 have a bucket
+ * each, every further power of two is split in 4 buckets (<= 25% error).
+ */
+#define ISTGT_STATS_SUBBITS 2
+#define ISTGT_STATS_LINEAR (1 << (ISTGT_STATS_SUBBITS + 1))
+#define ISTGT_STATS_MAXEXP 35
+#define ISTGT_STATS_BUCKETS \
+	(ISTGT_STATS_LINEAR \
+	+ (ISTGT_STATS_MAXEXP - ISTGT_STATS_SUBBITS) * (1 << ISTGT_STATS_SUBBITS))
+
+#define ISTGT_STATS_READ 0
+#define ISTGT_STATS_WRITE 1
+#define ISTGT_STATS_OTHER 2
+
+typedef struct istgt_stats_counter_t {
+	uint64_t read_ops;
+	uint64_t write_ops;
+	uint64_t other_ops;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t errors;
+	uint64_t hist[ISTGT_STATS_PHASES][ISTGT_STATS_BUCKETS];
+} ISTGT_STATS_COUNTER;
+
+/*
+ * Updated by every connection and worker thread without locking; each
+ * CPU (or thread) hits its own cache-line aligned shard and readers sum
+ * the shards up.
+ */
+typedef struct istgt_stats_shard_t {
+	ISTGT_STATS_COUNTER c;
+	uint8_t pad[ISTGT_STATS_CACHELINE
+	    - (sizeof (ISTGT_STATS_COUNTER) % ISTGT_STATS_CACHELINE)];
+} ISTGT_STATS_SHARD;
+
+typedef struct istgt_stats_t {
+	ISTGT_STATS_SHARD *shards;
+	void *mem;
+	uint64_t start;
+	int inflight;
+	int max_inflight;
+} ISTGT_STATS;
+typedef ISTGT_STATS *ISTGT_STATS_Ptr;
+
+ISTGT_STATS_Ptr istgt_stats_create(void);
+void istgt_stats_destroy(ISTGT_STATS_Ptr stats);
+void istgt_stats_begin(ISTGT_STATS_Ptr stats);
+void istgt_stats_end(ISTGT_STATS_Ptr stats, int dir, uint64_t bytes, int error, const uint64_t *lat);
+void istgt_stats_snapshot(ISTGT_STATS_Ptr stats, ISTGT_STATS_COUNTER *snap);
+uint64_t istgt_stats_percentile(const ISTGT_STATS_COUNTER *snap, int phase, int permille);
+uint64_t istgt_stats_average(const ISTGT_STATS_COUNTER *snap, int phase);
+
+#endif /* ISTGT_STATS_H */
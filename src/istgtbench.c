@@ -0,0 +1,1238 @@
+/*
+ * Copyright (C) 2008-2012 Daisuke Aoyama <aoyama@peach.ne.jp>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "istgt.h"
+#include "istgt_ver.h"
+#include "istgt_log.h"
+#include "istgt_sock.h"
+#include "istgt_misc.h"
+#include "istgt_stats.h"
+#include "istgt_iscsi.h"
+#include "istgt_scsi.h"
+
+#if !defined(__GNUC__)
+#undef __attribute__
+#define __attribute__(x)
+#endif
+
+#define DEFAULT_BENCH_HOST "127.0.0.1"
+#define DEFAULT_BENCH_PORT 3260
+#define DEFAULT_BENCH_INITIATOR "iqn.2007-09.jp.ne.peach.istgt:bench"
+#define DEFAULT_BENCH_LUN 0
+#define DEFAULT_BENCH_SESSIONS 1
+#define DEFAULT_BENCH_DEPTH 1
+#define DEFAULT_BENCH_BLOCKSIZE 4096
+#define DEFAULT_BENCH_WORKLOAD "randread"
+#define DEFAULT_BENCH_RWMIX 50
+#define DEFAULT_BENCH_TIME 10
+#define DEFAULT_BENCH_TIMEOUT 30
+
+#define MAX_BENCH_SESSIONS 256
+#define MAX_BENCH_DEPTH 256
+#define MAX_BENCH_BLOCKSIZE (16 * 1024 * 1024)
+/* our MaxRecvDataSegmentLength */
+#define BENCH_RECVDATA_LEN (256 * 1024)
+#define BENCH_MAX_BURST (16 * 1024 * 1024 - 1)
+#define BENCH_TEXT_LEN 8192
+
+/* according to RFC1982 */
+#define SN32_CMPMAX (((uint32_t)1U) << (32 - 1))
+#define SN32_LT(S1,S2) \
+	(((uint32_t)(S1) != (uint32_t)(S2))				\
+	    && (((uint32_t)(S1) < (uint32_t)(S2)			\
+		    && ((uint32_t)(S2) - (uint32_t)(S1) < SN32_CMPMAX))	\
+		|| ((uint32_t)(S1) > (uint32_t)(S2)			\
+		    && ((uint32_t)(S1) - (uint32_t)(S2) > SN32_CMPMAX))))
+#define SN32_GT(S1,S2) \
+	(((uint32_t)(S1) != (uint32_t)(S2))				\
+	    && (((uint32_t)(S1) < (uint32_t)(S2)			\
+		    && ((uint32_t)(S2) - (uint32_t)(S1) > SN32_CMPMAX))	\
+		|| ((uint32_t)(S1) > (uint32_t)(S2)			\
+		    && ((uint32_t)(S1) - (uint32_t)(S2) < SN32_CMPMAX))))
+
+typedef struct istgt_bench_t {
+	const char *host;
+	int port;
+	const char *target;
+	const char *initiator;
+	int lun;
+	int sessions;
+	int depth;
+	int blocksize;
+	const char *workload;
+	int random;
+	int rwmix;
+	int duration;
+	uint64_t count;
+	uint64_t range;
+	int verbose;
+
+	int stop;
+	uint64_t issued;
+	ISTGT_STATS_Ptr stats[2];
+} BENCH;
+typedef BENCH *BENCH_Ptr;
+
+typedef struct istgt_bench_cmd_t {
+	int busy;
+	int write;
+	uint32_t itt;
+	uint32_t transfer_len;
+	uint64_t start;
+} BENCH_CMD;
+
+typedef struct istgt_bench_sess_t {
+	BENCH_Ptr bench;
+	int id;
+	int sock;
+	pthread_t thread;
+
+	uint8_t isid[6];
+	uint16_t tsih;
+	uint32_t itt;
+	uint32_t CmdSN;
+	uint32_t ExpCmdSN;
+	uint32_t MaxCmdSN;
+	uint32_t StatSN;
+
+	/* negotiated */
+	uint32_t MaxRecvDataSegmentLength;
+	uint32_t FirstBurstLength;
+	uint32_t MaxBurstLength;
+	int InitialR2T;
+	int ImmediateData;
+
+	uint32_t blocklen;
+	uint64_t nblocks;
+	uint64_t first_lba;
+	uint64_t next_lba;
+	uint64_t seed;
+
+	int outstanding;
+	BENCH_CMD cmds[MAX_BENCH_DEPTH];
+	uint8_t *wbuf;
+	uint8_t *rbuf;
+	int error;
+} BENCH_SESS;
+typedef BENCH_SESS *BENCH_SESS_Ptr;
+
+static void fatal(const char *format, ...) __attribute__((__noreturn__, __format__(__printf__, 1, 2)));
+
+static void
+fatal(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+bench_random(BENCH_SESS_Ptr sess)
+{
+	uint64_t x;
+
+	/* xorshift64* */
+	x = sess->seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sess->seed = x;
+	return x * 2685821657736338717ULL;
+}
+
+static int
+bench_writev(int sock, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(sock, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= (ssize_t) iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= (size_t) n;
+		}
+	}
+	return 0;
+}
+
+static int
+bench_readn(int sock, uint8_t *buf, size_t len)
+{
+	ssize_t n;
+	size_t total;
+
+	total = 0;
+	while (total < len) {
+		n = read(sock, buf + total, len - total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		total += (size_t) n;
+	}
+	return 0;
+}
+
+static int
+bench_send_pdu(BENCH_SESS_Ptr sess, uint8_t *bhs, uint8_t *data, size_t len)
+{
+	static uint8_t pad[ISCSI_ALIGNMENT];
+	struct iovec iov[3];
+	int iovcnt;
+
+	DSET24(&bhs[5], len);
+	iov[0].iov_base = bhs;
+	iov[0].iov_len = ISCSI_BHS_LEN;
+	iovcnt = 1;
+	if (len != 0) {
+		iov[1].iov_base = data;
+		iov[1].iov_len = len;
+		iovcnt++;
+		if (ISCSI_ALIGN(len) != len) {
+			iov[2].iov_base = pad;
+			iov[2].iov_len = ISCSI_ALIGN(len) - len;
+			iovcnt++;
+		}
+	}
+	return bench_writev(sess->sock, iov, iovcnt);
+}
+
+/* data segment is read into sess->rbuf, its length returned */
+static int
+bench_recv_pdu(BENCH_SESS_Ptr sess, uint8_t *bhs)
+{
+	uint8_t ahs[4 * 255];
+	size_t len;
+	int rc;
+
+	rc = bench_readn(sess->sock, bhs, ISCSI_BHS_LEN);
+	if (rc < 0) {
+		ISTGT_ERRLOG("session %d: read BHS failed\n", sess->id);
+		return -1;
+	}
+	len = bhs[4] * 4;
+	if (len != 0) {
+		rc = bench_readn(sess->sock, ahs, len);
+		if (rc < 0)
+			return -1;
+	}
+	len = DGET24(&bhs[5]);
+	if (ISCSI_ALIGN(len) > BENCH_RECVDATA_LEN) {
+		ISTGT_ERRLOG("session %d: data segment %zu too large\n",
+		    sess->id, len);
+		return -1;
+	}
+	if (len != 0) {
+		rc = bench_readn(sess->sock, sess->rbuf, ISCSI_ALIGN(len));
+		if (rc < 0) {
+			ISTGT_ERRLOG("session %d: read data failed\n",
+			    sess->id);
+			return -1;
+		}
+	}
+	return (int) len;
+}
+
+static void
+bench_update_sn(BENCH_SESS_Ptr sess, uint8_t *bhs)
+{
+	uint32_t ExpCmdSN, MaxCmdSN;
+
+	ExpCmdSN = DGET32(&bhs[28]);
+	MaxCmdSN = DGET32(&bhs[32]);
+	/* ignore the window if MaxCmdSN < ExpCmdSN - 1 */
+	if (SN32_LT(MaxCmdSN, ExpCmdSN - 1))
+		return;
+	if (SN32_GT(ExpCmdSN, sess->ExpCmdSN))
+		sess->ExpCmdSN = ExpCmdSN;
+	if (SN32_GT(MaxCmdSN, sess->MaxCmdSN))
+		sess->MaxCmdSN = MaxCmdSN;
+}
+
+static const char *
+bench_get_key(char *data, int len, const char *key)
+{
+	char *p, *q;
+	size_t keylen;
+
+	keylen = strlen(key);
+	p = data;
+	while (p < data + len) {
+		q = memchr(p, '\0', (size_t) (data + len - p));
+		if (q == NULL)
+			break;
+		if (strncasecmp(p, key, keylen) == 0 && p[keylen] == '=')
+			return p + keylen + 1;
+		p = q + 1;
+	}
+	return NULL;
+}
+
+static int
+bench_login_pdu(BENCH_SESS_Ptr sess, int csg, int nsg, char *keys, int keylen, int *transit)
+{
+	uint8_t bhs[ISCSI_BHS_LEN];
+	int len;
+	int rc;
+
+	memset(bhs, 0, sizeof bhs);
+	bhs[0] = ISCSI_OP_LOGIN | 0x40;
+	bhs[1] = (uint8_t) (0x80 | (csg << 2) | nsg);
+	memcpy(&bhs[8], sess->isid, sizeof sess->isid);
+	DSET16(&bhs[14], sess->tsih);
+	DSET32(&bhs[16], sess->itt);
+	DSET16(&bhs[20], 0);
+	DSET32(&bhs[24], sess->CmdSN);
+	DSET32(&bhs[28], sess->StatSN);
+	rc = bench_send_pdu(sess, bhs, (uint8_t *) keys, (size_t) keylen);
+	if (rc < 0)
+		return -1;
+
+	len = bench_recv_pdu(sess, bhs);
+	if (len < 0)
+		return -1;
+	if ((bhs[0] & 0x3f) != ISCSI_OP_LOGIN_RSP) {
+		ISTGT_ERRLOG("session %d: unexpected opcode 0x%x in login\n",
+		    sess->id, bhs[0] & 0x3f);
+		return -1;
+	}
+	if (bhs[36] != 0) {
+		ISTGT_ERRLOG("session %d: login failed (class=%d, detail=%d)\n",
+		    sess->id, bhs[36], bhs[37]);
+		return -1;
+	}
+	*transit = BGET8(&bhs[1], 7);
+	sess->tsih = DGET16(&bhs[14]);
+	sess->StatSN = DGET32(&bhs[24]) + 1;
+	sess->ExpCmdSN = DGET32(&bhs[28]);
+	sess->MaxCmdSN = DGET32(&bhs[32]);
+	return len;
+}
+
+static int
+bench_login(BENCH_SESS_Ptr sess)
+{
+	BENCH_Ptr bench = sess->bench;
+	char keys[BENCH_TEXT_LEN];
+	const char *val;
+	int keylen;
+	int transit;
+	int len;
+	int i;
+
+	/* security stage, no authentication */
+	keylen = 0;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "InitiatorName=%s", bench->initiator) + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "SessionType=Normal") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "TargetName=%s", bench->target) + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "AuthMethod=None") + 1;
+	transit = 0;
+	for (i = 0; i < 4 && !transit; i++) {
+		len = bench_login_pdu(sess, 0, 1, keys, keylen, &transit);
+		if (len < 0)
+			return -1;
+		keylen = 0;
+	}
+	if (!transit) {
+		ISTGT_ERRLOG("session %d: security stage not finished\n",
+		    sess->id);
+		return -1;
+	}
+
+	/* operational stage */
+	keylen = 0;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "HeaderDigest=None") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "DataDigest=None") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "MaxRecvDataSegmentLength=%d", BENCH_RECVDATA_LEN) + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "InitialR2T=No") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "ImmediateData=Yes") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "FirstBurstLength=%d", BENCH_RECVDATA_LEN) + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "MaxBurstLength=%d", BENCH_MAX_BURST) + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "MaxOutstandingR2T=1") + 1;
+	keylen += snprintf(keys + keylen, sizeof keys - keylen,
+	    "ErrorRecoveryLevel=0") + 1;
+	sess->MaxRecvDataSegmentLength = 8192;
+	sess->FirstBurstLength = 65536;
+	sess->MaxBurstLength = 262144;
+	sess->InitialR2T = 1;
+	sess->ImmediateData = 1;
+	transit = 0;
+	for (i = 0; i < 4 && !transit; i++) {
+		len = bench_login_pdu(sess, 1, 3, keys, keylen, &transit);
+		if (len < 0)
+			return -1;
+		keylen = 0;
+
+		val = bench_get_key((char *) sess->rbuf, len,
+		    "MaxRecvDataSegmentLength");
+		if (val != NULL && strtoul(val, NULL, 10) != 0)
+			sess->MaxRecvDataSegmentLength = (uint32_t) strtoul(val, NULL, 10);
+		val = bench_get_key((char *) sess->rbuf, len, "FirstBurstLength");
+		if (val != NULL && strtoul(val, NULL, 10) != 0)
+			sess->FirstBurstLength = (uint32_t) strtoul(val, NULL, 10);
+		val = bench_get_key((char *) sess->rbuf, len, "MaxBurstLength");
+		if (val != NULL && strtoul(val, NULL, 10) != 0)
+			sess->MaxBurstLength = (uint32_t) strtoul(val, NULL, 10);
+		val = bench_get_key((char *) sess->rbuf, len, "InitialR2T");
+		if (val != NULL)
+			sess->InitialR2T = (strcasecmp(val, "Yes") == 0);
+		val = bench_get_key((char *) sess->rbuf, len, "ImmediateData");
+		if (val != NULL)
+			sess->ImmediateData = (strcasecmp(val, "Yes") == 0);
+	}
+	if (!transit) {
+		ISTGT_ERRLOG("session %d: operational stage not finished\n",
+		    sess->id);
+		return -1;
+	}
+	if (sess->FirstBurstLength > sess->MaxBurstLength)
+		sess->FirstBurstLength = sess->MaxBurstLength;
+	if (bench->verbose) {
+		fprintf(stderr, "session %d: TSIH=%u, MaxRecvDataSegmentLength=%u,"
+		    " FirstBurstLength=%u, MaxBurstLength=%u,"
+		    " InitialR2T=%s, ImmediateData=%s\n",
+		    sess->id, sess->tsih, sess->MaxRecvDataSegmentLength,
+		    sess->FirstBurstLength, sess->MaxBurstLength,
+		    sess->InitialR2T ? "Yes" : "No",
+		    sess->ImmediateData ? "Yes" : "No");
+	}
+	return 0;
+}
+
+static void
+bench_build_cmd(BENCH_SESS_Ptr sess, uint8_t *bhs, uint32_t itt, int R_bit, int W_bit, uint32_t transfer_len, uint8_t *cdb, int cdblen)
+{
+	uint64_t islun;
+	int lun = sess->bench->lun;
+
+	if (lun < 0x100) {
+		islun = ((uint64_t) (lun & 0xff)) << 48;
+	} else {
+		/* flat space addressing */
+		islun = ((uint64_t) (0x40 | ((lun >> 8) & 0x3f))) << 56;
+		islun |= ((uint64_t) (lun & 0xff)) << 48;
+	}
+	memset(bhs, 0, ISCSI_BHS_LEN);
+	bhs[0] = ISCSI_OP_SCSI;
+	/* F=1, Attr=SIMPLE */
+	bhs[1] = 0x80 | 0x01;
+	BDADD8(&bhs[1], R_bit, 6);
+	BDADD8(&bhs[1], W_bit, 5);
+	DSET64(&bhs[8], islun);
+	DSET32(&bhs[16], itt);
+	DSET32(&bhs[20], transfer_len);
+	DSET32(&bhs[24], sess->CmdSN);
+	DSET32(&bhs[28], sess->StatSN);
+	memcpy(&bhs[32], cdb, (size_t) cdblen);
+	sess->CmdSN++;
+}
+
+static int
+bench_data_out(BENCH_SESS_Ptr sess, uint32_t itt, uint32_t ttt, uint32_t offset, uint32_t len)
+{
+	uint8_t bhs[ISCSI_BHS_LEN];
+	uint32_t DataSN;
+	uint32_t n;
+	int rc;
+
+	DataSN = 0;
+	while (len > 0) {
+		n = DMIN32(len, sess->MaxRecvDataSegmentLength);
+		memset(bhs, 0, sizeof bhs);
+		bhs[0] = ISCSI_OP_SCSI_DATAOUT;
+		BDADD8(&bhs[1], (n == len), 7);
+		DSET32(&bhs[16], itt);
+		DSET32(&bhs[20], ttt);
+		DSET32(&bhs[28], sess->StatSN);
+		DSET32(&bhs[36], DataSN);
+		DSET32(&bhs[40], offset);
+		rc = bench_send_pdu(sess, bhs, sess->wbuf + offset, n);
+		if (rc < 0)
+			return -1;
+		offset += n;
+		len -= n;
+		DataSN++;
+	}
+	return 0;
+}
+
+/* issue one command and wait for it, used for setup only */
+static int
+bench_exec_sync(BENCH_SESS_Ptr sess, uint8_t *cdb, int cdblen, uint8_t *data, uint32_t alloc_len)
+{
+	uint8_t bhs[ISCSI_BHS_LEN];
+	uint32_t offset;
+	int len;
+	int rc;
+
+	bench_build_cmd(sess, bhs, sess->itt++, 1, 0, alloc_len, cdb, cdblen);
+	rc = bench_send_pdu(sess, bhs, NULL, 0);
+	if (rc < 0)
+		return -1;
+	while (1) {
+		len = bench_recv_pdu(sess, bhs);
+		if (len < 0)
+			return -1;
+		switch (bhs[0] & 0x3f) {
+		case ISCSI_OP_SCSI_DATAIN:
+			offset = DGET32(&bhs[40]);
+			if (offset < alloc_len) {
+				memcpy(data + offset, sess->rbuf,
+				    DMIN32((uint32_t) len, alloc_len - offset));
+			}
+			if (BGET8(&bhs[1], 0)) {
+				sess->StatSN = DGET32(&bhs[24]) + 1;
+				bench_update_sn(sess, bhs);
+				return bhs[3];
+			}
+			break;
+		case ISCSI_OP_SCSI_RSP:
+			sess->StatSN = DGET32(&bhs[24]) + 1;
+			bench_update_sn(sess, bhs);
+			return bhs[3];
+		case ISCSI_OP_NOPIN:
+		case ISCSI_OP_ASYNC:
+			bench_update_sn(sess, bhs);
+			break;
+		default:
+			ISTGT_ERRLOG("session %d: unexpected opcode 0x%x\n",
+			    sess->id, bhs[0] & 0x3f);
+			return -1;
+		}
+	}
+}
+
+static int
+bench_read_capacity(BENCH_SESS_Ptr sess)
+{
+	uint8_t cdb[16];
+	uint8_t data[32];
+	int status;
+	int i;
+
+	/* the first command may see a UNIT ATTENTION */
+	for (i = 0; i < 4; i++) {
+		memset(cdb, 0, sizeof cdb);
+		cdb[0] = SPC_SERVICE_ACTION_IN_16;
+		cdb[1] = SBC_SAI_READ_CAPACITY_16;
+		DSET32(&cdb[10], sizeof data);
+		memset(data, 0, sizeof data);
+		status = bench_exec_sync(sess, cdb, 16, data, sizeof data);
+		if (status < 0)
+			return -1;
+		if (status == ISTGT_SCSI_STATUS_GOOD) {
+			sess->nblocks = DGET64(&data[0]) + 1;
+			sess->blocklen = DGET32(&data[8]);
+			if (sess->blocklen == 0)
+				break;
+			return 0;
+		}
+	}
+	ISTGT_ERRLOG("session %d: READ CAPACITY failed\n", sess->id);
+	return -1;
+}
+
+static int
+bench_submit(BENCH_SESS_Ptr sess, int slot)
+{
+	BENCH_Ptr bench = sess->bench;
+	BENCH_CMD *cmd;
+	uint8_t bhs[ISCSI_BHS_LEN];
+	uint8_t cdb[16];
+	uint64_t lba;
+	uint64_t nio;
+	uint32_t blocks;
+	uint32_t len, sent, imm;
+	int rc;
+
+	cmd = &sess->cmds[slot];
+	blocks = (uint32_t) (bench->blocksize / sess->blocklen);
+	nio = sess->nblocks / blocks;
+	if (bench->random) {
+		lba = sess->first_lba + (bench_random(sess) % nio) * blocks;
+	} else {
+		lba = sess->next_lba;
+		sess->next_lba += blocks;
+		if (sess->next_lba + blocks > sess->first_lba + nio * blocks)
+			sess->next_lba = sess->first_lba;
+	}
+	if (bench->rwmix >= 100) {
+		cmd->write = 0;
+	} else if (bench->rwmix <= 0) {
+		cmd->write = 1;
+	} else {
+		cmd->write = ((int) (bench_random(sess) % 100) >= bench->rwmix);
+	}
+	len = (uint32_t) bench->blocksize;
+
+	memset(cdb, 0, sizeof cdb);
+	cdb[0] = cmd->write ? SBC_WRITE_16 : SBC_READ_16;
+	DSET64(&cdb[2], lba);
+	DSET32(&cdb[10], blocks);
+
+	/* ITT carries the slot */
+	cmd->itt = (sess->itt++ << 16) | (uint32_t) slot;
+	if (cmd->itt == 0xffffffffU)
+		cmd->itt = (sess->itt++ << 16) | (uint32_t) slot;
+	cmd->transfer_len = len;
+	cmd->busy = 1;
+	cmd->start = istgt_clock_usec();
+	sess->outstanding++;
+	istgt_stats_begin(bench->stats[cmd->write]);
+
+	bench_build_cmd(sess, bhs, cmd->itt, !cmd->write, cmd->write,
+	    len, cdb, 16);
+	if (!cmd->write) {
+		return bench_send_pdu(sess, bhs, NULL, 0);
+	}
+
+	/* immediate and unsolicited data up to FirstBurstLength */
+	sent = 0;
+	imm = 0;
+	if (sess->ImmediateData) {
+		imm = DMIN32(len, sess->FirstBurstLength);
+		imm = DMIN32(imm, sess->MaxRecvDataSegmentLength);
+	}
+	rc = bench_send_pdu(sess, bhs, sess->wbuf, imm);
+	if (rc < 0)
+		return -1;
+	sent = imm;
+	if (!sess->InitialR2T && sent < DMIN32(len, sess->FirstBurstLength)) {
+		rc = bench_data_out(sess, cmd->itt, 0xffffffffU, sent,
+		    DMIN32(len, sess->FirstBurstLength) - sent);
+		if (rc < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+bench_complete(BENCH_SESS_Ptr sess, uint32_t itt, int status)
+{
+	BENCH_Ptr bench = sess->bench;
+	BENCH_CMD *cmd;
+	uint64_t lat[ISTGT_STATS_PHASES];
+	int slot;
+
+	slot = (int) (itt & 0xffff);
+	if (slot >= bench->depth || !sess->cmds[slot].busy
+	    || sess->cmds[slot].itt != itt) {
+		ISTGT_ERRLOG("session %d: unknown ITT 0x%x\n", sess->id, itt);
+		sess->error = 1;
+		return;
+	}
+	cmd = &sess->cmds[slot];
+	/* only the round trip is known to the initiator */
+	memset(lat, 0, sizeof lat);
+	lat[ISTGT_STATS_TOTAL] = istgt_clock_usec() - cmd->start;
+	istgt_stats_end(bench->stats[cmd->write],
+	    cmd->write ? ISTGT_STATS_WRITE : ISTGT_STATS_READ,
+	    cmd->transfer_len, status != ISTGT_SCSI_STATUS_GOOD, lat);
+	if (status != ISTGT_SCSI_STATUS_GOOD && bench->verbose) {
+		fprintf(stderr, "session %d: ITT 0x%x status 0x%x\n",
+		    sess->id, itt, status);
+	}
+	cmd->busy = 0;
+	sess->outstanding--;
+}
+
+static int
+bench_handle_pdu(BENCH_SESS_Ptr sess)
+{
+	uint8_t bhs[ISCSI_BHS_LEN];
+	uint32_t itt, ttt;
+	uint32_t offset, len;
+	int slot;
+	int rc;
+
+	rc = bench_recv_pdu(sess, bhs);
+	if (rc < 0)
+		return -1;
+	itt = DGET32(&bhs[16]);
+	switch (bhs[0] & 0x3f) {
+	case ISCSI_OP_SCSI_DATAIN:
+		/* data is discarded */
+		if (BGET8(&bhs[1], 0)) {
+			sess->StatSN = DGET32(&bhs[24]) + 1;
+			bench_update_sn(sess, bhs);
+			bench_complete(sess, itt, bhs[3]);
+		}
+		break;
+	case ISCSI_OP_SCSI_RSP:
+		sess->StatSN = DGET32(&bhs[24]) + 1;
+		bench_update_sn(sess, bhs);
+		bench_complete(sess, itt, (bhs[2] != 0) ? 0xff : bhs[3]);
+		break;
+	case ISCSI_OP_R2T:
+		bench_update_sn(sess, bhs);
+		ttt = DGET32(&bhs[20]);
+		offset = DGET32(&bhs[40]);
+		len = DGET32(&bhs[44]);
+		slot = (int) (itt & 0xffff);
+		if (slot >= sess->bench->depth || !sess->cmds[slot].busy
+		    || offset + len > sess->cmds[slot].transfer_len) {
+			ISTGT_ERRLOG("session %d: bad R2T ITT 0x%x\n",
+			    sess->id, itt);
+			return -1;
+		}
+		rc = bench_data_out(sess, itt, ttt, offset, len);
+		if (rc < 0)
+			return -1;
+		break;
+	case ISCSI_OP_NOPIN:
+		bench_update_sn(sess, bhs);
+		ttt = DGET32(&bhs[20]);
+		if (ttt != 0xffffffffU) {
+			/* answer ping from target */
+			bhs[0] = ISCSI_OP_NOPOUT | 0x40;
+			bhs[1] = 0x80;
+			DSET32(&bhs[16], 0xffffffffU);
+			DSET32(&bhs[20], ttt);
+			DSET32(&bhs[24], sess->CmdSN);
+			DSET32(&bhs[28], sess->StatSN);
+			memset(&bhs[32], 0, ISCSI_BHS_LEN - 32);
+			rc = bench_send_pdu(sess, bhs, NULL, 0);
+			if (rc < 0)
+				return -1;
+		}
+		break;
+	case ISCSI_OP_ASYNC:
+		bench_update_sn(sess, bhs);
+		if (bhs[36] != 0) {
+			ISTGT_ERRLOG("session %d: async event %d\n",
+			    sess->id, bhs[36]);
+			return -1;
+		}
+		break;
+	default:
+		ISTGT_ERRLOG("session %d: unexpected opcode 0x%x\n",
+		    sess->id, bhs[0] & 0x3f);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench_logout(BENCH_SESS_Ptr sess)
+{
+	uint8_t bhs[ISCSI_BHS_LEN];
+	int rc;
+
+	memset(bhs, 0, sizeof bhs);
+	bhs[0] = ISCSI_OP_LOGOUT | 0x40;
+	/* close the session */
+	bhs[1] = 0x80;
+	DSET32(&bhs[16], sess->itt++ << 16);
+	DSET32(&bhs[24], sess->CmdSN);
+	DSET32(&bhs[28], sess->StatSN);
+	rc = bench_send_pdu(sess, bhs, NULL, 0);
+	if (rc < 0)
+		return -1;
+	while (1) {
+		rc = bench_recv_pdu(sess, bhs);
+		if (rc < 0)
+			return -1;
+		if ((bhs[0] & 0x3f) == ISCSI_OP_LOGOUT_RSP)
+			break;
+	}
+	return 0;
+}
+
+static void *
+bench_worker(void *arg)
+{
+	BENCH_SESS_Ptr sess = (BENCH_SESS_Ptr) arg;
+	BENCH_Ptr bench = sess->bench;
+	uint64_t n;
+	int stop;
+	int rc;
+	int i;
+
+	stop = 0;
+	while (!sess->error) {
+		if (!stop && __atomic_load_n(&bench->stop, __ATOMIC_RELAXED))
+			stop = 1;
+		for (i = 0; !stop && i < bench->depth; i++) {
+			if (sess->cmds[i].busy)
+				continue;
+			/* stay inside the command window */
+			if (SN32_GT(sess->CmdSN, sess->MaxCmdSN))
+				break;
+			if (bench->count != 0) {
+				n = __atomic_fetch_add(&bench->issued, 1,
+				    __ATOMIC_RELAXED);
+				if (n >= bench->count) {
+					stop = 1;
+					break;
+				}
+			}
+			rc = bench_submit(sess, i);
+			if (rc < 0) {
+				sess->error = 1;
+				break;
+			}
+		}
+		if (sess->outstanding == 0) {
+			if (stop)
+				break;
+			continue;
+		}
+		rc = bench_handle_pdu(sess);
+		if (rc < 0) {
+			sess->error = 1;
+			break;
+		}
+	}
+	if (bench->count != 0) {
+		/* all sessions stop once the count is reached */
+		__atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void
+bench_json_dir(const char *name, ISTGT_STATS_Ptr stats, double secs, int last)
+{
+	ISTGT_STATS_COUNTER snap;
+	uint64_t ops, bytes;
+
+	istgt_stats_snapshot(stats, &snap);
+	ops = snap.read_ops + snap.write_ops;
+	bytes = snap.read_bytes + snap.write_bytes;
+	printf("  \"%s\": {\n", name);
+	printf("    \"ops\": %"PRIu64",\n", ops);
+	printf("    \"bytes\": %"PRIu64",\n", bytes);
+	printf("    \"errors\": %"PRIu64",\n", snap.errors);
+	printf("    \"iops\": %.1f,\n", secs > 0.0 ? (double) ops / secs : 0.0);
+	printf("    \"bandwidth_bytes_per_sec\": %.0f,\n",
+	    secs > 0.0 ? (double) bytes / secs : 0.0);
+	printf("    \"latency_usec\": {\n");
+	printf("      \"avg\": %"PRIu64",\n",
+	    istgt_stats_average(&snap, ISTGT_STATS_TOTAL));
+	printf("      \"p50\": %"PRIu64",\n",
+	    istgt_stats_percentile(&snap, ISTGT_STATS_TOTAL, 500));
+	printf("      \"p90\": %"PRIu64",\n",
+	    istgt_stats_percentile(&snap, ISTGT_STATS_TOTAL, 900));
+	printf("      \"p99\": %"PRIu64",\n",
+	    istgt_stats_percentile(&snap, ISTGT_STATS_TOTAL, 990));
+	printf("      \"p999\": %"PRIu64",\n",
+	    istgt_stats_percentile(&snap, ISTGT_STATS_TOTAL, 999));
+	printf("      \"max\": %"PRIu64"\n",
+	    istgt_stats_percentile(&snap, ISTGT_STATS_TOTAL, 1000));
+	printf("    }\n");
+	printf("  }%s\n", last ? "" : ",");
+}
+
+static void
+bench_json(BENCH_Ptr bench, BENCH_SESS_Ptr sessions, uint64_t elapsed)
+{
+	ISTGT_STATS_COUNTER rsnap, wsnap;
+	double secs;
+	uint64_t ops, bytes;
+
+	secs = (double) elapsed / 1000000.0;
+	istgt_stats_snapshot(bench->stats[0], &rsnap);
+	istgt_stats_snapshot(bench->stats[1], &wsnap);
+	ops = rsnap.read_ops + wsnap.write_ops;
+	bytes = rsnap.read_bytes + wsnap.write_bytes;
+
+	printf("{\n");
+	printf("  \"version\": \"%s (%s)\",\n", ISTGT_VERSION, ISTGT_EXTRA_VERSION);
+	printf("  \"host\": \"%s\",\n", bench->host);
+	printf("  \"port\": %d,\n", bench->port);
+	printf("  \"target\": \"%s\",\n", bench->target);
+	printf("  \"lun\": %d,\n", bench->lun);
+	printf("  \"block_length\": %u,\n", sessions[0].blocklen);
+	printf("  \"workload\": \"%s\",\n", bench->workload);
+	printf("  \"rwmix_read\": %d,\n", bench->rwmix);
+	printf("  \"block_size\": %d,\n", bench->blocksize);
+	printf("  \"queue_depth\": %d,\n", bench->depth);
+	printf("  \"sessions\": %d,\n", bench->sessions);
+	printf("  \"range_bytes\": %"PRIu64",\n",
+	    sessions[0].nblocks * sessions[0].blocklen);
+	printf("  \"runtime_usec\": %"PRIu64",\n", elapsed);
+	printf("  \"ops\": %"PRIu64",\n", ops);
+	printf("  \"bytes\": %"PRIu64",\n", bytes);
+	printf("  \"errors\": %"PRIu64",\n", rsnap.errors + wsnap.errors);
+	printf("  \"iops\": %.1f,\n", secs > 0.0 ? (double) ops / secs : 0.0);
+	printf("  \"bandwidth_bytes_per_sec\": %.0f,\n",
+	    secs > 0.0 ? (double) bytes / secs : 0.0);
+	bench_json_dir("read", bench->stats[0], secs, 0);
+	bench_json_dir("write", bench->stats[1], secs, 1);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static int
+bench_parse_size(const char *s, uint64_t *size)
+{
+	char *endp;
+	uint64_t val;
+
+	val = strtoull(s, &endp, 10);
+	switch (*endp) {
+	case 'k': case 'K':
+		val *= 1024ULL;
+		endp++;
+		break;
+	case 'm': case 'M':
+		val *= 1024ULL * 1024ULL;
+		endp++;
+		break;
+	case 'g': case 'G':
+		val *= 1024ULL * 1024ULL * 1024ULL;
+		endp++;
+		break;
+	default:
+		break;
+	}
+	if (endp == s || *endp != '\0')
+		return -1;
+	*size = val;
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("istgtbench [options]\n");
+	printf("options:\n");
+	printf(" -h host     target host name or IP (default %s)\n", DEFAULT_BENCH_HOST);
+	printf(" -p port     port number (default %d)\n", DEFAULT_BENCH_PORT);
+	printf(" -t target   target iqn (required, AuthMethod None)\n");
+	printf(" -i name     initiator iqn (default %s)\n", DEFAULT_BENCH_INITIATOR);
+	printf(" -l lun      target lun (default %d)\n", DEFAULT_BENCH_LUN);
+	printf(" -w workload read/write/rw/randread/randwrite/randrw (default %s)\n",
+	    DEFAULT_BENCH_WORKLOAD);
+	printf(" -m percent  read percentage of rw/randrw (default %d)\n", DEFAULT_BENCH_RWMIX);
+	printf(" -b size     block size (default %d)\n", DEFAULT_BENCH_BLOCKSIZE);
+	printf(" -q depth    queue depth per session (default %d)\n", DEFAULT_BENCH_DEPTH);
+	printf(" -s count    number of sessions (default %d)\n", DEFAULT_BENCH_SESSIONS);
+	printf(" -T seconds  run time (default %d)\n", DEFAULT_BENCH_TIME);
+	printf(" -n count    stop after count commands\n");
+	printf(" -r size     limit I/O to the first size bytes of the LUN\n");
+	printf(" -v         verbose mode\n");
+	printf(" -H         show this usage\n");
+	printf(" -V         show version\n");
+	printf("results are written to standard output in JSON\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	BENCH xbench, *bench;
+	BENCH_SESS_Ptr sessions, sess;
+	struct sigaction sigact;
+	uint64_t start, elapsed;
+	uint64_t size;
+	uint64_t nblocks;
+	long l;
+	int errors;
+	int ch;
+	int rc;
+	int i;
+
+	memset(&xbench, 0, sizeof xbench);
+	bench = &xbench;
+	bench->host = DEFAULT_BENCH_HOST;
+	bench->port = DEFAULT_BENCH_PORT;
+	bench->initiator = DEFAULT_BENCH_INITIATOR;
+	bench->lun = DEFAULT_BENCH_LUN;
+	bench->sessions = DEFAULT_BENCH_SESSIONS;
+	bench->depth = DEFAULT_BENCH_DEPTH;
+	bench->blocksize = DEFAULT_BENCH_BLOCKSIZE;
+	bench->workload = DEFAULT_BENCH_WORKLOAD;
+	bench->rwmix = -1;
+	bench->duration = DEFAULT_BENCH_TIME;
+
+	while ((ch = getopt(argc, argv, "h:p:t:i:l:w:m:b:q:s:T:n:r:vVH")) != -1) {
+		switch (ch) {
+		case 'h':
+			bench->host = optarg;
+			break;
+		case 'p':
+			l = strtol(optarg, NULL, 10);
+			if (l < 0 || l > 65535) {
+				fatal("invalid port %s\n", optarg);
+			}
+			bench->port = (int) l;
+			break;
+		case 't':
+			bench->target = optarg;
+			break;
+		case 'i':
+			bench->initiator = optarg;
+			break;
+		case 'l':
+			l = strtol(optarg, NULL, 10);
+			if (l < 0 || l > 0x3fff) {
+				fatal("invalid lun %s\n", optarg);
+			}
+			bench->lun = (int) l;
+			break;
+		case 'w':
+			bench->workload = optarg;
+			break;
+		case 'm':
+			l = strtol(optarg, NULL, 10);
+			if (l < 0 || l > 100) {
+				fatal("invalid percentage %s\n", optarg);
+			}
+			bench->rwmix = (int) l;
+			break;
+		case 'b':
+			if (bench_parse_size(optarg, &size) < 0
+			    || size == 0 || size > MAX_BENCH_BLOCKSIZE) {
+				fatal("invalid block size %s\n", optarg);
+			}
+			bench->blocksize = (int) size;
+			break;
+		case 'q':
+			l = strtol(optarg, NULL, 10);
+			if (l < 1 || l > MAX_BENCH_DEPTH) {
+				fatal("invalid queue depth %s\n", optarg);
+			}
+			bench->depth = (int) l;
+			break;
+		case 's':
+			l = strtol(optarg, NULL, 10);
+			if (l < 1 || l > MAX_BENCH_SESSIONS) {
+				fatal("invalid sessions %s\n", optarg);
+			}
+			bench->sessions = (int) l;
+			break;
+		case 'T':
+			l = strtol(optarg, NULL, 10);
+			if (l < 1) {
+				fatal("invalid time %s\n", optarg);
+			}
+			bench->duration = (int) l;
+			break;
+		case 'n':
+			bench->count = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			if (bench_parse_size(optarg, &bench->range) < 0) {
+				fatal("invalid range %s\n", optarg);
+			}
+			break;
+		case 'v':
+			bench->verbose = 1;
+			break;
+		case 'V':
+			printf("istgtbench version %s (%s)\n",
+			    ISTGT_VERSION, ISTGT_EXTRA_VERSION);
+			exit(EXIT_SUCCESS);
+		case 'H':
+		default:
+			usage();
+			exit(EXIT_SUCCESS);
+		}
+	}
+	if (bench->target == NULL) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (strcasecmp(bench->workload, "read") == 0) {
+		bench->random = 0;
+		bench->rwmix = 100;
+	} else if (strcasecmp(bench->workload, "write") == 0) {
+		bench->random = 0;
+		bench->rwmix = 0;
+	} else if (strcasecmp(bench->workload, "rw") == 0) {
+		bench->random = 0;
+	} else if (strcasecmp(bench->workload, "randread") == 0) {
+		bench->random = 1;
+		bench->rwmix = 100;
+	} else if (strcasecmp(bench->workload, "randwrite") == 0) {
+		bench->random = 1;
+		bench->rwmix = 0;
+	} else if (strcasecmp(bench->workload, "randrw") == 0) {
+		bench->random = 1;
+	} else {
+		fatal("invalid workload %s\n", bench->workload);
+	}
+	if (bench->rwmix < 0)
+		bench->rwmix = DEFAULT_BENCH_RWMIX;
+
+	/* ignore SIGPIPE, errors are returned by write */
+	memset(&sigact, 0, sizeof sigact);
+	sigact.sa_handler = SIG_IGN;
+	sigemptyset(&sigact.sa_mask);
+	rc = sigaction(SIGPIPE, &sigact, NULL);
+	if (rc < 0) {
+		fatal("sigaction(SIGPIPE) failed\n");
+	}
+
+	bench->stats[0] = istgt_stats_create();
+	bench->stats[1] = istgt_stats_create();
+	sessions = xmalloc(sizeof *sessions * bench->sessions);
+	memset(sessions, 0, sizeof *sessions * bench->sessions);
+	srandom((unsigned int) (getpid() ^ istgt_clock_usec()));
+
+	/* log in all sessions before starting */
+	for (i = 0; i < bench->sessions; i++) {
+		sess = &sessions[i];
+		sess->bench = bench;
+		sess->id = i;
+		sess->seed = ((uint64_t) random() << 32) ^ (uint64_t) random();
+		sess->seed |= 1;
+		sess->isid[0] = 0x80;
+		sess->isid[1] = (uint8_t) (random() & 0xff);
+		sess->isid[2] = (uint8_t) (random() & 0xff);
+		sess->isid[3] = (uint8_t) (getpid() & 0xff);
+		DSET16(&sess->isid[4], i);
+		sess->CmdSN = 1;
+		sess->itt = 1;
+		sess->rbuf = xmalloc(BENCH_RECVDATA_LEN);
+		sess->wbuf = xmalloc((size_t) bench->blocksize);
+		for (l = 0; l < bench->blocksize; l++) {
+			sess->wbuf[l] = (uint8_t) bench_random(sess);
+		}
+
+		sess->sock = istgt_connect(bench->host, bench->port);
+		if (sess->sock < 0) {
+			fatal("connect to %s:%d failed\n", bench->host, bench->port);
+		}
+		(void) istgt_set_recvtimeout(sess->sock, DEFAULT_BENCH_TIMEOUT * 1000);
+		(void) istgt_set_sendtimeout(sess->sock, DEFAULT_BENCH_TIMEOUT * 1000);
+		rc = bench_login(sess);
+		if (rc < 0) {
+			fatal("session %d: login to %s failed\n", i, bench->target);
+		}
+		rc = bench_read_capacity(sess);
+		if (rc < 0) {
+			fatal("session %d: LUN%d is not a disk\n", i, bench->lun);
+		}
+		if (bench->blocksize % sess->blocklen != 0) {
+			fatal("block size %d is not a multiple of %u\n",
+			    bench->blocksize, sess->blocklen);
+		}
+		if (bench->range != 0 && bench->range / sess->blocklen < sess->nblocks)
+			sess->nblocks = bench->range / sess->blocklen;
+		if (sess->nblocks < (uint64_t) (bench->blocksize / sess->blocklen)) {
+			fatal("LUN%d is smaller than the block size\n", bench->lun);
+		}
+		/* sequential streams start in their own part of the LUN */
+		nblocks = sess->nblocks / (uint64_t) bench->sessions;
+		nblocks -= nblocks % (uint64_t) (bench->blocksize / sess->blocklen);
+		sess->first_lba = 0;
+		sess->next_lba = nblocks * (uint64_t) i;
+	}
+
+	start = istgt_clock_usec();
+	for (i = 0; i < bench->sessions; i++) {
+		rc = pthread_create(&sessions[i].thread, NULL, &bench_worker,
+		    &sessions[i]);
+		if (rc != 0) {
+			fatal("pthread_create() failed\n");
+		}
+	}
+	while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+		if (bench->count == 0
+		    && istgt_clock_usec() - start
+		    >= (uint64_t) bench->duration * 1000000ULL)
+			break;
+		usleep(10000);
+	}
+	__atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+	errors = 0;
+	for (i = 0; i < bench->sessions; i++) {
+		(void) pthread_join(sessions[i].thread, NULL);
+		if (sessions[i].error)
+			errors++;
+	}
+	elapsed = istgt_clock_usec() - start;
+
+	for (i = 0; i < bench->sessions; i++) {
+		sess = &sessions[i];
+		if (!sess->error)
+			(void) bench_logout(sess);
+		close(sess->sock);
+	}
+	bench_json(bench, sessions, elapsed);
+
+	for (i = 0; i < bench->sessions; i++) {
+		xfree(sessions[i].rbuf);
+		xfree(sessions[i].wbuf);
+	}
+	xfree(sessions);
+	istgt_stats_destroy(bench->stats[0]);
+	istgt_stats_destroy(bench->stats[1]);
+	if (errors != 0) {
+		fprintf(stderr, "%d session(s) failed\n", errors);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
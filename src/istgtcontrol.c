@@ -584,6 +584,88 @@ exec_info(UCTL_Ptr uctl)
 	return UCTL_CMD_OK;
 }
 
+static int
+exec_stats(UCTL_Ptr uctl)
+{
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *result;
+	int rc;
+
+	/* send command */
+	if (uctl->iqn != NULL) {
+		uctl_snprintf(uctl, "STATS \"%s\"\n", uctl->iqn);
+	} else {
+		uctl_snprintf(uctl, "STATS\n");
+	}
+	rc = uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return rc;
+	}
+
+	/* receive result */
+	while (1) {
+		rc = uctl_readline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+		arg = trim_string(uctl->recvbuf);
+		result = strsepq(&arg, delim);
+		strupr(result);
+		if (strcmp(result, uctl->cmd) != 0)
+			break;
+		printf("%s\n", arg);
+	}
+	if (strcmp(result, "OK") != 0) {
+		if (is_err_req_auth(uctl, arg))
+			return UCTL_CMD_REQAUTH;
+		fprintf(stderr, "ERROR %s\n", arg);
+		return UCTL_CMD_ERR;
+	}
+	return UCTL_CMD_OK;
+}
+
+static int
+exec_qos(UCTL_Ptr uctl)
+{
+	const char *delim = ARGS_DELIM;
+	char *arg;
+	char *result;
+	int rc;
+
+	/* send command */
+	if (uctl->iqn != NULL) {
+		uctl_snprintf(uctl, "QOS \"%s\"\n", uctl->iqn);
+	} else {
+		uctl_snprintf(uctl, "QOS\n");
+	}
+	rc = uctl_writeline(uctl);
+	if (rc != UCTL_CMD_OK) {
+		return rc;
+	}
+
+	/* receive result */
+	while (1) {
+		rc = uctl_readline(uctl);
+		if (rc != UCTL_CMD_OK) {
+			return rc;
+		}
+		arg = trim_string(uctl->recvbuf);
+		result = strsepq(&arg, delim);
+		strupr(result);
+		if (strcmp(result, uctl->cmd) != 0)
+			break;
+		printf("%s\n", arg);
+	}
+	if (strcmp(result, "OK") != 0) {
+		if (is_err_req_auth(uctl, arg))
+			return UCTL_CMD_REQAUTH;
+		fprintf(stderr, "ERROR %s\n", arg);
+		return UCTL_CMD_ERR;
+	}
+	return UCTL_CMD_OK;
+}
+
 typedef struct exec_table_t
 {
 	const char *name;
@@ -603,6 +685,8 @@ static EXEC_TABLE exec_table[] =
 	{ "CHANGE",  exec_change,   1, 1 },
 	{ "RESET",   exec_reset,    0, 1 },
 	{ "INFO",    exec_info,     0, 0 },
+	{ "STATS",   exec_stats,    0, 0 },
+	{ "QOS",     exec_qos,      0, 0 },
 	{ NULL,      NULL,          0, 0 },
 };
 
@@ -1069,6 +1153,8 @@ usage(void)
 	printf(" change     change media with <file> at specified unit\n");
 	printf(" reset      reset specified lun of target\n");
 	printf(" info       show connections of target\n");
+	printf(" stats      show I/O statistics of target\n");
+	printf(" qos        show I/O limits and throttle state of target\n");
 }
 
 int